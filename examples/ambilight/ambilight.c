@@ -3,10 +3,12 @@
  * License: GNU GPLv3
  * Copyright (c) 2018-2019 RedFantom
 */
-#include "libmk.h"
+#include "libmkc.h"
+#include "libmks.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <pthread.h>
 #include <time.h>
@@ -19,22 +21,18 @@
 #define BRIGHTNESS_NORM
 #define UPPER_TRESHOLD 700
 #define LOWER_TRESHOLD 25
+#define PER_KEY_STEP 0  // 0: Single color, n: color per key, every nth pixel
+#define WORKERS 0  // 0: One thread per processor, n threads otherwise
+#define TRANSITION_TIME 500000  // Time to reach a new color in us
 
 
 bool exit_requested = false;
-unsigned char target_color[3] = {0};
 pthread_mutex_t exit_req_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t target_color_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t keyboard_lock = PTHREAD_MUTEX_INITIALIZER;
+LibMK_Controller* controller;
 Display* display;
 Window root;
 XWindowAttributes gwa;
-
-
-typedef struct Screenshot {
-    unsigned char* data;
-    unsigned int width, height;
-} Screenshot;
+LibMK_Capture* capture;
 
 
 void interrupt_handler(int signal) {
@@ -45,32 +43,6 @@ void interrupt_handler(int signal) {
 }
 
 
-int capture_screenshot(Screenshot** screenshot) {
-    /** Capture a screenshot and store it in an array */
-    (*screenshot) = (Screenshot*) malloc(sizeof(Screenshot));
-    int width = gwa.width, height = gwa.height;
-    (*screenshot)->data = (unsigned char*) malloc(
-        width * height * 3 * sizeof(unsigned char));
-    
-    XImage* img = XGetImage(
-        display, root, 0, 0, width, height, AllPlanes, ZPixmap);
-
-    unsigned long rm = img->red_mask, gm = img->green_mask, bm = img->blue_mask;
-    unsigned long masks[3] = {rm, gm, bm};
-    unsigned char pixel[3];
-
-    for (int x=0; x < width; x++)
-        for (int y = 0; y < height; y++) {
-            unsigned long pix = XGetPixel(img, x, y);
-            for (int i = 0; i  < 3; i++)
-                (*screenshot)->data[(x + width * y) * 3 + i] =
-                    (unsigned char) (pix >> (2 - i) * 8);
-        }
-    XDestroyImage(img);
-    return 0;
-}
-
-
 void* calculate_keyboard_color(void *void_ptr) {
     /** Continuously capture screens and calculate the dominant colour
      *
@@ -87,8 +59,37 @@ void* calculate_keyboard_color(void *void_ptr) {
      * BRIGHTNESS_NORM: If defined, target colors sent to the keyboard
      *   are scaled so that at least one of the RGB values of the
      *   triplet is the maximum of 255.
+     * PER_KEY_STEP: If 0, the whole keyboard is set to a single color.
+     *   Otherwise, the screen is split into a zone for every key, of
+     *   which the dominant color is calculated from every nth pixel.
+     * WORKERS: Number of threads the rows of the screen are split
+     *   over. If 0, one thread for every processor is used.
+     *
+     * TRANSITION_TIME: Time in microseconds in which the keyboard
+     *   changes to a new color.
+     *
+     * Only the region used is captured, through shared memory with the
+     * X server if possible. The pixels are filtered and summed by
+     * libmks, which uses SIMD instructions if the processor supports
+     * them. Every new color is scheduled as a transition on the
+     * controller, which continues from the colors reached if the
+     * color changes again before the transition is done.
      */
-    Screenshot* screen;
+    LibMK_Color_Filter filter;
+    filter.lower = LOWER_TRESHOLD;
+    filter.upper = UPPER_TRESHOLD;
+    filter.saturation_bias = SATURATION_BIAS;
+#ifdef BRIGHTNESS_NORM
+    filter.brightness_norm = true;
+#else
+    filter.brightness_norm = false;
+#endif
+    LibMK_Workers* workers = libmk_create_workers(WORKERS);
+    if (workers == NULL) {
+        int code = -1;
+        pthread_exit(&code);
+    }
+    unsigned char target[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] = {{{0}}};
 
     while (true) {
 
@@ -99,122 +100,49 @@ void* calculate_keyboard_color(void *void_ptr) {
             break;
         }
         pthread_mutex_unlock(&exit_req_lock);
-        if (capture_screenshot(&screen) < 0) {
+        if (libmk_get_controller_state(controller) != LIBMK_STATE_ACTIVE) {
+            printf("LibMK Error: %d\n", libmk_get_controller_error(controller));
+            break;
+        }
+        if (libmk_capture(capture) != LIBMK_SUCCESS) {
+            libmk_free_workers(workers);
             int code = -2;
             pthread_exit(&code);
         }
 
-        int w = gwa.width, h = gwa.height;
-
-        unsigned char temp[3];
-        unsigned long colors[3] = {0};
-        unsigned long n_pixels = 0;
-        unsigned int sum;
-
-        int lim;
-        if (MAX_WIDTH == 0) {
-            lim = w;
-        } else if (MAX_WIDTH == -1) {
-            lim = w / 2;
+        unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+        if (PER_KEY_STEP > 0) {
+            LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS];
+            libmk_sum_zones_parallel(
+                workers, &capture->image, 0, 0, capture->image.width,
+                capture->image.height, PER_KEY_STEP, &filter, sums);
+            for (int r=0; r < LIBMK_MAX_ROWS; r++)
+                for (int c=0; c < LIBMK_MAX_COLS; c++)
+                    if (!libmk_get_sum_color(
+                            &sums[r][c], &filter, layout[r][c]))
+                        memset(layout[r][c], 0x00, 3);
         } else {
-            lim = MAX_WIDTH;
-        }
-
-        // Sum
-        for (int x = 0; x < lim; x++) {
-            for (int y = 0; y < h; y++) {
-                sum = 0;
-                int max_diff = 0;
-                for (int i = 0; i < 3; i++) {
-                    int first = i, second = i + 1;
-                    if (i == 2)
-                        second = 0;
-                    int diff = screen->data[(x + y * w) * 3 + first] -
-                               screen->data[(x + y * w) * 3 + second];
-                    if (diff > max_diff)
-                        max_diff = diff;
-
-                    temp[i] = screen->data[(x + y * w) * 3 + i];
-                    sum += temp[i];
-                }
-                if (sum < LOWER_TRESHOLD ||
-                    sum > UPPER_TRESHOLD ||
-                    max_diff < SATURATION_BIAS)
-                    continue;
-                for (int i = 0; i < 3; i++)
-                    colors[i] += temp[i];
-                n_pixels += 1;
-            }
-        }
-        unsigned char color[3];
-        unsigned char max = 0;
-
-        // Average
-        for (int i = 0; i < 3; i++) {
-            if (n_pixels == 0) {
-                color[i] = 0xFF;
-                continue;
-            }
-            color[i] = (unsigned char) (colors[i] / n_pixels);
-            if (color[i] > max)
-                max = color[i];
-        }
-
-#ifdef BRIGHTNESS_NORM
-        // Normalize
-        if (max != 0)
-            for (int i = 0; i < 3; i++)
-                color[i] = (unsigned char) ((int) color[i] * (255.0 / max));
-#endif
-
-        // Copy color over to thread-safe variable
-        pthread_mutex_lock(&target_color_lock);
-        for (int i=0; i < 3; i++)
-            target_color[i] = color[i];
-        pthread_mutex_unlock(&target_color_lock);
-
-        // Clean up
-        free(screen->data);
-        free(screen);
-    }
-    pthread_exit(0);
-}
-
-
-void* update_keyboard_color(void* ptr) {
-    unsigned char color[3] = {0}, prev[3] = {0};
-    while (true) {
-        pthread_mutex_lock(&exit_req_lock);
-        if (exit_requested) {
-            pthread_mutex_unlock(&exit_req_lock);
-            break;
+            unsigned char color[3];
+            LibMK_Color_Sum sum;
+            libmk_sum_image_parallel(
+                workers, &capture->image, 0, 0, capture->image.width,
+                capture->image.height, &filter, &sum);
+            libmk_get_sum_color(&sum, &filter, color);
+            for (int r=0; r < LIBMK_MAX_ROWS; r++)
+                for (int c=0; c < LIBMK_MAX_COLS; c++)
+                    for (int i=0; i < 3; i++)
+                        layout[r][c][i] = color[i];
         }
-        pthread_mutex_unlock(&exit_req_lock);
 
-        int diff;
-        bool equal = true;
-        pthread_mutex_lock(&target_color_lock);
-        for (int i=0; i < 3; i++) {
-            diff = (int) target_color[i] - color[i];
-            prev[i] = color[i];
-            color[i] += (unsigned char) (diff / 20.0);
-            equal = (prev[i] == target_color[i]) && equal;
-        }
-        pthread_mutex_unlock(&target_color_lock);
-        
-        if (equal)
+        if (memcmp(target, layout, sizeof(layout)) == 0)
             continue;
-    
-        pthread_mutex_lock(&keyboard_lock);
-        int r = libmk_set_full_color(NULL, color[0], color[1], color[2]);
-        if (r != LIBMK_SUCCESS)
-            printf("LibMK Error: %d\n", r);
-        pthread_mutex_unlock(&keyboard_lock);
-        
-        struct timespec time;
-        time.tv_nsec = 100000000 / 4;
-        nanosleep(&time, NULL);
+        memcpy(target, layout, sizeof(layout));
+        LibMK_Instruction* i = libmk_create_instruction_transition(
+            layout, TRANSITION_TIME, LIBMK_EASE_OUT);
+        if (i != NULL)
+            libmk_sched_instruction(controller, i);
     }
+    libmk_free_workers(workers);
     pthread_exit(0);
 }
 
@@ -231,8 +159,24 @@ int main() {
         printf("libmk_detect_devices failed: %d\n", n);
         return n;
     }
-    libmk_set_device(devices[0], NULL);
-    libmk_enable_control(NULL);
+    LibMK_Handle* handle;
+    int r = libmk_set_device(devices[0], &handle);
+    if (r != LIBMK_SUCCESS) {
+        printf("libmk_set_device failed: %d\n", r);
+        return r;
+    }
+    // Coalescing, so only the newest color is shown if the keyboard
+    // falls behind
+    controller = libmk_create_controller(handle);
+    if (controller == NULL)
+        return -1;
+    libmk_set_controller_coalesce(controller, true);
+    libmk_set_overflow_policy(controller, LIBMK_OVERFLOW_COALESCE);
+    r = libmk_start_controller(controller);
+    if (r != LIBMK_SUCCESS) {
+        printf("libmk_start_controller failed: %d\n", r);
+        return r;
+    }
     
     // Open the XDisplay
     display = XOpenDisplay(NULL);
@@ -240,17 +184,30 @@ int main() {
     if (XGetWindowAttributes(display, root, &gwa) < 0)
         return -1;
 
-    pthread_t keyboard, screenshot;
+    int lim;
+    if (MAX_WIDTH == 0) {
+        lim = gwa.width;
+    } else if (MAX_WIDTH == -1) {
+        lim = gwa.width / 2;
+    } else {
+        lim = MAX_WIDTH;
+    }
+    capture = libmk_create_capture(display, 0, 0, lim, 0);
+    if (capture == NULL)
+        return -1;
+
+    pthread_t screenshot;
 
     // Run the loop
     pthread_create(&screenshot, NULL, calculate_keyboard_color, NULL);
-    pthread_create(&keyboard, NULL, update_keyboard_color, NULL);
-
     pthread_join(screenshot, NULL);
-    pthread_join(keyboard, NULL);
     
     // Perform closing actions
-    libmk_disable_control(NULL);
+    libmk_free_capture(capture);
+    libmk_stop_controller(controller);
+    libmk_join_controller(controller, 1.0);
+    libmk_close_handle(handle);
+    libmk_free_controller(controller);
     libmk_exit();
     return 0;
 }
@@ -2,10 +2,12 @@
  * License: GNU GPLv3
  * Copyright (c) 2018-2019 RedFantom
 */
+#include "libmks.h"
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/X.h>
@@ -14,12 +16,15 @@
 typedef struct CaptureArgs {
     unsigned char* target_color;
     pthread_mutex_t* target_lock;
+    pthread_cond_t* target_cond;
     pthread_mutex_t* exit_lock;
     pthread_mutex_t* keyboard_lock;
     bool* exit_flag;
     Display* display;
     Window root;
     XWindowAttributes gwa;
+    LibMK_Capture* capture;
+    LibMK_Workers* workers;
     int divider;
     int saturation_bias;
     int upper_threshold;
@@ -28,24 +33,18 @@ typedef struct CaptureArgs {
 } CaptureArgs;
 
 
-typedef struct Screenshot {
-    unsigned char* data;
-    unsigned int w, h;
-} Screenshot;
-
-
-unsigned char calc_diff(unsigned char one, unsigned char two) {
-    /** Calculate the absolute difference between two values */
-    int diff = (int) one - (int) two;
-    return diff < 0 ? -diff : diff;
-}
-
-
 CaptureArgs* init_capture(int divider, int sat_bias, int lower, int upper,
-                          bool brightness_norm, unsigned char* target_color,
-                          pthread_mutex_t* target_lock, bool* exit_flag,
+                          bool brightness_norm, int workers,
+                          unsigned char* target_color,
+                          pthread_mutex_t* target_lock,
+                          pthread_cond_t* target_cond, bool* exit_flag,
                           pthread_mutex_t* exit_lock, pthread_mutex_t* kb_lock) {
-    /** Initialize a CaptureArgs struct that can be passed as thread argument */
+    /** Initialize a CaptureArgs struct that can be passed as thread argument
+     *
+     * workers is the number of threads the dominant color is calculated
+     * with, zero for one thread per processor. target_cond is signalled
+     * when the capture thread changes the target color.
+     */
     CaptureArgs* args = (CaptureArgs*) malloc(sizeof(CaptureArgs));
     
     args->divider = divider;
@@ -55,6 +54,7 @@ CaptureArgs* init_capture(int divider, int sat_bias, int lower, int upper,
     args->brightness_norm = brightness_norm;
     args->target_color = target_color;
     args->target_lock = target_lock;
+    args->target_cond = target_cond;
     args->exit_flag = exit_flag;
     args->exit_lock = exit_lock;
     args->keyboard_lock = kb_lock;
@@ -67,95 +67,64 @@ CaptureArgs* init_capture(int divider, int sat_bias, int lower, int upper,
         return NULL;
     }
     
+    /// Only the columns used for the dominant color are captured
+    divider = divider == 0 ? 1 : divider;
+    args->capture = libmk_create_capture(
+        args->display, 0, 0, args->gwa.width / divider, 0);
+    if (args->capture == NULL) {
+        XCloseDisplay(args->display);
+        free(args);
+        return NULL;
+    }
+    
+    args->workers = libmk_create_workers(workers < 0 ? 0 : workers);
+    if (args->workers == NULL) {
+        libmk_free_capture(args->capture);
+        XCloseDisplay(args->display);
+        free(args);
+        return NULL;
+    }
+    
     return args;
 }
 
 
-void capture(Screenshot** screenshot, XWindowAttributes gwa,
-             Display* display, Window root) {
-    /** Capture screenshot and save it to Screenshot struct
+void calc_image_color(LibMK_Workers* workers, LibMK_Image* image,
+                      unsigned char* target, int divider, int sat_bias,
+                      int lower, int upper, bool brightness_norm) {
+    /** Calculate the dominant color of the left part of an image
      *
-     * The data captured from X.org is in long int format (32-bit
-     * integers), which have to be converted to three separate 8-bit
-     * integers representing the pixels.
+     * Only the first 1/divider of the columns of the image are included.
+     * The rows are split over the workers, or summed on the calling
+     * thread if workers is NULL.
      */
-    (*screenshot) = (Screenshot*) malloc(sizeof(Screenshot));
-    int width = gwa.width, height = gwa.height;
-    
-    (*screenshot)->data = (unsigned char*) malloc(
-        width*height*3*sizeof(unsigned char));
-    (*screenshot)->w = width;
-    (*screenshot)->h = height;
-    
-    XImage* img = XGetImage(
-        display, root, 0, 0, width, height, AllPlanes, ZPixmap);
-    unsigned long masks[3] = {
-        img->red_mask, img->green_mask, img->blue_mask};
-    
-    for (int x=0; x<width; x++)
-        for (int y=0; y<height; y++) {
-            unsigned long pix = XGetPixel(img, x, y);
-            for (int i=0; i<3; i++)
-                (*screenshot)->data[(x+width*y) * 3 + i] =
-                    (unsigned char) (pix >> (2-i) * 8);
-        }
-        
-    XDestroyImage(img);
+    LibMK_Color_Filter filter;
+    filter.lower = lower;
+    filter.upper = upper;
+    filter.saturation_bias = sat_bias;
+    filter.brightness_norm = brightness_norm;
+    divider = divider == 0 ? 1 : divider;
+    LibMK_Color_Sum sum;
+    libmk_sum_image_parallel(
+        workers, image, 0, 0, image->width / divider, image->height,
+        &filter, &sum);
+    libmk_get_sum_color(&sum, &filter, target);
 }
 
 
 void calc_dominant_color(unsigned char* data, int w, int h,
                          unsigned char* target, int divider, int sat_bias,
                          int lower, int upper, bool brightness_norm) {
-    /** Calculate the dominant color in an array of pixels
-     *
-     *
-     */
-    unsigned char temp[3];
-    unsigned long colors[3] = {0};
-    unsigned long n_pixels = 0;
-    
-    divider = divider == 0 ? 1 : divider;
-    int width = w / divider;
-    
-    /// Summing of pixels fitting criteria
-    for (int x=0; x<width; x++) {
-        for (int y=0; y<h; y++) {
-            unsigned int sum = 0;
-            int max_diff = 0;
-            unsigned char* pixel = &(data[(x+y*w)*3]);
-            for (int i=0; i<3; i++) {
-                int first = i, second = i+1<3 ? i+1 : 0;
-                unsigned char diff = calc_diff(pixel[first], pixel[second]);
-                max_diff = diff > max_diff ? diff : max_diff;
-                sum += pixel[i];
-            }
-            if (sum < lower || sum > upper || max_diff < sat_bias)
-                continue;
-            for (int i=0; i<3; i++)
-                colors[i] += pixel[i];
-            n_pixels += 1;
-        }
-    }
-    
-    /// Averaging
-    unsigned char max = 0;
-    for (int i=0; i<3; i++) {
-        if (n_pixels == 0) {
-            target[i] = 0xFF;  // Error condition
-            continue;
-        }
-        target[i] = (unsigned char) (colors[i] / n_pixels);
-        max = target[i] > max ? target[i] : max;
-    }
-    
-    max = max == 0 ? 0xFF : max;
-    
-    /// Normalization
-    if (brightness_norm && max != 0xFF)
-        for (int i=0; i<3; i++)
-            target[i] = (unsigned char) ((double) target[i] * (255.0 / (double) max));
-        
+    /** Calculate the dominant color in an array of RGB pixels, row by row */
+    LibMK_Image image;
+    image.data = data;
+    image.width = w;
+    image.height = h;
+    image.stride = w * 3;
+    image.format = LIBMK_PIXEL_RGB24;
+    calc_image_color(
+        NULL, &image, target, divider, sat_bias, lower, upper,
+        brightness_norm);
 }
 
 
@@ -163,7 +132,7 @@ void capturer(struct CaptureArgs* args) {
     /** Function designed to be run in a thread, captures screenshots
      *
      */
-    unsigned char target[3], previous[3];
+    unsigned char target[3], previous[3] = {0};
     
     while (true) {
         pthread_mutex_lock(args->exit_lock);
@@ -172,24 +141,22 @@ void capturer(struct CaptureArgs* args) {
         if (exit)
             break;
         
-        Screenshot* screenshot;
-        
-        capture(&screenshot, args->gwa, args->display, args->root);
-        
-        calc_dominant_color(screenshot->data, screenshot->w, screenshot->h,
-                            target, args->divider, args->saturation_bias,
-                            args->lower_threshold, args->upper_threshold,
-                            args->brightness_norm);
+        if (libmk_capture(args->capture) != LIBMK_SUCCESS)
+            continue;
         
-        free(screenshot->data);
-        free(screenshot);
+        calc_image_color(args->workers, &(args->capture->image), target, 1,
+                         args->saturation_bias, args->lower_threshold,
+                         args->upper_threshold, args->brightness_norm);
         
+        if (memcmp(target, previous, 3) == 0)
+            continue;
         pthread_mutex_lock(args->keyboard_lock);
         pthread_mutex_lock(args->target_lock);
         for (int i=0; i<3; i++) {
             args->target_color[i] = target[i];
             previous[i] = target[i];
         }
+        pthread_cond_signal(args->target_cond);
         pthread_mutex_unlock(args->target_lock);
         pthread_mutex_unlock(args->keyboard_lock);
     }
@@ -2,8 +2,10 @@
  * License: GNU GPLv3
  * Copyright (c) 2018-2019 RedFantom
 */
+#define _GNU_SOURCE 1
 #include "capture.h"
 #include "libmk.h"
+#include "libmkc.h"
 #include <stdbool.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -20,7 +22,6 @@
 /// Global variables
 bool exit_requested = false;
 unsigned char target_color[3] = {0};
-bool target_override = false;
 double speed = 20.0;
 int flash_repeat = 2;
 double flash_time = 1.0;
@@ -29,6 +30,11 @@ double flash_time = 1.0;
 pthread_mutex_t exit_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t target_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t keyboard_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t target_cond = PTHREAD_COND_INITIALIZER;
+
+/// Keyboard
+LibMK_Handle* handle;
+LibMK_Controller* controller;
 
 /// Threads
 pthread_t keyboard_thread;
@@ -38,64 +44,98 @@ pthread_t capture_thread;
 CaptureArgs* capture_args;
 
 
-void mkn_exit() {
+void request_exit() {
     pthread_mutex_lock(&exit_lock);
     exit_requested = true;
     pthread_mutex_unlock(&exit_lock);
+    // The keyboard thread waits for the target color to change
+    pthread_mutex_lock(&target_lock);
+    pthread_cond_broadcast(&target_cond);
+    pthread_mutex_unlock(&target_lock);
+}
+
+
+bool is_exit_requested() {
+    pthread_mutex_lock(&exit_lock);
+    bool exit = exit_requested;
+    pthread_mutex_unlock(&exit_lock);
+    return exit;
+}
+
+
+void mkn_exit() {
+    request_exit();
     pthread_join(keyboard_thread, NULL);
     pthread_join(capture_thread, NULL);
-    libmk_disable_control(NULL);
+    libmk_stop_controller(controller);
+    libmk_join_controller(controller, 1.0);
+    libmk_close_handle(handle);
+    libmk_free_controller(controller);
     libmk_exit();
 }
 
 
-void keyboard_updater() {
-    /** Thread controlling the color of a keyboard
+void sleep_us(unsigned int us) {
+    struct timespec t;
+    t.tv_sec = us / 1000000;
+    t.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&t, NULL);
+}
+
+
+unsigned int transition_time() {
+    /** Duration of a transition to a new screen color in microseconds
      *
-     * The thread sets the color of the keyboard to a color set by a
-     * different thread in target_color. target_color is protected by
-     * target_lock.
+     * Matches the time in which the keyboard used to cover most of
+     * the difference, moving 1/speed towards the target every 10 ms.
+     */
+    return speed > 0 ? (unsigned int) (speed * 10000) : 0;
+}
+
+
+void schedule_color(unsigned char color[3], unsigned int duration) {
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    for (int r=0; r<LIBMK_MAX_ROWS; r++)
+        for (int c=0; c<LIBMK_MAX_COLS; c++)
+            memcpy(colors[r][c], color, 3);
+    LibMK_Instruction* i = libmk_create_instruction_transition(
+        colors, duration, LIBMK_EASE_OUT);
+    if (i != NULL)
+        libmk_sched_instruction(controller, i);
+}
+
+
+void keyboard_updater() {
+    /** Thread scheduling transitions to the color of the screen
      *
-     * Expects that the keyboard to controlled is in the global device
-     * handle and control is enabled.
+     * Sleeps until the capture thread sets a new color in target_color
+     * and signals target_cond, and schedules a transition to the new
+     * color on the controller. The controller stops sending frames once
+     * the color is reached. A new transition is only scheduled after
+     * the previous has finished, so the transitions do not queue up if
+     * the color of the screen keeps changing.
      */
-    unsigned char target[3], previous[3];
-    bool exit = false, override = false;
+    unsigned char target[3], previous[3] = {0};
     
     while (true) {
-        pthread_mutex_lock(&exit_lock);
-        exit = exit_requested;
-        pthread_mutex_unlock(&exit_lock);
-        if (exit)
-            break;
-        
         pthread_mutex_lock(&target_lock);
-        for (int i=0; i<3; i++)
-            target[i] = target_color[i];
-        override = target_override;
+        while (memcmp(target_color, previous, 3) == 0 && !is_exit_requested())
+            pthread_cond_wait(&target_cond, &target_lock);
+        memcpy(target, target_color, 3);
         pthread_mutex_unlock(&target_lock);
+        if (is_exit_requested())
+            break;
         
-        bool equal = (
-            target[0] == previous[0] &&
-            target[1] == previous[1] &&
-            target[2] == previous[2]);
-        if (equal) { // If equal, sleep to prevent overactiveness
-            continue;
-        }
-        
-        if (!target_override)
-            for (int i=0; i<3; i++) {
-                int diff = (int) target[i] - (int) previous[i];
-                target[i] = previous[i] + (unsigned char) (diff / speed);
-                previous[i] = target[i];
-            }
-        int r = libmk_set_full_color(NULL, target[0], target[1], target[2]);
-        int* return_code = (int*) malloc(sizeof(int));
-        *(return_code) = r;
-        if (r != LIBMK_SUCCESS)
+        LibMK_Result r = libmk_get_controller_error(controller);
+        if (r != LIBMK_SUCCESS) {
+            int* return_code = (int*) malloc(sizeof(int));
+            *(return_code) = r;
             pthread_exit((void*) return_code);
-        
-        usleep(10000);
+        }
+        memcpy(previous, target, 3);
+        unsigned int duration = transition_time();
+        schedule_color(target, duration);
+        sleep_us(duration);
     }
     pthread_exit(LIBMK_SUCCESS);
 }
@@ -110,18 +150,20 @@ static PyObject* init(PyObject* self, PyObject* args) {
     
     int divider, lower, upper, sat_bias;
     int brightness_norm;
-    if (!PyArg_ParseTuple(args, "iiiiidid", &divider, &lower, &upper, &sat_bias,
-                          &brightness_norm, &speed, &flash_repeat, &flash_time)) {
+    int workers = 0;  // One per processor
+    if (!PyArg_ParseTuple(args, "iiiiidid|i", &divider, &lower, &upper,
+                          &sat_bias, &brightness_norm, &speed, &flash_repeat,
+                          &flash_time, &workers)) {
         PyErr_SetString(PyExc_ValueError, "Failed to parse arguments");
         libmk_exit();
         return NULL;
     }
     
     capture_args = init_capture(divider, sat_bias, lower, upper,
-        brightness_norm != 0, &target_color, &target_lock, &exit_requested,
-        &exit_lock, &keyboard_lock);
+        brightness_norm != 0, workers, target_color, &target_lock,
+        &target_cond, &exit_requested, &exit_lock, &keyboard_lock);
     
-    if (args == NULL) {
+    if (capture_args == NULL) {
         PyErr_SetString(PyExc_RuntimeError, "Failed to build CaptureArgs struct");
         libmk_exit();
         return NULL;
@@ -135,14 +177,23 @@ static PyObject* init(PyObject* self, PyObject* args) {
     }
 
     LibMK_Model model = models[0]; // Take first device found as target
-    int r = libmk_set_device(model, NULL); // Use global device handle
+    int r = libmk_set_device(model, &handle);
     if (r != LIBMK_SUCCESS) {
         libmk_exit();
         return PyInt_FromLong(r);
     }
     
-    r = libmk_enable_control(NULL);
+    controller = libmk_create_controller(handle);
+    if (controller == NULL) {
+        libmk_close_handle(handle);
+        libmk_free_handle(handle);
+        libmk_exit();
+        return PyInt_FromLong(LIBMK_ERR_INVALID_ARG);
+    }
+    r = libmk_start_controller(controller); // Enables control
     if (r != LIBMK_SUCCESS) {
+        libmk_close_handle(handle);
+        libmk_free_controller(controller);
         libmk_exit();
         return PyInt_FromLong(r);
     }
@@ -162,9 +213,7 @@ static PyObject* start(PyObject* self, PyObject* args) {
 
 static PyObject* stop(PyObject* self, PyObject* args) {
     /** Stop and join capture and keyboard threads */
-    pthread_mutex_lock(&exit_lock);
-    exit_requested = true;
-    pthread_mutex_unlock(&exit_lock);
+    request_exit();
     int return_kb, return_cp;
     pthread_join(keyboard_thread, NULL);
     pthread_join(capture_thread, NULL);
@@ -188,7 +237,7 @@ static PyObject* py_calculate_dominant_color(PyObject* self, PyObject* args) {
             &PyList_Type, &list, &divider, &w, &h, &lower, &upper,
             &sat_bias, &brightness_norm))
         return NULL;
-    unsigned char data[w][h][3];
+    unsigned char data[h][w][3];  // Row by row for calc_dominant_color
     PyObject* column, *row, *e;
     for (int x=0; x<w; x++) {
         column = PyList_GetItem(list, x);
@@ -209,53 +258,39 @@ static PyObject* py_calculate_dominant_color(PyObject* self, PyObject* args) {
                         PyExc_TypeError, "Invalid type in data");
                     return NULL;
                 }
-                data[x][y][i] = (unsigned char) PyInt_AsLong(e);
+                data[y][x][i] = (unsigned char) PyInt_AsLong(e);
             }
         }
     }
     unsigned char result[3];
     PyObject* tuple = PyTuple_New(3);
     calc_dominant_color(
-        data, w, h, result, divider, sat_bias, lower, upper, brightness_norm==1);
+        (unsigned char*) data, w, h, result, divider, sat_bias, lower, upper, brightness_norm==1);
     for (int i=0; i<3; i++)
         PyTuple_SetItem(tuple, i, PyInt_FromLong(result[i]));
     return tuple;
 }
 
 
-void __flash_keyboard(unsigned char* color) {
+void _flash_keyboard(unsigned char* color) {
+    /** Flash the keyboard from the color of the screen and back
+     *
+     * The keyboard lock keeps the capture thread from changing the
+     * target color, so the flashes end on the color of the screen. The
+     * transitions are executed by the controller after the transition
+     * that is in progress, and the thread sleeps until they are done.
+     */
+    pthread_mutex_lock(&keyboard_lock);
     pthread_mutex_lock(&target_lock);
-    target_override = true;
+    unsigned char screen[3];
+    memcpy(screen, target_color, 3);
     pthread_mutex_unlock(&target_lock);
-    unsigned char r = color[0], g = color[1], b = color[2];
-    for (int i=0; i<256; i++) {
-        pthread_mutex_unlock(&target_lock);
-        for (int j=0; j<3; j++) {
-            target_color[j] = (unsigned char) (
-                (double) color[j] * (double) i / 255.0);
-            usleep((int) (flash_time / (2*255.0) * 1000000));
-        }
-        pthread_mutex_unlock(&target_lock);
-    }
-    for (int i=255; i>-1; i--) {
-        pthread_mutex_unlock(&target_lock);
-        for (int j=0; j<3; j++) {
-            target_color[j] = (unsigned char) (
-                (double) color[j] * (double) i / 255.0);
-            usleep((int) (flash_time / (2*255.0) * 1000000));
-        }
-        pthread_mutex_unlock(&target_lock);
+    unsigned int half = (unsigned int) (flash_time * 1000000 / 2);
+    for (int i=0; i<flash_repeat; i++) {
+        schedule_color(color, half);
+        schedule_color(screen, half);
     }
-    pthread_mutex_lock(&target_lock);
-    target_override = false;
-    pthread_mutex_unlock(&target_lock);
-}
-
-
-void _flash_keyboard(unsigned char* color) {
-    pthread_mutex_lock(&keyboard_lock);
-    for (int i=0; i<flash_repeat; i++)
-        __flash_keyboard(color);
+    sleep_us(transition_time() + (unsigned int) flash_repeat * 2 * half);
     pthread_mutex_unlock(&keyboard_lock);
     free(color);
 }
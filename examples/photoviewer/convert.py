@@ -0,0 +1,106 @@
+"""
+Author: RedFantom
+License: GNU GPLv3
+Copyright (c) 2018-2019 RedFantom
+"""
+import masterkeys as mk
+import struct
+from argparse import ArgumentParser
+from PIL import Image, ImageSequence
+
+
+# Format of animation files, see LibMK_Animation_Header in libmkc.h
+MAGIC = b"MKAN"
+VERSION = 1
+HEADER = struct.Struct("<4sHHIIII")
+KEYFRAME = struct.Struct("<III")
+FRAME = struct.Struct("<IHH")
+FRAME_KEY = 0x0001
+KEYS = mk.MAX_ROWS * mk.MAX_COLS
+
+
+def read_frames(files, interval):
+    """
+    Calculate the key colors of the frames of a sequence of images
+
+    Every frame of an animated image is shown for the duration stored
+    in the image, other images for the given interval.
+
+    :return: List of (duration in microseconds, color bytes) tuples
+    """
+    frames = []
+    for file in files:
+        img = Image.open(file)
+        for frame in ImageSequence.Iterator(img):
+            duration = frame.info.get("duration", 0) or interval
+            frame = frame.convert("RGB")
+            w, h = frame.size
+            layout = mk.calculate_zone_colors(frame.tobytes(), w, h)
+            colors = bytes(c for row in layout for key in row for c in key)
+            frames.append((int(duration * 1000), colors))
+    return frames
+
+
+def encode_frames(frames, key_interval):
+    """
+    Encode frames as key frames or as the changes to the previous frame
+
+    A frame is stored as a key frame at the given interval, and whenever
+    the changes would take more space than all colors.
+
+    :return: (duration in microseconds, list of (time, is key frame,
+        frame bytes) tuples)
+    """
+    encoded, previous, time = [], None, 0
+    for n, (duration, colors) in enumerate(frames):
+        changes = b""
+        if previous is not None:
+            for k in range(KEYS):
+                if colors[k * 3:k * 3 + 3] != previous[k * 3:k * 3 + 3]:
+                    changes += bytes((k,)) + colors[k * 3:k * 3 + 3]
+        if previous is None or n % key_interval == 0 or len(changes) >= len(colors):
+            encoded.append((time, True, FRAME.pack(time, 0, FRAME_KEY) + colors))
+        else:
+            count = len(changes) // 4
+            encoded.append((time, False, FRAME.pack(time, count, 0) + changes))
+        previous = colors
+        time += duration
+    return time, encoded
+
+
+def write_animation(path, duration, encoded):
+    """Write the header, the index of the key frames and the frames"""
+    keyframes = sum(1 for _, key, _ in encoded if key)
+    data = HEADER.size + keyframes * KEYFRAME.size
+    index, offset = b"", data
+    for n, (time, key, frame) in enumerate(encoded):
+        if key:
+            index += KEYFRAME.pack(time, n, offset)
+        offset += len(frame)
+    with open(path, "wb") as fo:
+        fo.write(HEADER.pack(MAGIC, VERSION, 0, len(encoded), keyframes, duration, data))
+        fo.write(index)
+        for _, _, frame in encoded:
+            fo.write(frame)
+
+
+if __name__ == '__main__':
+    """
+    Convert a sequence of images or an animated GIF into an animation
+    file, to be played with utils/play.c or libmk_open_animation.
+    Decoding and averaging the images is done once here, rather than
+    for every frame shown on the keyboard.
+    """
+    parser = ArgumentParser(description="Convert images into an animation")
+    parser.add_argument("files", nargs="+", help="Images, in order")
+    parser.add_argument("-o", "--output", default="animation.mka")
+    parser.add_argument("-i", "--interval", type=int, default=100,
+                        help="Milliseconds to show images without a duration")
+    parser.add_argument("-k", "--keyframes", type=int, default=30,
+                        help="Frames between key frames, for seeking")
+    args = parser.parse_args()
+
+    frames = read_frames(args.files, args.interval)
+    duration, encoded = encode_frames(frames, max(args.keyframes, 1))
+    write_animation(args.output, duration, encoded)
+    print("Wrote {} frames to {}.".format(len(encoded), args.output))
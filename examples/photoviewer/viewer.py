@@ -6,15 +6,6 @@ Copyright (c) 2018-2019 RedFantom
 import masterkeys as mk
 from os import path
 from PIL import Image
-import sys
-
-
-def print_progress(done, total):
-    """Print a progress bar using #"""
-    filled, percent = int(60 * done / total), done * 100 / total
-    bar = "[{}]".format("#" * filled + " " * (60 - filled))
-    sys.stdout.write("\r{} {:02.1f}%\r".format(bar, percent))
-    sys.stdout.flush()
 
 
 if __name__ == '__main__':
@@ -29,28 +20,10 @@ if __name__ == '__main__':
         exit(-1)
     img = Image.open(file)
 
-    # Process the image
+    # Process the image, averaging the pixels of the zone of every key
+    img = img.convert("RGB")
     w, h = img.size
-    pixels = img.load()
-    layout = mk.build_layout_list()
-    w_p_c, h_p_r = (w // mk.MAX_COLS), (h // mk.MAX_ROWS)
-    done, total = 0, mk.MAX_ROWS * mk.MAX_COLS
-    for r in range(mk.MAX_ROWS):
-        for c in range(mk.MAX_COLS):
-            sums = [0, 0, 0]
-            xrange = list(range(w_p_c * c, w_p_c * (c + 1)))
-            yrange = list(range(h_p_r * r, h_p_r * (r + 1)))
-            for x in xrange:
-                for y in yrange:
-                    for i in range(3):
-                        sums[i] += pixels[x, y][i]
-            color = (v // (w_p_c * h_p_r) for v in sums)
-            color = tuple(map(int, color))
-            layout[r][c] = color
-
-            done += 1
-            print_progress(done, total)
-    print()
+    layout = mk.calculate_zone_colors(img.tobytes(), w, h)
 
     # Update the color of the keyboard
     devices = mk.detect_devices()
@@ -2,13 +2,25 @@
  * License: GNU GPLv3
  * Copyright (c) 2018-2019 RedFantom
 */
+#define _GNU_SOURCE
 #include "libmk.h"
+#include "libmk_keys.h"
 #include "libusb.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 // #define LIBMK_DEBUG
 // #define LIBMK_USB_DEBUG
@@ -33,6 +45,14 @@
 */
 static libusb_context* Context;
 static LibMK_Handle* DeviceHandle;
+static LibMK_Device* Devices;  // Cache of supported devices
+static bool DevicesValid;
+static libusb_hotplug_callback_handle HotplugHandle;
+static bool HotplugEnabled;
+static LibMK_Hotplug_Callback HotplugCallback;
+static void* HotplugData;
+static libusb_device* HotplugPending[LIBMK_HOTPLUG_PENDING];
+static unsigned int HotplugPendingCount;
 
 typedef enum LibMK_Model LibMK_Model;
 typedef enum LibMK_Result LibMK_Result;
@@ -54,9 +74,6 @@ const unsigned int ANSI[] =
 const unsigned int ISO[] =
     {0x0047, 0x0000};
 
-const unsigned char LAYOUT_ANSI = 0;
-const unsigned char LAYOUT_ISO = 1;
-
 const char* LIBMK_MODEL_STRINGS[] = {
     "MasterKeys Pro L RGB",
     "MasterKeys Pro S RGB",
@@ -72,7 +89,8 @@ const char* LIBMK_MODEL_STRINGS[] = {
  *
  * These matrices describe the internal addresses of keys within the
  * keyboard. The matrix is in [row][column] format. A value of 0xFF
- * indicates an unknown value.
+ * indicates an unknown value. After changing a matrix, libmk_keys.h
+ * must be regenerated with utils/keys.c.
 */
 const unsigned char LIBMK_LAYOUT[2][3][LIBMK_MAX_ROWS][LIBMK_MAX_COLS] = {
     { // ANSI Layouts
@@ -178,6 +196,67 @@ const unsigned char LIBMK_LAYOUT[2][3][LIBMK_MAX_ROWS][LIBMK_MAX_COLS] = {
 };
 
 
+/** Key code matrices
+ *
+ * These matrices describe the Linux key codes reported by the keyboard
+ * interface for the keys of LIBMK_LAYOUT, in the same [row][column]
+ * format. A value of 0 indicates that no key code is known. The
+ * positions of the keys are equal for all sizes of a layout.
+*/
+static const unsigned short LIBMK_KEY_CODE_MATRIX[2][LIBMK_MAX_ROWS][LIBMK_MAX_COLS] = {
+    { // ANSI layout, all sizes
+      {KEY_ESC, KEY_F1, KEY_F2, KEY_F3, KEY_F4, 0, KEY_F5, KEY_F6, KEY_F7,
+       KEY_F8, 0, KEY_F9, KEY_F10, KEY_F11, KEY_F12, KEY_SYSRQ,
+       KEY_SCROLLLOCK, KEY_PAUSE, 0, 0, 0, 0, 0, 0},
+      {KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8,
+       KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL, 0, KEY_BACKSPACE, KEY_INSERT,
+       KEY_HOME, KEY_PAGEUP, KEY_NUMLOCK, KEY_KPSLASH, KEY_KPASTERISK,
+       KEY_KPMINUS, 0, 0},
+      {KEY_TAB, KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I,
+       KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE, 0, KEY_BACKSLASH,
+       KEY_DELETE, KEY_END, KEY_PAGEDOWN, KEY_KP7, KEY_KP8, KEY_KP9,
+       KEY_KPPLUS, 0, 0},
+      {KEY_CAPSLOCK, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K,
+       KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE, 0, 0, KEY_ENTER, 0, 0, 0,
+       KEY_KP4, KEY_KP5, KEY_KP6, 0, 0, 0},
+      {KEY_LEFTSHIFT, 0, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M,
+       KEY_COMMA, KEY_DOT, KEY_SLASH, 0, 0, KEY_RIGHTSHIFT, 0, KEY_UP, 0,
+       KEY_KP1, KEY_KP2, KEY_KP3, KEY_KPENTER, 0, 0},
+      {KEY_LEFTCTRL, KEY_LEFTMETA, KEY_LEFTALT, 0, 0, 0, KEY_SPACE, 0, 0, 0,
+       KEY_RIGHTALT, KEY_RIGHTMETA, KEY_COMPOSE, 0, KEY_RIGHTCTRL, KEY_LEFT,
+       KEY_DOWN, KEY_RIGHT, KEY_KP0, 0, KEY_KPDOT, 0, 0, 0},
+      {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+       0}},
+    { // ISO layout, all sizes
+      {KEY_ESC, KEY_F1, KEY_F2, KEY_F3, KEY_F4, 0, KEY_F5, KEY_F6, KEY_F7,
+       KEY_F8, 0, KEY_F9, KEY_F10, KEY_F11, KEY_F12, KEY_SYSRQ,
+       KEY_SCROLLLOCK, KEY_PAUSE, 0, 0, 0, 0, 0, 0},
+      {KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8,
+       KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL, 0, KEY_BACKSPACE, KEY_INSERT,
+       KEY_HOME, KEY_PAGEUP, KEY_NUMLOCK, KEY_KPSLASH, KEY_KPASTERISK,
+       KEY_KPMINUS, 0, 0},
+      {KEY_TAB, KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I,
+       KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE, 0, KEY_ENTER,
+       KEY_DELETE, KEY_END, KEY_PAGEDOWN, KEY_KP7, KEY_KP8, KEY_KP9,
+       KEY_KPPLUS, 0, 0},
+      {KEY_CAPSLOCK, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K,
+       KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE, KEY_BACKSLASH, 0, 0, 0, 0, 0,
+       KEY_KP4, KEY_KP5, KEY_KP6, 0, 0, 0},
+      {KEY_LEFTSHIFT, KEY_102ND, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N,
+       KEY_M, KEY_COMMA, KEY_DOT, KEY_SLASH, 0, 0, KEY_RIGHTSHIFT, 0,
+       KEY_UP, 0, KEY_KP1, KEY_KP2, KEY_KP3, KEY_KPENTER, 0, 0},
+      {KEY_LEFTCTRL, KEY_LEFTMETA, KEY_LEFTALT, 0, 0, 0, KEY_SPACE, 0, 0, 0,
+       KEY_RIGHTALT, KEY_RIGHTMETA, KEY_COMPOSE, 0, KEY_RIGHTCTRL, KEY_LEFT,
+       KEY_DOWN, KEY_RIGHT, KEY_KP0, 0, KEY_KPDOT, 0, 0, 0},
+      {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+       0}}
+};
+
+
+static void libmk_clear_devices(void);
+static void libmk_process_hotplug(void);
+
+
 bool libmk_init(void) {
     int result = libusb_init(&Context);
 #ifdef LIBMK_USB_DEBUG
@@ -193,47 +272,71 @@ int libmk_exit(void) {
         if (r != LIBMK_SUCCESS)
             return r;
     }
+    libmk_disable_hotplug();
+    libmk_clear_devices();
     libusb_exit(Context);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_detect_devices(LibMK_Model** model_list) {
+static void libmk_clear_devices(void) {
+    LibMK_Device* next;
+    while (Devices != NULL) {
+        next = Devices->next;
+        libmk_free_device(Devices);
+        Devices = next;
+    }
+    DevicesValid = false;
+}
+
+
+static int libmk_scan_devices(void) {
+    if (DevicesValid)
+        return LIBMK_SUCCESS;
     libusb_device** devices = NULL;
     ssize_t amount = libusb_get_device_list(Context, &devices);
     if (amount < 0)
         return LIBMK_ERR_DEV_LIST;
-
-    int n = 0;
-    libusb_device* current = NULL;
-    LibMK_Device* list = NULL;
-    LibMK_Device* temp = NULL;
-
-    // Build a linked list of Device structs of supported devices
+    libmk_clear_devices();
+    LibMK_Device* device;
     for (ssize_t i = 0; i < amount; i++) {
-        current = devices[i];
-        if (current == NULL)
+        if (devices[i] == NULL)
             break;
-        temp = libmk_open_device(current);
-        if (temp == NULL)  // Not a MasterKeys device
+        device = libmk_open_device(devices[i]);
+        if (device == NULL)  // Not a MasterKeys device
             continue;
-
-        list = libmk_append_device(list, temp);
-        n = n + 1;
+        Devices = libmk_append_device(Devices, device);
     }
+    // Cached devices hold a reference of their own
+    libusb_free_device_list(devices, true);
+    DevicesValid = true;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_refresh_devices(void) {
+    DevicesValid = false;
+    int r = libmk_scan_devices();
+    if (r != LIBMK_SUCCESS)
+        return r;
+    int n = 0;
+    for (LibMK_Device* d = Devices; d != NULL; d = d->next)
+        n++;
+    return n;
+}
+
 
-    // Now build an array of Model numbers
-    LibMK_Model* models = (LibMK_Model*) malloc(sizeof(LibMK_Model) * n);
+int libmk_detect_devices(LibMK_Model** model_list) {
+    int n = libmk_refresh_devices();
+    if (n < 0)
+        return n;
+    LibMK_Model* models = (LibMK_Model*) malloc(
+        sizeof(LibMK_Model) * (n > 0 ? n : 1));
+    if (models == NULL)
+        return LIBMK_ERR_DEV_LIST;
     *model_list = models;
-    temp = list;
-    LibMK_Device* to_free;
-    for (int j = 0; j < n; j++) {
-        models[j] = temp->model;
-        to_free = temp;
-        if (temp->next != NULL)
-            temp = temp->next;
-        libmk_free_device(to_free);
-    }
+    for (LibMK_Device* d = Devices; d != NULL; d = d->next)
+        *(models++) = d->model;
     return n;
 }
 
@@ -242,27 +345,26 @@ LibMK_Device* libmk_open_device(libusb_device* device) {
     int r;
     struct libusb_device_descriptor descriptor;
     libusb_device_handle* handle = NULL;
-    unsigned char* manufacturer =
-        (unsigned char*) malloc(LIBMK_USB_DESCR_LEN * sizeof(unsigned char));
-    unsigned char* product =
-        (unsigned char*) malloc(LIBMK_USB_DESCR_LEN * sizeof(unsigned char));
+    unsigned char manufacturer[LIBMK_USB_DESCR_LEN] = {0};
+    unsigned char product[LIBMK_USB_DESCR_LEN] = {0};
 
-    // Get the device descriptor of the next device
+    // Only devices of the right vendor are opened, as opening a device
+    // is slow and may fail due to missing permissions
     r = libusb_get_device_descriptor(device, &descriptor);
-    if (r < 0)
+    if (r < 0 || descriptor.idVendor != LIBMK_VENDOR_ID)
         return NULL;
 
     // Open the device and decode the descriptor strings
     r = libusb_open(device, &handle);
     if (r < 0)
         return NULL;
-
     libusb_get_string_descriptor_ascii(
         handle, descriptor.iManufacturer,
         manufacturer, LIBMK_USB_DESCR_LEN);
     libusb_get_string_descriptor_ascii(
         handle, descriptor.iProduct,
         product, LIBMK_USB_DESCR_LEN);
+    libusb_close(handle);
 
     if (strcmp((char*) manufacturer, MANUFACTURER) != 0)
         return NULL;
@@ -272,11 +374,9 @@ LibMK_Device* libmk_open_device(libusb_device* device) {
     if (model == DEV_UNKNOWN)
         return NULL;
 
-    LibMK_Device* device_struct = libmk_create_device(
+    return libmk_create_device(
         model, device, (char*) manufacturer, (char*) product,
         descriptor.idVendor, descriptor.idProduct);
-    libusb_close(handle);
-    return device_struct;
 }
 
 
@@ -292,13 +392,15 @@ LibMK_Device* libmk_create_device(LibMK_Model model, libusb_device* dev,
     device->iProduct = p_str;
     device->bVendor = bVendor;
     device->bDevice = bDevice;
-    device->device = dev;
+    device->device = libusb_ref_device(dev);
     device->model = model;
+    device->next = NULL;
     return device;
 }
 
 
 void libmk_free_device(LibMK_Device* device) {
+    libusb_unref_device(device->device);
     free(device->iManufacturer);
     free(device->iProduct);
     free(device);
@@ -317,322 +419,953 @@ LibMK_Device* libmk_append_device(LibMK_Device* first_device,
 }
 
 
-int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device) {
-    *handle = (LibMK_Handle*) malloc(sizeof(LibMK_Handle));
-    if (*handle == NULL)
-        return LIBMK_ERR_DEV_OPEN_FAILED;
-    int r = libusb_open(device->device, &(*handle)->handle);
-    if (r != 0)
-        return LIBMK_ERR_DEV_OPEN_FAILED;
-    (*handle)->open = true;
-    (*handle)->model = device->model;
-    (*handle)->bDevice = device->bDevice;
-    (*handle)->bVendor = device->bVendor;
-    LibMK_Model model = device->model;
-    if (model == DEV_RGB_L || model == DEV_WHITE_L)
-        (*handle)->size = LIBMK_L;
-    else if (model == DEV_RGB_M || model == DEV_WHITE_M)
-        (*handle)->size = LIBMK_M;
-    else if (model == DEV_RGB_S || model == DEV_WHITE_S)
-        (*handle)->size = LIBMK_S;
-    else {
-        libusb_close((*handle)->handle);
-        return LIBMK_ERR_UNKNOWN_LAYOUT;
+static int libmk_libusb_claim(LibMK_Handle* handle) {
+    int r;
+    // Unload the kernel driver for the device if it is active
+    if (libusb_kernel_driver_active(handle->handle, LIBMK_IFACE_NUM)) {
+        r = libusb_detach_kernel_driver(handle->handle, LIBMK_IFACE_NUM);
+        if (r < 0)
+            return LIBMK_ERR_KERNEL_DRIVER;
     }
+
+    // Claim the interface on the device
+    r = libusb_claim_interface(handle->handle, LIBMK_IFACE_NUM);
+    if (r < 0)
+        return LIBMK_ERR_IFACE_CLAIM_FAILED;
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_free_handle(LibMK_Handle* handle) {
-    if (handle->open)
-        return LIBMK_ERR_DEV_NOT_CLOSED;
-    free(handle);
+static int libmk_libusb_release(LibMK_Handle* handle) {
+    int r = libusb_release_interface(handle->handle, LIBMK_IFACE_NUM);
+    if (r < 0)
+        return LIBMK_ERR_IFACE_RELEASE_FAILED;
+    // Reset so that the kernel driver is attached again
+    libusb_reset_device(handle->handle);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_device(LibMK_Model model, LibMK_Handle** handle) {
-    libusb_device** devices;
-    ssize_t amount = libusb_get_device_list(NULL, &devices);
-    if (amount < 0)
-        return LIBMK_ERR_DEV_LIST;
+static int libmk_libusb_reset(LibMK_Handle* handle) {
+    if (libusb_reset_device(handle->handle) != LIBUSB_SUCCESS)
+        return LIBMK_ERR_DEV_RESET_FAILED;
+    return LIBMK_SUCCESS;
+}
 
-    // Variables required for looping over the device list
-    int r;  // libusb requires error handling with return values
-    libusb_device* current = NULL;
-    libusb_device* device = NULL;
-    struct libusb_device_descriptor descriptor;
-    libusb_device_handle* usb_handle;
 
-    // Strings to store decoded device descriptors in
-    unsigned char manufacturer[LIBMK_USB_DESCR_LEN];
-    unsigned char product[LIBMK_USB_DESCR_LEN];
+static void libmk_libusb_close(LibMK_Handle* handle) {
+    libusb_close(handle->handle);
+    handle->handle = NULL;
+}
 
-    for (ssize_t i = 0; i < amount; i++) {
 
-        // Get the device descriptor of the next device
-        current = devices[i];
-        r = libusb_get_device_descriptor(current, &descriptor);
-        if (r < 0)
-            return LIBMK_ERR_DESCR;
+static int libmk_libusb_transfer(
+        LibMK_Handle* handle, unsigned char endpoint, unsigned char* packet) {
+    int t;
+    int r = libusb_interrupt_transfer(
+        handle->handle, endpoint, packet, LIBMK_PACKET_SIZE, &t,
+        LIBMK_PACKET_TIMEOUT);
+    if (r == LIBUSB_ERROR_TIMEOUT)
+        return LIBMK_ERR_TIMEOUT;
+    if (r != LIBUSB_SUCCESS || t != LIBMK_PACKET_SIZE)
+        return LIBMK_ERR_TRANSFER;
+    return LIBMK_SUCCESS;
+}
 
-        // Open the device and decode the descriptor strings
-        r = libusb_open(current, &usb_handle);
-        if (r < 0)
-            return LIBMK_ERR_DEV_OPEN_FAILED;
-        libusb_get_string_descriptor_ascii(
-            usb_handle, descriptor.iManufacturer,
-            manufacturer, LIBMK_USB_DESCR_LEN);
-        libusb_get_string_descriptor_ascii(
-            usb_handle, descriptor.iProduct,
-            product, LIBMK_USB_DESCR_LEN);
-
-        // Determine whether this is a valid MasterKeys keyboard device
-        if (strcmp((char*) manufacturer, MANUFACTURER) == 0) {
-            if (model == DEV_ANY
-                || libmk_ident_model((char*) product) == model) {
-
-                device = current;
-                libusb_close(usb_handle);
-                break;
-            }
-        }
-        libusb_close(usb_handle);
-    }
 
-    if (device == NULL)
-        // No devices detected
-        return LIBMK_ERR_DEV_NOT_CONNECTED;
+static int libmk_libusb_write(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_libusb_transfer(
+        handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT, packet);
+}
 
-    // Open the device into the handle
-    LibMK_Device* dev = libmk_open_device(device);
-    if (handle == NULL)
-        handle = &DeviceHandle;
-    r = libmk_create_handle(handle, dev);
-    libusb_free_device_list(devices, true);
-    return r;
+
+static int libmk_libusb_read(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_libusb_transfer(
+        handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN, packet);
 }
 
 
-LibMK_Model libmk_ident_model(char* product) {
-    if (strstr(product, PRODUCT) == NULL)
-        return DEV_UNKNOWN;
-    if (strstr(product, WHITE) != NULL) {
-        if (strstr(product, LARGE) != NULL)
-            return DEV_WHITE_L;
-        else if (strstr(product, SMALL) != NULL)
-            return DEV_WHITE_S;
-        return DEV_WHITE_M;
+/// Transfer reused for every packet of LIBMK_TRANSPORT_LIBUSB_ASYNC
+typedef struct LibMK_Async {
+    struct libusb_transfer* transfer;
+    int completed;
+} LibMK_Async;
+
+
+static void LIBUSB_CALL libmk_async_cb(struct libusb_transfer* transfer) {
+    *((int*) transfer->user_data) = 1;
+}
+
+
+static void libmk_async_free(LibMK_Handle* handle) {
+    LibMK_Async* async = (LibMK_Async*) handle->transport_data;
+    if (async == NULL)
+        return;
+    libusb_free_transfer(async->transfer);
+    free(async);
+    handle->transport_data = NULL;
+}
+
+
+static void libmk_async_close(LibMK_Handle* handle) {
+    libmk_async_free(handle);
+    libmk_libusb_close(handle);
+}
+
+
+static int libmk_async_transfer(
+        LibMK_Handle* handle, unsigned char endpoint, unsigned char* packet) {
+    LibMK_Async* async = (LibMK_Async*) handle->transport_data;
+    if (async == NULL) {
+        async = (LibMK_Async*) malloc(sizeof(LibMK_Async));
+        if (async == NULL)
+            return LIBMK_ERR_TRANSFER;
+        async->transfer = libusb_alloc_transfer(0);
+        if (async->transfer == NULL) {
+            free(async);
+            return LIBMK_ERR_TRANSFER;
+        }
+        handle->transport_data = async;
     }
-    if (strstr(product, LARGE) != NULL)
-        return DEV_RGB_L;
-    else if (strstr(product, SMALL) != NULL)
-        return DEV_RGB_S;
-    return DEV_RGB_M;
+    async->completed = 0;
+    libusb_fill_interrupt_transfer(
+        async->transfer, handle->handle, endpoint, packet, LIBMK_PACKET_SIZE,
+        libmk_async_cb, &async->completed, LIBMK_PACKET_TIMEOUT);
+    if (libusb_submit_transfer(async->transfer) != LIBUSB_SUCCESS)
+        return LIBMK_ERR_TRANSFER;
+    // Transfers of frames and other handles are completed while waiting
+    bool cancelled = false;
+    while (!async->completed) {
+        int r = libusb_handle_events_completed(Context, &async->completed);
+        if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED &&
+                !cancelled) {
+            // The transfer may only be reused once its callback is called
+            libusb_cancel_transfer(async->transfer);
+            cancelled = true;
+        }
+    }
+    if (async->transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        return LIBMK_ERR_TIMEOUT;
+    if (async->transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            async->transfer->actual_length != LIBMK_PACKET_SIZE)
+        return LIBMK_ERR_TRANSFER;
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_get_device_ident(LibMK_Handle* handle) {
-    if (handle == NULL)
-        handle = DeviceHandle;
-    if (handle == NULL)
-        return 0x0000;
-    return DeviceHandle->bDevice;
+static int libmk_async_write(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_async_transfer(
+        handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT, packet);
 }
 
 
-int libmk_enable_control(LibMK_Handle* handle) {
-    int r;  // Stores libusb return values
+static int libmk_async_read(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_async_transfer(
+        handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN, packet);
+}
 
-    if (handle == NULL)
-        handle = DeviceHandle;
-    if (handle == NULL)
-        return LIBMK_ERR_DEV_NOT_SET;
 
-    // Claim the interface on the device
-    r = libmk_claim_interface(handle);
-    if (r != LIBMK_SUCCESS)
-        return LIBMK_ERR_IFACE_CLAIM_FAILED;
+static int libmk_read_sysfs(const char* dir, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    int value;
+    if (fscanf(file, "%d", &value) != 1)
+        value = -1;
+    fclose(file);
+    return value;
+}
 
-    // Send the enable control packet to the keyboard
-    return libmk_send_control_packet(handle);
+
+static int libmk_hidraw_find(LibMK_Handle* handle, char* node, size_t n) {
+    /* The device of a hidraw node resolves to the HID device within the
+     * directory of its USB interface, within the directory of the USB
+     * device: .../usb1/1-2/1-2:1.1/0003:2516:0047.0001
+     */
+    libusb_device* device = libusb_get_device(handle->handle);
+    int bus = libusb_get_bus_number(device);
+    int address = libusb_get_device_address(device);
+    DIR* dir = opendir("/sys/class/hidraw");
+    if (dir == NULL)
+        return LIBMK_ERR_NOT_SUPPORTED;
+    char path[PATH_MAX], real[PATH_MAX];
+    char *sep, *dot;
+    struct dirent* entry;
+    int r = LIBMK_ERR_DEV_NOT_CONNECTED;
+    while (r != LIBMK_SUCCESS && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        snprintf(path, PATH_MAX, "/sys/class/hidraw/%s/device", entry->d_name);
+        if (realpath(path, real) == NULL || (sep = strrchr(real, '/')) == NULL)
+            continue;
+        *sep = '\0';
+        sep = strrchr(real, '/');
+        dot = sep != NULL ? strrchr(sep, '.') : NULL;
+        if (dot == NULL || strchr(sep, ':') == NULL ||
+                atoi(dot + 1) != LIBMK_IFACE_NUM)
+            continue;
+        *sep = '\0';
+        if (libmk_read_sysfs(real, "busnum") == bus &&
+                libmk_read_sysfs(real, "devnum") == address) {
+            snprintf(node, n, "/dev/%s", entry->d_name);
+            r = LIBMK_SUCCESS;
+        }
+    }
+    closedir(dir);
+    return r;
 }
 
 
-int libmk_send_control_packet(LibMK_Handle* handle) {
-    int r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+static int libmk_hidraw_claim(LibMK_Handle* handle) {
+    char node[PATH_MAX];
+    int r = libmk_hidraw_find(handle, node, PATH_MAX);
     if (r != LIBMK_SUCCESS)
         return r;
-    LibMK_Firmware* fw;
-    r = libmk_get_firmware_version(handle, &fw);
-    if (r != LIBMK_SUCCESS) {
-        libusb_close(handle->handle);
-        return r;
+    handle->fd = open(node, O_RDWR | O_CLOEXEC);
+    if (handle->fd < 0)
+        return LIBMK_ERR_IFACE_CLAIM_FAILED;
+    return LIBMK_SUCCESS;
+}
+
+
+static int libmk_hidraw_release(LibMK_Handle* handle) {
+    // The kernel driver remains attached, so no reset is required
+    if (handle->fd >= 0 && close(handle->fd) != 0) {
+        handle->fd = -1;
+        return LIBMK_ERR_IFACE_RELEASE_FAILED;
     }
-    handle->layout = fw->layout;
+    handle->fd = -1;
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_disable_control(LibMK_Handle* handle) {
-    if (handle == NULL)
-        handle = DeviceHandle;
-    if (handle == NULL)
-        return LIBMK_ERR_DEV_NOT_SET;
+static int libmk_hidraw_reset(LibMK_Handle* handle) {
+    /* The device is reset through its usbfs node, rather than through
+     * libusb. usbhid remains bound across the reset, so the hidraw node
+     * stays open.
+     */
+    libusb_device* device = libusb_get_device(handle->handle);
+    char node[PATH_MAX];
+    snprintf(node, PATH_MAX, "/dev/bus/usb/%03d/%03d",
+             libusb_get_bus_number(device), libusb_get_device_address(device));
+    int fd = open(node, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return LIBMK_ERR_DEV_RESET_FAILED;
+    int r = ioctl(fd, USBDEVFS_RESET, 0);
+    close(fd);
+    return r < 0 ? LIBMK_ERR_DEV_RESET_FAILED : LIBMK_SUCCESS;
+}
+
+
+static void libmk_hidraw_close(LibMK_Handle* handle) {
+    libmk_hidraw_release(handle);
+    libmk_libusb_close(handle);
+}
+
+
+static int libmk_hidraw_write(LibMK_Handle* handle, unsigned char* packet) {
+    // The reports of the device are not numbered, indicated by ID zero
+    unsigned char report[LIBMK_PACKET_SIZE + 1];
+    report[0] = 0x00;
+    memcpy(report + 1, packet, LIBMK_PACKET_SIZE);
+    if (write(handle->fd, report, LIBMK_PACKET_SIZE + 1) != LIBMK_PACKET_SIZE + 1)
+        return LIBMK_ERR_TRANSFER;
+    return LIBMK_SUCCESS;
+}
 
-    int r = libmk_set_control_mode(handle, LIBMK_FIRMWARE_CTRL);
-    if (r != LIBMK_SUCCESS)
-        return r;
 
-    r = libusb_release_interface(handle->handle, LIBMK_IFACE_NUM);
+static int libmk_hidraw_read(LibMK_Handle* handle, unsigned char* packet) {
+    struct pollfd fd = {handle->fd, POLLIN, 0};
+    int r = poll(&fd, 1, LIBMK_PACKET_TIMEOUT);
+    if (r == 0)
+        return LIBMK_ERR_TIMEOUT;
     if (r < 0)
-        return LIBMK_ERR_IFACE_RELEASE_FAILED;
+        return LIBMK_ERR_TRANSFER;
+    if (read(handle->fd, packet, LIBMK_PACKET_SIZE) != LIBMK_PACKET_SIZE)
+        return LIBMK_ERR_TRANSFER;
+    return LIBMK_SUCCESS;
+}
 
-    libusb_close(handle->handle);
-    handle->open = false;
-    if (handle == DeviceHandle) {
-        libmk_free_handle(handle);
-        DeviceHandle = NULL;
+
+static LibMK_Mock* libmk_create_mock(LibMK_Layout layout) {
+    LibMK_Mock* mock = (LibMK_Mock*) malloc(sizeof(LibMK_Mock));
+    if (mock == NULL)
+        return NULL;
+    mock->capacity = LIBMK_MOCK_CAPACITY;
+    mock->packets = malloc(LIBMK_PACKET_SIZE * mock->capacity);
+    if (mock->packets == NULL) {
+        free(mock);
+        return NULL;
     }
-    libusb_reset_device(handle->handle);
+    mock->n = 0;
+    memset(mock->response, 0x00, LIBMK_PACKET_SIZE);
+    mock->layout = layout;
+    mock->delay = 0;
+    return mock;
+}
+
+
+static int libmk_mock_nop(LibMK_Handle* handle) {
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_claim_interface(LibMK_Handle* handle) {
-    int r;
-    if (handle == NULL)
-        handle = DeviceHandle;
-    if (handle == NULL)
-        return LIBMK_ERR_DEV_NOT_SET;
+static void libmk_mock_close(LibMK_Handle* handle) {
+    LibMK_Mock* mock = (LibMK_Mock*) handle->transport_data;
+    if (mock == NULL)
+        return;
+    free(mock->packets);
+    free(mock);
+    handle->transport_data = NULL;
+}
 
-    // Unload the kernel driver for the device if it is active
-    if (libusb_kernel_driver_active(handle->handle, LIBMK_IFACE_NUM)) {
-        r = libusb_detach_kernel_driver(handle->handle, LIBMK_IFACE_NUM);
-        if (r < 0)
-            return LIBMK_ERR_KERNEL_DRIVER;
-    }
 
-    // Claim the interface on the device
-    r = libusb_claim_interface(handle->handle, LIBMK_IFACE_NUM);
-    if (r < 0)
-        return LIBMK_ERR_IFACE_CLAIM_FAILED;
+static int libmk_mock_write(LibMK_Handle* handle, unsigned char* packet) {
+    LibMK_Mock* mock = (LibMK_Mock*) handle->transport_data;
+    if (mock->delay != 0)
+        usleep(mock->delay);
+    memcpy(mock->packets[mock->n % mock->capacity], packet, LIBMK_PACKET_SIZE);
+    mock->n++;
+    memcpy(mock->response, packet, LIBMK_PACKET_SIZE);
+    if (packet[0] == 0x01 && packet[1] == 0x02)
+        // Firmware version of which the first digit is the layout
+        snprintf((char*) mock->response + 0x04, LIBMK_PACKET_SIZE - 0x04,
+                 "%d.0.0", mock->layout);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect) {
+static int libmk_mock_read(LibMK_Handle* handle, unsigned char* packet) {
+    LibMK_Mock* mock = (LibMK_Mock*) handle->transport_data;
+    memcpy(packet, mock->response, LIBMK_PACKET_SIZE);
+    return LIBMK_SUCCESS;
+}
+
+
+/// Built-in transports, indexed by LibMK_Transport_Type
+static const LibMK_Transport LIBMK_TRANSPORTS[LIBMK_TRANSPORT_CUSTOM] = {
+    {LIBMK_TRANSPORT_LIBUSB, libmk_libusb_claim, libmk_libusb_release,
+     libmk_libusb_reset, libmk_libusb_close, libmk_libusb_write,
+     libmk_libusb_read, true},
+    {LIBMK_TRANSPORT_LIBUSB_ASYNC, libmk_libusb_claim, libmk_libusb_release,
+     libmk_libusb_reset, libmk_async_close, libmk_async_write,
+     libmk_async_read, true},
+    {LIBMK_TRANSPORT_HIDRAW, libmk_hidraw_claim, libmk_hidraw_release,
+     libmk_hidraw_reset, libmk_hidraw_close, libmk_hidraw_write,
+     libmk_hidraw_read, false},
+    {LIBMK_TRANSPORT_MOCK, libmk_mock_nop, libmk_mock_nop, libmk_mock_nop,
+     libmk_mock_close, libmk_mock_write, libmk_mock_read, false},
+};
+
+
+int libmk_set_transport(LibMK_Handle* handle, LibMK_Transport_Type type) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-
-    unsigned char* packet = libmk_build_packet(
-        2, 0x41, 0x01);
-    int r = libmk_send_packet(handle, packet);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    packet = libmk_build_packet(
-        5, HEADER_SET, OPCODE_EFFECT, 0x00, 0x00, (unsigned char) effect);
-    return libmk_send_packet(handle, packet);
+    if (type < LIBMK_TRANSPORT_LIBUSB || type >= LIBMK_TRANSPORT_CUSTOM)
+        return LIBMK_ERR_INVALID_ARG;
+    if (handle->mode != LIBMK_FIRMWARE_CTRL)
+        return LIBMK_ERR_STILL_ACTIVE;
+    if (handle->transport->type == type)
+        return LIBMK_SUCCESS;
+    if (type == LIBMK_TRANSPORT_MOCK) {
+        LibMK_Mock* mock = libmk_create_mock(LIBMK_LAYOUT_ANSI);
+        if (mock == NULL)
+            return LIBMK_ERR_DEV_OPEN_FAILED;
+        libmk_close_handle(handle);
+        handle->transport_data = mock;
+        handle->open = true;
+    } else if (handle->handle == NULL)
+        // Only the libusb device of a handle can be switched between
+        return LIBMK_ERR_INVALID_ARG;
+    else if (handle->transport->type == LIBMK_TRANSPORT_LIBUSB_ASYNC)
+        libmk_async_free(handle);
+    handle->transport = &LIBMK_TRANSPORTS[type];
+    libmk_invalidate_frame(handle);
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_full_color(LibMK_Handle* handle,
-                         unsigned char r,
-                         unsigned char g,
-                         unsigned char b) {
+int libmk_set_transport_ops(
+        LibMK_Handle* handle, const LibMK_Transport* transport, void* data) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* packet = libmk_build_packet(
-        7, HEADER_FULL_COLOR, 0x00, 0x00, 0x00, r, g, b);
-    return libmk_send_packet(handle, packet);
+    if (transport == NULL)
+        return LIBMK_ERR_INVALID_ARG;
+    if (handle->mode != LIBMK_FIRMWARE_CTRL)
+        return LIBMK_ERR_STILL_ACTIVE;
+    handle->transport = transport;
+    handle->transport_data = data;
+    handle->open = true;
+    libmk_invalidate_frame(handle);
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_send_packet(LibMK_Handle* handle, unsigned char* packet) {
-    return libmk_send_recv_packet(handle, packet, true);
+LibMK_Mock* libmk_get_mock(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL || handle->transport->type != LIBMK_TRANSPORT_MOCK)
+        return NULL;
+    return (LibMK_Mock*) handle->transport_data;
 }
 
 
-int libmk_send_recv_packet(
-        LibMK_Handle* handle, unsigned char* packet, bool response_required) {
+int libmk_get_stats(LibMK_Handle* handle, LibMK_Stats* stats, bool reset) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int t, result;
-    int r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
-        packet, LIBMK_PACKET_SIZE, &t,
-        LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Sent");
-#endif // LIBMK_DEBUG
-    free(packet);
-    if (r != 0 || t != LIBMK_PACKET_SIZE)
-        return LIBMK_ERR_TRANSFER;
-    packet = libmk_build_packet(0);
-    r = libusb_interrupt_transfer(
-            handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
-            packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Response");
+    unsigned long long* src = (unsigned long long*) &handle->stats;
+    unsigned long long* dst = (unsigned long long*) stats;
+    // The struct consists of counters only
+    for (unsigned int k = 0; k < sizeof(LibMK_Stats) / sizeof(*src); k++)
+        dst[k] = reset ? __atomic_exchange_n(src + k, 0, __ATOMIC_RELAXED) :
+            __atomic_load_n(src + k, __ATOMIC_RELAXED);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_trace(
+        LibMK_Handle* handle, LibMK_Trace_Callback callback, void* user_data) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    handle->trace = callback;
+    handle->trace_data = user_data;
+    return LIBMK_SUCCESS;
+}
+
+
+static unsigned long long libmk_now_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+
+static void libmk_count(unsigned long long* counter, unsigned long long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+
+static void libmk_record_error(LibMK_Handle* handle, int r) {
+    libmk_count(&handle->stats.errors, 1);
+    if (r == LIBMK_ERR_TIMEOUT)
+        libmk_count(&handle->stats.timeouts, 1);
+}
+
+
+/// Count a packet written to the device and call the trace callback
+static void libmk_record_send(
+        LibMK_Handle* handle, unsigned char* packet, int r) {
+    if (r == LIBMK_SUCCESS) {
+        libmk_count(&handle->stats.packets, 1);
+        libmk_count(&handle->stats.bytes, LIBMK_PACKET_SIZE);
+    } else
+        libmk_record_error(handle, r);
+    if (handle->trace != NULL)
+        handle->trace(
+            handle, LIBMK_TRACE_SEND, packet, r, handle->trace_data);
+}
+
+
+/// Count a response read from the device, sent at start microseconds
+static void libmk_record_recv(
+        LibMK_Handle* handle, unsigned char* response, int r,
+        unsigned long long start) {
+    if (r == LIBMK_SUCCESS) {
+        unsigned long long latency = libmk_now_us() - start;
+        unsigned int bucket = 0;
+        while (bucket < LIBMK_STATS_BUCKETS - 1 && (latency >> bucket) != 0)
+            bucket++;
+        LibMK_Stats* stats = &handle->stats;
+        libmk_count(&stats->responses, 1);
+        libmk_count(&stats->bytes, LIBMK_PACKET_SIZE);
+        libmk_count(&stats->latency_sum, latency);
+        libmk_count(&stats->latency[bucket], 1);
+        if (latency > __atomic_load_n(&stats->latency_max, __ATOMIC_RELAXED))
+            __atomic_store_n(&stats->latency_max, latency, __ATOMIC_RELAXED);
+        if (response[0] == HEADER_ERROR)
+            libmk_count(&stats->protocol_errors, 1);
+    } else
+        libmk_record_error(handle, r);
+    if (handle->trace != NULL)
+        handle->trace(
+            handle, LIBMK_TRACE_RECV, response, r, handle->trace_data);
+}
+
+
+/// Read the oldest response of the packets sent ahead
+static void libmk_read_ahead(LibMK_Handle* handle) {
+    unsigned int k = handle->ahead_first;
+    unsigned char* response = handle->response;
+    memset(response, 0x00, LIBMK_PACKET_SIZE);
+    int r = handle->transport->read(handle, response);
+    libmk_record_recv(handle, response, r, handle->ahead_sent[k]);
+    if (r != LIBMK_SUCCESS)
+        // Packets without a required response may not be answered
+        r = handle->ahead_packet[k] < 0 ? LIBMK_SUCCESS : LIBMK_ERR_TRANSFER;
+    else if (response[0] == HEADER_ERROR) {
+        libmk_print_packet(response, "Error response");
+        r = LIBMK_ERR_PROTOCOL;
+    }
+    if (r != LIBMK_SUCCESS && handle->ahead_packet[k] < 0) {
+        if (handle->ahead_error == LIBMK_SUCCESS)
+            handle->ahead_error = r;
+    } else if (r != LIBMK_SUCCESS) {
+        // Send the packet again with the next frame
+        handle->frame_valid[handle->ahead_packet[k]] = false;
+        if (handle->ahead_error == LIBMK_SUCCESS)
+            handle->ahead_error = r;
+    }
+    handle->ahead_first = (k + 1) % LIBMK_WRITE_AHEAD_MAX;
+    handle->ahead--;
+}
+
+
+/// Send the LED packet of handle->frame at index k ahead of its response
+static int libmk_write_ahead(LibMK_Handle* handle, short k) {
+    if (handle->ahead >= handle->window)
+        libmk_read_ahead(handle);
+    unsigned int l =
+        (handle->ahead_first + handle->ahead) % LIBMK_WRITE_AHEAD_MAX;
+    handle->ahead_sent[l] = libmk_now_us();
+    int r = handle->transport->write(handle, handle->frame[k]);
+    libmk_record_send(handle, handle->frame[k], r);
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(handle->frame[k], "Sent ahead");
 #endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS && response_required) {
-        result = LIBMK_ERR_TRANSFER;
-    } else if (t != LIBMK_PACKET_SIZE && response_required) {
+    if (r != LIBMK_SUCCESS)
+        return LIBMK_ERR_TRANSFER;
+    handle->ahead_packet[l] = k;
+    handle->ahead++;
+    return LIBMK_SUCCESS;
+}
+
+
+/// Read the responses sent ahead, keeping their errors to report later
+static void libmk_read_all_ahead(LibMK_Handle* handle) {
+    while (handle->ahead != 0)
+        libmk_read_ahead(handle);
+}
+
+
+int libmk_drain_responses(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    libmk_read_all_ahead(handle);
+    int r = handle->ahead_error;
+    handle->ahead_error = LIBMK_SUCCESS;
+    return r;
+}
+
+
+int libmk_set_write_ahead(LibMK_Handle* handle, unsigned int window) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    if (window > LIBMK_WRITE_AHEAD_MAX)
+        return LIBMK_ERR_INVALID_ARG;
+    int r = libmk_drain_responses(handle);
+    handle->window = window;
+    return r;
+}
+
+
+static int libmk_alloc_handle(LibMK_Handle** result, LibMK_Model model) {
+    *result = NULL;
+    LibMK_Handle* handle = (LibMK_Handle*) malloc(sizeof(LibMK_Handle));
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    handle->handle = NULL;
+    handle->open = false;
+    handle->model = model;
+    handle->bDevice = 0x0000;
+    handle->bVendor = LIBMK_VENDOR_ID;
+    handle->layout = LIBMK_LAYOUT_UNKNOWN;
+    handle->mode = LIBMK_FIRMWARE_CTRL;
+    handle->effect = LIBMK_EFF_NONE;
+    handle->details_valid = false;
+    handle->keys = -1;
+    handle->scatter = NULL;
+    handle->transport = &LIBMK_TRANSPORTS[LIBMK_TRANSPORT_LIBUSB];
+    handle->transport_data = NULL;
+    handle->fd = -1;
+    memset(&handle->stats, 0x00, sizeof(LibMK_Stats));
+    handle->trace = NULL;
+    handle->trace_data = NULL;
+    handle->window = 0;
+    handle->ahead = 0;
+    handle->ahead_first = 0;
+    handle->ahead_error = LIBMK_SUCCESS;
+    handle->input = -1;
+    memset(handle->input_map, 0xFF, sizeof(handle->input_map));
+    libmk_invalidate_frame(handle);
+    if (model == DEV_RGB_L || model == DEV_WHITE_L)
+        handle->size = LIBMK_L;
+    else if (model == DEV_RGB_M || model == DEV_WHITE_M)
+        handle->size = LIBMK_M;
+    else if (model == DEV_RGB_S || model == DEV_WHITE_S)
+        handle->size = LIBMK_S;
+    else {
+        free(handle);
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    }
+    *result = handle;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_create_mock_handle(
+        LibMK_Handle** handle, LibMK_Model model, LibMK_Layout layout) {
+    if (handle == NULL)
+        handle = &DeviceHandle;
+    int r = libmk_alloc_handle(handle, model);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    LibMK_Mock* mock = libmk_create_mock(layout);
+    if (mock == NULL) {
+        free(*handle);
+        *handle = NULL;
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    }
+    (*handle)->transport = &LIBMK_TRANSPORTS[LIBMK_TRANSPORT_MOCK];
+    (*handle)->transport_data = mock;
+    (*handle)->open = true;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device) {
+    int r = libmk_alloc_handle(handle, device->model);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    r = libusb_open(device->device, &(*handle)->handle);
+    if (r != 0) {
+        libmk_free_handle(*handle);
+        *handle = NULL;
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    }
+    (*handle)->open = true;
+    (*handle)->bDevice = device->bDevice;
+    (*handle)->bVendor = device->bVendor;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_free_handle(LibMK_Handle* handle) {
+    if (handle->open)
+        return LIBMK_ERR_DEV_NOT_CLOSED;
+    free(handle);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_close_handle(LibMK_Handle* handle) {
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    libmk_close_input(handle);
+    if (handle->open) {
+        handle->transport->close(handle);
+        handle->open = false;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_device(LibMK_Model model, LibMK_Handle** handle) {
+    int r = libmk_scan_devices();
+    if (r != LIBMK_SUCCESS)
+        return r;
+    LibMK_Device* device = Devices;
+    while (device != NULL && model != DEV_ANY && device->model != model)
+        device = device->next;
+    if (device == NULL)
+        // No devices detected
+        return LIBMK_ERR_DEV_NOT_CONNECTED;
+
+    // Open the device into the handle
+    if (handle == NULL)
+        handle = &DeviceHandle;
+    r = libmk_create_handle(handle, device);
+    if (r == LIBMK_ERR_DEV_OPEN_FAILED)
+        DevicesValid = false;  // Device may have been disconnected
+    return r;
+}
+
+
+int libmk_open_all_devices(LibMK_Handle*** handles) {
+    int n = libmk_refresh_devices();
+    if (n < 0)
+        return n;
+    LibMK_Handle** list = (LibMK_Handle**) malloc(
+        sizeof(LibMK_Handle*) * (n > 0 ? n : 1));
+    if (list == NULL)
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    n = 0;
+    for (LibMK_Device* d = Devices; d != NULL; d = d->next) {
+        if (libmk_create_handle(&list[n], d) == LIBMK_SUCCESS)
+            n++;
+    }
+    *handles = list;
+    return n;
+}
+
+
+LibMK_Model libmk_ident_model(char* product) {
+    if (strstr(product, PRODUCT) == NULL)
+        return DEV_UNKNOWN;
+    if (strstr(product, WHITE) != NULL) {
+        if (strstr(product, LARGE) != NULL)
+            return DEV_WHITE_L;
+        else if (strstr(product, SMALL) != NULL)
+            return DEV_WHITE_S;
+        return DEV_WHITE_M;
+    }
+    if (strstr(product, LARGE) != NULL)
+        return DEV_RGB_L;
+    else if (strstr(product, SMALL) != NULL)
+        return DEV_RGB_S;
+    return DEV_RGB_M;
+}
+
+
+int libmk_get_device_ident(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return 0x0000;
+    return DeviceHandle->bDevice;
+}
+
+
+int libmk_enable_control(LibMK_Handle* handle) {
+    int r;  // Stores libusb return values
+
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+
+    // Claim the interface on the device
+    r = libmk_claim_interface(handle);
+    if (r != LIBMK_SUCCESS)
+        return LIBMK_ERR_IFACE_CLAIM_FAILED;
+
+    // Send the enable control packet to the keyboard
+    return libmk_send_control_packet(handle);
+}
+
+
+int libmk_send_control_packet(LibMK_Handle* handle) {
+    int r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    LibMK_Firmware* fw;
+    r = libmk_get_firmware_version(handle, &fw);
+    if (r != LIBMK_SUCCESS) {
+        libmk_close_handle(handle);
+        return r;
+    }
+    handle->layout = fw->layout;
+    free(fw);
+    return libmk_build_scatter_table(handle);
+}
+
+
+int libmk_disable_control(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+
+    int r = libmk_set_control_mode(handle, LIBMK_FIRMWARE_CTRL);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    // Let the device finish the switch before it is reset
+    libmk_read_all_ahead(handle);
+
+    r = handle->transport->release(handle);
+    if (r != LIBMK_SUCCESS)
+        return r;
+
+    // Release while the device is still open, the handle may be freed
+    libmk_close_input(handle);
+    handle->transport->close(handle);
+    handle->open = false;
+    if (handle == DeviceHandle) {
+        libmk_free_handle(handle);
+        DeviceHandle = NULL;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_claim_interface(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    return handle->transport->claim(handle);
+}
+
+
+int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+
+    // Any effect change, even to LIBMK_EFF_CUSTOM, loses the LED state
+    handle->effect = LIBMK_EFF_NONE;
+    handle->details_valid = false;
+    libmk_invalidate_frame(handle);
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(packet, 2, 0x41, 0x01);
+    int r = libmk_transfer_packet(handle, packet, true);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    handle->mode = LIBMK_EFFECT_CTRL;
+    libmk_fill_packet(
+        packet, 5, HEADER_SET, OPCODE_EFFECT, 0x00, 0x00, (unsigned char) effect);
+    r = libmk_transfer_packet(handle, packet, true);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    handle->effect = effect;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_full_color(LibMK_Handle* handle,
+                         unsigned char r,
+                         unsigned char g,
+                         unsigned char b) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    handle->details_valid = false;
+    libmk_invalidate_frame(handle);
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(packet, 7, HEADER_FULL_COLOR, 0x00, 0x00, 0x00, r, g, b);
+    return libmk_transfer_packet(handle, packet, true);
+}
+
+
+int libmk_send_packet(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_send_recv_packet(handle, packet, true);
+}
+
+
+int libmk_send_recv_packet(
+        LibMK_Handle* handle, unsigned char* packet, bool response_required) {
+    int result = libmk_transfer_packet(handle, packet, response_required);
+    free(packet);
+    return result;
+}
+
+
+int libmk_transfer_packet(
+        LibMK_Handle* handle, unsigned char* packet, bool response_required) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    int result;
+    // Responses to packets sent ahead would be read as the response
+    libmk_read_all_ahead(handle);
+    unsigned long long start = libmk_now_us();
+    int r = handle->transport->write(handle, packet);
+    libmk_record_send(handle, packet, r);
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(packet, "Sent");
+#endif // LIBMK_DEBUG
+    if (r != LIBMK_SUCCESS)
+        return LIBMK_ERR_TRANSFER;
+    if (!response_required) {
+        // Read before the next transfer rather than waiting for a
+        // response that may not come
+        handle->ahead_sent[handle->ahead_first] = start;
+        handle->ahead_packet[handle->ahead_first] = -1;
+        handle->ahead = 1;
+        return LIBMK_SUCCESS;
+    }
+    unsigned char* response = handle->response;
+    memset(response, 0x00, LIBMK_PACKET_SIZE);
+    r = handle->transport->read(handle, response);
+    libmk_record_recv(handle, response, r, start);
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(response, "Response");
+#endif // LIBMK_DEBUG
+    if (r != LIBMK_SUCCESS) {
         result = LIBMK_ERR_TRANSFER;
-    } else if (packet[0] == HEADER_ERROR) {
-        libmk_print_packet(packet, "Error response");
+    } else if (response[0] == HEADER_ERROR) {
+        libmk_print_packet(response, "Error response");
         result = LIBMK_ERR_PROTOCOL;
     } else
         result = LIBMK_SUCCESS;
-    free(packet);
     return result;
 }
 
 
 int libmk_exch_packet(LibMK_Handle* handle, unsigned char* packet) {
-    int t;
-    int r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
-        packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
+    libmk_read_all_ahead(handle);
+    unsigned long long start = libmk_now_us();
+    int r = handle->transport->write(handle, packet);
+    libmk_record_send(handle, packet, r);
 #ifdef LIBMK_DEBUG
     libmk_print_packet(packet, "Sent");
 #endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS || t != LIBMK_PACKET_SIZE) {
-        free(packet);
+    if (r != LIBMK_SUCCESS)
         return LIBMK_ERR_TRANSFER;
-    }
-    r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
-        packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
+    r = handle->transport->read(handle, packet);
+    libmk_record_recv(handle, packet, r, start);
 #ifdef LIBMK_DEBUG
     libmk_print_packet(packet, "Received");
 #endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS || t != LIBMK_PACKET_SIZE)
+    if (r != LIBMK_SUCCESS)
         return LIBMK_ERR_TRANSFER;
     return LIBMK_SUCCESS;
 }
 
 
+static void libmk_vfill_packet(
+        unsigned char* packet, unsigned char predef, va_list elements) {
+    memset(packet, 0x00, LIBMK_PACKET_SIZE);
+    int elem;
+    for (unsigned char i = 0; i < predef; i++) {
+        elem = va_arg(elements, int);
+        packet[i] = (unsigned char) elem;
+    }
+}
+
+
+void libmk_fill_packet(unsigned char* packet, unsigned char predef, ...) {
+    va_list elements;
+    va_start(elements, predef);
+    libmk_vfill_packet(packet, predef, elements);
+    va_end(elements);
+}
+
+
 unsigned char* libmk_build_packet(unsigned char predef, ...) {
     unsigned char* packet = (unsigned char*)
         malloc(LIBMK_PACKET_SIZE * sizeof(unsigned char));
     if (packet == NULL)
         return NULL;
-    for (int i = 0; i < LIBMK_PACKET_SIZE; i++)
-        packet[i] = 0x00;
     va_list elements;
     va_start(elements, predef);
-    int elem;
-    for (unsigned char i = 0; i < predef; i++) {
-        elem = va_arg(elements, int);
-        packet[i] = (unsigned char) elem;
-    }
+    libmk_vfill_packet(packet, predef, elements);
     va_end(elements);
     return packet;
 }
@@ -643,51 +1376,447 @@ int libmk_reset(LibMK_Handle* handle) {
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int r = libusb_reset_device(handle->handle);
-    if (r != LIBUSB_SUCCESS)
-        return LIBMK_ERR_DEV_RESET_FAILED;
+    if (!handle->open)
+        return LIBMK_ERR_DEV_NOT_SET;
+    return handle->transport->reset(handle);
+}
+
+
+int libmk_build_scatter_table(LibMK_Handle* handle) {
+    handle->keys = -1;
+    handle->scatter = NULL;
+    if (handle->layout != LIBMK_LAYOUT_ANSI &&
+            handle->layout != LIBMK_LAYOUT_ISO)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    unsigned char l = handle->layout - LIBMK_LAYOUT_ANSI;
+    handle->scatter = LIBMK_KEYS[l][handle->size];
+    handle->keys = LIBMK_KEY_COUNTS[l][handle->size];
+    return LIBMK_SUCCESS;
+}
+
+
+static void libmk_init_all_led_packets(
+        unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE]) {
+    memset(packets, 0x00, LIBMK_ALL_LED_PCK_NUM * LIBMK_PACKET_SIZE);
+    for (short i = 0; i < LIBMK_ALL_LED_PCK_NUM; i++) {
+        packets[i][0] = HEADER_SET;
+        packets[i][1] = OPCODE_ALL_LED;
+        packets[i][2] = (unsigned char) i * 2;
+    }
+}
+
+
+int libmk_build_all_led_packets(
+        LibMK_Handle* handle, unsigned char* colors,
+        unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE]) {
+    if (handle->keys < 0) {
+        int r = libmk_build_scatter_table(handle);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+    // The matrix of the layout of this size has not been recorded yet
+    if (handle->keys == 0)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    libmk_init_all_led_packets(packets);
+
+    unsigned char* dst = packets[0];
+    const LibMK_Key* key = handle->scatter;
+    for (short k = 0; k < handle->keys; k++, key++) {
+        dst[key->dst + 0] = colors[key->src + 0];
+        dst[key->dst + 1] = colors[key->src + 1];
+        dst[key->dst + 2] = colors[key->src + 2];
+    }
     return LIBMK_SUCCESS;
 }
 
 
+static int libmk_send_all_led_packets(
+        LibMK_Handle* handle,
+        unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE],
+        const bool* mask) {
+    if (handle->effect != LIBMK_EFF_CUSTOM) {
+        int r = libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+
+    // Only send the packets that differ from the state of the keyboard,
+    // and only those in the mask if one is given
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        if (mask != NULL && !mask[k])
+            continue;
+        if (handle->frame_valid[k] &&
+                memcmp(handle->frame[k], packets[k], LIBMK_PACKET_SIZE) == 0)
+            continue;
+        memcpy(handle->frame[k], packets[k], LIBMK_PACKET_SIZE);
+        int r;
+        if (handle->window != 0)
+            r = libmk_write_ahead(handle, k);
+        else
+            r = libmk_transfer_packet(handle, handle->frame[k], true);
+        handle->frame_valid[k] = (r == LIBMK_SUCCESS);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+    // Report the responses of earlier packets sent ahead that failed
+    int r = handle->ahead_error;
+    handle->ahead_error = LIBMK_SUCCESS;
+    return r;
+}
+
+
 int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
-    unsigned char* packets[LIBMK_ALL_LED_PCK_NUM];
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+    int r = libmk_build_all_led_packets(handle, colors, packets);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    return libmk_send_all_led_packets(handle, packets, NULL);
+}
 
-    for (short i = 0; i < LIBMK_ALL_LED_PCK_NUM; i++)
-        packets[i] = libmk_build_packet(3, HEADER_SET, 0xA8, (unsigned char) i * 2);
 
-    unsigned char offset;
-    int packet, index, result;
+int libmk_set_all_led_color_offset(LibMK_Handle* handle, unsigned char* colors) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+    libmk_init_all_led_packets(packets);
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++)
+        memcpy(&packets[k][4], &colors[k * LIBMK_ALL_LED_PER_PCK * 3],
+               LIBMK_ALL_LED_PER_PCK * 3);
+    return libmk_send_all_led_packets(handle, packets, NULL);
+}
 
-    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
-        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
-            result = libmk_get_offset(&offset, handle, r, c);
-            if (result != LIBMK_SUCCESS)
-                return result;
-            if (offset == 0xFF)
-                continue;
-            packet = offset / LIBMK_ALL_LED_PER_PCK;
-            index = offset % LIBMK_ALL_LED_PER_PCK;
-            for (short o = 0; o < 3; o++) {
-                packets[packet][4 + (index * 3) + o] = colors[
-                    (r * LIBMK_MAX_COLS + c) * 3 + o];
+
+LibMK_Frame* libmk_create_frame(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return NULL;
+    LibMK_Frame* frame = (LibMK_Frame*) malloc(sizeof(LibMK_Frame));
+    if (frame == NULL)
+        return NULL;
+    frame->handle = handle;
+    frame->pending = 0;
+    frame->completed = 1;
+    frame->result = LIBMK_SUCCESS;
+    frame->callback = NULL;
+    frame->user_data = NULL;
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        frame->out[k] = libusb_alloc_transfer(0);
+        frame->in[k] = libusb_alloc_transfer(0);
+        if (frame->out[k] == NULL || frame->in[k] == NULL) {
+            for (short l = 0; l <= k; l++) {
+                libusb_free_transfer(frame->out[l]);
+                libusb_free_transfer(frame->in[l]);
             }
+            free(frame);
+            return NULL;
         }
-        
+    }
+    return frame;
+}
+
+
+int libmk_free_frame(LibMK_Frame* frame) {
+    if (!libmk_frame_done(frame))
+        return LIBMK_ERR_STILL_ACTIVE;
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        libusb_free_transfer(frame->out[k]);
+        libusb_free_transfer(frame->in[k]);
+    }
+    free(frame);
+    return LIBMK_SUCCESS;
+}
+
+
+static void libmk_complete_frame(LibMK_Frame* frame) {
+    frame->completed = 1;
+    if (frame->callback != NULL)
+        frame->callback(frame, frame->result, frame->user_data);
+}
+
+
+static void libmk_cancel_frame(LibMK_Frame* frame) {
+    // Transfers that are not in flight return LIBUSB_ERROR_NOT_FOUND
     for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
-        int r = libmk_send_packet(handle, packets[k]);
+        libusb_cancel_transfer(frame->out[k]);
+        libusb_cancel_transfer(frame->in[k]);
+    }
+}
+
+
+static void libmk_frame_transfer_cb(struct libusb_transfer* transfer) {
+    LibMK_Frame* frame = (LibMK_Frame*) transfer->user_data;
+    bool is_in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+    int k = (int) (transfer->buffer - (is_in ?
+        frame->responses[0] : frame->packets[0])) / LIBMK_PACKET_SIZE;
+    int r = LIBMK_SUCCESS;
+
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        r = LIBMK_ERR_TIMEOUT;
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            transfer->actual_length != LIBMK_PACKET_SIZE)
+        r = LIBMK_ERR_TRANSFER;
+    // Transfers cancelled after another failed are not counted
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        if (is_in)
+            libmk_record_recv(
+                frame->handle, transfer->buffer, r, frame->submitted);
+        else
+            libmk_record_send(frame->handle, transfer->buffer, r);
+    }
+    if (r == LIBMK_ERR_TIMEOUT)
+        r = LIBMK_ERR_TRANSFER;
+    else if (r == LIBMK_SUCCESS && is_in &&
+            transfer->buffer[0] == HEADER_ERROR) {
+        libmk_print_packet(transfer->buffer, "Error response");
+        r = LIBMK_ERR_PROTOCOL;
+    }
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(transfer->buffer, is_in ? "Response" : "Sent");
+#endif // LIBMK_DEBUG
+
+    if (r != LIBMK_SUCCESS) {
+        frame->handle->frame_valid[k] = false;
+        if (frame->result == LIBMK_SUCCESS) {
+            frame->result = r;
+            libmk_cancel_frame(frame);
+        }
+    }
+    frame->pending -= 1;
+    if (frame->pending == 0)
+        libmk_complete_frame(frame);
+}
+
+
+int libmk_submit_all_led_color(
+        LibMK_Frame* frame, unsigned char* colors,
+        LibMK_Frame_Callback callback, void* user_data) {
+    if (!libmk_frame_done(frame))
+        return LIBMK_ERR_STILL_ACTIVE;
+    LibMK_Handle* handle = frame->handle;
+    int r;
+    if (handle->effect != LIBMK_EFF_CUSTOM) {
+        r = libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
         if (r != LIBMK_SUCCESS)
             return r;
     }
+
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+    r = libmk_build_all_led_packets(handle, colors, packets);
+    if (r != LIBMK_SUCCESS)
+        return r;
+
+    frame->callback = callback;
+    frame->user_data = user_data;
+    frame->result = LIBMK_SUCCESS;
+    frame->completed = 0;
+    frame->pending = 0;
+    frame->submitted = libmk_now_us();
+
+    if (!handle->transport->async) {
+        // The transport cannot transfer the packets in the background
+        frame->result = libmk_send_all_led_packets(handle, packets, NULL);
+        libmk_complete_frame(frame);
+        return frame->result;
+    }
+
+    // Transfers are queued on the endpoints in order, so the responses
+    // arrive in the same order as the packets are submitted
+    libmk_read_all_ahead(handle);
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        if (handle->frame_valid[k] &&
+                memcmp(handle->frame[k], packets[k], LIBMK_PACKET_SIZE) == 0)
+            continue;
+        memcpy(handle->frame[k], packets[k], LIBMK_PACKET_SIZE);
+        memcpy(frame->packets[k], packets[k], LIBMK_PACKET_SIZE);
+        memset(frame->responses[k], 0x00, LIBMK_PACKET_SIZE);
+        handle->frame_valid[k] = true;
+
+        libusb_fill_interrupt_transfer(
+            frame->out[k], handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
+            frame->packets[k], LIBMK_PACKET_SIZE, libmk_frame_transfer_cb,
+            frame, LIBMK_PACKET_TIMEOUT * LIBMK_ALL_LED_PCK_NUM);
+        libusb_fill_interrupt_transfer(
+            frame->in[k], handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
+            frame->responses[k], LIBMK_PACKET_SIZE, libmk_frame_transfer_cb,
+            frame, LIBMK_PACKET_TIMEOUT * LIBMK_ALL_LED_PCK_NUM);
+
+        if (libusb_submit_transfer(frame->out[k]) != LIBUSB_SUCCESS) {
+            frame->result = LIBMK_ERR_TRANSFER;
+            handle->frame_valid[k] = false;
+            break;
+        }
+        frame->pending += 1;
+        if (libusb_submit_transfer(frame->in[k]) != LIBUSB_SUCCESS) {
+            frame->result = LIBMK_ERR_TRANSFER;
+            handle->frame_valid[k] = false;
+            break;
+        }
+        frame->pending += 1;
+    }
+
+    r = frame->result;
+    if (frame->pending == 0)
+        libmk_complete_frame(frame);
+    else if (r != LIBMK_SUCCESS)
+        libmk_cancel_frame(frame);
+    return r;
+}
+
+
+bool libmk_frame_done(LibMK_Frame* frame) {
+    return frame->completed != 0;
+}
+
+
+int libmk_wait_frame(LibMK_Frame* frame) {
+    while (!libmk_frame_done(frame)) {
+        int r = libusb_handle_events_completed(Context, &frame->completed);
+        if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED)
+            return LIBMK_ERR_TRANSFER;
+    }
+    return frame->result;
+}
+
+
+int libmk_handle_events(int timeout) {
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    int r = libusb_handle_events_timeout_completed(Context, &tv, NULL);
+    if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED)
+        return LIBMK_ERR_TRANSFER;
+    libmk_process_hotplug();
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_get_pollfds(LibMK_Pollfd** fds) {
+    const struct libusb_pollfd** pollfds = libusb_get_pollfds(Context);
+    if (pollfds == NULL)
+        return LIBMK_ERR_NOT_SUPPORTED;
+    int n = 0;
+    while (pollfds[n] != NULL)
+        n++;
+    *fds = (LibMK_Pollfd*) malloc(sizeof(LibMK_Pollfd) * (n > 0 ? n : 1));
+    if (*fds == NULL) {
+        libusb_free_pollfds(pollfds);
+        return LIBMK_ERR_TRANSFER;
+    }
+    for (int k = 0; k < n; k++) {
+        (*fds)[k].fd = pollfds[k]->fd;
+        (*fds)[k].events = pollfds[k]->events;
+    }
+    libusb_free_pollfds(pollfds);
+    return n;
+}
+
+
+int libmk_get_next_timeout(void) {
+    if (libusb_pollfds_handle_timeouts(Context))
+        return -1;
+    struct timeval tv;
+    int r = libusb_get_next_timeout(Context, &tv);
+    if (r <= 0)
+        return -1;
+    // Rounded up, so the timeout has expired when it is handled
+    return (int) (tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+}
+
+
+static int LIBUSB_CALL libmk_hotplug_cb(
+        libusb_context* ctx, libusb_device* device,
+        libusb_hotplug_event event, void* user_data) {
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        // Descriptor strings require I/O, which must not be performed
+        // from within the callback, so opening it is deferred
+        if (HotplugPendingCount < LIBMK_HOTPLUG_PENDING)
+            HotplugPending[HotplugPendingCount++] = libusb_ref_device(device);
+        return 0;
+    }
+    LibMK_Device* prev = NULL;
+    for (LibMK_Device* d = Devices; d != NULL; prev = d, d = d->next) {
+        if (d->device != device)
+            continue;
+        if (prev == NULL)
+            Devices = d->next;
+        else
+            prev->next = d->next;
+        if (HotplugCallback != NULL)
+            HotplugCallback(d->model, false, HotplugData);
+        libmk_free_device(d);
+        break;
+    }
+    return 0;
+}
+
+
+static void libmk_process_hotplug(void) {
+    LibMK_Device* device;
+    for (unsigned int k = 0; k < HotplugPendingCount; k++) {
+        device = libmk_open_device(HotplugPending[k]);
+        libusb_unref_device(HotplugPending[k]);
+        if (device == NULL)
+            continue;
+        Devices = libmk_append_device(Devices, device);
+        if (HotplugCallback != NULL)
+            HotplugCallback(device->model, true, HotplugData);
+    }
+    HotplugPendingCount = 0;
+}
+
+
+int libmk_enable_hotplug(LibMK_Hotplug_Callback callback, void* user_data) {
+    if (HotplugEnabled)
+        return LIBMK_ERR_INVALID_ARG;
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return LIBMK_ERR_NOT_SUPPORTED;
+    int r = libmk_scan_devices();
+    if (r != LIBMK_SUCCESS)
+        return r;
+    HotplugCallback = callback;
+    HotplugData = user_data;
+    r = libusb_hotplug_register_callback(
+        Context,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_NO_FLAGS, LIBMK_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+        LIBUSB_HOTPLUG_MATCH_ANY, libmk_hotplug_cb, NULL, &HotplugHandle);
+    if (r != LIBUSB_SUCCESS)
+        return LIBMK_ERR_NOT_SUPPORTED;
+    HotplugEnabled = true;
     return LIBMK_SUCCESS;
 }
 
 
+void libmk_disable_hotplug(void) {
+    if (!HotplugEnabled)
+        return;
+    libusb_hotplug_deregister_callback(Context, HotplugHandle);
+    for (unsigned int k = 0; k < HotplugPendingCount; k++)
+        libusb_unref_device(HotplugPending[k]);
+    HotplugPendingCount = 0;
+    HotplugEnabled = false;
+    // Without hotplug events the cache may become outdated
+    DevicesValid = false;
+}
+
+
+void libmk_invalidate_frame(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return;
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++)
+        handle->frame_valid[k] = false;
+}
+
+
 inline void libmk_print_packet(unsigned char* packet, char* label) {
 #ifdef LIBMK_DEBUG
     printf("Packet: %s\n", label);
@@ -705,9 +1834,13 @@ inline void libmk_print_packet(unsigned char* packet, char* label) {
 int libmk_get_offset(
         unsigned char* offset, LibMK_Handle* handle,
         unsigned char row, unsigned char col) {
-    if (handle->layout != LAYOUT_ISO && handle->layout != LAYOUT_ANSI)
+    if (handle->layout != LIBMK_LAYOUT_ANSI &&
+            handle->layout != LIBMK_LAYOUT_ISO)
         return LIBMK_ERR_UNKNOWN_LAYOUT;
-    *offset = LIBMK_LAYOUT[handle->layout - 1][handle->size][row][col];
+    if (row >= LIBMK_MAX_ROWS || col >= LIBMK_MAX_COLS)
+        return LIBMK_ERR_INVALID_ARG;
+    *offset = LIBMK_LAYOUT[handle->layout - LIBMK_LAYOUT_ANSI]
+                          [handle->size][row][col];
     return LIBMK_SUCCESS;
 }
 
@@ -719,27 +1852,244 @@ int libmk_set_single_led(
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int result = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
-    if (result != LIBMK_SUCCESS)
-        return result;
+    int result;
+    if (handle->mode != LIBMK_CUSTOM_CTRL) {
+        result = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+        if (result != LIBMK_SUCCESS)
+            return result;
+    }
     unsigned char offset;
     result = libmk_get_offset(&offset, handle, row, col);
     if (result != LIBMK_SUCCESS)
         return result;
-    unsigned char* packet = libmk_build_packet(
-        8, 0xC0, 0x01, 0x01, 0x00, offset, r, g, b);
-    return libmk_send_packet(handle, packet);
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(packet, 8, 0xC0, 0x01, 0x01, 0x00, offset, r, g, b);
+    return libmk_transfer_packet(handle, packet, true);
 }
 
 
-int libmk_set_effect_details(
-    LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+int libmk_set_led_colors(
+        LibMK_Handle* handle, const LibMK_Key_Color* keys, unsigned int n) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+
+    // Index plus one of the last entry for every offset, so that every
+    // key is sent once and later entries take precedence
+    unsigned int last[LIBMK_MAX_OFFSETS] = {0};
+    bool touched[LIBMK_ALL_LED_PCK_NUM] = {false};
+    unsigned int singles = 0, packets = 0;
+    unsigned char offset;
+    int r;
+    for (unsigned int i = 0; i < n; i++) {
+        r = libmk_get_offset(&offset, handle, keys[i].row, keys[i].col);
+        if (r != LIBMK_SUCCESS)
+            return r;
+        if (offset >= LIBMK_MAX_OFFSETS)  // 0xFF for unknown keys
+            continue;
+        singles += last[offset] == 0;
+        last[offset] = i + 1;
+        packets += !touched[offset / LIBMK_ALL_LED_PER_PCK];
+        touched[offset / LIBMK_ALL_LED_PER_PCK] = true;
+    }
+    if (singles == 0)
+        return LIBMK_SUCCESS;
+
+    // The full LED packets overwrite the other keys in them, so their
+    // colors must be known, unless they are lost by switching effects
+    bool custom = handle->mode == LIBMK_EFFECT_CTRL &&
+                  handle->effect == LIBMK_EFF_CUSTOM;
+    bool known = true;
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++)
+        known &= !touched[k] || handle->frame_valid[k];
+    if (!custom)
+        packets += 2;  // Control mode and effect
+    if (handle->mode != LIBMK_CUSTOM_CTRL)
+        singles += 1;
+
+    if ((known || !custom) && packets <= singles) {
+        unsigned char frame[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+        if (custom)
+            memcpy(frame, handle->frame, sizeof(frame));
+        else
+            libmk_init_all_led_packets(frame);
+        for (short o = 0; o < LIBMK_MAX_OFFSETS; o++)
+            if (last[o] != 0)
+                memcpy(&frame[o / LIBMK_ALL_LED_PER_PCK]
+                             [4 + (o % LIBMK_ALL_LED_PER_PCK) * 3],
+                       keys[last[o] - 1].color, 3);
+        return libmk_send_all_led_packets(handle, frame, touched);
+    }
+
+    if (handle->mode != LIBMK_CUSTOM_CTRL) {
+        r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    for (short o = 0; o < LIBMK_MAX_OFFSETS; o++) {
+        if (last[o] == 0)
+            continue;
+        const unsigned char* color = keys[last[o] - 1].color;
+        libmk_fill_packet(packet, 8, 0xC0, 0x01, 0x01, 0x00,
+                          (unsigned char) o, color[0], color[1], color[2]);
+        r = libmk_transfer_packet(handle, packet, true);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+static bool libmk_input_has_key(int fd, int key) {
+    unsigned long bits[KEY_MAX / (8 * sizeof(long)) + 1];
+    memset(bits, 0x00, sizeof(bits));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0)
+        return false;
+    return (bits[key / (8 * sizeof(long))] >> (key % (8 * sizeof(long)))) & 1;
+}
+
+
+static int libmk_input_find(LibMK_Handle* handle) {
+    /* The device of an event node resolves to the input device within
+     * the HID device of a USB interface, within the directory of the
+     * USB device: .../usb1/1-2/1-2:1.0/0003:2516:0047.0001/input/input5
+     */
+    if (handle->handle == NULL)
+        return LIBMK_ERR_NOT_SUPPORTED;
+    libusb_device* device = libusb_get_device(handle->handle);
+    int bus = libusb_get_bus_number(device);
+    int address = libusb_get_device_address(device);
+    DIR* dir = opendir("/sys/class/input");
+    if (dir == NULL)
+        return LIBMK_ERR_NOT_SUPPORTED;
+    char path[PATH_MAX], real[PATH_MAX];
+    char* sep;
+    struct dirent* entry;
+    int k, fd, r = LIBMK_ERR_DEV_NOT_CONNECTED;
+    while (r < 0 && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0)
+            continue;
+        snprintf(path, PATH_MAX, "/sys/class/input/%s/device", entry->d_name);
+        if (realpath(path, real) == NULL)
+            continue;
+        for (k = 0; k < 4 && (sep = strrchr(real, '/')) != NULL; k++)
+            *sep = '\0';
+        if (k != 4 || libmk_read_sysfs(real, "busnum") != bus ||
+                libmk_read_sysfs(real, "devnum") != address)
+            continue;
+        snprintf(path, PATH_MAX, "/dev/input/%s", entry->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0) {
+            r = LIBMK_ERR_INPUT;
+            continue;
+        }
+        // The other interfaces of the keyboard report the media keys
+        if (libmk_input_has_key(fd, KEY_A))
+            r = fd;
+        else
+            close(fd);
+    }
+    closedir(dir);
+    return r;
+}
+
+
+int libmk_open_input(LibMK_Handle* handle, const char* path) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    if (handle->layout != LIBMK_LAYOUT_ANSI &&
+            handle->layout != LIBMK_LAYOUT_ISO)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    libmk_close_input(handle);
+    int fd;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0)
+            return LIBMK_ERR_INPUT;
+    } else {
+        fd = libmk_input_find(handle);
+        if (fd < 0)
+            return fd;
+    }
+    // Time the events on the clock of the controllers, if the node
+    // supports it
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+
+    // Invert the key code matrix for the keys of the layout of this size
+    unsigned char l = handle->layout - LIBMK_LAYOUT_ANSI;
+    memset(handle->input_map, 0xFF, sizeof(handle->input_map));
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            unsigned short code = LIBMK_KEY_CODE_MATRIX[l][r][c];
+            if (code == 0 || code >= LIBMK_KEY_CODES ||
+                    LIBMK_LAYOUT[l][handle->size][r][c] >= LIBMK_MAX_OFFSETS)
+                continue;
+            handle->input_map[code][0] = r;
+            handle->input_map[code][1] = c;
+        }
+    handle->input = fd;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_close_input(LibMK_Handle* handle) {
     if (handle == NULL)
         handle = DeviceHandle;
+    if (handle == NULL || handle->input < 0)
+        return;
+    close(handle->input);
+    handle->input = -1;
+}
+
+
+int libmk_read_key_events(
+        LibMK_Handle* handle, LibMK_Key_Event* events, unsigned int n) {
     if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL || handle->input < 0)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* packet = libmk_build_packet(
-        10, HEADER_SET, OPCODE_EFFECT_ARGS, 0x00, 0x00,
+    struct input_event buffer[16];
+    unsigned int k = 0;
+    while (k < n) {
+        // Read no more events than fit, so that none are lost
+        size_t m = n - k < 16 ? n - k : 16;
+        ssize_t r = read(handle->input, buffer, m * sizeof(struct input_event));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 && (k != 0 || r == 0 || errno == EAGAIN))
+            break;
+        if (r < 0)
+            return errno == ENODEV ? LIBMK_ERR_DEV_NOT_CONNECTED : LIBMK_ERR_INPUT;
+        for (size_t i = 0; i < r / sizeof(struct input_event); i++) {
+            struct input_event* e = &buffer[i];
+            // Repeats of held keys are reported with value 2
+            if (e->type != EV_KEY || e->code >= LIBMK_KEY_CODES || e->value > 1)
+                continue;
+            const unsigned char* position = handle->input_map[e->code];
+            if (position[0] == 0xFF)
+                continue;
+            events[k].row = position[0];
+            events[k].col = position[1];
+            events[k].pressed = e->value == 1;
+            events[k].time = (unsigned long long) e->input_event_sec * 1000000 +
+                             e->input_event_usec;
+            k++;
+        }
+    }
+    return (int) k;
+}
+
+
+static int libmk_send_effect_details(
+        LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(
+        packet, 10, HEADER_SET, OPCODE_EFFECT_ARGS, 0x00, 0x00,
         (unsigned char) effect->effect, effect->speed, effect->direction,
         effect->amount, 0xFF, 0xFF);
     unsigned char i;
@@ -749,10 +2099,64 @@ int libmk_set_effect_details(
         packet[13 + i] = effect->background[i];
     for (i=16; i < 64; i++)
         packet[i] = 0xFF;
+    handle->details_valid = false;
+    int r = libmk_transfer_packet(handle, packet, true);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    handle->details = *effect;
+    handle->details_valid = true;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_effect_details(
+    LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
     int r = libmk_set_effect(handle, effect->effect);
     if (r != LIBMK_SUCCESS)
         return r;
-    return libmk_send_packet(handle, packet);
+    return libmk_send_effect_details(handle, effect);
+}
+
+
+int libmk_update_effect(LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    unsigned char packet[LIBMK_PACKET_SIZE];
+    int r;
+    if (handle->mode != LIBMK_EFFECT_CTRL) {
+        r = libmk_set_control_mode(handle, LIBMK_EFFECT_CTRL);
+        if (r != LIBMK_SUCCESS)
+            return r;
+    }
+    if (handle->effect != effect->effect) {
+        handle->effect = LIBMK_EFF_NONE;
+        handle->details_valid = false;
+        libmk_invalidate_frame(handle);
+        libmk_fill_packet(
+            packet, 5, HEADER_SET, OPCODE_EFFECT, 0x00, 0x00,
+            (unsigned char) effect->effect);
+        r = libmk_transfer_packet(handle, packet, true);
+        if (r != LIBMK_SUCCESS)
+            return r;
+        handle->effect = effect->effect;
+    }
+    // The struct may contain padding, so compare the fields
+    LibMK_Effect_Details* last = &handle->details;
+    if (handle->details_valid &&
+            last->effect == effect->effect &&
+            last->speed == effect->speed &&
+            last->direction == effect->direction &&
+            last->amount == effect->amount &&
+            memcmp(last->foreground, effect->foreground, 3) == 0 &&
+            memcmp(last->background, effect->background, 3) == 0)
+        return LIBMK_SUCCESS;
+    return libmk_send_effect_details(handle, effect);
 }
 
 
@@ -761,7 +2165,8 @@ int libmk_get_firmware_version(LibMK_Handle* handle, LibMK_Firmware** fw) {
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* p = libmk_build_packet(2, 0x01, 0x02);
+    unsigned char p[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(p, 2, 0x01, 0x02);
     int r = libmk_exch_packet(handle, p);
     if (r != LIBMK_SUCCESS)
         return r;
@@ -785,8 +2190,9 @@ int libmk_save_profile(LibMK_Handle* handle) {
      int r = libmk_set_control_mode(handle, LIBMK_PROFILE_CTRL);
      if (r != LIBMK_SUCCESS)
          return r;
-     unsigned char* p = libmk_build_packet(2, 0x50, 0x55);
-     r = libmk_send_recv_packet(handle, p, false);
+     unsigned char p[LIBMK_PACKET_SIZE];
+     libmk_fill_packet(p, 2, 0x50, 0x55);
+     r = libmk_transfer_packet(handle, p, false);
      if (r != LIBMK_SUCCESS)
          return r;
      return libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
@@ -803,8 +2209,9 @@ int libmk_set_active_profile(LibMK_Handle* handle, char profile) {
         return r;
     if (!(1 <= profile <= 4))
         return LIBMK_ERR_INVALID_ARG;
-    unsigned char* p = libmk_build_packet(5, HEADER_SET, 0x00, 0x00, 0x00, profile);
-    r = libmk_send_packet(handle, p);
+    unsigned char p[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(p, 5, HEADER_SET, 0x00, 0x00, 0x00, profile);
+    r = libmk_transfer_packet(handle, p, true);
     if (r != LIBMK_SUCCESS)
         return r;
     return libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
@@ -816,12 +2223,12 @@ int libmk_get_active_profile(LibMK_Handle* handle, char* profile) {
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* p = libmk_build_packet(1, 0x52);
+    unsigned char p[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(p, 1, 0x52);
     int r = libmk_exch_packet(handle, p);
     if (r != LIBMK_SUCCESS)
         return r;
     *profile = p[4];
-    free(p);
     return LIBMK_SUCCESS;
 }
 
@@ -831,6 +2238,16 @@ int libmk_set_control_mode(LibMK_Handle* handle, LibMK_ControlMode mode) {
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    char* p = libmk_build_packet(2, 0x41, mode);
-    return libmk_send_recv_packet(handle, p, false);
+    unsigned char p[LIBMK_PACKET_SIZE];
+    libmk_fill_packet(p, 2, 0x41, mode);
+    int r = libmk_transfer_packet(handle, p, false);
+    if (r != LIBMK_SUCCESS || handle->mode != mode) {
+        // The LED state is not retained when switching control modes
+        handle->effect = LIBMK_EFF_NONE;
+        handle->details_valid = false;
+        libmk_invalidate_frame(handle);
+    }
+    if (r == LIBMK_SUCCESS)
+        handle->mode = mode;
+    return r;
 }
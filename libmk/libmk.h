@@ -10,6 +10,8 @@
  *
  * Contains all the enums, macro and function definitions for libmk
 */
+#ifndef LIBMK_H
+#define LIBMK_H
 #include "libusb.h"
 #include <string.h>
 #include <stdarg.h>
@@ -24,6 +26,12 @@
 #define LIBMK_PACKET_TIMEOUT 50
 #define LIBMK_EP_IN 0x03
 #define LIBMK_EP_OUT 0x04
+#define LIBMK_VENDOR_ID 0x2516  // Cooler Master bVendor
+#define LIBMK_MOCK_CAPACITY 1024  // Packets recorded by a LibMK_Mock
+#define LIBMK_HOTPLUG_PENDING 16  // Arrivals buffered between events
+#define LIBMK_STATS_BUCKETS 20  // Buckets of the latency histogram
+#define LIBMK_WRITE_AHEAD_MAX 16  // Largest window of libmk_set_write_ahead
+#define LIBMK_KEY_CODES 128  // Linux key codes of the keys of the layouts
 
 /// @brief Maximum number of rows supported on any device
 #define LIBMK_MAX_ROWS 7
@@ -31,6 +39,8 @@
 #define LIBMK_MAX_COLS 24
 #define LIBMK_ALL_LED_PCK_NUM 8
 #define LIBMK_ALL_LED_PER_PCK 16
+/// @brief Number of key offsets addressable with the full LED packets
+#define LIBMK_MAX_OFFSETS (LIBMK_ALL_LED_PCK_NUM * LIBMK_ALL_LED_PER_PCK)
 
 /// @brief Error codes used within libmk
 typedef enum LibMK_Result {
@@ -52,6 +62,14 @@ typedef enum LibMK_Result {
     LIBMK_ERR_PROTOCOL = -13, ///< Keyboard interaction protocol error
     LIBMK_ERR_INVALID_ARG = -14, ///< Invalid arguments passed by caller
     LIBMK_ERR_STILL_ACTIVE = -15, ///< Controller is still active
+    LIBMK_ERR_THREAD = -17, ///< Failed to create a thread
+    LIBMK_ERR_NOT_SUPPORTED = -18, ///< Not supported on this platform
+    LIBMK_ERR_CAPTURE = -19, ///< Failed to capture the screen
+    LIBMK_ERR_TIMEOUT = -20, ///< Transfer timed out. Returned by the
+        ///< transports only, reported as LIBMK_ERR_TRANSFER otherwise.
+    LIBMK_ERR_DAEMON = -21, ///< Failed to communicate with the daemon
+    LIBMK_ERR_INPUT = -22, ///< Failed to read the key events of the device
+    LIBMK_ERR_ANIMATION = -23, ///< Invalid or unreadable animation file
 } LibMK_Result;
 
 
@@ -69,6 +87,7 @@ typedef enum LibMK_Effect {
     LIBMK_EFF_SNAKE = 9,  ///< Snake game
     LIBMK_EFF_CUSTOM = 10,  ///< Custom LED layout
     LIBMK_EFF_OFF = 0xFE, ///< LEDs off
+    LIBMK_EFF_NONE = 0xFF, ///< Internal: active effect is not known
     
     // MasterMouse effects
     LIBMK_EFF_SPECTRUM = 11, ///< Not used
@@ -145,29 +164,37 @@ typedef struct LibMK_Device {
 
 
 /** @brief Array of strings representing the supported models */
-const char* LIBMK_MODEL_STRINGS[];
+extern const char* LIBMK_MODEL_STRINGS[];
 
-/** @brief Struct describing an opened supported device
+/** @brief Key offset matrices of the layouts, by layout and size
  *
- * Result of libmk_set_device(LibMK_Model, LibMK_Handle**). Contains all
- * the required data to control a keyboard device. Contains a
- * libusb_device_handle* to allow interaction with the keyboard
- * endpoints by the library. Multiple of these may be availble in your
- * program, but no multiple handles for a single device are allowed.
+ * Indexed with the LibMK_Layout minus LIBMK_LAYOUT_ANSI and the
+ * LibMK_Size of a device. A value of 0xFF indicates an unknown key.
  */
-typedef struct LibMK_Handle {
-    LibMK_Model model; ///< Model of the keyboard this handle controls
-    int bVendor; ///< USB bVendor ID number
-    int bDevice; ///< USB bDevice ID number
-    LibMK_Layout layout; ///< Layout of this device
-    LibMK_Size size; ///< Size of this device
-    libusb_device_handle* handle; ///< libusb_device_handle required for
-                                  ///< reading from and writing to the
-                                  ///< device endpoints
-    bool open; ///< Current state of the handle. If closed, the handle
-               ///< is no longer valid. Handles may not be re-opened.
-} LibMK_Handle;
+extern const unsigned char LIBMK_LAYOUT[2][3][LIBMK_MAX_ROWS][LIBMK_MAX_COLS];
 
+/// @brief Position of a key in the color matrix and the full LED packets
+typedef struct LibMK_Key {
+    unsigned short src; ///< Byte index of the key in the
+        ///< [LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] color matrix
+    unsigned short dst; ///< Byte index of the key in the full LED packets
+} LibMK_Key;
+
+/// @brief New color of a single key, for libmk_set_led_colors
+typedef struct LibMK_Key_Color {
+    unsigned char row; ///< Row of the key in the layout matrix
+    unsigned char col; ///< Column of the key in the layout matrix
+    unsigned char color[3]; ///< RGB color of the key
+} LibMK_Key_Color;
+
+/// @brief Press or release of a key, read by libmk_read_key_events
+typedef struct LibMK_Key_Event {
+    unsigned char row; ///< Row of the key in the layout matrix
+    unsigned char col; ///< Column of the key in the layout matrix
+    bool pressed; ///< true if the key was pressed, false if released
+    unsigned long long time; ///< CLOCK_MONOTONIC time in microseconds at
+        ///< which the kernel received the event from the keyboard
+} LibMK_Key_Event;
 
 /** @brief Struct describing an effect with custom settings
  *
@@ -195,6 +222,225 @@ typedef struct LibMK_Effect_Details {
     unsigned char background[3]; ///< Background color of the effect
 } LibMK_Effect_Details;
 
+
+/// @brief Backends that transfer the packets of a handle
+typedef enum LibMK_Transport_Type {
+    LIBMK_TRANSPORT_LIBUSB = 0, ///< libusb synchronous interrupt transfers
+    LIBMK_TRANSPORT_LIBUSB_ASYNC = 1, ///< libusb asynchronous transfers,
+        ///< completed by handling the events of the libusb context, so
+        ///< that the transfers of LibMK_Frame are handled while waiting
+    LIBMK_TRANSPORT_HIDRAW = 2, ///< Reports on the /dev/hidrawN node of the
+        ///< LED interface, the kernel driver remains attached
+    LIBMK_TRANSPORT_MOCK = 3, ///< In-memory emulation of a device that
+        ///< records the packets sent to it, see LibMK_Mock
+    LIBMK_TRANSPORT_CUSTOM = 4, ///< Operations set by the user
+} LibMK_Transport_Type;
+
+struct LibMK_Handle;
+
+/** @brief Counters of the transfers of a handle
+ *
+ * Updated upon every transfer with relaxed atomic operations, so the
+ * counters of a handle may be read with libmk_get_stats while another
+ * thread uses it, although the counters are not updated together.
+ * Latencies are measured from sending a packet until its response is
+ * received. For a LibMK_Frame, they are measured from the submission
+ * of the frame, so they include the packets queued before.
+ */
+typedef struct LibMK_Stats {
+    unsigned long long packets; ///< Number of packets sent
+    unsigned long long responses; ///< Number of responses received
+    unsigned long long bytes; ///< Number of bytes sent and received
+    unsigned long long errors; ///< Number of failed transfers, including
+        ///< those that timed out
+    unsigned long long timeouts; ///< Number of transfers that timed out
+    unsigned long long protocol_errors; ///< Number of responses
+        ///< reporting an error, which result in LIBMK_ERR_PROTOCOL
+    unsigned long long latency_sum; ///< Sum of the latencies in
+        ///< microseconds, divide by responses for the mean
+    unsigned long long latency_max; ///< Largest latency in microseconds
+    unsigned long long latency[LIBMK_STATS_BUCKETS]; ///< Histogram of the
+        ///< latencies. Bucket 0 counts latencies below a microsecond,
+        ///< bucket k those from 2^(k-1) up to 2^k microseconds and the
+        ///< last bucket also those above.
+} LibMK_Stats;
+
+/// @brief Points at which the trace callback of a handle is called
+typedef enum LibMK_Trace_Point {
+    LIBMK_TRACE_SEND = 0, ///< Packet sent, data is the packet
+    LIBMK_TRACE_RECV = 1, ///< Response received, data is the response
+    LIBMK_TRACE_DEQUEUE = 2, ///< Instruction taken by a controller to
+        ///< be executed, data is the LibMK_Instruction
+} LibMK_Trace_Point;
+
+/** @brief Callback called at the trace points of a handle
+ *
+ * Called in the thread performing the transfer or running the
+ * controller, so it should return quickly. The result is the
+ * LibMK_Result of the transfer, for which the data may not be valid if
+ * it failed.
+ */
+typedef void (*LibMK_Trace_Callback)(
+    struct LibMK_Handle* handle, LibMK_Trace_Point point, const void* data,
+    int result, void* user_data);
+
+/** @brief Operations of the backend that transfers the packets of a handle
+ *
+ * All operations return a LibMK_Result. The built-in backends are
+ * selected with libmk_set_transport, other backends may be plugged in
+ * with libmk_set_transport_ops.
+ */
+typedef struct LibMK_Transport {
+    LibMK_Transport_Type type; ///< Type of the backend
+    int (*claim)(struct LibMK_Handle* h); ///< Prepare the device for
+        ///< transfers, called by libmk_enable_control
+    int (*release)(struct LibMK_Handle* h); ///< Undo claim and return the
+        ///< device to the firmware, called by libmk_disable_control
+    int (*reset)(struct LibMK_Handle* h); ///< Reset the device
+    void (*close)(struct LibMK_Handle* h); ///< Close the device and free
+        ///< the data of the transport
+    int (*write)(struct LibMK_Handle* h, unsigned char* packet); ///< Send
+        ///< a packet of LIBMK_PACKET_SIZE bytes
+    int (*read)(struct LibMK_Handle* h, unsigned char* packet); ///< Receive
+        ///< a packet of LIBMK_PACKET_SIZE bytes
+    bool async; ///< Whether LibMK_Frame may submit libusb transfers for
+        ///< the libusb_device_handle of the handle. Frames are sent with
+        ///< write and read otherwise.
+} LibMK_Transport;
+
+/** @brief In-memory emulation of a keyboard
+ *
+ * Data of a handle with LIBMK_TRANSPORT_MOCK. Every packet written is
+ * recorded and answered like the firmware would: the response echoes
+ * the packet, except for the firmware version request, which reports
+ * the layout. Enables benchmarks and tests without a keyboard.
+ */
+typedef struct LibMK_Mock {
+    unsigned char (*packets)[LIBMK_PACKET_SIZE]; ///< Recorded packets, the
+        ///< oldest are overwritten once capacity is reached
+    unsigned long capacity; ///< Number of packets that can be recorded
+    unsigned long n; ///< Total number of packets written
+    unsigned char response[LIBMK_PACKET_SIZE]; ///< Next packet to read
+    LibMK_Layout layout; ///< Layout reported in the firmware version
+    unsigned int delay; ///< Duration of every transfer in microseconds
+} LibMK_Mock;
+
+
+/** @brief Struct describing an opened supported device
+ *
+ * Result of libmk_set_device(LibMK_Model, LibMK_Handle**). Contains all
+ * the required data to control a keyboard device. Contains a
+ * libusb_device_handle* to allow interaction with the keyboard
+ * endpoints by the library. Multiple of these may be availble in your
+ * program, but no multiple handles for a single device are allowed.
+ */
+typedef struct LibMK_Handle {
+    LibMK_Model model; ///< Model of the keyboard this handle controls
+    int bVendor; ///< USB bVendor ID number
+    int bDevice; ///< USB bDevice ID number
+    LibMK_Layout layout; ///< Layout of this device
+    LibMK_Size size; ///< Size of this device
+    libusb_device_handle* handle; ///< libusb_device_handle required for
+                                  ///< reading from and writing to the
+                                  ///< device endpoints, NULL for a mock
+    const LibMK_Transport* transport; ///< Backend transferring the packets
+    void* transport_data; ///< Data of the backend, LibMK_Mock for a mock
+    int fd; ///< File descriptor of the hidraw node, -1 if not open
+    bool open; ///< Current state of the handle. If closed, the handle
+               ///< is no longer valid. Handles may not be re-opened.
+    LibMK_ControlMode mode; ///< Control mode last set on the device
+    LibMK_Effect effect; ///< Effect last set on the device, or
+                         ///< LIBMK_EFF_NONE if not known
+    unsigned char frame[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+        ///< Shadow of the last sent packets of libmk_set_all_led_color
+    bool frame_valid[LIBMK_ALL_LED_PCK_NUM]; ///< Whether the packet in
+        ///< frame matches the state of the device
+    LibMK_Effect_Details details; ///< Parameters last set on the device
+        ///< by libmk_set_effect_details or libmk_update_effect
+    bool details_valid; ///< Whether details matches the state of the
+        ///< device
+    unsigned char response[LIBMK_PACKET_SIZE]; ///< Last response received
+        ///< by libmk_transfer_packet
+    short keys; ///< Number of keys in the scatter table, negative if the
+                ///< table has not been selected
+    const LibMK_Key* scatter; ///< Packed table of the known keys of the
+        ///< layout of the device, generated into libmk_keys.h
+    LibMK_Stats stats; ///< Counters of the transfers, see libmk_get_stats
+    LibMK_Trace_Callback trace; ///< Called at the trace points, may be NULL
+    void* trace_data; ///< Passed to the trace callback
+    unsigned int window; ///< Number of LED packets that may be sent ahead
+        ///< of their responses, see libmk_set_write_ahead
+    unsigned int ahead; ///< Number of responses that have not been read
+    unsigned int ahead_first; ///< Index of the oldest unread response in
+        ///< the ring of ahead_sent and ahead_packet
+    unsigned long long ahead_sent[LIBMK_WRITE_AHEAD_MAX]; ///< Times at
+        ///< which the packets of the unread responses were sent
+    short ahead_packet[LIBMK_WRITE_AHEAD_MAX]; ///< Indices in frame of
+        ///< the packets of the unread responses, -1 for packets sent
+        ///< without a required response
+    int ahead_error; ///< LibMK_Result of the first failed response that
+        ///< has not been reported yet
+    int input; ///< File descriptor of the evdev node of the keyboard,
+        ///< -1 if not open, see libmk_open_input
+    unsigned char input_map[LIBMK_KEY_CODES][2]; ///< Row and column of
+        ///< the keys by Linux key code, 0xFF for keys not in the layout
+} LibMK_Handle;
+
+struct LibMK_Frame;
+
+/** @brief Callback called when all packets of a LibMK_Frame completed
+ *
+ * Called from within libmk_handle_events or libmk_wait_frame in the
+ * thread that handles the events. Upon return of the callback, the
+ * frame may be submitted again.
+ */
+typedef void (*LibMK_Frame_Callback)(
+    struct LibMK_Frame* frame, int result, void* user_data);
+
+/** @brief Callback for devices that are connected or disconnected
+ *
+ * @param model: Model of the device
+ * @param arrived: True if the device was connected, false if it was
+ *    disconnected
+ *
+ * Called from within libmk_handle_events.
+ */
+typedef void (*LibMK_Hotplug_Callback)(
+    LibMK_Model model, bool arrived, void* user_data);
+
+/// @brief File descriptor to poll for libusb events
+typedef struct LibMK_Pollfd {
+    int fd; ///< File descriptor
+    short events; ///< Events to poll for, as for poll()
+} LibMK_Pollfd;
+
+/** @brief Struct describing a set of LED packets transferred asynchronously
+ *
+ * Created with libmk_create_frame for a specific handle and may be
+ * submitted any number of times with libmk_submit_all_led_color, but
+ * only a single submission may be in flight at the same time. All the
+ * packet buffers and libusb transfers are owned by the frame. The
+ * attributes of the frame should not be accessed directly while it is
+ * in flight. Synchronous functions may not be used on the same handle
+ * while a frame is in flight, as they would read its responses.
+ */
+typedef struct LibMK_Frame {
+    LibMK_Handle* handle; ///< Handle of the device the frame is for
+    struct libusb_transfer* out[LIBMK_ALL_LED_PCK_NUM]; ///< OUT transfers
+    struct libusb_transfer* in[LIBMK_ALL_LED_PCK_NUM]; ///< IN transfers
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+        ///< Packets in flight
+    unsigned char responses[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+        ///< Responses of the keyboard to the packets in flight
+    int pending; ///< Number of transfers that have not yet completed
+    int completed; ///< Set when all transfers have completed
+    int result; ///< LibMK_Result of the first failed transfer
+    unsigned long long submitted; ///< Time of the last submission in
+        ///< microseconds, for the latencies of the stats of the handle
+    LibMK_Frame_Callback callback; ///< Called upon completion, may be NULL
+    void* user_data; ///< Passed to the callback
+} LibMK_Frame;
+
 /** @brief Initialize the library and its dependencies to a usable state
  *
  * Initializes a default libusb context for use throughout the library.
@@ -219,10 +465,37 @@ int libmk_exit();
  * @returns The number of found devices, or a LibMK_Result error code.
  *
  * Perform a search for devices using libusb and store all the found
- * supported devices in an allocated array of LibMK_Model.
+ * supported devices in an allocated array of LibMK_Model. The search
+ * also refreshes the cache of devices used by libmk_set_device.
  */
 int libmk_detect_devices(LibMK_Model** model_list);
 
+/** @brief Search for devices and cache the results
+ *
+ * Only devices with the Cooler Master vendor ID are opened to read
+ * their descriptor strings. The cache is used by libmk_set_device
+ * and libmk_open_all_devices. While hotplug events are enabled, the
+ * cache is kept up to date with connected and disconnected devices.
+ *
+ * @returns The number of found devices, or a LibMK_Result error code.
+ */
+int libmk_refresh_devices(void);
+
+/** @brief Keep the device cache up to date using hotplug events
+ *
+ * @param callback: Called for every supported device that is connected
+ *    or disconnected, may be NULL
+ * @returns LIBMK_ERR_NOT_SUPPORTED if libusb does not support hotplug
+ *    events on this platform, LIBMK_SUCCESS otherwise.
+ *
+ * Events are only processed while libmk_handle_events is called, for
+ * example by a dedicated thread of a long-running program.
+ */
+int libmk_enable_hotplug(LibMK_Hotplug_Callback callback, void* user_data);
+
+/** @brief Stop receiving hotplug events */
+void libmk_disable_hotplug(void);
+
 /** @brief Internal function. Loads the details of a device
  *
  * @param device: libusb device descriptor to load details for
@@ -256,6 +529,118 @@ int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device);
 /** @brief Internal function. Free memory of allocated LibMK_Handle */
 int libmk_free_handle(LibMK_Handle* handle);
 
+/** @brief Close the device of a handle that is not under control
+ *
+ * Handles are closed by libmk_disable_control. This function is for
+ * handles of which control was never enabled, so that they can be
+ * freed. Does nothing if the handle is already closed.
+ */
+int libmk_close_handle(LibMK_Handle* handle);
+
+/** @brief Select the backend that transfers the packets of a handle
+ *
+ * @param handle: Handle to set the transport of. If NULL uses the
+ *    global device handle. Control of the device may not be enabled.
+ * @param type: Built-in backend to use. For LIBMK_TRANSPORT_MOCK, the
+ *    device is closed and replaced by an emulation.
+ * @returns LibMK_Result result code
+ *
+ * Handles use LIBMK_TRANSPORT_LIBUSB by default. LIBMK_TRANSPORT_HIDRAW
+ * does not detach the kernel driver of the device or reset the device
+ * when control is disabled, so taking and releasing control is faster.
+ * It requires read and write access to the hidraw node, and the node is
+ * only looked up by libmk_enable_control.
+ */
+int libmk_set_transport(LibMK_Handle* handle, LibMK_Transport_Type type);
+
+/** @brief Plug a custom backend into a handle
+ *
+ * @param handle: Handle to set the transport of. If NULL uses the
+ *    global device handle. Control of the device may not be enabled.
+ * @param transport: Operations of the backend, which must remain valid
+ *    as long as the handle
+ * @param data: Stored in the transport_data of the handle
+ * @returns LibMK_Result result code
+ *
+ * The close operation of the previous backend is not called, so for a
+ * libusb device, transport->close must close handle->handle.
+ */
+int libmk_set_transport_ops(
+    LibMK_Handle* handle, const LibMK_Transport* transport, void* data);
+
+/** @brief Create a handle for an emulated keyboard
+ *
+ * @param handle: Pointer to store the allocated handle in. If NULL,
+ *    the handle is stored as the global device handle, like
+ *    libmk_set_device.
+ * @param model: Model to emulate, determines the size
+ * @param layout: Layout reported by the emulated firmware
+ * @returns LibMK_Result result code
+ *
+ * The handle uses LIBMK_TRANSPORT_MOCK and may be used as the handle of
+ * a connected device. The recorded packets are available through
+ * libmk_get_mock.
+ */
+int libmk_create_mock_handle(
+    LibMK_Handle** handle, LibMK_Model model, LibMK_Layout layout);
+
+/** @brief Retrieve the emulation of a handle with LIBMK_TRANSPORT_MOCK
+ *
+ * @returns Pointer to the emulation, NULL if the handle is not a mock.
+ */
+LibMK_Mock* libmk_get_mock(LibMK_Handle* handle);
+
+/** @brief Send the LED packets of a handle without waiting for responses
+ *
+ * @param handle: Handle to configure. If NULL uses the global device
+ *    handle.
+ * @param window: Number of packets that may be sent before the oldest
+ *    response is read, at most LIBMK_WRITE_AHEAD_MAX. Zero waits for
+ *    the response of every packet, which is the default.
+ * @returns LibMK_Result result code, the result of libmk_drain_responses
+ *    if responses were outstanding
+ *
+ * With a window, the packets of libmk_set_all_led_color and functions
+ * built on it are sent back-to-back, so that the rate of frames is
+ * bounded by the bandwidth of the OUT endpoint rather than by the
+ * round-trip time of every packet. The responses are only read once
+ * the window is full, before any other transfer on the handle and by
+ * libmk_drain_responses. A failed response is thus reported by a later
+ * call, and its packet is sent again with the next frame.
+ */
+int libmk_set_write_ahead(LibMK_Handle* handle, unsigned int window);
+
+/** @brief Read the outstanding responses of the packets sent ahead
+ *
+ * @param handle: Handle to drain. If NULL uses the global device handle.
+ * @returns LibMK_Result of the first failed response since the last
+ *    report, LIBMK_ERR_PROTOCOL if the device responded with an error.
+ */
+int libmk_drain_responses(LibMK_Handle* handle);
+
+/** @brief Retrieve the transfer counters of a handle
+ *
+ * @param handle: Handle to get the stats of. If NULL uses the global
+ *    device handle.
+ * @param stats: Struct to copy the counters into
+ * @param reset: Whether to reset the counters to zero
+ * @returns LibMK_Result result code
+ */
+int libmk_get_stats(LibMK_Handle* handle, LibMK_Stats* stats, bool reset);
+
+/** @brief Set a callback to trace the transfers of a handle
+ *
+ * @param handle: Handle to trace. If NULL uses the global device handle.
+ * @param callback: Called at every LibMK_Trace_Point, NULL to disable
+ *    tracing, in which case it costs a single comparison per transfer
+ * @param user_data: Passed to the callback
+ * @returns LibMK_Result result code
+ *
+ * May only be changed while the handle is not used by another thread.
+ */
+int libmk_set_trace(
+    LibMK_Handle* handle, LibMK_Trace_Callback callback, void* user_data);
+
 /** @brief Initialize a device within the library
  *
  * @param model: Model to initialize. The model must be connected, else
@@ -270,6 +655,19 @@ int libmk_free_handle(LibMK_Handle* handle);
  */
 int libmk_set_device(LibMK_Model model, LibMK_Handle** handle);
 
+/** @brief Open all connected supported devices
+ *
+ * @param handles: Pointer to an array of LibMK_Handle pointers.
+ *    Required memory for the array is allocated by the function and
+ *    must be freed by the caller, as must the handles.
+ * @returns The number of opened devices, or a LibMK_Result error code.
+ *
+ * Unlike libmk_set_device, this function allows controlling multiple
+ * devices of the same model. Devices that could not be opened are
+ * skipped.
+ */
+int libmk_open_all_devices(LibMK_Handle*** handles);
+
 /** @brief Initialize the keyboard for control and send control packet
  *
  * @param handle: LibMK_Handle* for the device to control. If NULL, the
@@ -294,18 +692,27 @@ int libmk_enable_control(LibMK_Handle* handle);
  */
 int libmk_disable_control(LibMK_Handle* handle);
 
-/** @brief Internal function. Claims USB LED interface on device */
+/** @brief Internal function. Claims USB LED interface on device
+ *
+ * Performed by the claim operation of the transport of the handle.
+ */
 int libmk_claim_interface(LibMK_Handle* handle);
 
 /** @brief Sends packet to put the keyboard in LIBMK_EFFECT_CTRL
  *
  * @param handle: LibMK_Handle* for the device to send the packet to. If
  *    NULL, the global handle is used.
- * @returns LibMK_Result result code
+ * @returns LibMK_Result result code, LIBMK_ERR_UNKNOWN_LAYOUT if the
+ *    firmware reports a layout that is not supported.
  */
 int libmk_send_control_packet(LibMK_Handle* handle);
 
-/** @brief Internal function. Reset the libusb interface when releasing */
+/** @brief Internal function. Reset the device with its transport
+ *
+ * @returns LibMK_Result result code, LIBMK_ERR_DEV_NOT_SET if the
+ *    handle is not open, LIBMK_ERR_DEV_RESET_FAILED if the reset failed.
+ *    Resetting an emulated device does nothing.
+ */
 int libmk_reset(LibMK_Handle* handle);
 
 /** @brief Internal function. Return the bDevice USB descriptor property */
@@ -353,6 +760,24 @@ int libmk_send_packet(LibMK_Handle* handle, unsigned char* packet);
  */
 int libmk_exch_packet(LibMK_Handle* handle, unsigned char* packet);
 
+/** @brief Send a single packet without freeing it and verify the response
+ *
+ * @param handle: LibMK_Handle of the device to send the packet to. If
+ *    NULL the global device handle is used.
+ * @param packet: Array of bytes (unsigned char) of size
+ *    LIBMK_PACKET_SIZE to send. May be allocated on the stack, as it is
+ *    not freed.
+ * @param response_required: Whether to expect a response, see
+ *    libmk_send_recv_packet
+ * @returns LibMK_Result result code
+ *
+ * The response is read into the response buffer of the handle, so no
+ * memory is allocated. libmk_send_packet and libmk_send_recv_packet
+ * are wrappers around this function that free the packet.
+ */
+int libmk_transfer_packet(
+    LibMK_Handle* handle, unsigned char* packet, bool response_required);
+
 /** @brief Set effect to be active on keyboard
  *
  * @param handle: LibMK_Handle for device to set effect on. If NULL uses
@@ -371,6 +796,24 @@ int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect);
  */
 int libmk_set_effect_details(LibMK_Handle* handle, LibMK_Effect_Details* effect);
 
+/** @brief Apply an effect with parameters, sending only what changed
+ *
+ * @param handle: LibMK_Handle for device to set effect on. If NULL uses
+ *    global device handle.
+ * @param effect: LibMK_Effect_Details instance with all parameters set
+ * @returns LibMK_Result result code
+ *
+ * Results in the same state as libmk_set_effect_details, but compares
+ * the effect with the last state applied to the handle. The control
+ * mode packet is only sent if the device is not in LIBMK_EFFECT_CTRL,
+ * the effect packet only if the effect changed and the parameters
+ * packet only if any of the parameters changed. Repeating an effect
+ * therefore sends no packets at all, and changing only its colors or
+ * speed sends a single packet, allowing effects rendered by the
+ * firmware to be changed at a high rate.
+ */
+int libmk_update_effect(LibMK_Handle* handle, LibMK_Effect_Details* effect);
+
 /** @brief Set color of all the LEDs on the keyboard to a single color
  *
  * @param handle: LibMK_Handle for device to set color off. If NULL uses
@@ -390,9 +833,40 @@ int libmk_set_full_color(
  * @param colors: Pointer to array of unsigned char of
  *    [LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] size.
  * @returns LibMK_Result result code
+ *
+ * The packets last sent are kept in the handle. Only the packets of
+ * which the colors have changed since the previous call are sent to
+ * the keyboard, and the custom effect is only activated if it is not
+ * already active.
  */
 int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors);
 
+/** @brief Set the color of all the LEDs on the keyboard in device order
+ *
+ * @param handle: LibMK_Handle for device to set the key colors on. If
+ *    NULL uses the global device handle.
+ * @param colors: Pointer to array of unsigned char of
+ *    [LIBMK_MAX_OFFSETS][3] size, indexed by the key offsets as returned
+ *    by libmk_get_offset.
+ * @returns LibMK_Result result code
+ *
+ * Equivalent to libmk_set_all_led_color, but the colors are copied into
+ * the packets directly without translating the layout matrix.
+ */
+int libmk_set_all_led_color_offset(LibMK_Handle* handle, unsigned char* colors);
+
+/** @brief Mark the LED state kept in the handle as unknown
+ *
+ * @param handle: LibMK_Handle for the device. If NULL uses the global
+ *    device handle.
+ *
+ * Forces the next libmk_set_all_led_color to send all of its packets.
+ * Called by the library whenever the LED state of the keyboard may
+ * have changed. Must be called by the user after sending custom packets
+ * that change the LEDs with libmk_send_packet.
+ */
+void libmk_invalidate_frame(LibMK_Handle* handle);
+
 /** @brief Set the color of a single LED on the keyboard
  *
  * @param handle: LibMK_Handle for device to set the color of the key
@@ -403,11 +877,36 @@ int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors);
  * @param g: color byte green
  * @param b: color byte blue
  * @returns LibMK_Result result code
+ *
+ * Switches the device to LIBMK_CUSTOM_CTRL unless the handle is in that
+ * control mode already. For more than one key, libmk_set_led_colors
+ * requires fewer transfers.
  */
 int libmk_set_single_led(
     LibMK_Handle* handle, unsigned char row, unsigned char col,
     unsigned char r, unsigned char g, unsigned char b);
 
+/** @brief Set the color of a number of keys with as few transfers as possible
+ *
+ * @param handle: LibMK_Handle to set the colors on, NULL for the global
+ *    device handle
+ * @param keys: Keys to change. Later entries for the same key take
+ *    precedence. Positions without a key in the layout are skipped.
+ * @param n: Number of entries in keys
+ * @returns LibMK_Result result code, LIBMK_ERR_INVALID_ARG if a row or
+ *    column is out of range, in which case nothing is sent.
+ *
+ * Either sends a single key packet for every entry, as
+ * libmk_set_single_led, or only the full LED packets that contain the
+ * keys, as libmk_set_all_led_color, whichever requires fewer transfers
+ * including those for switching the control mode. The full LED packets
+ * are only used if the colors of the other keys in the packets are
+ * known from an earlier frame, or all colors are lost anyway because
+ * the control mode has to change.
+ */
+int libmk_set_led_colors(
+    LibMK_Handle* handle, const LibMK_Key_Color* keys, unsigned int n);
+
 /** @brief Retrieve the addressing offset of a specific key
  *
  * @param offset: Pointer to unsigned char to store offset in
@@ -421,6 +920,44 @@ int libmk_get_offset(
     unsigned char* offset, LibMK_Handle* handle,
     unsigned char row, unsigned char col);
 
+/** @brief Open the key events of the keyboard of a handle
+ *
+ * @param handle: LibMK_Handle for the device, NULL for the global
+ *    device handle
+ * @param path: Path of the evdev node to read, NULL to find the node of
+ *    the keyboard interface of the USB device of the handle
+ * @returns LibMK_Result result code. LIBMK_ERR_UNKNOWN_LAYOUT if the
+ *    layout of the device is not known, LIBMK_ERR_DEV_NOT_CONNECTED if
+ *    no evdev node was found, LIBMK_ERR_INPUT if it could not be opened.
+ *
+ * The keys are reported by the keyboard as Linux key codes, which are
+ * translated into positions with the inverse of a matrix of key codes
+ * of the layout. Positions without a key in LIBMK_LAYOUT for the size of
+ * the device are not reported. The events are not grabbed, so they are
+ * still delivered to other applications. The node is closed along with
+ * the handle.
+ */
+int libmk_open_input(LibMK_Handle* handle, const char* path);
+
+/** @brief Close the key events opened by libmk_open_input */
+void libmk_close_input(LibMK_Handle* handle);
+
+/** @brief Read the key events available without blocking
+ *
+ * @param handle: LibMK_Handle for the device, NULL for the global
+ *    device handle
+ * @param events: Array to store the events in
+ * @param n: Maximum number of events to read
+ * @returns Number of events read, or a negative LibMK_Result result
+ *    code. LIBMK_ERR_DEV_NOT_CONNECTED if the keyboard was
+ *    disconnected, LIBMK_ERR_DEV_NOT_SET if the input is not open.
+ *
+ * Key repeats are not reported. To wait for events, poll handle->input
+ * for POLLIN.
+ */
+int libmk_read_key_events(
+    LibMK_Handle* handle, LibMK_Key_Event* events, unsigned int n);
+
 /** @brief Set the profile active on the device
  *
  * @param handle: LibMK_Handle for the device to set the profile on. If
@@ -466,9 +1003,11 @@ int libmk_save_profile(LibMK_Handle* handle);
  *    NULL the global device handle is used.
  * @param packet: Pointer to array of packet to send.
  * @param r: Whether to expect a response. If ``false``, the function
- *    still attempts to read a response to make sure that the buffer is
- *    empty. If ``true``, performs protocol error checks and yields an
- *    error if no response was received.
+ *    does not wait for the response. It is read before the next
+ *    transfer on the handle, so that the buffer is empty, and an error
+ *    response is reported by libmk_drain_responses. If ``true``,
+ *    performs protocol error checks and yields an error if no response
+ *    was received.
  * @returns LibMK_Result result code
  */
 int libmk_send_recv_packet(LibMK_Handle* handle, unsigned char* packet, bool r);
@@ -484,5 +1023,121 @@ int libmk_send_recv_packet(LibMK_Handle* handle, unsigned char* packet, bool r);
  */
 unsigned char* libmk_build_packet(unsigned char predef, ...);
 
+/** @brief Fill an existing buffer with a new packet of data
+ *
+ * @param packet: Buffer of LIBMK_PACKET_SIZE bytes to fill, for example
+ *    allocated on the stack. All bytes not given are set to zero.
+ * @param predef: Amount of bytes given in the variable arguments
+ * @param ...: Bytes to from index zero of the packet, as for
+ *    libmk_build_packet
+ */
+void libmk_fill_packet(unsigned char* packet, unsigned char predef, ...);
+
+/** @brief Internal function. Build the packets for libmk_set_all_led_color
+ *
+ * @param handle: LibMK_Handle of the device to build the packets for.
+ *    Required to determine the layout of the device.
+ * @param colors: Pointer to array of unsigned char of
+ *    [LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] size.
+ * @param packets: Buffer to build the packets in
+ * @returns LibMK_Result result code
+ */
+int libmk_build_all_led_packets(
+    LibMK_Handle* handle, unsigned char* colors,
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE]);
+
+/** @brief Internal function. Select the key scatter table of a handle
+ *
+ * The scatter tables list only the known keys of each layout with their
+ * byte index in the color matrix and in the full LED packets, and are
+ * generated from LIBMK_LAYOUT by utils/keys.c. Called when control is
+ * enabled, as the layout of the device is then known.
+ *
+ * @returns LIBMK_ERR_UNKNOWN_LAYOUT if the layout reported by the
+ *    firmware is not supported, LIBMK_SUCCESS otherwise.
+ */
+int libmk_build_scatter_table(LibMK_Handle* handle);
+
+/** @brief Allocate a LibMK_Frame for asynchronous LED updates
+ *
+ * @param handle: LibMK_Handle of the device to update. If NULL the
+ *    global device handle is used.
+ * @returns Pointer to the allocated frame, NULL upon failure
+ */
+LibMK_Frame* libmk_create_frame(LibMK_Handle* handle);
+
+/** @brief Free a LibMK_Frame and its libusb transfers
+ *
+ * @returns LIBMK_ERR_STILL_ACTIVE if the frame is still in flight,
+ *    LIBMK_SUCCESS otherwise.
+ */
+int libmk_free_frame(LibMK_Frame* frame);
+
+/** @brief Asynchronously set the color of all the LEDs individually
+ *
+ * @param frame: LibMK_Frame that is not in flight
+ * @param colors: Pointer to array of unsigned char of
+ *    [LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] size. Copied into the frame,
+ *    so it may be re-used immediately.
+ * @param callback: Called when all packets have been exchanged, may be
+ *    NULL
+ * @param user_data: Passed to the callback
+ * @returns LibMK_Result result code of the submission
+ *
+ * Asynchronous equivalent of libmk_set_all_led_color. All the packets
+ * that changed are submitted at once and their responses are verified
+ * as they arrive. The transfers are executed while libusb events are
+ * handled using libmk_handle_events or libmk_wait_frame. If no packets
+ * have to be sent, the frame is completed before this function returns.
+ */
+int libmk_submit_all_led_color(
+    LibMK_Frame* frame, unsigned char* colors,
+    LibMK_Frame_Callback callback, void* user_data);
+
+/** @brief Return whether the frame is no longer in flight */
+bool libmk_frame_done(LibMK_Frame* frame);
+
+/** @brief Handle libusb events until the frame has completed
+ *
+ * @returns LibMK_Result result code of the frame
+ */
+int libmk_wait_frame(LibMK_Frame* frame);
+
+/** @brief Handle pending libusb events of the library context
+ *
+ * @param timeout: Maximum time to block in milliseconds
+ * @returns LibMK_Result result code
+ *
+ * Completes transfers of submitted frames and calls their callbacks.
+ * Also processes hotplug events if enabled. May be called continuously
+ * from a dedicated thread.
+ */
+int libmk_handle_events(int timeout);
+
+/** @brief Retrieve the file descriptors to poll for libusb events
+ *
+ * @param fds: Pointer to an array of LibMK_Pollfd. Required memory is
+ *    allocated by the function and must be freed by the caller.
+ * @returns The number of file descriptors, or a LibMK_Result error code.
+ *
+ * Allows the integration of asynchronous frames into the event loop of
+ * a program. When any of the file descriptors is ready, or the timeout
+ * returned by libmk_get_next_timeout expires, libmk_handle_events
+ * should be called with a timeout of zero. The file descriptors change
+ * when devices are opened or closed.
+ */
+int libmk_get_pollfds(LibMK_Pollfd** fds);
+
+/** @brief Retrieve the time until libusb events must be handled
+ *
+ * @returns Time in milliseconds after which libmk_handle_events must
+ *    be called even if no file descriptor is ready, or -1 if there is
+ *    no such timeout pending or timeouts are signalled through the file
+ *    descriptors.
+ */
+int libmk_get_next_timeout(void);
+
 /** Debugging purposes */
 void libmk_print_packet(unsigned char* packet, char* label);
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+ *
+ * @file libmk_keys.h
+ * @brief Scatter tables of the layouts of libmk
+ *
+ * Generated from LIBMK_LAYOUT by utils/keys.c, do not edit.
+*/
+#ifndef LIBMK_KEYS_H
+#define LIBMK_KEYS_H
+#include "libmk.h"
+
+static const LibMK_Key LIBMK_KEYS_ANSI_L[] = {
+    {0, 37}, {3, 86}, {6, 110}, {9, 95}, {12, 101}, {18, 25},
+    {21, 205}, {24, 223}, {27, 238}, {33, 342}, {36, 345}, {39, 333},
+    {42, 339}, {45, 305}, {48, 284}, {51, 4}, {54, 403}, {57, 427},
+    {60, 467}, {63, 473}, {72, 46}, {75, 49}, {78, 89}, {81, 113},
+    {84, 153}, {87, 150}, {90, 174}, {93, 177}, {96, 217}, {99, 241},
+    {102, 281}, {105, 278}, {108, 214}, {114, 327}, {117, 13}, {120, 7},
+    {123, 10}, {126, 400}, {129, 424}, {132, 464}, {135, 470}, {144, 31},
+    {147, 28}, {150, 68}, {153, 92}, {156, 132}, {159, 135}, {162, 159},
+    {165, 156}, {168, 196}, {171, 220}, {174, 260}, {177, 263}, {180, 199},
+    {186, 330}, {189, 366}, {192, 360}, {195, 348}, {198, 388}, {201, 412},
+    {204, 452}, {207, 430}, {216, 71}, {219, 34}, {222, 74}, {225, 98},
+    {228, 138}, {231, 141}, {234, 165}, {237, 162}, {240, 202}, {243, 226},
+    {246, 266}, {249, 269}, {258, 336}, {270, 391}, {273, 415}, {276, 455},
+    {288, 287}, {294, 40}, {297, 80}, {300, 104}, {303, 144}, {306, 147},
+    {309, 171}, {312, 168}, {315, 208}, {318, 232}, {321, 275}, {330, 290},
+    {336, 324}, {342, 394}, {345, 418}, {348, 458}, {351, 433}, {360, 22},
+    {363, 354}, {366, 293}, {378, 357}, {390, 299}, {393, 302}, {396, 235},
+    {402, 16}, {405, 369}, {408, 363}, {411, 19}, {414, 421}, {420, 461},
+};
+
+static const LibMK_Key LIBMK_KEYS_ANSI_S[] = {
+    {0, 388}, {3, 391}, {6, 394}, {9, 397}, {12, 412}, {18, 415},
+    {21, 418}, {24, 452}, {27, 455}, {33, 458}, {36, 269}, {39, 272},
+    {42, 275}, {45, 406}, {48, 409}, {51, 421}, {72, 4}, {75, 7},
+    {78, 28}, {81, 31}, {84, 68}, {87, 71}, {90, 92}, {93, 95},
+    {96, 132}, {99, 135}, {102, 156}, {105, 159}, {108, 196}, {114, 199},
+    {117, 220}, {120, 223}, {123, 260}, {144, 10}, {147, 13}, {150, 34},
+    {153, 37}, {156, 74}, {159, 77}, {162, 98}, {165, 101}, {168, 138},
+    {171, 141}, {174, 162}, {177, 165}, {180, 202}, {186, 205}, {189, 226},
+    {192, 229}, {195, 266}, {216, 16}, {219, 19}, {222, 40}, {225, 43},
+    {228, 80}, {231, 83}, {234, 104}, {237, 107}, {240, 144}, {243, 147},
+    {246, 168}, {249, 171}, {258, 208}, {288, 22}, {294, 25}, {297, 46},
+    {300, 49}, {303, 86}, {306, 89}, {309, 110}, {312, 113}, {315, 150},
+    {318, 153}, {321, 174}, {324, 7}, {330, 177}, {336, 235}, {360, 357},
+    {363, 354}, {366, 360}, {378, 363}, {390, 366}, {393, 232}, {396, 369},
+    {402, 214}, {405, 241}, {408, 238}, {411, 278},
+};
+
+static const LibMK_Key LIBMK_KEYS_ISO_L[] = {
+    {0, 37}, {3, 86}, {6, 110}, {9, 95}, {12, 101}, {18, 25},
+    {21, 205}, {24, 223}, {27, 238}, {33, 342}, {36, 345}, {39, 333},
+    {42, 339}, {45, 305}, {48, 284}, {51, 4}, {54, 403}, {57, 427},
+    {60, 467}, {63, 473}, {72, 46}, {75, 49}, {78, 89}, {81, 113},
+    {84, 153}, {87, 150}, {90, 174}, {93, 177}, {96, 217}, {99, 241},
+    {102, 281}, {105, 278}, {108, 214}, {114, 327}, {117, 13}, {120, 7},
+    {123, 10}, {126, 400}, {129, 424}, {132, 464}, {135, 470}, {144, 31},
+    {147, 28}, {150, 68}, {153, 92}, {156, 132}, {159, 135}, {162, 159},
+    {165, 156}, {168, 196}, {171, 220}, {174, 260}, {177, 263}, {180, 199},
+    {186, 336}, {189, 366}, {192, 360}, {195, 348}, {198, 388}, {201, 412},
+    {204, 452}, {207, 430}, {216, 71}, {219, 34}, {222, 74}, {225, 98},
+    {228, 138}, {231, 141}, {234, 165}, {237, 162}, {240, 202}, {243, 226},
+    {246, 266}, {249, 269}, {252, 272}, {270, 391}, {273, 415}, {276, 455},
+    {288, 287}, {291, 77}, {294, 40}, {297, 80}, {300, 104}, {303, 144},
+    {306, 147}, {309, 171}, {312, 168}, {315, 208}, {318, 232}, {321, 275},
+    {330, 290}, {336, 324}, {342, 394}, {345, 418}, {348, 458}, {351, 433},
+    {360, 22}, {363, 354}, {366, 293}, {378, 357}, {390, 299}, {393, 302},
+    {396, 235}, {402, 16}, {405, 369}, {408, 363}, {411, 19}, {414, 421},
+    {420, 461},
+};
+
+/// Scatter tables by layout and size, NULL if no keys are known
+static const LibMK_Key* const LIBMK_KEYS[2][3] = {
+    {LIBMK_KEYS_ANSI_L, NULL, LIBMK_KEYS_ANSI_S},
+    {LIBMK_KEYS_ISO_L, NULL, NULL},
+};
+
+/// Number of keys in the scatter tables by layout and size
+static const short LIBMK_KEY_COUNTS[2][3] = {
+    {108, 0, 88},
+    {109, 0, 0},
+};
+
+#endif
@@ -3,15 +3,55 @@
  * License: GNU GPLv3
  * Copyright (c) 2018 RedFantom
 */
+#define _GNU_SOURCE
 #include "libmkc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define LIBMKC_DEBUG
 
 
+static void libmk_init_cond(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+
+static void libmk_add_time(struct timespec* t, unsigned long us) {
+    t->tv_sec += us / 1000000;
+    t->tv_nsec += (us % 1000000) * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec += 1;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+
+static void libmk_get_deadline(struct timespec* t, unsigned long us) {
+    clock_gettime(CLOCK_MONOTONIC, t);
+    libmk_add_time(t, us);
+}
+
+
+/// Difference a - b in microseconds
+static long libmk_diff_time(const struct timespec* a, const struct timespec* b) {
+    return (long) (a->tv_sec - b->tv_sec) * 1000000 +
+        (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+
 LibMK_Controller* libmk_create_controller(LibMK_Handle* handle) {
     LibMK_Controller* controller = (LibMK_Controller*) malloc(
         sizeof(LibMK_Controller));
@@ -20,12 +60,41 @@ LibMK_Controller* libmk_create_controller(LibMK_Handle* handle) {
     controller->handle = handle;
     pthread_mutex_init(&controller->state_lock, NULL);
     pthread_mutex_init(&controller->exit_flag_lock, NULL);
-    pthread_mutex_init(&controller->instr_lock, NULL);
+    pthread_mutex_init(&controller->cancel_lock, NULL);
     pthread_mutex_init(&controller->error_lock, NULL);
-    controller->instr = NULL;
+    libmk_init_cond(&controller->work_cond);
+    libmk_init_cond(&controller->space_cond);
+    libmk_init_cond(&controller->state_cond);
+    controller->sleeping = 0;
+    controller->blocked = 0;
+    for (unsigned long k = 0; k < LIBMK_QUEUE_SIZE; k++) {
+        controller->queue.cells[k].seq = k;
+        controller->queue.cells[k].instr = NULL;
+    }
+    controller->queue.head = 0;
+    controller->queue.tail = 0;
+    controller->overflow = NULL;
+    controller->pending = NULL;
+    controller->policy = LIBMK_OVERFLOW_BLOCK;
+    controller->coalesce = false;
+    controller->current = NULL;
+    memset(controller->frame, 0x00, sizeof(controller->frame));
+    controller->next_id = 1;
+    controller->cancel_count = 0;
+    controller->error = LIBMK_SUCCESS;
+    pthread_mutex_init(&controller->stats_lock, NULL);
+    controller->late_policy = LIBMK_LATE_EXECUTE;
+    controller->late_tolerance = 0;
+    memset(&controller->stats, 0x00, sizeof(LibMK_Timing_Stats));
+    controller->jitter_sum = 0;
     controller->state = LIBMK_STATE_PRESTART;
     controller->exit_flag = false;
     controller->wait_flag = false;
+    controller->key_callback = NULL;
+    controller->key_data = NULL;
+    controller->input_wake = -1;
+    controller->key_head = 0;
+    controller->key_tail = 0;
     return controller;
 }
 
@@ -49,10 +118,23 @@ LibMK_Result libmk_get_controller_error(LibMK_Controller* c) {
 LibMK_Result libmk_free_controller(LibMK_Controller* c) {
     if (libmk_get_controller_state(c) == LIBMK_STATE_ACTIVE)
         return LIBMK_ERR_STILL_ACTIVE;
+    LibMK_Instruction* i;
+    while ((i = libmk_dequeue_instruction(&c->queue)) != NULL)
+        libmk_free_instruction(i);
+    if (c->overflow != NULL)
+        libmk_free_instruction(c->overflow);
+    if (c->pending != NULL)
+        libmk_free_instruction(c->pending);
+    if (c->current != NULL)
+        libmk_free_instruction(c->current);
     pthread_mutex_destroy(&c->state_lock);
     pthread_mutex_destroy(&c->exit_flag_lock);
-    pthread_mutex_destroy(&c->instr_lock);
+    pthread_mutex_destroy(&c->cancel_lock);
     pthread_mutex_destroy(&c->error_lock);
+    pthread_mutex_destroy(&c->stats_lock);
+    pthread_cond_destroy(&c->work_cond);
+    pthread_cond_destroy(&c->space_cond);
+    pthread_cond_destroy(&c->state_cond);
     int r = libmk_free_handle(c->handle);
     if (r != LIBMK_SUCCESS)
         return (LibMK_Result) r;
@@ -62,58 +144,488 @@ LibMK_Result libmk_free_controller(LibMK_Controller* c) {
 }
 
 
+static void libmk_set_controller_state(
+        LibMK_Controller* c, LibMK_Controller_State s) {
+    pthread_mutex_lock(&(c->state_lock));
+    c->state = s;
+    pthread_cond_broadcast(&(c->state_cond));
+    pthread_mutex_unlock(&(c->state_lock));
+}
+
+
+static void* libmk_run_input(void* data) {
+    LibMK_Controller* c = (LibMK_Controller*) data;
+    struct pollfd fds[2] = {
+        {c->handle->input, POLLIN, 0}, {c->input_wake, POLLIN, 0}};
+    LibMK_Key_Event events[LIBMK_KEY_EVENTS];
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+        int n = libmk_read_key_events(c->handle, events, LIBMK_KEY_EVENTS);
+        if (n < 0) {
+            libmk_set_controller_error(c, (LibMK_Result) n);
+            libmk_stop_controller(c);
+            break;
+        }
+        if (n == 0 && (fds[0].revents & (POLLHUP | POLLERR)))
+            break;
+        // The input thread is the only writer of the head
+        unsigned int head = c->key_head;
+        unsigned int tail = __atomic_load_n(&c->key_tail, __ATOMIC_ACQUIRE);
+        for (int k = 0; k < n && head - tail < LIBMK_KEY_EVENTS; k++, head++)
+            c->key_events[head % LIBMK_KEY_EVENTS] = events[k];
+        __atomic_store_n(&c->key_head, head, __ATOMIC_RELEASE);
+        // Also wakes the controller from the sleep before a deadline
+        pthread_mutex_lock(&(c->exit_flag_lock));
+        pthread_cond_broadcast(&(c->work_cond));
+        pthread_mutex_unlock(&(c->exit_flag_lock));
+    }
+    return NULL;
+}
+
+
+static LibMK_Result libmk_start_input(LibMK_Controller* c) {
+    if (c->key_callback == NULL)
+        return LIBMK_SUCCESS;
+    c->input_wake = eventfd(0, EFD_CLOEXEC);
+    if (c->input_wake < 0)
+        return LIBMK_ERR_THREAD;
+    if (pthread_create(&c->input_thread, NULL, libmk_run_input, c) != 0) {
+        close(c->input_wake);
+        c->input_wake = -1;
+        return LIBMK_ERR_THREAD;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+static void libmk_stop_input(LibMK_Controller* c) {
+    if (c->input_wake < 0)
+        return;
+    uint64_t one = 1;
+    if (write(c->input_wake, &one, sizeof(one)) == sizeof(one))
+        pthread_join(c->input_thread, NULL);
+    close(c->input_wake);
+    c->input_wake = -1;
+}
+
+
+static bool libmk_keys_pending(LibMK_Controller* c) {
+    return c->key_callback != NULL &&
+        __atomic_load_n(&c->key_head, __ATOMIC_ACQUIRE) != c->key_tail;
+}
+
+
+static void libmk_dispatch_keys(LibMK_Controller* c) {
+    unsigned int head = __atomic_load_n(&c->key_head, __ATOMIC_ACQUIRE);
+    while (c->key_tail != head) {
+        LibMK_Key_Event e = c->key_events[c->key_tail % LIBMK_KEY_EVENTS];
+        __atomic_store_n(&c->key_tail, c->key_tail + 1, __ATOMIC_RELEASE);
+        c->key_callback(c, &e, c->key_data);
+    }
+}
+
+
+LibMK_Result libmk_set_key_callback(
+        LibMK_Controller* c, LibMK_Key_Callback callback, void* data) {
+    if (libmk_get_controller_state(c) == LIBMK_STATE_ACTIVE)
+        return LIBMK_ERR_STILL_ACTIVE;
+    if (callback != NULL && c->handle->input < 0) {
+        int r = libmk_open_input(c->handle, NULL);
+        if (r != LIBMK_SUCCESS)
+            return (LibMK_Result) r;
+    }
+    c->key_callback = callback;
+    c->key_data = data;
+    return LIBMK_SUCCESS;
+}
+
+
 LibMK_Result libmk_start_controller(LibMK_Controller* controller) {
     LibMK_Result r = (LibMK_Result) libmk_enable_control(controller->handle);
     if (r != LIBMK_SUCCESS)
         return r;
-    pthread_create(
-        &controller->thread, NULL,
-        (void*) libmk_run_controller, (void*) controller);
+    // Set before the thread is created so that joining waits for it
+    libmk_set_controller_state(controller, LIBMK_STATE_ACTIVE);
+    r = libmk_start_input(controller);
+    if (r != LIBMK_SUCCESS || pthread_create(
+            &controller->thread, NULL,
+            (void*) libmk_run_controller, (void*) controller) != 0) {
+        libmk_stop_input(controller);
+        libmk_set_controller_state(controller, LIBMK_STATE_START_ERR);
+        libmk_disable_control(controller->handle);
+        return LIBMK_ERR_THREAD;
+    }
     return LIBMK_SUCCESS;
 }
 
 
+static bool libmk_take_cancelled(LibMK_Controller* c, unsigned int id) {
+    if (__atomic_load_n(&c->cancel_count, __ATOMIC_ACQUIRE) == 0)
+        return false;
+    bool found = false;
+    pthread_mutex_lock(&(c->cancel_lock));
+    for (unsigned char k = 0; k < c->cancel_count; k++) {
+        if (c->cancel[k] != id)
+            continue;
+        c->cancel[k] = c->cancel[c->cancel_count - 1];
+        __atomic_store_n(
+            &c->cancel_count, c->cancel_count - 1, __ATOMIC_RELEASE);
+        found = true;
+        break;
+    }
+    pthread_mutex_unlock(&(c->cancel_lock));
+    return found;
+}
+
+
+/// Take the next instruction from the queue, locked is whether the
+/// caller holds the exit_flag_lock
+static LibMK_Instruction* libmk_take_instruction(
+        LibMK_Controller* c, bool locked) {
+    LibMK_Instruction* i = c->pending;
+    if (i != NULL) {  // Taken from the queue before any other
+        c->pending = NULL;
+        return i;
+    }
+    i = libmk_dequeue_instruction(&c->queue);
+    if (i == NULL)  // Overflow is only executed once the queue is empty
+        return __atomic_exchange_n(&c->overflow, NULL, __ATOMIC_ACQ_REL);
+    // The lock is only taken if a scheduling thread waits for room
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->blocked, __ATOMIC_RELAXED) != 0) {
+        if (!locked)
+            pthread_mutex_lock(&(c->exit_flag_lock));
+        pthread_cond_broadcast(&(c->space_cond));
+        if (!locked)
+            pthread_mutex_unlock(&(c->exit_flag_lock));
+    }
+    return i;
+}
+
+
+static LibMK_Instruction* libmk_next_instruction(LibMK_Controller* c) {
+    return libmk_take_instruction(c, false);
+}
+
+
+static LibMK_Instruction* libmk_wait_instruction(LibMK_Controller* c) {
+    LibMK_Instruction* i = NULL;
+    pthread_mutex_lock(&(c->exit_flag_lock));
+    __atomic_store_n(&c->sleeping, 1, __ATOMIC_RELAXED);
+    while (true) {
+        // Pairs with the fence in libmk_wake_controller
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (c->exit_flag)
+            break;
+        i = libmk_take_instruction(c, true);
+        if (i != NULL || c->wait_flag)
+            break;
+        if (libmk_keys_pending(c)) {
+            pthread_mutex_unlock(&(c->exit_flag_lock));
+            libmk_dispatch_keys(c);
+            pthread_mutex_lock(&(c->exit_flag_lock));
+            continue;
+        }
+        pthread_cond_wait(&(c->work_cond), &(c->exit_flag_lock));
+    }
+    __atomic_store_n(&c->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(c->exit_flag_lock));
+    return i;
+}
+
+
+static void libmk_wake_controller(LibMK_Controller* c) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->sleeping, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&(c->exit_flag_lock));
+    pthread_cond_signal(&(c->work_cond));
+    pthread_mutex_unlock(&(c->exit_flag_lock));
+}
+
+
+/// Sleep until an absolute deadline, like clock_nanosleep with
+/// TIMER_ABSTIME, but woken up by libmk_stop_controller
+static void libmk_controller_sleep(
+        LibMK_Controller* c, const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (libmk_diff_time(deadline, &now) <= 0)
+        return;
+    pthread_mutex_lock(&(c->exit_flag_lock));
+    while (!c->exit_flag) {
+        if (libmk_keys_pending(c)) {
+            pthread_mutex_unlock(&(c->exit_flag_lock));
+            libmk_dispatch_keys(c);
+            pthread_mutex_lock(&(c->exit_flag_lock));
+            continue;
+        }
+        if (pthread_cond_timedwait(
+                &(c->work_cond), &(c->exit_flag_lock), deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&(c->exit_flag_lock));
+}
+
+
+static void libmk_record_timing(LibMK_Controller* c, long late, bool skip) {
+    pthread_mutex_lock(&(c->stats_lock));
+    if (skip) {
+        c->stats.skipped++;
+    } else {
+        c->stats.executed++;
+        c->jitter_sum += late;
+        c->stats.jitter_last = late;
+        if (late > c->stats.jitter_max)
+            c->stats.jitter_max = late;
+    }
+    pthread_mutex_unlock(&(c->stats_lock));
+}
+
+
+/// Copy the colors of a player into the colors last sent
+static void libmk_track_player(LibMK_Controller* c, LibMK_Player* p) {
+    if (!(p->animation->header->flags & LIBMK_ANIMATION_OFFSETS)) {
+        memcpy(c->frame, p->colors, sizeof(c->frame));
+        return;
+    }
+    LibMK_Handle* h = c->handle;
+    unsigned char offset;
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char k = 0; k < LIBMK_MAX_COLS; k++) {
+            offset = LIBMK_LAYOUT[h->layout - LIBMK_LAYOUT_ANSI][h->size][r][k];
+            if (offset < LIBMK_MAX_OFFSETS)
+                memcpy(c->frame[r][k], p->colors + offset * 3, 3);
+            else
+                memset(c->frame[r][k], 0x00, 3);
+        }
+}
+
+
+static void libmk_merge_instruction(LibMK_Controller* c, LibMK_Instruction* i) {
+    if (i->type == LIBMK_INSTR_ALL) {
+        memcpy(c->frame, i->colors, sizeof(c->frame));
+    } else if (i->type == LIBMK_INSTR_FULL) {
+        for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+            for (unsigned char k = 0; k < LIBMK_MAX_COLS; k++)
+                memcpy(c->frame[r][k], i->color, 3);
+    } else if (i->type == LIBMK_INSTR_SINGLE) {
+        if (i->r < LIBMK_MAX_ROWS && i->c < LIBMK_MAX_COLS)
+            memcpy(c->frame[i->r][i->c], i->color, 3);
+    } else if (i->type == LIBMK_INSTR_EFFECT) {
+        // Switching back to custom control after an effect clears the keys
+        memset(c->frame, 0, sizeof(c->frame));
+    } else if (i->type == LIBMK_INSTR_GENERATOR) {
+        libmk_render_generator(i->generator);
+        memcpy(c->frame, i->generator->colors, sizeof(c->frame));
+    } else if (i->type == LIBMK_INSTR_TRANSITION) {
+        // Continues from the colors of the instructions merged before
+        if (!i->transition->started)
+            libmk_start_transition(i->transition, c->frame);
+        libmk_render_transition(i->transition);
+        memcpy(c->frame, i->transition->colors, sizeof(c->frame));
+    } else if (i->type == LIBMK_INSTR_ANIMATION) {
+        i->duration = libmk_play_frame(i->player);
+        libmk_track_player(c, i->player);
+    }
+}
+
+
+/// Update the colors last sent with an instruction executed as is
+static void libmk_track_instruction(LibMK_Controller* c, LibMK_Instruction* i) {
+    if (i->type == LIBMK_INSTR_GENERATOR)
+        memcpy(c->frame, i->generator->colors, sizeof(c->frame));
+    else if (i->type == LIBMK_INSTR_TRANSITION)
+        memcpy(c->frame, i->transition->colors, sizeof(c->frame));
+    else if (i->type == LIBMK_INSTR_ANIMATION)
+        libmk_track_player(c, i->player);
+    else
+        libmk_merge_instruction(c, i);
+}
+
+
+static LibMK_Result libmk_exec_coalesced(
+        LibMK_Controller* c, LibMK_Instruction** instr) {
+    LibMK_Instruction* i = *instr;
+    LibMK_Instruction* next;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    libmk_merge_instruction(c, i);
+    bool full = (i->type == LIBMK_INSTR_FULL);
+
+    // Bounded, so that fast producers cannot starve the keyboard
+    for (unsigned int n = 0; n < LIBMK_QUEUE_SIZE; n++) {
+        next = libmk_next_instruction(c);
+        if (next == NULL)
+            break;
+        if (libmk_take_cancelled(c, next->id)) {
+            libmk_free_instruction(next);
+            continue;
+        }
+        // Instructions due later are executed at their own time
+        if ((next->time.tv_sec != 0 || next->time.tv_nsec != 0) &&
+                libmk_diff_time(&next->time, &now) > 0) {
+            c->pending = next;
+            break;
+        }
+        libmk_free_instruction(i);
+        i = next;
+        libmk_merge_instruction(c, i);
+        full = (i->type == LIBMK_INSTR_FULL);
+    }
+    *instr = i;
+
+    if (i->type == LIBMK_INSTR_EFFECT)
+        return (LibMK_Result) libmk_update_effect(c->handle, &(i->effect));
+    // A full color update is a single packet, so it is preferred
+    if (full)
+        return (LibMK_Result) libmk_set_full_color(
+            c->handle, i->color[0], i->color[1], i->color[2]);
+    return (LibMK_Result) libmk_set_all_led_color(
+        c->handle, (unsigned char*) c->frame);
+}
+
+
+/// Keep a generator, transition or animation instruction as the current
+/// instruction of the controller if frames remain, returns false if it
+/// may be freed
+static bool libmk_keep_current(LibMK_Controller* c, LibMK_Instruction* i) {
+    if (i->type == LIBMK_INSTR_GENERATOR) {
+        if (libmk_generator_done(i->generator))
+            return false;
+    } else if (i->type == LIBMK_INSTR_ANIMATION) {
+        if (libmk_player_done(i->player))
+            return false;
+    } else if (i->type != LIBMK_INSTR_TRANSITION ||
+               libmk_transition_done(i->transition))
+        return false;
+    // The next frames follow on the timeline of the first
+    i->time.tv_sec = 0;
+    i->time.tv_nsec = 0;
+    c->current = i;
+    return true;
+}
+
+
+/// Take the instruction to execute after the current generator,
+/// transition or animation
+static LibMK_Instruction* libmk_take_current(LibMK_Controller* c) {
+    LibMK_Instruction* i = c->current;
+    c->current = NULL;
+    if (i->type == LIBMK_INSTR_TRANSITION ||
+            (i->type == LIBMK_INSTR_GENERATOR && i->generator->frames != 0) ||
+            (i->type == LIBMK_INSTR_ANIMATION && !i->player->loop))
+        return i;
+    // Generators without a limit on the frames and looping animations
+    // yield to anything else
+    LibMK_Instruction* next = libmk_next_instruction(c);
+    if (next == NULL && !__atomic_load_n(&c->wait_flag, __ATOMIC_ACQUIRE))
+        return i;
+    libmk_free_instruction(i);
+    return next;
+}
+
+
 void libmk_run_controller(LibMK_Controller* controller) {
-    pthread_mutex_lock(&(controller->state_lock));
-    controller->state = LIBMK_STATE_ACTIVE;
-    pthread_mutex_unlock(&(controller->state_lock));
-    bool exit_flag, wait_flag;
+    struct timespec now, target;
+    clock_gettime(CLOCK_MONOTONIC, &target);
     while (true) {
-        pthread_mutex_lock(&(controller->exit_flag_lock));
-        exit_flag = controller->exit_flag;
-        wait_flag = controller->wait_flag;
-        pthread_mutex_unlock(&(controller->exit_flag_lock));
-        if (exit_flag)
+        // Flags are only read under the lock when no work is available
+        if (__atomic_load_n(&controller->exit_flag, __ATOMIC_ACQUIRE))
             break;
-        pthread_mutex_lock(&(controller->instr_lock));
-        if (controller->instr == NULL) {
-            pthread_mutex_unlock(&(controller->instr_lock));
-            if (wait_flag)
+        if (libmk_keys_pending(controller))
+            libmk_dispatch_keys(controller);
+        LibMK_Instruction* instr;
+        bool idle = false;
+        if (controller->current != NULL)
+            instr = libmk_take_current(controller);
+        else
+            instr = libmk_next_instruction(controller);
+        if (instr == NULL) {
+            idle = true;
+            // Check the responses of the last frame while there is time
+            LibMK_Result r = (LibMK_Result)
+                libmk_drain_responses(controller->handle);
+            if (r != LIBMK_SUCCESS) {
+                libmk_set_controller_error(controller, r);
                 break;
-            usleep(1000);
+            }
+            instr = libmk_wait_instruction(controller);
+        }
+        if (instr == NULL) {
+            // Finish the duration of the last instruction before exiting
+            libmk_controller_sleep(controller, &target);
+            break;
+        }
+        if (libmk_take_cancelled(controller, instr->id)) {
+            libmk_free_instruction(instr);
             continue;
         }
-        LibMK_Result r = (LibMK_Result) libmk_exec_instruction(
-            controller->handle, controller->instr);
+        LibMK_Handle* h = controller->handle;
+        if (h->trace != NULL)
+            h->trace(
+                h, LIBMK_TRACE_DEQUEUE, instr, LIBMK_SUCCESS, h->trace_data);
+        if (instr->time.tv_sec != 0 || instr->time.tv_nsec != 0) {
+            target = instr->time;
+        } else if (idle) {
+            // The queue ran empty, so the timeline restarts
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (libmk_diff_time(&now, &target) > 0)
+                target = now;
+        }
+        libmk_controller_sleep(controller, &target);
+        if (__atomic_load_n(&controller->exit_flag, __ATOMIC_ACQUIRE)) {
+            libmk_free_instruction(instr);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long late = libmk_diff_time(&now, &target);
+        if (instr->type == LIBMK_INSTR_TRANSITION &&
+                !instr->transition->started)
+            libmk_start_transition(instr->transition, controller->frame);
+        if (controller->late_policy == LIBMK_LATE_SKIP &&
+                late > (long) controller->late_tolerance) {
+            libmk_record_timing(controller, late, true);
+            if (instr->type == LIBMK_INSTR_ANIMATION)
+                instr->duration = libmk_play_frame(instr->player);
+            libmk_add_time(&target, instr->duration);
+            if (instr->type == LIBMK_INSTR_GENERATOR)
+                instr->generator->frame++;
+            if (!libmk_keep_current(controller, instr))
+                libmk_free_instruction(instr);
+            continue;
+        }
+        LibMK_Result r;
+        if (controller->coalesce) {
+            r = libmk_exec_coalesced(controller, &instr);
+        } else {
+            r = (LibMK_Result) libmk_exec_instruction(
+                controller->handle, instr);
+            libmk_track_instruction(controller, instr);
+        }
         if (r != LIBMK_SUCCESS) {
             libmk_set_controller_error(controller, r);
-            pthread_mutex_unlock(&(controller->instr_lock));
+            libmk_free_instruction(instr);
             break;
         }
-        usleep(controller->instr->duration);
-        // Move on to next instruction
-        LibMK_Instruction* old = controller->instr;
-        controller->instr = controller->instr->next;
-        libmk_free_instruction(old);
-        pthread_mutex_unlock(&(controller->instr_lock));
+        libmk_record_timing(controller, late, false);
+        libmk_add_time(&target, instr->duration);
+        if (!libmk_keep_current(controller, instr))
+            libmk_free_instruction(instr);
     }
+    // The input is closed along with the handle
+    libmk_stop_input(controller);
     int r = libmk_disable_control(controller->handle);
     if (r != LIBMK_SUCCESS) {
         libmk_set_controller_error(controller, (LibMK_Result) r);
     }
-    pthread_mutex_lock(&(controller->state_lock));
-    controller->state = LIBMK_STATE_STOPPED;
-    pthread_mutex_unlock(&(controller->state_lock));
+    libmk_set_controller_state(controller, LIBMK_STATE_STOPPED);
 }
 
 
@@ -135,13 +647,31 @@ LibMK_Result libmk_exec_instruction(LibMK_Handle* h, LibMK_Instruction* i) {
     } else if (i->type == LIBMK_INSTR_SINGLE) {
         return libmk_set_single_led(
             h, i->r, i->c, i->color[0], i->color[1], i->color[2]);
+    } else if (i->type == LIBMK_INSTR_EFFECT) {
+        return libmk_update_effect(h, &(i->effect));
+    } else if (i->type == LIBMK_INSTR_GENERATOR) {
+        libmk_render_generator(i->generator);
+        return libmk_set_all_led_color(
+            h, (unsigned char*) i->generator->colors);
+    } else if (i->type == LIBMK_INSTR_TRANSITION) {
+        libmk_render_transition(i->transition);
+        return libmk_set_all_led_color(
+            h, (unsigned char*) i->transition->colors);
+    } else if (i->type == LIBMK_INSTR_ANIMATION) {
+        i->duration = libmk_play_frame(i->player);
+        if (i->player->animation->header->flags & LIBMK_ANIMATION_OFFSETS)
+            return libmk_set_all_led_color_offset(h, i->player->colors);
+        return libmk_set_all_led_color(h, i->player->colors);
     }
+    return LIBMK_ERR_INVALID_ARG;
 }
 
 
 void libmk_stop_controller(LibMK_Controller* controller) {
     pthread_mutex_lock(&(controller->exit_flag_lock));
-    controller->exit_flag = true;
+    __atomic_store_n(&controller->exit_flag, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&(controller->work_cond));
+    pthread_cond_broadcast(&(controller->space_cond));
     pthread_mutex_unlock(&(controller->exit_flag_lock));
 }
 
@@ -149,6 +679,7 @@ void libmk_stop_controller(LibMK_Controller* controller) {
 void libmk_wait_controller(LibMK_Controller* controller) {
     pthread_mutex_lock(&(controller->exit_flag_lock));
     controller->wait_flag = true;
+    pthread_cond_broadcast(&(controller->work_cond));
     pthread_mutex_unlock(&(controller->exit_flag_lock));
 }
 
@@ -156,19 +687,19 @@ void libmk_wait_controller(LibMK_Controller* controller) {
 LibMK_Controller_State libmk_join_controller(
         LibMK_Controller* controller, double timeout) {
     LibMK_Controller_State s;
-    clock_t t = clock();
-    double elapsed;
-    while (true) {
-        pthread_mutex_lock(&(controller->state_lock));
-        s = controller->state;
-        pthread_mutex_unlock(&(controller->state_lock));
-        if (s != LIBMK_STATE_ACTIVE)
+    struct timespec deadline;
+    libmk_get_deadline(
+        &deadline, timeout > 0 ? (unsigned long) (timeout * 1000000) : 0);
+    pthread_mutex_lock(&(controller->state_lock));
+    while (controller->state == LIBMK_STATE_ACTIVE) {
+        if (pthread_cond_timedwait(
+                &(controller->state_cond), &(controller->state_lock),
+                &deadline) == ETIMEDOUT)
             break;
-        elapsed = ((double) (clock() - t)) / CLOCKS_PER_SEC;
-        if (elapsed > timeout)
-            return LIBMK_STATE_JOIN_ERR;
     }
-    return s;
+    s = controller->state;
+    pthread_mutex_unlock(&(controller->state_lock));
+    return s == LIBMK_STATE_ACTIVE ? LIBMK_STATE_JOIN_ERR : s;
 }
 
 
@@ -176,6 +707,12 @@ void libmk_free_instruction(LibMK_Instruction* i) {
     fflush(stdout);
     if (i->colors != NULL)
         free(i->colors);
+    if (i->generator != NULL)
+        free(i->generator);
+    if (i->transition != NULL)
+        free(i->transition);
+    if (i->player != NULL)
+        free(i->player);
     free(i);
 }
 
@@ -184,10 +721,15 @@ LibMK_Instruction* libmk_create_instruction() {
     LibMK_Instruction* i =
         (LibMK_Instruction*) malloc(sizeof(LibMK_Instruction));
     i->duration = 0;
+    i->time.tv_sec = 0;
+    i->time.tv_nsec = 0;
     i->id = -1;
     i->type = -1;
     i->next = NULL;
     i->colors = NULL;
+    i->generator = NULL;
+    i->transition = NULL;
+    i->player = NULL;
     return i;
 }
 
@@ -224,6 +766,395 @@ LibMK_Instruction* libmk_create_instruction_all(
 }
 
 
+LibMK_Instruction* libmk_create_instruction_effect(
+        LibMK_Effect_Details* effect) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    i->effect = *effect;
+    i->type = LIBMK_INSTR_EFFECT;
+    return i;
+}
+
+
+/// Raised cosine from 0 to 128 over a quarter of a cycle of 1024, in
+/// steps of four
+static const unsigned char LIBMK_WAVE_TABLE[65] = {
+    0, 0, 0, 0, 1, 1, 1, 2, 2, 3, 4, 5, 6, 6, 7, 9, 10, 11, 12, 14, 15,
+    17, 18, 20, 22, 23, 25, 27, 29, 31, 33, 35, 37, 40, 42, 44, 47, 49,
+    52, 54, 57, 60, 62, 65, 68, 70, 73, 76, 79, 82, 85, 88, 91, 94, 97,
+    100, 103, 106, 109, 112, 115, 119, 122, 125, 128
+};
+
+
+/// Raised cosine of a phase in 1/1024 cycles, from 0 at phase 0 to 256
+/// at phase 512
+static unsigned int libmk_wave(unsigned int p) {
+    p &= 1023;
+    if (p > 512)
+        p = 1024 - p;
+    bool upper = (p > 256);
+    if (upper)
+        p = 512 - p;
+    unsigned int k = p >> 2, f = p & 3;
+    unsigned int w = LIBMK_WAVE_TABLE[k] * 4;
+    if (f != 0)
+        w = LIBMK_WAVE_TABLE[k] * (4 - f) + LIBMK_WAVE_TABLE[k + 1] * f;
+    w >>= 2;
+    return upper ? 256 - w : w;
+}
+
+
+/// Triangle of a phase in 1/1024 cycles, from 0 at phase 0 to 256 at
+/// phase 512
+static unsigned int libmk_triangle(unsigned int p) {
+    p &= 1023;
+    return (p > 512 ? 1024 - p : p) >> 1;
+}
+
+
+static unsigned int libmk_isqrt(unsigned int n) {
+    unsigned int r = 0, b = 1u << 30;
+    while (b > n)
+        b >>= 2;
+    while (b != 0) {
+        if (n >= r + b) {
+            n -= r + b;
+            r = (r >> 1) + b;
+        } else {
+            r >>= 1;
+        }
+        b >>= 2;
+    }
+    return r;
+}
+
+
+/// Blend a and b with a weight w of b between 0 and 256
+static void libmk_blend(
+        unsigned char dst[3], unsigned char a[3], unsigned char b[3],
+        unsigned int w) {
+    for (unsigned char j = 0; j < 3; j++)
+        dst[j] = (unsigned char) ((a[j] * (256 - w) + b[j] * w) >> 8);
+}
+
+
+void libmk_init_generator(
+        LibMK_Generator* g, LibMK_Generator_Type type,
+        unsigned char foreground[3], unsigned char background[3]) {
+    g->type = type;
+    memcpy(g->foreground, foreground, 3);
+    memcpy(g->background, background, 3);
+    g->period = 64;
+    g->size = 8;
+    g->row = 0;
+    g->column = 0;
+    g->frames = 0;
+    g->frame = 0;
+    memset(g->colors, 0x00, sizeof(g->colors));
+}
+
+
+void libmk_render_generator(LibMK_Generator* g) {
+    unsigned int period = g->period > 0 ? g->period : 1;
+    unsigned int size = g->size > 0 ? g->size : 1;
+    // Position in the cycle in 1/1024 cycles
+    unsigned int phase = (unsigned int) (
+        (unsigned long long) (g->frame % period) * 1024 / period);
+    unsigned int w = 0;
+    if (g->type == LIBMK_GEN_BREATHE)
+        w = libmk_wave(phase);
+    // Radius and width of the ring in 1/256 keys
+    unsigned int radius = (phase * LIBMK_MAX_COLS) >> 2;
+    unsigned int width = size << 8;
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++) {
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            if (g->type == LIBMK_GEN_GRADIENT) {
+                w = libmk_triangle((r + c) * 1024 / size + 1024 - phase);
+            } else if (g->type == LIBMK_GEN_WAVE) {
+                w = libmk_wave(c * 1024 / size + 1024 - phase);
+            } else if (g->type == LIBMK_GEN_RIPPLE) {
+                int dr = (int) r - g->row, dc = (int) c - g->column;
+                unsigned int d = libmk_isqrt(
+                    (unsigned int) (dr * dr + dc * dc) << 16);
+                unsigned int diff = d > radius ? d - radius : radius - d;
+                w = diff < width ? 256 - (diff << 8) / width : 0;
+                // The rings fade out as they expand
+                w = (w * (1024 - phase)) >> 10;
+            }
+            libmk_blend(g->colors[r][c], g->background, g->foreground, w);
+        }
+    }
+    g->frame++;
+}
+
+
+bool libmk_generator_done(LibMK_Generator* g) {
+    return g->frames != 0 && g->frame >= g->frames;
+}
+
+
+LibMK_Instruction* libmk_create_instruction_generator(LibMK_Generator* g) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    i->generator = (LibMK_Generator*) malloc(sizeof(LibMK_Generator));
+    if (i->generator == NULL) {
+        free(i);
+        return NULL;
+    }
+    *(i->generator) = *g;
+    i->type = LIBMK_INSTR_GENERATOR;
+    return i;
+}
+
+
+/// Apply an easing curve to a progress in 16.16 fixed-point
+static unsigned int libmk_ease(LibMK_Easing easing, unsigned int p) {
+    unsigned long long q = p, end = LIBMK_TRANSITION_END;
+    if (easing == LIBMK_EASE_IN)
+        return (unsigned int) ((q * q) >> 16);
+    if (easing == LIBMK_EASE_OUT)
+        return (unsigned int) (end - (((end - q) * (end - q)) >> 16));
+    if (easing == LIBMK_EASE_IN_OUT)
+        return (unsigned int) ((q * q * (3 * end - 2 * q)) >> 32);
+    return p;
+}
+
+
+void libmk_start_transition(
+        LibMK_Transition* t,
+        unsigned char from[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    memcpy(t->from, from, sizeof(t->from));
+    memcpy(t->colors, from, sizeof(t->colors));
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+    t->progress = 0;
+    t->started = true;
+}
+
+
+void libmk_render_transition(LibMK_Transition* t) {
+    if (!t->started) {
+        unsigned char black[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] = {{{0}}};
+        libmk_start_transition(t, black);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = libmk_diff_time(&now, &t->start);
+    unsigned int w = LIBMK_TRANSITION_END;
+    if (elapsed < (long) t->duration)
+        w = libmk_ease(t->easing, elapsed <= 0 ? 0 : (unsigned int) (
+            (unsigned long long) elapsed * LIBMK_TRANSITION_END / t->duration));
+    t->progress = w;
+    unsigned char* from = (unsigned char*) t->from;
+    unsigned char* target = (unsigned char*) t->target;
+    unsigned char* colors = (unsigned char*) t->colors;
+    for (unsigned int k = 0; k < LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3; k++)
+        colors[k] = (unsigned char) ((
+            from[k] * (LIBMK_TRANSITION_END - w) + target[k] * w +
+            LIBMK_TRANSITION_END / 2) >> 16);
+}
+
+
+bool libmk_transition_done(LibMK_Transition* t) {
+    return t->started && t->progress == LIBMK_TRANSITION_END;
+}
+
+
+LibMK_Instruction* libmk_create_instruction_transition(
+        unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3],
+        unsigned int duration, LibMK_Easing easing) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    i->transition = (LibMK_Transition*) malloc(sizeof(LibMK_Transition));
+    if (i->transition == NULL) {
+        free(i);
+        return NULL;
+    }
+    memcpy(i->transition->target, c, sizeof(i->transition->target));
+    i->transition->duration = duration;
+    i->transition->easing = easing;
+    i->transition->started = false;
+    i->transition->progress = 0;
+    i->type = LIBMK_INSTR_TRANSITION;
+    i->duration = LIBMK_TRANSITION_INTERVAL;
+    return i;
+}
+
+
+static size_t libmk_frame_size(
+        const LibMK_Animation* a, const LibMK_Animation_Frame* f) {
+    if (f->flags & LIBMK_FRAME_KEY)
+        return sizeof(LibMK_Animation_Frame) + a->keys * 3;
+    return sizeof(LibMK_Animation_Frame) + (size_t) f->count * 4;
+}
+
+
+/// Check the header, the index and the bounds of all the frames, so
+/// that the frames can be decoded without any checks but the keys
+static bool libmk_check_animation(const LibMK_Animation* a) {
+    const LibMK_Animation_Header* h = a->header;
+    if (memcmp(h->magic, LIBMK_ANIMATION_MAGIC, 4) != 0 ||
+            h->version != LIBMK_ANIMATION_VERSION ||
+            h->frames == 0 || h->keyframes == 0)
+        return false;
+    size_t end = sizeof(LibMK_Animation_Header) +
+                 (size_t) h->keyframes * sizeof(LibMK_Animation_Keyframe);
+    if (h->data % 4 != 0 || h->data < end || h->data > a->size)
+        return false;
+    size_t position = h->data;
+    uint32_t time = 0, k = 0;
+    for (uint32_t n = 0; n < h->frames; n++) {
+        if (a->size - position < sizeof(LibMK_Animation_Frame))
+            return false;
+        const LibMK_Animation_Frame* f =
+            (const LibMK_Animation_Frame*) (a->data + position);
+        size_t size = libmk_frame_size(a, f);
+        if (a->size - position < size || f->time < time ||
+                (n == 0 && !(f->flags & LIBMK_FRAME_KEY)))
+            return false;
+        if (k < h->keyframes && a->index[k].frame == n) {
+            if (a->index[k].offset != position ||
+                    a->index[k].time != f->time ||
+                    !(f->flags & LIBMK_FRAME_KEY))
+                return false;
+            k++;
+        }
+        time = f->time;
+        position += size;
+    }
+    return k == h->keyframes && a->index[0].frame == 0;
+}
+
+
+int libmk_open_animation(LibMK_Animation** animation, const char* path) {
+    *animation = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return LIBMK_ERR_ANIMATION;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+            st.st_size >= (off_t) sizeof(LibMK_Animation_Header))
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return LIBMK_ERR_ANIMATION;
+    LibMK_Animation* a = (LibMK_Animation*) malloc(sizeof(LibMK_Animation));
+    if (a == NULL) {
+        munmap(data, st.st_size);
+        return LIBMK_ERR_ANIMATION;
+    }
+    a->data = (const unsigned char*) data;
+    a->size = st.st_size;
+    a->header = (const LibMK_Animation_Header*) data;
+    a->index = (const LibMK_Animation_Keyframe*) (
+        a->data + sizeof(LibMK_Animation_Header));
+    if (a->header->flags & LIBMK_ANIMATION_OFFSETS)
+        a->keys = LIBMK_MAX_OFFSETS;
+    else
+        a->keys = LIBMK_MAX_ROWS * LIBMK_MAX_COLS;
+    if (!libmk_check_animation(a)) {
+        libmk_close_animation(a);
+        return LIBMK_ERR_ANIMATION;
+    }
+    *animation = a;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_close_animation(LibMK_Animation* animation) {
+    if (animation == NULL)
+        return;
+    munmap((void*) animation->data, animation->size);
+    free(animation);
+}
+
+
+void libmk_init_player(
+        LibMK_Player* p, const LibMK_Animation* animation, bool loop) {
+    p->animation = animation;
+    p->loop = loop;
+    p->frame = 0;
+    p->position = animation->header->data;
+    memset(p->colors, 0x00, sizeof(p->colors));
+}
+
+
+static const LibMK_Animation_Frame* libmk_apply_frame(LibMK_Player* p) {
+    const LibMK_Animation* a = p->animation;
+    const LibMK_Animation_Frame* f =
+        (const LibMK_Animation_Frame*) (a->data + p->position);
+    const unsigned char* src = (const unsigned char*) (f + 1);
+    if (f->flags & LIBMK_FRAME_KEY) {
+        memcpy(p->colors, src, a->keys * 3);
+    } else {
+        for (uint16_t k = 0; k < f->count; k++, src += 4)
+            if (src[0] < a->keys)
+                memcpy(p->colors + src[0] * 3, src + 1, 3);
+    }
+    p->position += libmk_frame_size(a, f);
+    p->frame++;
+    return f;
+}
+
+
+unsigned int libmk_play_frame(LibMK_Player* p) {
+    const LibMK_Animation_Header* h = p->animation->header;
+    if (p->frame >= h->frames) {
+        if (!p->loop)
+            return 0;
+        p->frame = 0;
+        p->position = h->data;
+    }
+    uint32_t time = libmk_apply_frame(p)->time;
+    if (p->frame < h->frames)
+        return ((const LibMK_Animation_Frame*) (
+            p->animation->data + p->position))->time - time;
+    return h->duration > time ? h->duration - time : 0;
+}
+
+
+bool libmk_player_done(LibMK_Player* p) {
+    return !p->loop && p->frame >= p->animation->header->frames;
+}
+
+
+void libmk_seek_player(LibMK_Player* p, unsigned int time) {
+    const LibMK_Animation* a = p->animation;
+    if (p->loop && a->header->duration != 0)
+        time %= a->header->duration;
+    unsigned int lo = 0, hi = a->header->keyframes, mid;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (a->index[mid].time <= time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    p->frame = a->index[lo].frame;
+    p->position = a->index[lo].offset;
+    // Apply the frames before the one shown at the time
+    const LibMK_Animation_Frame* f;
+    while (p->frame + 1 < a->header->frames) {
+        f = (const LibMK_Animation_Frame*) (a->data + p->position);
+        f = (const LibMK_Animation_Frame*) (
+            a->data + p->position + libmk_frame_size(a, f));
+        if (f->time > time)
+            break;
+        libmk_apply_frame(p);
+    }
+}
+
+
+LibMK_Instruction* libmk_create_instruction_animation(LibMK_Player* p) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    i->player = (LibMK_Player*) malloc(sizeof(LibMK_Player));
+    if (i->player == NULL) {
+        free(i);
+        return NULL;
+    }
+    *(i->player) = *p;
+    i->type = LIBMK_INSTR_ANIMATION;
+    return i;
+}
+
+
 LibMK_Instruction* libmk_create_instruction_flash(
         unsigned char c[3], unsigned int delay, unsigned char n) {
     unsigned char color[3] = {0};
@@ -252,57 +1183,623 @@ LibMK_Instruction* libmk_create_instruction_flash(
 }
 
 
+bool libmk_enqueue_instruction(LibMK_Queue* q, LibMK_Instruction* i) {
+    LibMK_Queue_Cell* cell;
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &q->cells[pos & (LIBMK_QUEUE_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(
+                    &q->tail, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false;  // Queue is full
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->instr = i;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+LibMK_Instruction* libmk_dequeue_instruction(LibMK_Queue* q) {
+    LibMK_Queue_Cell* cell;
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &q->cells[pos & (LIBMK_QUEUE_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(
+                    &q->head, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL;  // Queue is empty
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    LibMK_Instruction* i = cell->instr;
+    __atomic_store_n(&cell->seq, pos + LIBMK_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return i;
+}
+
+
+/// Handle an instruction that did not fit in the queue, returns false if
+/// it was not queued because the controller has exited
+static bool libmk_overflow_instruction(
+        LibMK_Controller* c, LibMK_Instruction* i) {
+    LibMK_Instruction* old;
+    bool queued;
+    switch (c->policy) {
+        case LIBMK_OVERFLOW_DROP_OLDEST:
+            while (!libmk_enqueue_instruction(&c->queue, i)) {
+                old = libmk_dequeue_instruction(&c->queue);
+                if (old != NULL)
+                    libmk_free_instruction(old);
+            }
+            break;
+        case LIBMK_OVERFLOW_COALESCE:
+            old = __atomic_exchange_n(&c->overflow, i, __ATOMIC_ACQ_REL);
+            if (old != NULL)
+                libmk_free_instruction(old);
+            break;
+        default:  // LIBMK_OVERFLOW_BLOCK
+            pthread_mutex_lock(&(c->exit_flag_lock));
+            __atomic_add_fetch(&c->blocked, 1, __ATOMIC_SEQ_CST);
+            // No room is made once the controller has exited
+            while (!(queued = libmk_enqueue_instruction(&c->queue, i)) &&
+                   !c->exit_flag)
+                pthread_cond_wait(&(c->space_cond), &(c->exit_flag_lock));
+            __atomic_sub_fetch(&c->blocked, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&(c->exit_flag_lock));
+            return queued;
+    }
+    return true;
+}
+
+
+/// Queue an instruction, returns false if it was not queued because the
+/// controller has exited
+static bool libmk_push_instruction(LibMK_Controller* c, LibMK_Instruction* i) {
+    // A pending overflow instruction is older than i, so it goes first
+    LibMK_Instruction* o = __atomic_exchange_n(
+        &c->overflow, NULL, __ATOMIC_ACQ_REL);
+    bool queued = true;
+    if (o != NULL && !libmk_enqueue_instruction(&c->queue, o)) {
+        libmk_free_instruction(o);  // Superseded by i
+        queued = libmk_overflow_instruction(c, i);
+    } else if (!libmk_enqueue_instruction(&c->queue, i))
+        queued = libmk_overflow_instruction(c, i);
+    libmk_wake_controller(c);
+    return queued;
+}
+
+
 int libmk_sched_instruction(
         LibMK_Controller* c, LibMK_Instruction* i) {
-    pthread_mutex_lock(&(c->instr_lock));
-    if (i->id != -1)
+    if (i->id != (unsigned int) -1)
         return LIBMK_ERR_INVALID_ARG; // Instruction already scheduled!
-    if (c->instr == NULL) {
-        c->instr = i;
-        c->instr->id = 1;
+    unsigned int n = 0;
+    for (LibMK_Instruction* k = i; k != NULL; k = k->next)
+        n++;
+    unsigned int id = __atomic_fetch_add(&c->next_id, n, __ATOMIC_RELAXED);
+    int first_id = (int) id;
+    LibMK_Instruction* next;
+    while (i != NULL) {
+        next = i->next;
+        i->next = NULL;
+        i->id = id++;
+        if (!libmk_push_instruction(c, i)) {
+            // The rest of the list would not be executed either
+            i->next = next;
+            while (i != NULL) {
+                next = i->next;
+                libmk_free_instruction(i);
+                i = next;
+            }
+            return LIBMK_ERR_STILL_ACTIVE;
+        }
+        i = next;
+    }
+    return first_id;
+}
+
+
+LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id) {
+    pthread_mutex_lock(&(c->cancel_lock));
+    if (c->cancel_count < LIBMK_CANCEL_MAX) {
+        c->cancel[c->cancel_count] = id;
+        __atomic_store_n(
+            &c->cancel_count, c->cancel_count + 1, __ATOMIC_RELEASE);
     } else {
-        LibMK_Instruction* t = c->instr;
-        while (t != NULL) {
-            if (t->next == NULL) {
-                t->next = i;
-                t->next->id = t->id + 1;
-                break;
+        // Forget the oldest cancellation, which most likely refers to an
+        // instruction that was already executed
+        memmove(c->cancel, c->cancel + 1,
+                (LIBMK_CANCEL_MAX - 1) * sizeof(unsigned int));
+        c->cancel[LIBMK_CANCEL_MAX - 1] = id;
+    }
+    pthread_mutex_unlock(&(c->cancel_lock));
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_set_overflow_policy(
+        LibMK_Controller* c, LibMK_Overflow_Policy policy) {
+    c->policy = policy;
+}
+
+
+void libmk_set_controller_coalesce(LibMK_Controller* c, bool coalesce) {
+    c->coalesce = coalesce;
+}
+
+
+void libmk_set_late_policy(
+        LibMK_Controller* c, LibMK_Late_Policy policy, unsigned int tolerance) {
+    c->late_tolerance = tolerance;
+    c->late_policy = policy;
+}
+
+
+void libmk_get_timing_stats(
+        LibMK_Controller* c, LibMK_Timing_Stats* stats, bool reset) {
+    pthread_mutex_lock(&(c->stats_lock));
+    *stats = c->stats;
+    stats->jitter_mean = c->stats.executed == 0 ? 0 :
+        (long) (c->jitter_sum / (long long) c->stats.executed);
+    if (reset) {
+        memset(&c->stats, 0x00, sizeof(LibMK_Timing_Stats));
+        c->jitter_sum = 0;
+    }
+    pthread_mutex_unlock(&(c->stats_lock));
+}
+
+
+LibMK_Instruction* libmk_copy_instruction(LibMK_Instruction* i) {
+    LibMK_Instruction* first = NULL;
+    LibMK_Instruction* last = NULL;
+    LibMK_Instruction* copy;
+    for (; i != NULL; i = i->next) {
+        copy = (LibMK_Instruction*) malloc(sizeof(LibMK_Instruction));
+        if (copy == NULL)
+            goto fail;
+        *copy = *i;
+        copy->next = NULL;
+        copy->colors = NULL;
+        copy->generator = NULL;
+        copy->transition = NULL;
+        copy->player = NULL;
+        if (i->colors != NULL) {
+            copy->colors = (unsigned char*) malloc(
+                sizeof(unsigned char) * LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3);
+            if (copy->colors == NULL) {
+                free(copy);
+                goto fail;
+            }
+            memcpy(copy->colors, i->colors,
+                   LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3);
+        }
+        if (i->generator != NULL) {
+            copy->generator = (LibMK_Generator*) malloc(
+                sizeof(LibMK_Generator));
+            if (copy->generator == NULL) {
+                libmk_free_instruction(copy);
+                goto fail;
+            }
+            *(copy->generator) = *(i->generator);
+        }
+        if (i->transition != NULL) {
+            copy->transition = (LibMK_Transition*) malloc(
+                sizeof(LibMK_Transition));
+            if (copy->transition == NULL) {
+                libmk_free_instruction(copy);
+                goto fail;
             }
-            t = t->next;
+            *(copy->transition) = *(i->transition);
         }
+        if (i->player != NULL) {
+            copy->player = (LibMK_Player*) malloc(sizeof(LibMK_Player));
+            if (copy->player == NULL) {
+                libmk_free_instruction(copy);
+                goto fail;
+            }
+            *(copy->player) = *(i->player);
+        }
+        if (last == NULL)
+            first = copy;
+        else
+            last->next = copy;
+        last = copy;
+    }
+    return first;
+fail:
+    while (first != NULL) {
+        copy = first->next;
+        libmk_free_instruction(first);
+        first = copy;
     }
-    if (i->next != NULL) {
-        LibMK_Instruction *k = i->next;
-        unsigned int id = i->id;
-        while (k != NULL) {
-            id += 1;
-            k->id = id;
-            k = k->next;
+    return NULL;
+}
+
+
+LibMK_Pool* libmk_create_pool(void) {
+    LibMK_Handle** handles = NULL;
+    int n = libmk_open_all_devices(&handles);
+    if (n < 0)
+        return NULL;
+    LibMK_Pool* p = (LibMK_Pool*) malloc(sizeof(LibMK_Pool));
+    if (p != NULL) {
+        p->controllers = (LibMK_Controller**) malloc(
+            sizeof(LibMK_Controller*) * (n > 0 ? n : 1));
+        p->errors = (unsigned long*) calloc(
+            n > 0 ? n : 1, sizeof(unsigned long));
+    }
+    if (p == NULL || p->controllers == NULL || p->errors == NULL) {
+        if (p != NULL) {
+            free(p->controllers);
+            free(p->errors);
+            free(p);
         }
+        free(handles);
+        return NULL;
     }
-    int first_id = i->id;
-    pthread_mutex_unlock(&(c->instr_lock));
-    return first_id;
+    p->n = 0;
+    for (int k = 0; k < n; k++) {
+        LibMK_Controller* c = libmk_create_controller(handles[k]);
+        if (c == NULL) {
+            libmk_close_handle(handles[k]);
+            libmk_free_handle(handles[k]);
+            continue;
+        }
+        p->controllers[p->n++] = c;
+    }
+    free(handles);
+    return p;
 }
 
 
-LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id) {
-    pthread_mutex_lock(&(c->instr_lock));
-    LibMK_Instruction* prev = NULL;
-    LibMK_Instruction* curr = c->instr;
-    while (curr != NULL) {
-        if (curr->id == id) {
-            // Cancel this instruction
-            if (prev != NULL)
-                prev->next = curr->next;
-            else  // First instruction in Linked List
-                c->instr = curr->next;
-            libmk_free_instruction(curr);
-            break;
+LibMK_Result libmk_free_pool(LibMK_Pool* p) {
+    for (unsigned int k = 0; k < p->n; k++)
+        if (libmk_get_controller_state(p->controllers[k]) ==
+                LIBMK_STATE_ACTIVE)
+            return LIBMK_ERR_STILL_ACTIVE;
+    LibMK_Result r = LIBMK_SUCCESS;
+    for (unsigned int k = 0; k < p->n; k++) {
+        // Controllers that never started still have an open handle
+        libmk_close_handle(p->controllers[k]->handle);
+        LibMK_Result e = libmk_free_controller(p->controllers[k]);
+        if (e != LIBMK_SUCCESS)
+            r = e;
+    }
+    free(p->controllers);
+    free(p->errors);
+    free(p);
+    return r;
+}
+
+
+LibMK_Result libmk_start_pool(LibMK_Pool* p) {
+    LibMK_Result r = LIBMK_ERR_DEV_NOT_CONNECTED;
+    bool started = false;
+    for (unsigned int k = 0; k < p->n; k++) {
+        r = libmk_start_controller(p->controllers[k]);
+        if (r == LIBMK_SUCCESS)
+            started = true;
+        else
+            p->errors[k]++;
+    }
+    return started ? LIBMK_SUCCESS : r;
+}
+
+
+static bool libmk_pool_active(LibMK_Pool* p, unsigned int k) {
+    return libmk_get_controller_state(p->controllers[k]) ==
+        LIBMK_STATE_ACTIVE &&
+        libmk_get_controller_error(p->controllers[k]) == LIBMK_SUCCESS;
+}
+
+
+int libmk_broadcast_instruction(LibMK_Pool* p, LibMK_Instruction* i) {
+    int n = 0;
+    unsigned int last = p->n;
+    for (unsigned int k = 0; k < p->n; k++) {
+        if (libmk_pool_active(p, k))
+            last = k;
+        else
+            p->errors[k]++;
+    }
+    LibMK_Instruction* copy;
+    for (unsigned int k = 0; k < last; k++) {
+        if (!libmk_pool_active(p, k))
+            continue;
+        copy = libmk_copy_instruction(i);
+        if (copy == NULL || libmk_sched_instruction(
+                p->controllers[k], copy) < 0) {
+            p->errors[k]++;
+            continue;
         }
-        prev = curr;
-        curr = curr->next;
+        n++;
     }
-    pthread_mutex_unlock(&(c->instr_lock));
-    return LIBMK_SUCCESS;
+    // The original instructions are scheduled on the last keyboard
+    int r = LIBMK_ERR_INVALID_ARG;
+    if (last < p->n)
+        r = libmk_sched_instruction(p->controllers[last], i);
+    if (r >= 0)
+        return n + 1;
+    if (last < p->n)
+        p->errors[last]++;
+    if (r == LIBMK_ERR_STILL_ACTIVE)
+        return n;  // Freed by the scheduler
+    while (i != NULL) {
+        copy = i->next;
+        libmk_free_instruction(i);
+        i = copy;
+    }
+    return n;
+}
+
+
+int libmk_broadcast_all_led_color(
+        LibMK_Pool* p, unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    LibMK_Instruction* i = libmk_create_instruction_all(c);
+    if (i == NULL)
+        return LIBMK_ERR_INVALID_ARG;
+    return libmk_broadcast_instruction(p, i);
+}
+
+
+unsigned long libmk_get_pool_errors(
+        LibMK_Pool* p, unsigned int k, LibMK_Result* error) {
+    if (k >= p->n)
+        return 0;
+    if (error != NULL)
+        *error = libmk_get_controller_error(p->controllers[k]);
+    return p->errors[k];
+}
+
+
+void libmk_stop_pool(LibMK_Pool* p) {
+    for (unsigned int k = 0; k < p->n; k++)
+        libmk_stop_controller(p->controllers[k]);
+}
+
+
+void libmk_wait_pool(LibMK_Pool* p) {
+    for (unsigned int k = 0; k < p->n; k++)
+        libmk_wait_controller(p->controllers[k]);
+}
+
+
+LibMK_Controller_State libmk_join_pool(LibMK_Pool* p, double timeout) {
+    LibMK_Controller_State r = LIBMK_STATE_STOPPED, s;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int k = 0; k < p->n; k++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double remaining =
+            timeout - (double) libmk_diff_time(&now, &start) / 1000000;
+        s = libmk_join_controller(p->controllers[k], remaining);
+        if (s == LIBMK_STATE_JOIN_ERR)
+            r = LIBMK_STATE_JOIN_ERR;
+        else if (libmk_get_controller_error(p->controllers[k]) !=
+                 LIBMK_SUCCESS && r != LIBMK_STATE_JOIN_ERR)
+            r = LIBMK_STATE_ERROR;
+    }
+    return r;
+}
+
+
+LibMK_Compositor* libmk_create_compositor(void) {
+    LibMK_Compositor* c = (LibMK_Compositor*) malloc(sizeof(LibMK_Compositor));
+    if (c == NULL)
+        return NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    c->n = 0;
+    c->next_id = 1;
+    c->modified = false;
+    c->initial = true;
+    memset(c->frame, 0x00, sizeof(c->frame));
+    memset(c->dirty, 0x00, sizeof(c->dirty));
+    return c;
+}
+
+
+void libmk_free_compositor(LibMK_Compositor* c) {
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+
+static void libmk_expire_layers(LibMK_Compositor* c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned int n = 0;
+    for (unsigned int k = 0; k < c->n; k++) {
+        LibMK_Layer* l = &c->layers[k];
+        bool expires = l->expiry.tv_sec != 0 || l->expiry.tv_nsec != 0;
+        if (expires && libmk_diff_time(&now, &l->expiry) >= 0) {
+            c->modified = true;
+            continue;
+        }
+        if (n != k)
+            c->layers[n] = *l;
+        n++;
+    }
+    c->n = n;
+}
+
+
+/// Index of a layer that has not expired, -1 if there is none
+static int libmk_find_layer(LibMK_Compositor* c, unsigned int id) {
+    libmk_expire_layers(c);
+    for (unsigned int k = 0; k < c->n; k++)
+        if (c->layers[k].id == id)
+            return (int) k;
+    return -1;
+}
+
+
+static void libmk_set_expiry(LibMK_Layer* l, unsigned int ttl) {
+    if (ttl == 0) {
+        l->expiry.tv_sec = 0;
+        l->expiry.tv_nsec = 0;
+    } else
+        libmk_get_deadline(&l->expiry, ttl);
+}
+
+
+int libmk_add_layer(LibMK_Compositor* c, int priority, unsigned int ttl) {
+    pthread_mutex_lock(&c->lock);
+    libmk_expire_layers(c);
+    if (c->n == LIBMK_MAX_LAYERS) {
+        pthread_mutex_unlock(&c->lock);
+        return LIBMK_ERR_INVALID_ARG;
+    }
+    unsigned int k = c->n;
+    while (k > 0 && c->layers[k - 1].priority > priority) {
+        c->layers[k] = c->layers[k - 1];
+        k--;
+    }
+    LibMK_Layer* l = &c->layers[k];
+    l->id = c->next_id++;
+    l->priority = priority;
+    libmk_set_expiry(l, ttl);
+    // A transparent layer does not change the frame
+    memset(l->colors, 0x00, sizeof(l->colors));
+    c->n++;
+    int id = (int) l->id;
+    pthread_mutex_unlock(&c->lock);
+    return id;
+}
+
+
+LibMK_Result libmk_remove_layer(LibMK_Compositor* c, unsigned int id) {
+    pthread_mutex_lock(&c->lock);
+    int k = libmk_find_layer(c, id);
+    if (k >= 0) {
+        for (unsigned int j = (unsigned int) k; j + 1 < c->n; j++)
+            c->layers[j] = c->layers[j + 1];
+        c->n--;
+        c->modified = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return k >= 0 ? LIBMK_SUCCESS : LIBMK_ERR_INVALID_ARG;
+}
+
+
+LibMK_Result libmk_set_layer(
+        LibMK_Compositor* c, unsigned int id,
+        unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]) {
+    pthread_mutex_lock(&c->lock);
+    int k = libmk_find_layer(c, id);
+    if (k >= 0) {
+        memcpy(c->layers[k].colors, colors, sizeof(c->layers[k].colors));
+        c->modified = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return k >= 0 ? LIBMK_SUCCESS : LIBMK_ERR_INVALID_ARG;
+}
+
+
+LibMK_Result libmk_fill_layer(
+        LibMK_Compositor* c, unsigned int id, unsigned char color[3],
+        unsigned char alpha) {
+    pthread_mutex_lock(&c->lock);
+    int k = libmk_find_layer(c, id);
+    if (k >= 0) {
+        for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+            for (unsigned char j = 0; j < LIBMK_MAX_COLS; j++) {
+                memcpy(c->layers[k].colors[r][j], color, 3);
+                c->layers[k].colors[r][j][3] = alpha;
+            }
+        c->modified = true;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return k >= 0 ? LIBMK_SUCCESS : LIBMK_ERR_INVALID_ARG;
+}
+
+
+LibMK_Result libmk_set_layer_ttl(
+        LibMK_Compositor* c, unsigned int id, unsigned int ttl) {
+    pthread_mutex_lock(&c->lock);
+    int k = libmk_find_layer(c, id);
+    if (k >= 0)
+        libmk_set_expiry(&c->layers[k], ttl);
+    pthread_mutex_unlock(&c->lock);
+    return k >= 0 ? LIBMK_SUCCESS : LIBMK_ERR_INVALID_ARG;
+}
+
+
+/** Blend n RGBA keys over n keys of four bytes
+ *
+ * The same operation is applied to every byte, with x / 255 calculated
+ * with shifts, so the loop is vectorized by the compiler. The fourth
+ * byte of the destination is not used.
+ */
+static void libmk_blend_layer(
+        unsigned char* restrict dst, const unsigned char* restrict src,
+        unsigned int n) {
+    for (unsigned int k = 0; k < n * 4; k += 4) {
+        unsigned int a = src[k + 3];
+        for (unsigned int j = 0; j < 4; j++) {
+            unsigned int x = src[k + j] * a + dst[k + j] * (255 - a) + 128;
+            dst[k + j] = (unsigned char) ((x + (x >> 8)) >> 8);
+        }
+    }
+}
+
+
+unsigned int libmk_composite(
+        LibMK_Compositor* c,
+        unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    unsigned char blended[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4];
+    unsigned int n = 0;
+    pthread_mutex_lock(&c->lock);
+    libmk_expire_layers(c);
+    if (c->modified || c->initial) {
+        memset(blended, 0x00, sizeof(blended));
+        for (unsigned int k = 0; k < c->n; k++)
+            libmk_blend_layer(
+                (unsigned char*) blended,
+                (const unsigned char*) c->layers[k].colors,
+                LIBMK_MAX_ROWS * LIBMK_MAX_COLS);
+        for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+            for (unsigned char k = 0; k < LIBMK_MAX_COLS; k++) {
+                c->dirty[r][k] = c->initial ||
+                    memcmp(c->frame[r][k], blended[r][k], 3) != 0;
+                memcpy(c->frame[r][k], blended[r][k], 3);
+                n += c->dirty[r][k];
+            }
+        c->modified = false;
+        c->initial = false;
+    } else
+        memset(c->dirty, 0x00, sizeof(c->dirty));
+    if (frame != NULL)
+        memcpy(frame, c->frame, sizeof(c->frame));
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
+
+
+int libmk_sched_composite(LibMK_Controller* ctl, LibMK_Compositor* c) {
+    unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    unsigned int n = libmk_composite(c, frame);
+    if (n == 0)
+        return 0;
+    LibMK_Instruction* i = libmk_create_instruction_all(frame);
+    int r = i == NULL ? LIBMK_ERR_INVALID_ARG : libmk_sched_instruction(ctl, i);
+    if (r >= 0)
+        return (int) n;
+    // The keys are sent again with the next frame
+    pthread_mutex_lock(&c->lock);
+    c->initial = true;
+    pthread_mutex_unlock(&c->lock);
+    return r;
 }
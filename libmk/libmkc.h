@@ -5,10 +5,36 @@
 */
 #include "libmk.h"
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
+/// @brief Number of instructions that fit in the queue of a controller.
+/// Must be a power of two.
+#define LIBMK_QUEUE_SIZE 4096
+/// @brief Maximum number of pending instruction cancellations
+#define LIBMK_CANCEL_MAX 64
+/// @brief Maximum number of layers of a compositor
+#define LIBMK_MAX_LAYERS 16
+/// @brief Default time between the frames of a transition in microseconds
+#define LIBMK_TRANSITION_INTERVAL 10000
+/// @brief Progress of a finished transition, in 16.16 fixed-point
+#define LIBMK_TRANSITION_END 65536
+/// @brief First bytes of an animation file
+#define LIBMK_ANIMATION_MAGIC "MKAN"
+/// @brief Version of the animation file format
+#define LIBMK_ANIMATION_VERSION 1
+/// @brief Animation flag: the colors are in the order of the key offsets
+/// of the device, as for libmk_set_all_led_color_offset, rather than
+/// in [row][column] order
+#define LIBMK_ANIMATION_OFFSETS 0x0001
+/// @brief Frame flag: the frame contains the colors of all keys rather
+/// than the keys changed since the previous frame
+#define LIBMK_FRAME_KEY 0x0001
+/// @brief Number of key events buffered for the key callback of a
+/// controller. Must be a power of two.
+#define LIBMK_KEY_EVENTS 64
 
 /// @brief Controller States
 typedef enum LibMK_Controller_State {
@@ -25,44 +51,318 @@ typedef enum LibMK_Instruction_Type {
     LIBMK_INSTR_FULL = 0, ///< Full keyboard color instruction
     LIBMK_INSTR_ALL = 1, ///< All LEDs individually instruction
     LIBMK_INSTR_SINGLE = 2, ///< Instruction for a single key
+    LIBMK_INSTR_EFFECT = 3, ///< Effect rendered by the firmware
+    LIBMK_INSTR_GENERATOR = 4, ///< Frames rendered by a LibMK_Generator
+    LIBMK_INSTR_TRANSITION = 5, ///< Frames rendered by a LibMK_Transition
+    LIBMK_INSTR_ANIMATION = 6, ///< Frames decoded by a LibMK_Player
 } LibMK_Instruction_Type;
 
+/// @brief Progression of the colors over time of a LibMK_Transition
+typedef enum LibMK_Easing {
+    LIBMK_EASE_LINEAR = 0, ///< Constant speed
+    LIBMK_EASE_IN = 1, ///< Starts slow, quadratic
+    LIBMK_EASE_OUT = 2, ///< Ends slow, quadratic
+    LIBMK_EASE_IN_OUT = 3, ///< Starts and ends slow, smoothstep
+} LibMK_Easing;
+
+/// @brief Animations rendered by a LibMK_Generator
+typedef enum LibMK_Generator_Type {
+    LIBMK_GEN_BREATHE = 0, ///< All keys fade between the two colors
+    LIBMK_GEN_GRADIENT = 1, ///< Diagonal gradient moving across the keys
+    LIBMK_GEN_WAVE = 2, ///< Waves of the foreground moving along the rows
+    LIBMK_GEN_RIPPLE = 3, ///< Rings of the foreground expanding from a key
+} LibMK_Generator_Type;
+
+/// @brief Behaviour of the scheduler when the instruction queue is full
+typedef enum LibMK_Overflow_Policy {
+    LIBMK_OVERFLOW_BLOCK = 0, ///< Wait until the controller made room
+    LIBMK_OVERFLOW_DROP_OLDEST = 1, ///< Drop the oldest instruction
+    LIBMK_OVERFLOW_COALESCE = 2, ///< Keep only the newest overflowing
+                                 ///< instruction until there is room
+} LibMK_Overflow_Policy;
+
+/// @brief Behaviour of the controller for instructions past their deadline
+typedef enum LibMK_Late_Policy {
+    LIBMK_LATE_EXECUTE = 0, ///< Execute late instructions anyway
+    LIBMK_LATE_SKIP = 1, ///< Skip instructions later than the tolerance
+} LibMK_Late_Policy;
+
+/// @brief Timing statistics of the instructions executed by a controller
+typedef struct LibMK_Timing_Stats {
+    unsigned long executed; ///< Number of instructions executed
+    unsigned long skipped; ///< Number of late instructions skipped
+    long jitter_last; ///< Lateness of the last instruction in microseconds
+    long jitter_max; ///< Largest lateness in microseconds
+    long jitter_mean; ///< Mean lateness in microseconds
+} LibMK_Timing_Stats;
+
+/** @brief Animation rendering its frames on demand
+ *
+ * Rather than building a list of instructions for every frame up front,
+ * a generator renders the next frame into its buffer only when it is
+ * executed, so animations of any length take a constant amount of
+ * memory. The colors are calculated with fixed-point arithmetic.
+ *
+ * The position of a frame in the animation is its index modulo period.
+ * The animation is drawn in the foreground color on the background
+ * color.
+ */
+typedef struct LibMK_Generator {
+    LibMK_Generator_Type type; ///< Animation to render
+    unsigned char foreground[3]; ///< Color of the animated parts
+    unsigned char background[3]; ///< Color of the other parts
+    unsigned int period; ///< Number of frames in a cycle of the animation
+    unsigned int size; ///< LIBMK_GEN_GRADIENT, LIBMK_GEN_WAVE: number of
+        ///< keys in a cycle along a row. LIBMK_GEN_RIPPLE: width of the
+        ///< rings in keys.
+    unsigned char row, column; ///< LIBMK_GEN_RIPPLE, origin of the rings
+    unsigned int frames; ///< Number of frames to render, zero for no limit
+    unsigned int frame; ///< Index of the next frame to render
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Last
+        ///< rendered frame
+} LibMK_Generator;
+
+/** @brief Interpolation of all keys from their colors to a target
+ *
+ * The transition starts from the colors last sent by the controller
+ * when it is first executed. The progress of a frame is determined by
+ * the time since the start, so frames that are late or skipped do not
+ * slow down the transition. The colors of the keys are interpolated in
+ * 16.16 fixed-point, so the target is reached exactly at the end of the
+ * duration, also for small differences.
+ */
+typedef struct LibMK_Transition {
+    unsigned char target[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Colors
+        ///< at the end of the transition
+    unsigned char from[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Colors at
+        ///< the start of the transition
+    unsigned int duration; ///< Duration in microseconds
+    LibMK_Easing easing; ///< Progression of the colors over time
+    bool started; ///< Whether from and start have been set
+    struct timespec start; ///< CLOCK_MONOTONIC time of the first frame
+    unsigned int progress; ///< Eased progress of the last rendered frame
+        ///< in 16.16 fixed-point, LIBMK_TRANSITION_END when finished
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Last
+        ///< rendered frame
+} LibMK_Transition;
+
+/** @brief Header at the start of an animation file
+ *
+ * An animation file consists of the header, the index of the key
+ * frames and the frames, all little-endian. Every frame starts with a
+ * LibMK_Animation_Frame. A key frame is followed by the colors of all
+ * keys, three bytes each. Other frames are followed by a red, green and
+ * blue byte preceded by the index of the key for every key that changed
+ * since the previous frame. The first frame is a key frame.
+ */
+typedef struct LibMK_Animation_Header {
+    char magic[4]; ///< LIBMK_ANIMATION_MAGIC, not terminated
+    uint16_t version; ///< LIBMK_ANIMATION_VERSION
+    uint16_t flags; ///< LIBMK_ANIMATION_OFFSETS or zero
+    uint32_t frames; ///< Number of frames
+    uint32_t keyframes; ///< Number of entries in the index of key frames
+    uint32_t duration; ///< Time in microseconds from the first frame
+        ///< until the animation repeats when looping
+    uint32_t data; ///< Byte offset of the first frame in the file
+} LibMK_Animation_Header;
+
+/// @brief Entry in the index of the key frames of an animation file
+typedef struct LibMK_Animation_Keyframe {
+    uint32_t time; ///< Time of the frame in microseconds
+    uint32_t frame; ///< Index of the frame
+    uint32_t offset; ///< Byte offset of the frame in the file
+} LibMK_Animation_Keyframe;
+
+/// @brief Start of a frame of an animation file
+typedef struct LibMK_Animation_Frame {
+    uint32_t time; ///< Time in microseconds since the first frame
+    uint16_t count; ///< Number of changed keys, unused for key frames
+    uint16_t flags; ///< LIBMK_FRAME_KEY or zero
+} LibMK_Animation_Frame;
+
+/** @brief Animation file mapped into memory
+ *
+ * The file is validated once when opened, so that the frames can be
+ * decoded straight from the mapping. The animation is not changed by
+ * playing it, so it may be shared by any number of players.
+ */
+typedef struct LibMK_Animation {
+    const unsigned char* data; ///< Mapping of the file
+    size_t size; ///< Size of the file in bytes
+    const LibMK_Animation_Header* header; ///< Header of the file
+    const LibMK_Animation_Keyframe* index; ///< Index of the key frames
+    unsigned int keys; ///< Number of colors in a key frame
+} LibMK_Animation;
+
+/// @brief Playback position in a LibMK_Animation
+typedef struct LibMK_Player {
+    const LibMK_Animation* animation; ///< Animation to play, not owned
+    bool loop; ///< Whether to start over after the last frame
+    unsigned int frame; ///< Index of the next frame to decode
+    size_t position; ///< Byte offset of the next frame in the file
+    unsigned char colors[LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3]; ///< Colors
+        ///< of the last decoded frame, in the order of the animation
+} LibMK_Player;
+
 /** @brief Single instruction that can be executed by a controller
  *
  * An instruction should not be executed multiple times. An instruction
- * is bound to a specific controller as its id attribute is bound to the
- * linked list of instructions of a controller.
+ * is bound to a specific controller as its id attribute is assigned by
+ * the scheduler of that controller. Instructions may be built in a
+ * linked list to schedule them at once.
  */
 typedef struct LibMK_Instruction {
     unsigned char r, c; ///< LIBMK_INSTR_SINGLE, row and column coords
     unsigned char* colors; ///< LIBMK_INSTR_ALL, key color matrix
     unsigned char color[3]; ///< LIBMK_INSTR_SINGLE, LIBMK_INSTR_FULL
+    LibMK_Effect_Details effect; ///< LIBMK_INSTR_EFFECT, effect to apply
+    LibMK_Generator* generator; ///< LIBMK_INSTR_GENERATOR, owned generator
+    LibMK_Transition* transition; ///< LIBMK_INSTR_TRANSITION, owned
+        ///< transition
+    LibMK_Player* player; ///< LIBMK_INSTR_ANIMATION, owned player
     unsigned int duration; ///< Delay after execution of instruction
+    struct timespec time; ///< Absolute CLOCK_MONOTONIC time at which to
+        ///< execute, or zero to execute after the previous instruction
     unsigned int id; ///< ID number set by the scheduler
     struct LibMK_Instruction* next; ///< Linked list attribute
     LibMK_Instruction_Type type; ///< For the instruction execution
 } LibMK_Instruction;
 
+/// @brief Single slot in the instruction queue of a controller
+typedef struct LibMK_Queue_Cell {
+    unsigned long seq; ///< Sequence number of the slot
+    LibMK_Instruction* instr; ///< Instruction in the slot
+} LibMK_Queue_Cell;
+
+/** @brief Bounded lock-free queue of instructions
+ *
+ * Multi-producer multi-consumer queue with a fixed number of slots
+ * using sequence numbers per slot. Enqueueing and dequeueing are O(1)
+ * and never block, so scheduling threads are never blocked by the
+ * thread of the controller while it executes an instruction.
+ */
+typedef struct LibMK_Queue {
+    LibMK_Queue_Cell cells[LIBMK_QUEUE_SIZE]; ///< Slots of the queue
+    unsigned long head; ///< Position to dequeue the next instruction
+    unsigned long tail; ///< Position to enqueue the next instruction
+} LibMK_Queue;
+
+struct LibMK_Controller;
+
+/** @brief Callback for the key events of the keyboard of a controller
+ *
+ * Called on the thread of the controller, between the execution of its
+ * instructions and while it waits for them, so the callback may
+ * schedule instructions in reaction to the keys, such as a
+ * LIBMK_GEN_RIPPLE generator from the position of the key, before the
+ * next frame is sent. Should not block, as it delays the frames.
+ */
+typedef void (*LibMK_Key_Callback)(
+    struct LibMK_Controller* c, const LibMK_Key_Event* event, void* data);
+
 /** @brief Controller for a keyboard managing a single handle
  *
  * Access to the various attributes of the Controller is
- * protected by mutexes and the attributes of the controller should
- * therefore not be accessed directly.
+ * protected by mutexes or atomic operations and the attributes of the
+ * controller should therefore not be accessed directly.
  */
 typedef struct LibMK_Controller {
     LibMK_Handle* handle; ///< Handle of the keyboard to control
-    LibMK_Instruction* instr; ///< Linked list of instructions
-    pthread_mutex_t instr_lock; ///< Protects LibMK_Instruction* instr
+    LibMK_Queue queue; ///< Queue of scheduled instructions
+    LibMK_Instruction* overflow; ///< Newest instruction that did not fit
+                                 ///< in the queue for LIBMK_OVERFLOW_COALESCE
+    LibMK_Instruction* pending; ///< Instruction taken from the queue while
+        ///< merging, but due at a later time
+    LibMK_Overflow_Policy policy; ///< Behaviour upon a full queue
+    bool coalesce; ///< Whether pending instructions are merged
+    LibMK_Instruction* current; ///< Generator or transition instruction
+        ///< of which frames remain to be rendered
+    unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Colors
+        ///< last sent to the keyboard, target state when merging
+        ///< instructions
+    unsigned int next_id; ///< ID number of the next scheduled instruction
+    pthread_mutex_t cancel_lock; ///< Protects the cancellation attributes
+    unsigned int cancel[LIBMK_CANCEL_MAX]; ///< IDs of cancelled instructions
+    unsigned char cancel_count; ///< Number of IDs in cancel
     pthread_t thread; ///< Thread for libmk_run_controller
     pthread_mutex_t exit_flag_lock; ///< Protects bool exit_flag and wait_flag
+        ///< and is used with the condition variables of the controller
     bool exit_flag; ///< Exit event: Thread exits immediately
     bool wait_flag; ///< Wait event: Thread exits when all instructions are done
+    pthread_cond_t work_cond; ///< Signalled for new work and for exit events
+    pthread_cond_t space_cond; ///< Signalled when the queue has room again
+    unsigned int sleeping; ///< Whether the thread waits for work_cond
+    unsigned int blocked; ///< Number of threads waiting for space_cond
     pthread_mutex_t state_lock; ///< Protects LibMK_Controller_State state
+    pthread_cond_t state_cond; ///< Signalled when the state changes
     LibMK_Controller_State state; ///< Stores current state of controller
     pthread_mutex_t error_lock; ///< Protects LibMK_Result error
     LibMK_Result error; ///< Set for LIBMK_STATE_ERROR
+    LibMK_Late_Policy late_policy; ///< Behaviour for late instructions
+    unsigned int late_tolerance; ///< Lateness in microseconds allowed
+    pthread_mutex_t stats_lock; ///< Protects the timing statistics
+    LibMK_Timing_Stats stats; ///< Timing statistics
+    long long jitter_sum; ///< Sum of lateness in microseconds
+    LibMK_Key_Callback key_callback; ///< Called for the key events, may
+        ///< be NULL
+    void* key_data; ///< Passed to the key callback
+    pthread_t input_thread; ///< Thread reading the key events
+    int input_wake; ///< eventfd to stop the input thread, -1 if the
+        ///< thread is not running
+    LibMK_Key_Event key_events[LIBMK_KEY_EVENTS]; ///< Ring of the key
+        ///< events read by the input thread, by position modulo
+        ///< LIBMK_KEY_EVENTS
+    unsigned int key_head; ///< Number of key events read
+    unsigned int key_tail; ///< Number of key events passed to the callback
 } LibMK_Controller;
 
+/** @brief Pool of controllers for all connected keyboards
+ *
+ * Each keyboard is controlled by its own LibMK_Controller and thus its
+ * own thread, so an instruction broadcast to the pool is executed on
+ * all keyboards in parallel.
+ */
+typedef struct LibMK_Pool {
+    LibMK_Controller** controllers; ///< Controllers of the keyboards
+    unsigned long* errors; ///< Number of failed broadcasts per keyboard
+    unsigned int n; ///< Number of keyboards in the pool
+} LibMK_Pool;
+
+/// @brief Layer of RGBA colors combined by a LibMK_Compositor
+typedef struct LibMK_Layer {
+    unsigned int id; ///< ID number assigned by the compositor
+    int priority; ///< Layers of a higher priority cover lower layers
+    struct timespec expiry; ///< CLOCK_MONOTONIC time at which the layer
+        ///< is removed, or zero if the layer does not expire
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]; ///< RGBA
+        ///< colors of the keys. An alpha of 0 leaves the layers below
+        ///< visible, 255 covers them.
+} LibMK_Layer;
+
+/** @brief Blends ordered layers into the frames of a keyboard
+ *
+ * Every source of colors draws into a layer of its own rather than
+ * sharing the whole keyboard, and the layers are blended from the
+ * lowest priority up over black. Keys are marked dirty only if their
+ * blended color changed, so a frame of which only a few keys changed
+ * results in only the packets of these keys being sent. Access is
+ * protected by a mutex, so the layers may be drawn by different
+ * threads.
+ */
+typedef struct LibMK_Compositor {
+    pthread_mutex_t lock; ///< Protects all the other attributes
+    LibMK_Layer layers[LIBMK_MAX_LAYERS]; ///< Layers by priority, layers
+        ///< of equal priority by the order they were added in
+    unsigned int n; ///< Number of layers
+    unsigned int next_id; ///< ID number of the next layer
+    bool modified; ///< Whether the layers changed since the last frame
+    bool initial; ///< Whether no frame has been composited yet
+    unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Last
+        ///< composited frame
+    bool dirty[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]; ///< Keys of which the
+        ///< color changed in the last composited frame
+} LibMK_Compositor;
+
 /** @brief Create a new LibMK_Controller for a defined handle
  *
  * After initialization of the Controller, the Handle may no longer be
@@ -79,19 +379,38 @@ LibMK_Controller* libmk_create_controller(LibMK_Handle* handle);
  */
 LibMK_Result libmk_free_controller(LibMK_Controller* c);
 
+/** @brief Retrieve the current state of a controller */
+LibMK_Controller_State libmk_get_controller_state(LibMK_Controller* c);
+
+/** @brief Retrieve the error that stopped a controller
+ *
+ * @returns LIBMK_SUCCESS if no error occurred, LibMK_Result error code
+ *    of the first error otherwise.
+ */
+LibMK_Result libmk_get_controller_error(LibMK_Controller* c);
+
 /** @brief Schedule a linked-list of instructions
  *
  * Instruction scheduler than schedules the given linked-list of
- * instructions at the end of the list of the controller in the given
+ * instructions at the end of the queue of the controller in the given
  * order. After scheduling, all instructions are given an ID number
  * and they may not be scheduled again. After execution, the
  * instructions are freed and thus after scheduling an instruction may
  * not be accessed again.
  *
  * Returns the instruction ID of the first instruction in the linked
- * list (it is the user's responsibility to derive the ID number of the
- * other instructions) upon success (postive integer) or a LibMK_Result
- * (negative integer) upon failure.
+ * list (the other instructions have the consecutive ID numbers) upon
+ * success (postive integer) or a LibMK_Result (negative integer) upon
+ * failure.
+ *
+ * Safe to call from multiple threads at the same time. If the queue is
+ * full, the overflow policy of the controller determines the behaviour.
+ * With LIBMK_OVERFLOW_BLOCK, the call blocks until the controller has
+ * made room, so the controller must have been started. If the
+ * controller exits while the call blocks, LIBMK_ERR_STILL_ACTIVE is
+ * returned. The instruction that did not fit and the instructions
+ * after it in the list are then freed, while the instructions queued
+ * before it are freed along with the controller.
  */
 int libmk_sched_instruction(
     LibMK_Controller* controller, LibMK_Instruction* instruction);
@@ -101,10 +420,97 @@ int libmk_sched_instruction(
  * If the instruction has already been executed, the instruction is not
  * cancelled and the function fails quietly. Does not cancel any
  * successive instructions even if the instruction was scheduled as
- * part of a linked-list.
+ * part of a linked-list. The instruction is freed when the controller
+ * reaches it. At most LIBMK_CANCEL_MAX cancellations are remembered.
  */
 LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id);
 
+/** @brief Set the behaviour of the scheduler upon a full queue
+ *
+ * The default policy is LIBMK_OVERFLOW_BLOCK. With
+ * LIBMK_OVERFLOW_DROP_OLDEST the oldest scheduled instruction is freed
+ * without being executed to make room. With LIBMK_OVERFLOW_COALESCE
+ * only the newest instruction that did not fit is kept aside, and it is
+ * executed once the queue has been emptied.
+ */
+void libmk_set_overflow_policy(
+    LibMK_Controller* c, LibMK_Overflow_Policy policy);
+
+/** @brief Enable or disable the merging of pending instructions
+ *
+ * In coalescing mode, the controller takes all the instructions that
+ * are pending when it is ready for the next instruction and merges them
+ * into a single target state, so only the newest state is sent to the
+ * keyboard. LIBMK_INSTR_SINGLE instructions update a key of this state
+ * rather than being sent individually. Keys that have not been set by
+ * any instruction are off. A LIBMK_INSTR_EFFECT instruction turns off
+ * all keys of the target state, and is applied instead of the state if
+ * it is the newest instruction. A LIBMK_INSTR_GENERATOR instruction
+ * renders its next frame into the target state, and is interrupted by
+ * any newer instruction. A LIBMK_INSTR_TRANSITION instruction is
+ * interrupted likewise, so a newer transition continues from the colors
+ * reached. The duration of the newest instruction is used. Merging
+ * stops at an instruction with a time that has not come yet, which is
+ * executed at that time instead. Intended for producers that schedule
+ * frames faster than the keyboard can display them, for which the
+ * latency would otherwise increase as the queue fills up.
+ */
+void libmk_set_controller_coalesce(LibMK_Controller* c, bool coalesce);
+
+/** @brief Set the behaviour for instructions past their deadline
+ *
+ * The deadline of an instruction is either its absolute time, or the
+ * deadline of the previous instruction plus its duration. Deadlines are
+ * chained, so the time taken by the execution of an instruction does
+ * not delay the instructions that follow. An instruction that is later
+ * than the tolerance is skipped for LIBMK_LATE_SKIP, which allows an
+ * animation to catch up with its timeline.
+ *
+ * @param policy: Behaviour for late instructions
+ * @param tolerance: Lateness in microseconds before an instruction is
+ *    considered late
+ */
+void libmk_set_late_policy(
+    LibMK_Controller* c, LibMK_Late_Policy policy, unsigned int tolerance);
+
+/** @brief Pass the key events of the keyboard to a callback
+ *
+ * @param callback: Called for every key press and release, NULL to
+ *    ignore the keys
+ * @param data: Passed to the callback
+ * @returns LibMK_Result result code, LIBMK_ERR_STILL_ACTIVE if the
+ *    controller was started already, or the result of libmk_open_input
+ *
+ * Opens the key events of the handle with libmk_open_input, unless they
+ * were opened already. The events are read by a thread started along
+ * with the controller, which wakes up the thread of the controller to
+ * call the callback. Events are dropped while LIBMK_KEY_EVENTS events
+ * are waiting for the callback. A failure to read the events stops the
+ * controller with the error.
+ */
+LibMK_Result libmk_set_key_callback(
+    LibMK_Controller* c, LibMK_Key_Callback callback, void* data);
+
+/** @brief Retrieve the timing statistics of a controller
+ *
+ * Lateness is measured from the deadline of an instruction up to the
+ * moment the controller starts its execution.
+ *
+ * @param stats: Struct to copy the statistics into
+ * @param reset: Whether to reset the statistics afterwards
+ */
+void libmk_get_timing_stats(
+    LibMK_Controller* c, LibMK_Timing_Stats* stats, bool reset);
+
+/** @brief Internal Function. Enqueue a single instruction, non-blocking */
+bool libmk_enqueue_instruction(LibMK_Queue* q, LibMK_Instruction* i);
+
+/** @brief Internal Function. Dequeue a single instruction, non-blocking
+ *
+ * @returns NULL if the queue is empty
+ */
+LibMK_Instruction* libmk_dequeue_instruction(LibMK_Queue* q);
+
 /** @brief Start a new Controller thread
  *
  * Start the execution of instructions upon the keyboard in a different
@@ -127,8 +533,9 @@ void libmk_stop_controller(LibMK_Controller* controller);
 /** @brief Indicate the controller to finish only pending instructions
  *
  * If instructions are scheduled in the mean-time, they are added to the
- * linked list and still executed by the Controller before exiting. Only
- * after the linked list has become empty does the Controller exit.
+ * queue of the Controller, subject to its overflow policy, and still
+ * executed before exiting. Only after the queue has become empty does
+ * the Controller exit.
  *
  * This function sets the wait_flag, and thus the Controller has not
  * necessarily stopped after this function ends. To assure that the
@@ -138,7 +545,9 @@ void libmk_wait_controller(LibMK_Controller* controller);
 
 /** @brief Join the Controller thread
  *
- * @param t: Timeout in seconds
+ * Blocks until the controller has stopped or the timeout expires.
+ *
+ * @param t: Timeout in seconds, measured by a monotonic clock
  * @returns LIBMK_STATE_JOIN_ERR upon timeout, controller state after
  *    exiting upon success.
  */
@@ -147,6 +556,160 @@ LibMK_Controller_State libmk_join_controller(LibMK_Controller* c, double t);
 /** @brief Internal Function. */
 void libmk_set_controller_error(LibMK_Controller* c, LibMK_Result r);
 
+/** @brief Copy a linked list of instructions that is not scheduled
+ *
+ * @returns Pointer to the first instruction of the copy, NULL if
+ *    memory could not be allocated.
+ */
+LibMK_Instruction* libmk_copy_instruction(LibMK_Instruction* i);
+
+/** @brief Create a pool of controllers for all connected keyboards
+ *
+ * Opens all supported devices with libmk_open_all_devices and creates a
+ * controller for each of them.
+ *
+ * @returns Pointer to the pool, NULL upon failure. The pool may contain
+ *    no keyboards if none are connected.
+ */
+LibMK_Pool* libmk_create_pool(void);
+
+/** @brief Free a pool and all its controllers
+ *
+ * @returns LIBMK_ERR_STILL_ACTIVE if any of the controllers is still
+ *    active, in which case the pool is not freed.
+ */
+LibMK_Result libmk_free_pool(LibMK_Pool* p);
+
+/** @brief Start the controllers of all keyboards in the pool
+ *
+ * Keyboards for which the controller fails to start have their error
+ * count increased and are skipped by broadcasts.
+ *
+ * @returns LIBMK_SUCCESS if at least one controller was started, or the
+ *    LibMK_Result error code of the last keyboard otherwise.
+ */
+LibMK_Result libmk_start_pool(LibMK_Pool* p);
+
+/** @brief Schedule a linked list of instructions on all keyboards
+ *
+ * The pool takes ownership of the instructions, which are copied for
+ * all but one keyboard. Keyboards of which the controller is not active
+ * have their error count increased instead.
+ *
+ * @returns The number of keyboards the instructions were scheduled on,
+ *    or a LibMK_Result error code.
+ */
+int libmk_broadcast_instruction(LibMK_Pool* p, LibMK_Instruction* i);
+
+/** @brief Broadcast a color matrix to all keyboards in the pool */
+int libmk_broadcast_all_led_color(
+    LibMK_Pool* p, unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]);
+
+/** @brief Retrieve the number of failed broadcasts for a keyboard
+ *
+ * @param k: Index of the keyboard in the pool
+ * @param error: Pointer to store the error that stopped the controller
+ *    of the keyboard in, may be NULL
+ */
+unsigned long libmk_get_pool_errors(
+    LibMK_Pool* p, unsigned int k, LibMK_Result* error);
+
+/** @brief Stop the controllers of all keyboards in the pool */
+void libmk_stop_pool(LibMK_Pool* p);
+
+/** @brief Let the controllers of all keyboards finish their instructions */
+void libmk_wait_pool(LibMK_Pool* p);
+
+/** @brief Join the controllers of all keyboards in the pool
+ *
+ * @param t: Timeout in seconds for the whole pool
+ * @returns LIBMK_STATE_JOIN_ERR if any of the controllers could not be
+ *    joined, LIBMK_STATE_ERROR if any of the controllers was stopped by
+ *    an error, LIBMK_STATE_STOPPED otherwise.
+ */
+LibMK_Controller_State libmk_join_pool(LibMK_Pool* p, double t);
+
+/** @brief Create a compositor without any layers
+ *
+ * @returns Pointer to the compositor, NULL if memory could not be
+ *    allocated.
+ */
+LibMK_Compositor* libmk_create_compositor(void);
+
+/** @brief Free a compositor and all its layers */
+void libmk_free_compositor(LibMK_Compositor* c);
+
+/** @brief Add a transparent layer to a compositor
+ *
+ * @param priority: Order of the layer. Layers of equal priority are
+ *    ordered by the order they were added in.
+ * @param ttl: Time in microseconds after which the layer is removed,
+ *    zero for a layer that does not expire.
+ * @returns ID number of the layer (positive integer) upon success,
+ *    LIBMK_ERR_INVALID_ARG if the compositor has LIBMK_MAX_LAYERS layers
+ *    already.
+ */
+int libmk_add_layer(LibMK_Compositor* c, int priority, unsigned int ttl);
+
+/** @brief Remove a layer from a compositor
+ *
+ * @returns LIBMK_ERR_INVALID_ARG if the layer does not exist or has
+ *    expired, LIBMK_SUCCESS otherwise.
+ */
+LibMK_Result libmk_remove_layer(LibMK_Compositor* c, unsigned int id);
+
+/** @brief Set the colors of all keys of a layer
+ *
+ * @param colors: RGBA color matrix that is copied to the layer
+ * @returns LIBMK_ERR_INVALID_ARG if the layer does not exist or has
+ *    expired, LIBMK_SUCCESS otherwise.
+ */
+LibMK_Result libmk_set_layer(
+    LibMK_Compositor* c, unsigned int id,
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]);
+
+/** @brief Set all keys of a layer to the same color
+ *
+ * @param color: RGB triplet of the keys
+ * @param alpha: Opacity of the keys, 255 to cover the layers below
+ */
+LibMK_Result libmk_fill_layer(
+    LibMK_Compositor* c, unsigned int id, unsigned char color[3],
+    unsigned char alpha);
+
+/** @brief Restart the time to live of a layer
+ *
+ * @param ttl: Time in microseconds from now after which the layer is
+ *    removed, zero for a layer that does not expire.
+ */
+LibMK_Result libmk_set_layer_ttl(
+    LibMK_Compositor* c, unsigned int id, unsigned int ttl);
+
+/** @brief Blend the layers of a compositor into a frame
+ *
+ * Expired layers are removed first. The dirty attribute of the
+ * compositor is updated by comparing with the previous frame. If no
+ * layer changed since the previous frame, the layers are not blended
+ * again. All keys are dirty for the first frame.
+ *
+ * @param frame: RGB color matrix to copy the frame into, may be NULL
+ * @returns Number of dirty keys
+ */
+unsigned int libmk_composite(
+    LibMK_Compositor* c, unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]);
+
+/** @brief Composite a frame and schedule it on a controller if changed
+ *
+ * As the packets that did not change are not sent by the controller,
+ * the traffic scales with the number of dirty keys. Intended to be
+ * called whenever a layer has been drawn, with a controller in
+ * coalescing mode.
+ *
+ * @returns Number of dirty keys, zero if nothing was scheduled, or a
+ *    LibMK_Result error code upon failure to schedule.
+ */
+int libmk_sched_composite(LibMK_Controller* ctl, LibMK_Compositor* c);
+
 /** @brief Allocate a new LibMK_Instruction struct */
 LibMK_Instruction* libmk_create_instruction();
 
@@ -184,6 +747,152 @@ LibMK_Instruction* libmk_create_instruction_flash(
     unsigned char c[3], unsigned int delay, unsigned char n);
 
 
+/** @brief Create a new instruction to apply an effect of the firmware
+ *
+ * Executed with libmk_update_effect, so only the packets for the
+ * parameters that differ from the current effect are sent. Scheduling
+ * effect instructions rather than frames leaves the animation to the
+ * keyboard, so no frames have to be rendered by the host.
+ *
+ * @param effect: Effect with all parameters set, copied to the
+ *    instruction.
+ *
+ * @returns Single LibMK_Instruction, duration may be set by the user.
+ */
+LibMK_Instruction* libmk_create_instruction_effect(
+    LibMK_Effect_Details* effect);
+
+/** @brief Initialize a generator with default parameters
+ *
+ * The generator cycles every 64 frames without a limit on the number of
+ * frames, with a size of eight keys and rings from the top-left key.
+ */
+void libmk_init_generator(
+    LibMK_Generator* g, LibMK_Generator_Type type,
+    unsigned char foreground[3], unsigned char background[3]);
+
+/** @brief Render the next frame of a generator into its colors */
+void libmk_render_generator(LibMK_Generator* g);
+
+/** @brief Whether all the frames of a generator have been rendered */
+bool libmk_generator_done(LibMK_Generator* g);
+
+/** @brief Create a new instruction rendering the frames of a generator
+ *
+ * Upon every execution, the next frame of the generator is rendered
+ * and sent with libmk_set_all_led_color. A controller executes the
+ * instruction again after its duration until all frames have been
+ * rendered, before any later instruction. A generator without a limit
+ * on the number of frames is executed until another instruction is
+ * scheduled, the instruction is cancelled or the controller is waited
+ * for.
+ *
+ * @param g: Generator to render, copied to the instruction.
+ *
+ * @returns Single LibMK_Instruction, NULL upon failure. The duration
+ *    is the time between the frames and may be set by the user.
+ */
+LibMK_Instruction* libmk_create_instruction_generator(LibMK_Generator* g);
+
+/** @brief Start a transition from the given colors
+ *
+ * Called by the controller when a transition is first executed, may be
+ * called by the user to render a transition without a controller.
+ *
+ * @param from: RGB color matrix of the start of the transition
+ */
+void libmk_start_transition(
+    LibMK_Transition* t, unsigned char from[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]);
+
+/** @brief Render the frame of a transition for the current time
+ *
+ * Starts the transition from black if it has not been started.
+ */
+void libmk_render_transition(LibMK_Transition* t);
+
+/** @brief Whether the target of a transition has been rendered */
+bool libmk_transition_done(LibMK_Transition* t);
+
+/** @brief Create a new instruction for a transition to a color matrix
+ *
+ * Upon every execution, the frame for the current time is rendered
+ * and sent with libmk_set_all_led_color, so only the packets of the
+ * keys of which the color changed are sent. A controller executes the
+ * instruction again after its duration until the target is reached,
+ * before any later instruction, and then waits for the next
+ * instruction without sending any more frames.
+ *
+ * @param c: RGB color matrix of the target, copied to the instruction.
+ * @param duration: Duration of the transition in microseconds
+ * @param easing: Progression of the colors over time
+ *
+ * @returns Single LibMK_Instruction, NULL upon failure. The duration
+ *    of the instruction is the time between the frames, by default
+ *    LIBMK_TRANSITION_INTERVAL, and may be set by the user.
+ */
+LibMK_Instruction* libmk_create_instruction_transition(
+    unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3], unsigned int duration,
+    LibMK_Easing easing);
+
+/** @brief Map an animation file into memory
+ *
+ * @param animation: Pointer to store the allocated animation in
+ * @param path: Path of the file
+ * @returns LibMK_Result result code, LIBMK_ERR_ANIMATION if the file
+ *    could not be read or is not a valid animation
+ */
+int libmk_open_animation(LibMK_Animation** animation, const char* path);
+
+/** @brief Unmap and free an animation, once its players are done */
+void libmk_close_animation(LibMK_Animation* animation);
+
+/** @brief Initialize a player at the start of an animation
+ *
+ * @param loop: Whether to start over after the last frame
+ */
+void libmk_init_player(
+    LibMK_Player* p, const LibMK_Animation* animation, bool loop);
+
+/** @brief Decode the next frame of an animation into the colors
+ *
+ * @returns Time in microseconds until the frame that follows
+ *
+ * Only the changes of the frame are applied to the colors, so decoding
+ * takes no allocations or copies of full frames.
+ */
+unsigned int libmk_play_frame(LibMK_Player* p);
+
+/** @brief Whether all the frames of an animation played without looping */
+bool libmk_player_done(LibMK_Player* p);
+
+/** @brief Move the playback position of a player to a time
+ *
+ * @param time: Time in microseconds since the first frame. Taken
+ *    modulo the duration of the animation if the player loops.
+ *
+ * Decodes from the last key frame before the time, so that the next
+ * frame decoded is the frame shown at that time.
+ */
+void libmk_seek_player(LibMK_Player* p, unsigned int time);
+
+/** @brief Create a new instruction playing an animation
+ *
+ * Upon every execution, the next frame is decoded and sent with
+ * libmk_set_all_led_color, or libmk_set_all_led_color_offset for
+ * animations in the order of the key offsets. The duration of the
+ * instruction is set to the time until the frame that follows. A
+ * controller executes the instruction again until the last frame,
+ * before any later instruction. A looping animation is played until
+ * another instruction is scheduled, like a generator without a limit
+ * on the number of frames.
+ *
+ * @param p: Player to start from, copied to the instruction. The
+ *    animation must remain open until the instruction is freed.
+ *
+ * @returns Single LibMK_Instruction, NULL upon failure.
+ */
+LibMK_Instruction* libmk_create_instruction_animation(LibMK_Player* p);
+
 /** @brief Create a new instruction to set the color of a single key
  *
  * Overridden by a LIBMK_INSTR_FULL, just as in synchronous keyboard
@@ -0,0 +1,171 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "libmkd.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/// Number of attempts to read a slot the client keeps overwriting
+#define LIBMK_READ_ATTEMPTS 8
+
+
+const char* libmk_get_daemon_socket(void) {
+    const char* path = getenv(LIBMK_DAEMON_SOCKET_ENV);
+    if (path == NULL || path[0] == '\0')
+        return LIBMK_DAEMON_SOCKET;
+    return path;
+}
+
+
+static int libmk_recv_welcome(
+        int sock, LibMK_Daemon_Welcome* welcome, int fds[2]) {
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {welcome, sizeof(LibMK_Daemon_Welcome)};
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(LibMK_Daemon_Welcome))
+        return LIBMK_ERR_DAEMON;
+    if (welcome->result != LIBMK_SUCCESS)
+        return welcome->result;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2))
+        return LIBMK_ERR_DAEMON;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_connect_daemon(LibMK_Client** client, const char* path, int priority) {
+    if (path == NULL)
+        path = libmk_get_daemon_socket();
+    struct sockaddr_un addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return LIBMK_ERR_INVALID_ARG;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return LIBMK_ERR_DAEMON;
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        return LIBMK_ERR_DAEMON;
+    }
+    LibMK_Daemon_Hello hello = {LIBMK_DAEMON_VERSION, priority};
+    LibMK_Daemon_Welcome welcome;
+    int fds[2];
+    int r = LIBMK_ERR_DAEMON;
+    if (send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello))
+        r = libmk_recv_welcome(sock, &welcome, fds);
+    if (r != LIBMK_SUCCESS) {
+        close(sock);
+        return r;
+    }
+
+    // The eventfd is only used to notify the daemon
+    void* ring = mmap(NULL, sizeof(LibMK_Layer_Ring), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    *client = (LibMK_Client*) malloc(sizeof(LibMK_Client));
+    if (ring == MAP_FAILED || *client == NULL ||
+            ((LibMK_Layer_Ring*) ring)->version != LIBMK_DAEMON_VERSION) {
+        if (ring != MAP_FAILED)
+            munmap(ring, sizeof(LibMK_Layer_Ring));
+        free(*client);
+        *client = NULL;
+        close(fds[1]);
+        close(sock);
+        return LIBMK_ERR_DAEMON;
+    }
+    (*client)->sock = sock;
+    (*client)->event = fds[1];
+    (*client)->ring = (LibMK_Layer_Ring*) ring;
+    (*client)->model = welcome.model;
+    (*client)->layout = welcome.layout;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_disconnect_daemon(LibMK_Client* client) {
+    if (client == NULL)
+        return;
+    munmap(client->ring, sizeof(LibMK_Layer_Ring));
+    close(client->event);
+    close(client->sock);
+    free(client);
+}
+
+
+int libmk_submit_layer(
+        LibMK_Client* client,
+        unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]) {
+    LibMK_Layer_Ring* ring = client->ring;
+    // The client is the only writer of the ring
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    LibMK_Layer_Slot* slot = &ring->slots[head % LIBMK_DAEMON_SLOTS];
+    unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot->colors, colors, sizeof(slot->colors));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // A full counter means the daemon has yet to read the earlier frames
+    uint64_t one = 1;
+    if (write(client->event, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        return LIBMK_ERR_DAEMON;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_client_set_all_led_color(
+        LibMK_Client* client, unsigned char* colors, unsigned char alpha) {
+    unsigned char layer[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4];
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            memcpy(layer[r][c], colors + (r * LIBMK_MAX_COLS + c) * 3, 3);
+            layer[r][c][3] = alpha;
+        }
+    return libmk_submit_layer(client, layer);
+}
+
+
+bool libmk_read_layer(
+        LibMK_Layer_Ring* ring,
+        unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]) {
+    for (int k = 0; k < LIBMK_READ_ATTEMPTS; k++) {
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == 0)
+            return false;
+        LibMK_Layer_Slot* slot = &ring->slots[(head - 1) % LIBMK_DAEMON_SLOTS];
+        unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 != 0)
+            continue;
+        memcpy(colors, slot->colors, sizeof(slot->colors));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,140 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+ *
+ * @file libmkd.h
+ * @author RedFantom
+ * @date 2018-2019
+ * @brief Header file of libmkd
+ *
+ * Contains the client library of mkd, the daemon that owns the keyboard
+ * on behalf of multiple processes. Every client draws a layer, which is
+ * stored in memory shared with the daemon, and the daemon composites
+ * the layers into the frames sent to the keyboard.
+*/
+#ifndef LIBMKD_H
+#define LIBMKD_H
+#include "libmk.h"
+#include <stdbool.h>
+
+#define LIBMK_DAEMON_SOCKET "/run/mkd.sock"  // Default path of the socket
+#define LIBMK_DAEMON_SOCKET_ENV "MKD_SOCKET"  // Overrides the default
+#define LIBMK_DAEMON_VERSION 1  // Version of the protocol and the ring
+#define LIBMK_DAEMON_SLOTS 4  // Frames in the ring of a layer
+
+/** @brief Frame of a layer, protected by a sequence lock
+ *
+ * The sequence number is odd while the client writes the colors. The
+ * daemon copies the colors and retries if the sequence number changed
+ * meanwhile, so neither side ever waits for the other.
+ */
+typedef struct LibMK_Layer_Slot {
+    unsigned int seq; ///< Number of writes started and finished
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]; ///< RGBA
+        ///< colors of the keys. An alpha of 0 leaves the layers below
+        ///< visible, 255 covers them.
+} LibMK_Layer_Slot;
+
+/** @brief Shared memory of a layer, written by one client only
+ *
+ * Created by the daemon with memfd_create and sealed against resizing,
+ * so a client cannot cause the daemon to fault by truncating it. The
+ * client writes the frames into the slots in turn, so that the daemon
+ * can read the newest frame while the next frame is being written.
+ */
+typedef struct LibMK_Layer_Ring {
+    unsigned int version; ///< LIBMK_DAEMON_VERSION
+    unsigned int head; ///< Number of frames written
+    LibMK_Layer_Slot slots[LIBMK_DAEMON_SLOTS]; ///< Frames by head modulo
+        ///< LIBMK_DAEMON_SLOTS
+} LibMK_Layer_Ring;
+
+/// @brief Request sent by a client upon connecting to the daemon
+typedef struct LibMK_Daemon_Hello {
+    unsigned int version; ///< LIBMK_DAEMON_VERSION
+    int priority; ///< Order of the layer, higher layers cover lower
+} LibMK_Daemon_Hello;
+
+/** @brief Response of the daemon to LibMK_Daemon_Hello
+ *
+ * Upon success, the memfd of the LibMK_Layer_Ring and an eventfd are
+ * passed along with the response as SCM_RIGHTS.
+ */
+typedef struct LibMK_Daemon_Welcome {
+    int result; ///< LibMK_Result of the request
+    LibMK_Model model; ///< Model of the keyboard of the daemon
+    LibMK_Layout layout; ///< Layout of the keyboard of the daemon
+} LibMK_Daemon_Welcome;
+
+/// @brief Connection of a client process to the daemon
+typedef struct LibMK_Client {
+    int sock; ///< Socket connected to the daemon, closed to disconnect
+    int event; ///< eventfd signalled for every frame written
+    LibMK_Layer_Ring* ring; ///< Shared memory of the layer
+    LibMK_Model model; ///< Model of the keyboard of the daemon
+    LibMK_Layout layout; ///< Layout of the keyboard of the daemon
+} LibMK_Client;
+
+/** @brief Retrieve the path of the socket of the daemon
+ *
+ * @returns The value of the MKD_SOCKET environment variable if set,
+ *    LIBMK_DAEMON_SOCKET otherwise.
+ */
+const char* libmk_get_daemon_socket(void);
+
+/** @brief Connect to the daemon and create a layer
+ *
+ * @param client: Pointer to store the allocated connection in
+ * @param path: Path of the socket of the daemon, NULL for the result
+ *    of libmk_get_daemon_socket
+ * @param priority: Order of the layer. Layers of equal priority are
+ *    ordered by the time of connection.
+ * @returns LibMK_Result result code, LIBMK_ERR_DAEMON if the daemon is
+ *    not running or refused the connection
+ *
+ * The layer is transparent until the first frame is submitted. The
+ * layer is removed when the client disconnects or exits.
+ */
+int libmk_connect_daemon(LibMK_Client** client, const char* path, int priority);
+
+/** @brief Remove the layer of a client and free the connection */
+void libmk_disconnect_daemon(LibMK_Client* client);
+
+/** @brief Submit a frame of RGBA colors for the layer of a client
+ *
+ * @param colors: RGBA color matrix of the layer
+ * @returns LibMK_Result result code
+ *
+ * Submitting a frame is a copy into the shared memory of the layer and
+ * a write to the eventfd, so it does not wait for the keyboard. Frames
+ * submitted while the daemon is busy replace each other.
+ */
+int libmk_submit_layer(
+    LibMK_Client* client,
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]);
+
+/** @brief Set the color of all keys of the layer of a client
+ *
+ * @param colors: RGB color matrix, as for libmk_set_all_led_color
+ * @param alpha: Opacity of the keys of the layer, 255 to cover the
+ *    layers below
+ * @returns LibMK_Result result code
+ */
+int libmk_client_set_all_led_color(
+    LibMK_Client* client, unsigned char* colors, unsigned char alpha);
+
+/** @brief Copy the newest frame of a layer
+ *
+ * @param ring: Shared memory of the layer
+ * @param colors: RGBA color matrix to copy the frame into
+ * @returns false if no frame has been written yet or the client kept
+ *    overwriting the frame being read, true otherwise.
+ *
+ * Used by the daemon to read the layers of the clients.
+ */
+bool libmk_read_layer(
+    LibMK_Layer_Ring* ring,
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4]);
+
+#endif
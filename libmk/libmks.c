@@ -0,0 +1,781 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "libmks.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xutil.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LIBMKS_X86
+#include <immintrin.h>
+// Kernels are compiled for their instruction set regardless of the
+// compiler flags and only called if the processor supports them
+#define LIBMKS_TARGET(t) __attribute__((target(t)))
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LIBMKS_NEON
+#include <arm_neon.h>
+#endif
+
+
+/// Filter criteria clamped to the range of values a pixel can have
+typedef struct LibMK_Limits {
+    int lower, upper, bias;
+} LibMK_Limits;
+
+
+static LibMK_Simd Simd = (LibMK_Simd) -1;
+
+
+void libmk_init_color_filter(LibMK_Color_Filter* filter) {
+    filter->lower = 25;
+    filter->upper = 700;
+    filter->saturation_bias = 60;
+    filter->brightness_norm = true;
+}
+
+
+static bool libmk_simd_supported(LibMK_Simd simd) {
+    switch (simd) {
+        case LIBMK_SIMD_SCALAR:
+            return true;
+#ifdef LIBMKS_X86
+        case LIBMK_SIMD_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case LIBMK_SIMD_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef LIBMKS_NEON
+        case LIBMK_SIMD_NEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+
+LibMK_Simd libmk_get_simd(void) {
+    if (Simd != (LibMK_Simd) -1)
+        return Simd;
+#ifdef LIBMKS_X86
+    __builtin_cpu_init();
+#endif
+    LibMK_Simd order[3] = {LIBMK_SIMD_AVX2, LIBMK_SIMD_SSE2, LIBMK_SIMD_NEON};
+    Simd = LIBMK_SIMD_SCALAR;
+    for (int i = 0; i < 3; i++)
+        if (libmk_simd_supported(order[i])) {
+            Simd = order[i];
+            break;
+        }
+    return Simd;
+}
+
+
+int libmk_set_simd(LibMK_Simd simd) {
+    libmk_get_simd();  // Initializes the CPU detection
+    if (!libmk_simd_supported(simd))
+        return LIBMK_ERR_NOT_SUPPORTED;
+    Simd = simd;
+    return LIBMK_SUCCESS;
+}
+
+
+static void libmk_sum_row_scalar(
+        unsigned char* p, unsigned int w, unsigned int bpp,
+        LibMK_Limits* l, unsigned long long acc[4]) {
+    for (unsigned int x = 0; x < w; x++, p += bpp) {
+        int c0 = p[0], c1 = p[1], c2 = p[2];
+        int sum = c0 + c1 + c2;
+        int max = c0 > c1 ? c0 : c1;
+        int min = c0 < c1 ? c0 : c1;
+        max = c2 > max ? c2 : max;
+        min = c2 < min ? c2 : min;
+        // Largest difference between any pair is that of max and min
+        if (sum < l->lower || sum > l->upper || max - min < l->bias)
+            continue;
+        acc[0] += c0;
+        acc[1] += c1;
+        acc[2] += c2;
+        acc[3] += 1;
+    }
+}
+
+
+#ifdef LIBMKS_X86
+LIBMKS_TARGET("sse2")
+static void libmk_sum_row_sse2(
+        unsigned char* p, unsigned int w,
+        LibMK_Limits* l, unsigned long long acc[4]) {
+    const __m128i bytes = _mm_set1_epi32(0xFF);
+    const __m128i lower = _mm_set1_epi32(l->lower - 1);
+    const __m128i upper = _mm_set1_epi32(l->upper + 1);
+    const __m128i bias = _mm_set1_epi32(l->bias - 1);
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, an = a0;
+    unsigned int x = 0;
+    for (; x + 4 <= w; x += 4) {
+        // One pixel per 32-bit lane, one channel per vector
+        __m128i v = _mm_loadu_si128((__m128i*) (p + x * 4));
+        __m128i c0 = _mm_and_si128(v, bytes);
+        __m128i c1 = _mm_and_si128(_mm_srli_epi32(v, 8), bytes);
+        __m128i c2 = _mm_and_si128(_mm_srli_epi32(v, 16), bytes);
+        __m128i sum = _mm_add_epi32(_mm_add_epi32(c0, c1), c2);
+        // The upper halves of the lanes are zero, so 16-bit max and min
+        // work on the 32-bit lanes
+        __m128i max = _mm_max_epi16(_mm_max_epi16(c0, c1), c2);
+        __m128i min = _mm_min_epi16(_mm_min_epi16(c0, c1), c2);
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpgt_epi32(sum, lower), _mm_cmpgt_epi32(upper, sum)),
+            _mm_cmpgt_epi32(_mm_sub_epi32(max, min), bias));
+        a0 = _mm_add_epi32(a0, _mm_and_si128(c0, m));
+        a1 = _mm_add_epi32(a1, _mm_and_si128(c1, m));
+        a2 = _mm_add_epi32(a2, _mm_and_si128(c2, m));
+        an = _mm_sub_epi32(an, m);  // Mask lanes are -1
+    }
+    unsigned int t[4][4];
+    _mm_storeu_si128((__m128i*) t[0], a0);
+    _mm_storeu_si128((__m128i*) t[1], a1);
+    _mm_storeu_si128((__m128i*) t[2], a2);
+    _mm_storeu_si128((__m128i*) t[3], an);
+    for (int i = 0; i < 4; i++)
+        acc[i] += (unsigned long long) t[i][0] + t[i][1] + t[i][2] + t[i][3];
+    libmk_sum_row_scalar(p + x * 4, w - x, 4, l, acc);
+}
+
+
+LIBMKS_TARGET("avx2")
+static void libmk_sum_row_avx2(
+        unsigned char* p, unsigned int w,
+        LibMK_Limits* l, unsigned long long acc[4]) {
+    const __m256i bytes = _mm256_set1_epi32(0xFF);
+    const __m256i lower = _mm256_set1_epi32(l->lower - 1);
+    const __m256i upper = _mm256_set1_epi32(l->upper + 1);
+    const __m256i bias = _mm256_set1_epi32(l->bias - 1);
+    __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, an = a0;
+    unsigned int x = 0;
+    for (; x + 8 <= w; x += 8) {
+        __m256i v = _mm256_loadu_si256((__m256i*) (p + x * 4));
+        __m256i c0 = _mm256_and_si256(v, bytes);
+        __m256i c1 = _mm256_and_si256(_mm256_srli_epi32(v, 8), bytes);
+        __m256i c2 = _mm256_and_si256(_mm256_srli_epi32(v, 16), bytes);
+        __m256i sum = _mm256_add_epi32(_mm256_add_epi32(c0, c1), c2);
+        __m256i max = _mm256_max_epi16(_mm256_max_epi16(c0, c1), c2);
+        __m256i min = _mm256_min_epi16(_mm256_min_epi16(c0, c1), c2);
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_cmpgt_epi32(sum, lower),
+                _mm256_cmpgt_epi32(upper, sum)),
+            _mm256_cmpgt_epi32(_mm256_sub_epi32(max, min), bias));
+        a0 = _mm256_add_epi32(a0, _mm256_and_si256(c0, m));
+        a1 = _mm256_add_epi32(a1, _mm256_and_si256(c1, m));
+        a2 = _mm256_add_epi32(a2, _mm256_and_si256(c2, m));
+        an = _mm256_sub_epi32(an, m);
+    }
+    unsigned int t[4][8];
+    _mm256_storeu_si256((__m256i*) t[0], a0);
+    _mm256_storeu_si256((__m256i*) t[1], a1);
+    _mm256_storeu_si256((__m256i*) t[2], a2);
+    _mm256_storeu_si256((__m256i*) t[3], an);
+    for (int i = 0; i < 4; i++)
+        for (int k = 0; k < 8; k++)
+            acc[i] += t[i][k];
+    libmk_sum_row_scalar(p + x * 4, w - x, 4, l, acc);
+}
+#endif
+
+
+#ifdef LIBMKS_NEON
+static void libmk_sum_row_neon(
+        unsigned char* p, unsigned int w, unsigned int bpp,
+        LibMK_Limits* l, unsigned long long acc[4]) {
+    const uint16x8_t lower = vdupq_n_u16((uint16_t) l->lower);
+    const uint16x8_t upper = vdupq_n_u16((uint16_t) l->upper);
+    const uint16x8_t bias = vdupq_n_u16((uint16_t) l->bias);
+    uint32x4_t a0 = vdupq_n_u32(0), a1 = a0, a2 = a0, an = a0;
+    unsigned int x = 0;
+    for (; x + 8 <= w; x += 8) {
+        uint8x8_t c0, c1, c2;
+        if (bpp == 4) {
+            uint8x8x4_t v = vld4_u8(p + x * 4);
+            c0 = v.val[0]; c1 = v.val[1]; c2 = v.val[2];
+        } else {
+            uint8x8x3_t v = vld3_u8(p + x * 3);
+            c0 = v.val[0]; c1 = v.val[1]; c2 = v.val[2];
+        }
+        uint16x8_t sum = vaddw_u8(vaddl_u8(c0, c1), c2);
+        uint8x8_t sat = vsub_u8(
+            vmax_u8(vmax_u8(c0, c1), c2), vmin_u8(vmin_u8(c0, c1), c2));
+        uint16x8_t m = vandq_u16(
+            vandq_u16(vcgeq_u16(sum, lower), vcleq_u16(sum, upper)),
+            vcgeq_u16(vmovl_u8(sat), bias));
+        a0 = vpadalq_u16(a0, vandq_u16(vmovl_u8(c0), m));
+        a1 = vpadalq_u16(a1, vandq_u16(vmovl_u8(c1), m));
+        a2 = vpadalq_u16(a2, vandq_u16(vmovl_u8(c2), m));
+        an = vpadalq_u16(an, vshrq_n_u16(m, 15));
+    }
+    uint32x4_t a[4] = {a0, a1, a2, an};
+    for (int i = 0; i < 4; i++)
+        acc[i] += (unsigned long long) vgetq_lane_u32(a[i], 0) +
+            vgetq_lane_u32(a[i], 1) + vgetq_lane_u32(a[i], 2) +
+            vgetq_lane_u32(a[i], 3);
+    libmk_sum_row_scalar(p + x * bpp, w - x, bpp, l, acc);
+}
+#endif
+
+
+static bool libmk_get_limits(LibMK_Color_Filter* filter, LibMK_Limits* l) {
+    if (filter == NULL) {
+        // Every pixel is included
+        l->lower = 0;
+        l->upper = 3 * 255;
+        l->bias = 0;
+        return true;
+    }
+    l->lower = filter->lower < 0 ? 0 : filter->lower;
+    l->upper = filter->upper > 3 * 255 ? 3 * 255 : filter->upper;
+    l->bias = filter->saturation_bias < 0 ? 0 : filter->saturation_bias;
+    return l->lower <= l->upper && l->bias <= 255;
+}
+
+
+static void libmk_sum_segment(
+        unsigned char* p, unsigned int w, unsigned int bpp, unsigned int step,
+        LibMK_Simd kernel, LibMK_Limits* l, unsigned long long acc[4]) {
+    if (step > 1) {
+        // Sampled pixels are not adjacent and cannot be loaded as vectors
+        libmk_sum_row_scalar(p, (w + step - 1) / step, bpp * step, l, acc);
+        return;
+    }
+    switch (kernel) {
+#ifdef LIBMKS_X86
+        case LIBMK_SIMD_AVX2:
+            libmk_sum_row_avx2(p, w, l, acc);
+            break;
+        case LIBMK_SIMD_SSE2:
+            libmk_sum_row_sse2(p, w, l, acc);
+            break;
+#endif
+#ifdef LIBMKS_NEON
+        case LIBMK_SIMD_NEON:
+            libmk_sum_row_neon(p, w, bpp, l, acc);
+            break;
+#endif
+        default:
+            libmk_sum_row_scalar(p, w, bpp, l, acc);
+            break;
+    }
+}
+
+
+static void libmk_store_sum(
+        LibMK_Image* image, unsigned long long acc[4], LibMK_Color_Sum* sum) {
+    bool bgr = image->format == LIBMK_PIXEL_BGRX32;
+    sum->r = bgr ? acc[2] : acc[0];
+    sum->g = acc[1];
+    sum->b = bgr ? acc[0] : acc[2];
+    sum->n = acc[3];
+}
+
+
+/// Region of an image to sum, split into a grid of rows by cols zones
+typedef struct LibMK_Grid {
+    LibMK_Image* image;
+    unsigned int x, y, w, h, step, bpp;
+    unsigned int rows, cols;
+    LibMK_Limits l;
+    LibMK_Simd kernel;
+} LibMK_Grid;
+
+
+static bool libmk_init_grid(
+        LibMK_Grid* g, LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h, unsigned int step,
+        LibMK_Color_Filter* filter, unsigned int rows, unsigned int cols,
+        LibMK_Simd simd) {
+    if (x >= image->width || y >= image->height)
+        return false;
+    if (!libmk_get_limits(filter, &g->l))
+        return false;  // No pixel can be included
+    g->image = image;
+    g->x = x;
+    g->y = y;
+    g->w = w > image->width - x ? image->width - x : w;
+    g->h = h > image->height - y ? image->height - y : h;
+    g->step = step == 0 ? 1 : step;
+    g->rows = rows;
+    g->cols = cols;
+    g->bpp = image->format == LIBMK_PIXEL_RGB24 ? 3 : 4;
+    // Three bytes per pixel do not fit the lanes of the x86 kernels
+    g->kernel = simd;
+    if (g->bpp == 3 && g->kernel != LIBMK_SIMD_NEON)
+        g->kernel = LIBMK_SIMD_SCALAR;
+    return true;
+}
+
+
+/** Add the sums of the rows r0 up to r1 of the region to acc
+ *
+ * Every row is split into a segment per zone. Only every step-th row and
+ * column of the region is sampled. acc holds rows * cols accumulators.
+ */
+static void libmk_sum_band(
+        LibMK_Grid* g, unsigned int r0, unsigned int r1,
+        unsigned long long (*acc)[4]) {
+    unsigned int step = g->step, cols = g->cols, bpp = g->bpp;
+    r0 = (r0 + step - 1) / step * step;
+    for (unsigned int r = r0; r < r1; r += step) {
+        unsigned int zr = (unsigned int) (
+            (unsigned long long) r * g->rows / g->h);
+        unsigned char* row = g->image->data +
+            (size_t) (g->y + r) * g->image->stride + g->x * bpp;
+        for (unsigned int zc = 0; zc < cols; zc++) {
+            // Zones start at the first sampled column past their boundary
+            unsigned int s = (unsigned int) (
+                ((unsigned long long) zc * g->w + cols - 1) / cols);
+            unsigned int e = (unsigned int) (
+                ((unsigned long long) (zc + 1) * g->w + cols - 1) / cols);
+            s = (s + step - 1) / step * step;
+            if (s >= e)
+                continue;
+            libmk_sum_segment(
+                row + s * bpp, e - s, bpp, step, g->kernel, &g->l,
+                acc[zr * cols + zc]);
+        }
+    }
+}
+
+
+/** Sum a region of an image split into a grid of rows by cols zones
+ *
+ * acc must hold rows * cols accumulators and is cleared.
+ */
+static void libmk_sum_grid(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h, unsigned int step,
+        LibMK_Color_Filter* filter, unsigned int rows, unsigned int cols,
+        unsigned long long (*acc)[4], LibMK_Simd simd) {
+    memset(acc, 0x00, sizeof(unsigned long long) * 4 * rows * cols);
+    LibMK_Grid g;
+    if (libmk_init_grid(&g, image, x, y, w, h, step, filter, rows, cols, simd))
+        libmk_sum_band(&g, 0, g.h, acc);
+}
+
+
+static void libmk_sum_rows(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h, LibMK_Color_Filter* filter,
+        LibMK_Color_Sum* sum, LibMK_Simd simd) {
+    unsigned long long acc[1][4];
+    libmk_sum_grid(image, x, y, w, h, 1, filter, 1, 1, acc, simd);
+    libmk_store_sum(image, acc[0], sum);
+}
+
+
+void libmk_sum_image(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h,
+        LibMK_Color_Filter* filter, LibMK_Color_Sum* sum) {
+    libmk_sum_rows(image, x, y, w, h, filter, sum, libmk_get_simd());
+}
+
+
+void libmk_sum_image_scalar(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h,
+        LibMK_Color_Filter* filter, LibMK_Color_Sum* sum) {
+    libmk_sum_rows(image, x, y, w, h, filter, sum, LIBMK_SIMD_SCALAR);
+}
+
+
+void libmk_add_color_sum(LibMK_Color_Sum* dst, LibMK_Color_Sum* src) {
+    dst->r += src->r;
+    dst->g += src->g;
+    dst->b += src->b;
+    dst->n += src->n;
+}
+
+
+bool libmk_get_sum_color(
+        LibMK_Color_Sum* sum, LibMK_Color_Filter* filter,
+        unsigned char color[3]) {
+    if (sum->n == 0) {
+        memset(color, 0xFF, 3);  // Error condition
+        return false;
+    }
+    color[0] = (unsigned char) (sum->r / sum->n);
+    color[1] = (unsigned char) (sum->g / sum->n);
+    color[2] = (unsigned char) (sum->b / sum->n);
+    if (filter == NULL || !filter->brightness_norm)
+        return true;
+    unsigned char max = color[0];
+    max = color[1] > max ? color[1] : max;
+    max = color[2] > max ? color[2] : max;
+    if (max != 0)
+        for (int i = 0; i < 3; i++)
+            color[i] = (unsigned char) ((unsigned int) color[i] * 255 / max);
+    return true;
+}
+
+
+bool libmk_get_image_color(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h,
+        LibMK_Color_Filter* filter, unsigned char color[3]) {
+    LibMK_Color_Sum sum;
+    libmk_sum_image(image, x, y, w, h, filter, &sum);
+    return libmk_get_sum_color(&sum, filter, color);
+}
+
+
+void libmk_sum_zones(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h, unsigned int step,
+        LibMK_Color_Filter* filter,
+        LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]) {
+    libmk_sum_zones_parallel(NULL, image, x, y, w, h, step, filter, sums);
+}
+
+
+void libmk_get_zone_colors(
+        LibMK_Image* image, unsigned int x, unsigned int y,
+        unsigned int w, unsigned int h, unsigned int step,
+        LibMK_Color_Filter* filter,
+        unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS];
+    libmk_sum_zones(image, x, y, w, h, step, filter, sums);
+    for (unsigned int r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned int c = 0; c < LIBMK_MAX_COLS; c++)
+            if (!libmk_get_sum_color(&sums[r][c], filter, colors[r][c]))
+                memset(colors[r][c], 0x00, 3);  // Key off for empty zones
+}
+
+
+/// Sum the bands of the current reduction until none remain, with lock held
+static void libmk_sum_bands(LibMK_Workers* workers) {
+    while (workers->next < workers->n) {
+        unsigned int b = workers->next++;
+        LibMK_Grid* g = workers->grid;
+        pthread_mutex_unlock(&workers->lock);
+        unsigned long long (*acc)[4] = workers->acc[b];
+        memset(acc, 0x00, sizeof(workers->acc[b]));
+        libmk_sum_band(
+            g, (unsigned int) ((unsigned long long) b * g->h / workers->n),
+            (unsigned int) ((unsigned long long) (b + 1) * g->h / workers->n),
+            acc);
+        pthread_mutex_lock(&workers->lock);
+        if (++workers->done == workers->n)
+            pthread_cond_signal(&workers->done_cond);
+    }
+}
+
+
+static void* libmk_run_worker(void* ptr) {
+    LibMK_Workers* workers = (LibMK_Workers*) ptr;
+    pthread_mutex_lock(&workers->lock);
+    unsigned long generation = workers->generation;
+    while (true) {
+        while (!workers->exit_flag && workers->generation == generation)
+            pthread_cond_wait(&workers->work_cond, &workers->lock);
+        if (workers->exit_flag)
+            break;
+        generation = workers->generation;
+        libmk_sum_bands(workers);
+    }
+    pthread_mutex_unlock(&workers->lock);
+    return NULL;
+}
+
+
+LibMK_Workers* libmk_create_workers(unsigned int n) {
+    if (n == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cores < 1 ? 1 : (unsigned int) cores;
+    }
+    LibMK_Workers* workers = (LibMK_Workers*) malloc(sizeof(LibMK_Workers));
+    if (workers == NULL)
+        return NULL;
+    workers->n = n;
+    workers->n_threads = 0;
+    workers->generation = 0;
+    workers->next = workers->done = n;
+    workers->exit_flag = false;
+    workers->grid = NULL;
+    workers->threads = (pthread_t*) malloc(sizeof(pthread_t) * n);
+    workers->acc = malloc(sizeof(*workers->acc) * n);
+    if (workers->threads == NULL || workers->acc == NULL) {
+        free(workers->threads);
+        free(workers->acc);
+        free(workers);
+        return NULL;
+    }
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+    // The calling thread sums one of the bands itself
+    for (unsigned int i = 1; i < n; i++) {
+        if (pthread_create(
+                &workers->threads[workers->n_threads], NULL,
+                libmk_run_worker, (void*) workers) != 0) {
+            libmk_free_workers(workers);
+            return NULL;
+        }
+        workers->n_threads++;
+    }
+    return workers;
+}
+
+
+void libmk_free_workers(LibMK_Workers* workers) {
+    pthread_mutex_lock(&workers->lock);
+    workers->exit_flag = true;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+    for (unsigned int i = 0; i < workers->n_threads; i++)
+        pthread_join(workers->threads[i], NULL);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->threads);
+    free(workers->acc);
+    free(workers);
+}
+
+
+/** Sum a grid of zones split into a band of rows per worker
+ *
+ * acc must hold rows * cols accumulators and is cleared.
+ */
+static void libmk_sum_grid_parallel(
+        LibMK_Workers* workers, LibMK_Image* image,
+        unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+        unsigned int step, LibMK_Color_Filter* filter,
+        unsigned int rows, unsigned int cols, unsigned long long (*acc)[4]) {
+    if (workers == NULL || workers->n == 1) {
+        libmk_sum_grid(
+            image, x, y, w, h, step, filter, rows, cols, acc,
+            libmk_get_simd());
+        return;
+    }
+    memset(acc, 0x00, sizeof(unsigned long long) * 4 * rows * cols);
+    LibMK_Grid g;
+    if (!libmk_init_grid(
+            &g, image, x, y, w, h, step, filter, rows, cols,
+            libmk_get_simd()))
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->grid = &g;
+    workers->next = workers->done = 0;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->work_cond);
+    libmk_sum_bands(workers);
+    while (workers->done < workers->n)
+        pthread_cond_wait(&workers->done_cond, &workers->lock);
+    workers->grid = NULL;
+    pthread_mutex_unlock(&workers->lock);
+
+    // Combine the partial sums in band order for a deterministic result
+    for (unsigned int b = 0; b < workers->n; b++)
+        for (unsigned int z = 0; z < rows * cols; z++)
+            for (int i = 0; i < 4; i++)
+                acc[z][i] += workers->acc[b][z][i];
+}
+
+
+void libmk_sum_image_parallel(
+        LibMK_Workers* workers, LibMK_Image* image,
+        unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+        LibMK_Color_Filter* filter, LibMK_Color_Sum* sum) {
+    unsigned long long acc[1][4];
+    libmk_sum_grid_parallel(
+        workers, image, x, y, w, h, 1, filter, 1, 1, acc);
+    libmk_store_sum(image, acc[0], sum);
+}
+
+
+void libmk_sum_zones_parallel(
+        LibMK_Workers* workers, LibMK_Image* image,
+        unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+        unsigned int step, LibMK_Color_Filter* filter,
+        LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]) {
+    unsigned long long acc[LIBMK_MAX_ROWS * LIBMK_MAX_COLS][4];
+    libmk_sum_grid_parallel(
+        workers, image, x, y, w, h, step, filter,
+        LIBMK_MAX_ROWS, LIBMK_MAX_COLS, acc);
+    for (unsigned int r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned int c = 0; c < LIBMK_MAX_COLS; c++)
+            libmk_store_sum(image, acc[r * LIBMK_MAX_COLS + c], &sums[r][c]);
+}
+
+
+static bool ShmError;
+
+
+static int libmk_shm_error_handler(Display* display, XErrorEvent* event) {
+    ShmError = true;
+    return 0;
+}
+
+
+static bool libmk_attach_shm(LibMK_Capture* c, unsigned int w, unsigned int h) {
+    if (!XShmQueryExtension(c->display))
+        return false;
+    int screen = DefaultScreen(c->display);
+    c->img = XShmCreateImage(
+        c->display, DefaultVisual(c->display, screen),
+        DefaultDepth(c->display, screen), ZPixmap, NULL, &c->shm, w, h);
+    if (c->img == NULL)
+        return false;
+    c->shm.shmid = shmget(
+        IPC_PRIVATE, c->img->bytes_per_line * c->img->height,
+        IPC_CREAT | 0600);
+    if (c->shm.shmid < 0) {
+        XDestroyImage(c->img);
+        return false;
+    }
+    c->shm.shmaddr = c->img->data = (char*) shmat(c->shm.shmid, NULL, 0);
+    c->shm.readOnly = False;
+
+    // Attaching fails asynchronously for remote displays
+    ShmError = false;
+    XSync(c->display, False);
+    int (*handler)(Display*, XErrorEvent*) =
+        XSetErrorHandler(libmk_shm_error_handler);
+    Status s = XShmAttach(c->display, &c->shm);
+    XSync(c->display, False);
+    XSetErrorHandler(handler);
+    // Removed once detached, also if the process does not exit cleanly
+    shmctl(c->shm.shmid, IPC_RMID, NULL);
+    if (!s || ShmError) {
+        shmdt(c->shm.shmaddr);
+        XDestroyImage(c->img);
+        return false;
+    }
+    return true;
+}
+
+
+LibMK_Capture* libmk_create_capture(
+        Display* display, int x, int y, unsigned int w, unsigned int h) {
+    LibMK_Capture* c = (LibMK_Capture*) malloc(sizeof(LibMK_Capture));
+    if (c == NULL)
+        return NULL;
+    c->data = NULL;
+    c->img = NULL;
+    c->use_shm = false;
+    c->own_display = (display == NULL);
+    c->display = display == NULL ? XOpenDisplay(NULL) : display;
+    if (c->display == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->root = DefaultRootWindow(c->display);
+    XWindowAttributes gwa;
+    if (!XGetWindowAttributes(c->display, c->root, &gwa) ||
+            x < 0 || y < 0 || x >= gwa.width || y >= gwa.height) {
+        libmk_free_capture(c);
+        return NULL;
+    }
+    unsigned int max_w = gwa.width - x, max_h = gwa.height - y;
+    w = (w == 0 || w > max_w) ? max_w : w;
+    h = (h == 0 || h > max_h) ? max_h : h;
+    c->x = x;
+    c->y = y;
+    c->use_shm = libmk_attach_shm(c, w, h);
+    if (!c->use_shm) {
+        c->img = XGetImage(
+            c->display, c->root, x, y, w, h, AllPlanes, ZPixmap);
+        if (c->img == NULL) {
+            libmk_free_capture(c);
+            return NULL;
+        }
+    }
+
+    XImage* img = c->img;
+    c->image.width = w;
+    c->image.height = h;
+    if (img->bits_per_pixel == 32 && img->byte_order == LSBFirst &&
+            img->blue_mask == 0xFF && img->green_mask == 0xFF00 &&
+            img->red_mask == 0xFF0000) {
+        c->image.format = LIBMK_PIXEL_BGRX32;
+    } else if (img->bits_per_pixel == 32 && img->byte_order == LSBFirst &&
+            img->red_mask == 0xFF && img->green_mask == 0xFF00 &&
+            img->blue_mask == 0xFF0000) {
+        c->image.format = LIBMK_PIXEL_RGBX32;
+    } else {
+        c->data = (unsigned char*) malloc(w * h * 3);
+        if (c->data == NULL) {
+            libmk_free_capture(c);
+            return NULL;
+        }
+        c->image.format = LIBMK_PIXEL_RGB24;
+    }
+    if (c->data == NULL) {
+        c->image.data = (unsigned char*) img->data;
+        c->image.stride = img->bytes_per_line;
+    } else {
+        c->image.data = c->data;
+        c->image.stride = w * 3;
+    }
+    return c;
+}
+
+
+void libmk_free_capture(LibMK_Capture* c) {
+    if (c->img != NULL) {
+        if (c->use_shm) {
+            XShmDetach(c->display, &c->shm);
+            XSync(c->display, False);
+            shmdt(c->shm.shmaddr);
+        }
+        XDestroyImage(c->img);
+    }
+    free(c->data);
+    if (c->own_display)
+        XCloseDisplay(c->display);
+    free(c);
+}
+
+
+int libmk_capture(LibMK_Capture* c) {
+    if (c->use_shm) {
+        if (!XShmGetImage(c->display, c->root, c->img, c->x, c->y, AllPlanes))
+            return LIBMK_ERR_CAPTURE;
+    } else if (XGetSubImage(
+            c->display, c->root, c->x, c->y, c->image.width, c->image.height,
+            AllPlanes, ZPixmap, c->img, 0, 0) == NULL) {
+        return LIBMK_ERR_CAPTURE;
+    }
+    if (c->data == NULL)
+        return LIBMK_SUCCESS;
+
+    // Uncommon pixel format, converted with the masks of the image
+    XImage* img = c->img;
+    unsigned long masks[3] = {img->red_mask, img->green_mask, img->blue_mask};
+    int shifts[3];
+    for (int i = 0; i < 3; i++) {
+        shifts[i] = 0;
+        while (masks[i] != 0 && !(masks[i] & 1UL << shifts[i]))
+            shifts[i]++;
+    }
+    unsigned char* p = c->data;
+    for (unsigned int y = 0; y < c->image.height; y++)
+        for (unsigned int x = 0; x < c->image.width; x++) {
+            unsigned long pix = XGetPixel(img, x, y);
+            for (int i = 0; i < 3; i++) {
+                unsigned long v = (pix & masks[i]) >> shifts[i];
+                unsigned long max = masks[i] >> shifts[i];
+                *(p++) = max == 0 ? 0 : (unsigned char) (v * 255 / max);
+            }
+        }
+    return LIBMK_SUCCESS;
+}
@@ -0,0 +1,295 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+ *
+ * @file libmks.h
+ * @author RedFantom
+ * @date 2018-2019
+ * @brief Header file of libmks
+ *
+ * Contains the screen color functions of libmks, which calculate the
+ * colors for a keyboard from captured images of a screen.
+*/
+#ifndef LIBMKS_H
+#define LIBMKS_H
+#include "libmk.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+/// @brief Layout of the pixels in the data of an image
+typedef enum LibMK_Pixel_Format {
+    LIBMK_PIXEL_RGB24 = 0, ///< Three bytes per pixel: red, green, blue
+    LIBMK_PIXEL_BGRX32 = 1, ///< Four bytes per pixel: blue, green, red,
+                            ///< padding. Used by X.org on little-endian
+    LIBMK_PIXEL_RGBX32 = 2, ///< Four bytes per pixel: red, green, blue,
+                            ///< padding
+} LibMK_Pixel_Format;
+
+/// @brief Instruction set used for the color calculations
+typedef enum LibMK_Simd {
+    LIBMK_SIMD_SCALAR = 0, ///< Plain C, available on all platforms
+    LIBMK_SIMD_SSE2 = 1, ///< x86 SSE2, 4 pixels at a time
+    LIBMK_SIMD_AVX2 = 2, ///< x86 AVX2, 8 pixels at a time
+    LIBMK_SIMD_NEON = 3, ///< ARM NEON, 8 pixels at a time
+} LibMK_Simd;
+
+/** @brief Image of packed pixels stored row by row
+ *
+ * The image does not own its data, so an image may refer to the data
+ * of an XImage, for example.
+ */
+typedef struct LibMK_Image {
+    unsigned char* data; ///< Pixel data, row by row
+    unsigned int width; ///< Width in pixels
+    unsigned int height; ///< Height in pixels
+    unsigned int stride; ///< Number of bytes between the start of rows
+    LibMK_Pixel_Format format; ///< Layout of the pixels
+} LibMK_Image;
+
+/** @brief Criteria for the pixels included in the color of an image
+ *
+ * A pixel is included if the sum of its channels lies between lower
+ * and upper, inclusive, and the largest difference between any two of
+ * its channels is at least saturation_bias. This filters out dark,
+ * bright and grey pixels, so that the result is the dominant color
+ * of the image rather than its average.
+ */
+typedef struct LibMK_Color_Filter {
+    int lower; ///< Minimum sum of the channels of a pixel
+    int upper; ///< Maximum sum of the channels of a pixel
+    int saturation_bias; ///< Minimum difference between two channels
+    bool brightness_norm; ///< Scale colors so that the largest channel
+                          ///< of the result is 255
+} LibMK_Color_Filter;
+
+/** @brief Sum of the colors of the pixels included by a filter
+ *
+ * Sums of parts of an image may be added up with libmk_add_color_sum
+ * before the color is calculated with libmk_get_sum_color.
+ */
+typedef struct LibMK_Color_Sum {
+    unsigned long long r; ///< Sum of the red channels
+    unsigned long long g; ///< Sum of the green channels
+    unsigned long long b; ///< Sum of the blue channels
+    unsigned long long n; ///< Number of pixels included
+} LibMK_Color_Sum;
+
+struct LibMK_Grid;
+
+/** @brief Persistent pool of threads summing an image in parallel
+ *
+ * The region of an image is split into a band of rows for every worker.
+ * The calling thread sums one of the bands itself, the other bands are
+ * summed by threads that wait for the next image between reductions,
+ * so no threads are created for every image.
+ */
+typedef struct LibMK_Workers {
+    unsigned int n; ///< Number of workers, including the calling thread
+    pthread_t* threads; ///< Threads of the other workers
+    unsigned int n_threads; ///< Number of threads started
+    pthread_mutex_t lock; ///< Protects the state of the reduction
+    pthread_cond_t work_cond; ///< Signalled when a reduction is started
+    pthread_cond_t done_cond; ///< Signalled when all bands are summed
+    unsigned long generation; ///< Number of reductions started
+    unsigned int next; ///< Next band to be summed
+    unsigned int done; ///< Number of bands summed
+    bool exit_flag; ///< Requests the threads to exit
+    struct LibMK_Grid* grid; ///< Region of the current reduction
+    unsigned long long (*acc)[LIBMK_MAX_ROWS * LIBMK_MAX_COLS][4];
+        ///< Partial sums of every band
+} LibMK_Workers;
+
+/** @brief Capture of a region of the screen reusing its buffers
+ *
+ * Uses the MIT-SHM extension where available, in which case the X
+ * server writes the pixels directly into a shared memory segment that
+ * is reused for every capture. Otherwise XGetSubImage into a persistent
+ * XImage is used. The image refers to the XImage data directly if the
+ * pixels are in one of the formats of LibMK_Pixel_Format, else the
+ * pixels are converted into a persistent buffer.
+ */
+typedef struct LibMK_Capture {
+    Display* display; ///< Display to capture
+    bool own_display; ///< Whether the display was opened by the capture
+    Window root; ///< Root window of the display
+    int x; ///< Left side of the captured region
+    int y; ///< Top side of the captured region
+    XImage* img; ///< Image the X server stores the region in
+    XShmSegmentInfo shm; ///< Shared memory segment of img
+    bool use_shm; ///< Whether the MIT-SHM extension is used
+    unsigned char* data; ///< Converted pixels, NULL if not required
+    LibMK_Image image; ///< Pixels of the last capture
+} LibMK_Capture;
+
+/** @brief Initialize a filter with the default criteria
+ *
+ * The defaults are those of the AmbiLight example: lower 25, upper 700
+ * and a saturation bias of 60, with brightness normalization.
+ */
+void libmk_init_color_filter(LibMK_Color_Filter* filter);
+
+/** @brief Retrieve the instruction set used for the color calculations
+ *
+ * Determined upon the first call from the capabilities of the processor.
+ */
+LibMK_Simd libmk_get_simd(void);
+
+/** @brief Override the instruction set used for the color calculations
+ *
+ * Intended for validating the results of the vectorized kernels
+ * against the scalar kernel.
+ *
+ * @returns LIBMK_ERR_NOT_SUPPORTED if the instruction set is not
+ *    supported by the processor or the build, LIBMK_SUCCESS otherwise.
+ */
+int libmk_set_simd(LibMK_Simd simd);
+
+/** @brief Sum the colors of the pixels in a region of an image
+ *
+ * @param image: Image to sum the pixels of
+ * @param x, y: Coordinates of the top-left corner of the region
+ * @param w, h: Size of the region, clipped to the image
+ * @param filter: Criteria for the pixels to include, NULL to include
+ *    all pixels
+ * @param sum: Sum to store the result in, overwritten
+ *
+ * Processes the pixels row by row using the instruction set returned by
+ * libmk_get_simd. The results are identical for all instruction sets.
+ */
+void libmk_sum_image(
+    LibMK_Image* image, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h,
+    LibMK_Color_Filter* filter, LibMK_Color_Sum* sum);
+
+/** @brief Scalar version of libmk_sum_image, for validation */
+void libmk_sum_image_scalar(
+    LibMK_Image* image, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h,
+    LibMK_Color_Filter* filter, LibMK_Color_Sum* sum);
+
+/** @brief Add the sum src to the sum dst */
+void libmk_add_color_sum(LibMK_Color_Sum* dst, LibMK_Color_Sum* src);
+
+/** @brief Sum the colors of the pixels in each key zone of a region
+ *
+ * @param image: Image to sum the pixels of
+ * @param x, y: Coordinates of the top-left corner of the region
+ * @param w, h: Size of the region, clipped to the image
+ * @param step: Only every step-th row and column of the region is
+ *    sampled. One samples all pixels.
+ * @param filter: Criteria for the pixels to include, NULL to include
+ *    all pixels
+ * @param sums: Sums to store the results in, overwritten
+ *
+ * The region is split into a grid of LIBMK_MAX_ROWS by LIBMK_MAX_COLS
+ * zones of (nearly) equal size, one for each key in the color matrix.
+ * All zones are summed in a single pass over the region, so a sum per
+ * key costs as much as libmk_sum_image of the whole region. A step
+ * larger than one divides the amount of pixels processed by its square,
+ * but the sampled pixels cannot be processed with vector instructions.
+ */
+void libmk_sum_zones(
+    LibMK_Image* image, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h, unsigned int step,
+    LibMK_Color_Filter* filter,
+    LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]);
+
+/** @brief Calculate the average color of a sum of pixels
+ *
+ * @param filter: Filter the sum was created with, for its brightness
+ *    normalization. NULL for no normalization.
+ * @param color: RGB triplet to store the result in
+ * @returns false if no pixels were included, in which case the color
+ *    is white, true otherwise.
+ */
+bool libmk_get_sum_color(
+    LibMK_Color_Sum* sum, LibMK_Color_Filter* filter, unsigned char color[3]);
+
+/** @brief Calculate the dominant color of a region of an image
+ *
+ * Combines libmk_sum_image and libmk_get_sum_color.
+ */
+bool libmk_get_image_color(
+    LibMK_Image* image, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h,
+    LibMK_Color_Filter* filter, unsigned char color[3]);
+
+/** @brief Calculate the color matrix of a region of an image
+ *
+ * Combines libmk_sum_zones and libmk_get_sum_color. The keys of zones
+ * without any included pixels are turned off. The result may be passed
+ * to libmk_set_all_led_color directly.
+ */
+void libmk_get_zone_colors(
+    LibMK_Image* image, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h, unsigned int step,
+    LibMK_Color_Filter* filter,
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]);
+
+/** @brief Create a pool of workers for parallel reductions
+ *
+ * @param n: Number of workers including the calling thread, zero for
+ *    one worker for every online processor. One worker performs the
+ *    reductions on the calling thread only.
+ * @returns Pointer to the workers, NULL upon failure.
+ */
+LibMK_Workers* libmk_create_workers(unsigned int n);
+
+/** @brief Stop the threads of a pool of workers and free it */
+void libmk_free_workers(LibMK_Workers* workers);
+
+/** @brief Version of libmk_sum_image using a pool of workers
+ *
+ * The results are identical to those of libmk_sum_image. Only one
+ * thread may use a pool of workers at a time.
+ *
+ * @param workers: Workers to split the region over. If NULL, the
+ *    region is summed on the calling thread only.
+ */
+void libmk_sum_image_parallel(
+    LibMK_Workers* workers, LibMK_Image* image,
+    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    LibMK_Color_Filter* filter, LibMK_Color_Sum* sum);
+
+/** @brief Version of libmk_sum_zones using a pool of workers
+ *
+ * @param workers: Workers to split the region over. If NULL, the
+ *    region is summed on the calling thread only.
+ */
+void libmk_sum_zones_parallel(
+    LibMK_Workers* workers, LibMK_Image* image,
+    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    unsigned int step, LibMK_Color_Filter* filter,
+    LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]);
+
+/** @brief Create a capture for a region of the screen
+ *
+ * @param display: Display to capture. If NULL, the default display is
+ *    opened, and closed again by libmk_free_capture.
+ * @param x, y: Coordinates of the top-left corner of the region
+ * @param w, h: Size of the region, zero for the remaining size of the
+ *    root window. The region is clipped to the root window.
+ * @returns Pointer to the capture, NULL upon failure.
+ *
+ * Capturing only the region that is used for the color calculations
+ * reduces the amount of pixels copied by the X server.
+ */
+LibMK_Capture* libmk_create_capture(
+    Display* display, int x, int y, unsigned int w, unsigned int h);
+
+/** @brief Free a capture and its buffers */
+void libmk_free_capture(LibMK_Capture* capture);
+
+/** @brief Capture the region of the screen into capture->image
+ *
+ * The data of the image remains valid until the next capture.
+ *
+ * @returns LIBMK_SUCCESS, or LIBMK_ERR_CAPTURE if the X server failed to
+ *    provide the image.
+ */
+int libmk_capture(LibMK_Capture* capture);
+
+#endif
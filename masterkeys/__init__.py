@@ -9,7 +9,7 @@ except ImportError:
     import warnings
     warnings.warn("Failed to import masterkeys C library", ImportWarning)
 try:
-    from typing import Dict, List, Tuple
+    from typing import Dict, List, Tuple, Union
 except ImportError:  # PyCharm typing
     pass
 
@@ -85,6 +85,52 @@ class ControlMode:
     PROFILE_CTRL = 0x03
 
 
+class ControllerState:
+    ACTIVE = 0
+    STOPPED = 1
+    PRESTART = 2
+    ERROR = 3
+    JOIN_ERR = 4
+    START_ERR = 5
+
+
+class OverflowPolicy:
+    BLOCK = 0
+    DROP_OLDEST = 1
+    COALESCE = 2
+
+
+class Generator:
+    BREATHE = 0
+    GRADIENT = 1
+    WAVE = 2
+    RIPPLE = 3
+
+
+class Easing:
+    LINEAR = 0
+    IN = 1
+    OUT = 2
+    IN_OUT = 3
+
+
+class LatePolicy:
+    EXECUTE = 0
+    SKIP = 1
+
+
+class Layout:
+    ANSI = 1
+    ISO = 2
+
+
+class Transport:
+    LIBUSB = 0
+    LIBUSB_ASYNC = 1
+    HIDRAW = 2
+    MOCK = 3
+
+
 MODEL_STRINGS = {
     0: "MasterKeys Pro L RGB",
     5: "MasterKeys Pro M RGB",
@@ -126,6 +172,90 @@ def set_device(model):
     return _mk.set_device(model)
 
 
+def set_mock_device(model, layout=Layout.ANSI):
+    # type: (int, int) -> int
+    """
+    Set the device to be controlled by the library to an emulation
+
+    The emulated keyboard records the packets sent to it and responds
+    like a keyboard would, so that programs may be tested without a
+    device. Control must be enabled as for a connected device.
+
+    :param model: Model to emulate (:class:`.Model`)
+    :type model: int
+    :param layout: Layout reported by the emulation (:class:`.Layout`)
+    :type layout: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_mock_device(model, layout)
+
+
+def set_transport(transport):
+    # type: (int) -> int
+    """
+    Select the backend that transfers the packets of the device
+
+    Must be called before control is enabled. ``Transport.HIDRAW``
+    leaves the kernel driver attached, so that enabling and disabling
+    control is faster, but requires access to the hidraw node of the
+    device. ``Transport.MOCK`` replaces the device with an emulation.
+
+    :param transport: Backend to use (:class:`.Transport`)
+    :type transport: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_transport(transport)
+
+
+def set_write_ahead(window):
+    # type: (int) -> int
+    """
+    Send the LED packets without waiting for their responses
+
+    Up to ``window`` packets of :func:`set_all_led_color` are sent
+    before the oldest response is read, so that the rate of updates is
+    limited by the bandwidth rather than the latency of the device. A
+    failed response is reported by a later call.
+
+    :param window: Number of packets sent ahead of their responses, at
+        most 16. Zero, the default, waits for every response.
+    :type window: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_write_ahead(window)
+
+
+def get_stats(reset=False):
+    # type: (bool) -> Union[Dict[str, Union[int, Tuple[int, ...]]], int]
+    """
+    Return the transfer counters of the device set
+
+    :param reset: Whether to reset the counters afterwards
+    :type reset: bool
+    :return: Dictionary with the keys packets, responses, bytes, errors,
+        timeouts, protocol_errors, latency_sum and latency_max
+        (microseconds) and latency, a histogram of the latencies in
+        which bucket k counts latencies below 2 ** k microseconds. A
+        result code (:class:`.ResultCode`) if no device is set.
+    :rtype: Dict[str, Union[int, Tuple[int, ...]]] or int
+    """
+    return _mk.get_stats(reset)
+
+
+def get_mock_packets():
+    # type: () -> int
+    """
+    Return the number of packets sent to the emulated keyboard
+
+    :return: Number of packets, -1 if the device is not an emulation
+    :rtype: int
+    """
+    return _mk.get_mock_packets()
+
+
 def enable_control():
     # type: () -> int
     """
@@ -163,17 +293,21 @@ def set_effect(effect):
 
 
 def set_all_led_color(layout):
-    # type: (List[List[Tuple[int, int, int], ...], ...]) -> int
+    # type: (Union[List[List[Tuple[int, int, int], ...], ...], bytes]) -> int
     """
     Set the color of all LEDs on the keyboard individually
 
     :param layout: List of lists of color tuples such as created by
-        build_layout_list()
-    :type layout: List[List[Tuple[int, int, int], ...], ...]
+        build_layout_list(), or an object supporting the buffer
+        protocol of MAX_ROWS * MAX_COLS * 3 bytes in the same order,
+        such as ``bytes``, ``bytearray`` or a ``numpy`` array of
+        ``uint8`` with shape ``(MAX_ROWS, MAX_COLS, 3)``. Buffers are
+        copied directly and are therefore much faster than lists.
+    :type layout: Union[List[List[Tuple[int, int, int], ...], ...], bytes]
     :return: Result code (:class:`.ResultCode`)
     :rtype: int
     :raises: ``ValueError`` if the wrong amount of elements is in the
-        list
+        list or the buffer is of the wrong size
     :raises: ``TypeError`` if invalid argument type (any element)
     """
     return _mk.set_all_led_color(layout)
@@ -218,6 +352,24 @@ def set_ind_led_color(row, col, r, g, b):
     return _mk.set_ind_led_color(row, col, r, g, b)
 
 
+def set_ind_led_colors(keys):
+    # type: (List[Tuple[int, int, Tuple[int, int, int]]]) -> int
+    """
+    Set the color of a number of individual keys on the keyboard
+
+    Uses as few USB transfers as possible, so it is faster than calling
+    :func:`.set_ind_led_color` for every key. Later entries for the same
+    key take precedence.
+
+    :param keys: list of (row, col, (r, g, b)) tuples
+    :type keys: List[Tuple[int, int, Tuple[int, int, int]]]
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    :raises: ``TypeError`` upon invalid argument type
+    """
+    return _mk.set_ind_led_colors(keys)
+
+
 def get_device_ident():
     # type: () -> int
     """
@@ -294,6 +446,26 @@ def set_effect_details(effect, direction=0, speed=0x60, amount=0x00,
         effect, direction, speed, amount, foreground, background)
 
 
+def update_effect(effect, direction=0, speed=0x60, amount=0x00,
+                  foreground=(0xFF, 0xFF, 0xFF),
+                  background=(0x00, 0x00, 0x00)):
+    # type: (int, int, int, int, Tuple[int, int, int], Tuple[int, int, int]) -> int
+    """
+    Set an effect with custom parameters, sending only what changed
+
+    Results in the same state as :func:`set_effect_details`, but only
+    the parameters that differ from the effect last applied are sent
+    to the keyboard. Changing only the colors of an effect takes a
+    single packet, so effects rendered by the keyboard itself may be
+    changed at a high rate.
+
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.update_effect(
+        effect, direction, speed, amount, foreground, background)
+
+
 def get_active_profile():
     # type: () -> int
     """
@@ -341,3 +513,307 @@ def set_control_mode(mode):
     """
     return _mk.set_control_mode(mode)
 
+
+def calculate_zone_colors(data, width, height, step=1):
+    # type: (bytes, int, int, int) -> List[List[Tuple[int, int, int], ...], ...]
+    """
+    Calculate the average colors of the key zones of an image
+
+    The image is split into a grid of :data:`MAX_ROWS` by
+    :data:`MAX_COLS` zones of (nearly) equal size, one for each key.
+
+    :param data: Pixel data of the image, row by row, three bytes per
+        pixel (red, green, blue). For example the result of
+        ``PIL.Image.tobytes()`` for an image in RGB mode.
+    :type data: bytes
+    :param width: Width of the image in pixels
+    :type width: int
+    :param height: Height of the image in pixels
+    :type height: int
+    :param step: Only every step-th row and column is sampled, which
+        speeds up the calculation for large images
+    :type step: int
+    :return: List of lists of color tuples such as used by
+        set_all_led_color()
+    :rtype: List[List[Tuple[int, int, int], ...], ...]
+    :raises: ``ValueError`` if data is too small for the given size
+    """
+    return _mk.calculate_zone_colors(data, width, height, step)
+
+
+class Controller(object):
+    """
+    Controller executing instructions on a keyboard in a native thread
+
+    Opens its own handle to the keyboard, so it does not use the device
+    set with :func:`set_device`. The instructions are sent to the
+    keyboard by a thread of libmkc, outside of the Python interpreter,
+    so Python threads are not blocked by USB transfers. The methods that
+    schedule instructions return the ID of the first instruction
+    scheduled (positive), or a result code (:class:`.ResultCode`,
+    negative) upon failure.
+
+    :param model: Model of the keyboard to control (:class:`.Model`)
+    :type model: int
+    :raises: ``RuntimeError`` if the keyboard could not be opened
+    """
+
+    def __init__(self, model):
+        # type: (int) -> None
+        self._c = _mk.Controller(model)
+
+    def start(self):
+        # type: () -> int
+        """
+        Enable control of the keyboard and start the controller thread
+
+        :return: Result code (:class:`.ResultCode`)
+        :rtype: int
+        """
+        return self._c.start()
+
+    def stop(self):
+        # type: () -> None
+        """Request the controller to exit without executing its queue"""
+        self._c.stop()
+
+    def wait(self):
+        # type: () -> None
+        """Request the controller to exit once its queue is empty"""
+        self._c.wait()
+
+    def join(self, timeout=1.0):
+        # type: (float) -> int
+        """
+        Wait for the controller to exit
+
+        :param timeout: Timeout in seconds
+        :type timeout: float
+        :return: State of the controller (:class:`.ControllerState`),
+            ``ControllerState.JOIN_ERR`` upon timeout
+        :rtype: int
+        """
+        return self._c.join(timeout)
+
+    def get_state(self):
+        # type: () -> int
+        """Return the state of the controller (:class:`.ControllerState`)"""
+        return self._c.get_state()
+
+    def get_error(self):
+        # type: () -> int
+        """Return the error that stopped the controller (:class:`.ResultCode`)
+        """
+        return self._c.get_error()
+
+    def set_full_led_color(self, r, g, b, duration=0):
+        # type: (int, int, int, int) -> int
+        """
+        Schedule an instruction to set the color of all LEDs
+
+        :param duration: Time in microseconds before the next
+            instruction is executed
+        :type duration: int
+        :return: Instruction ID or result code
+        :rtype: int
+        """
+        return self._c.set_full_led_color(r, g, b, duration)
+
+    def set_all_led_color(self, layout, duration=0):
+        # type: (Union[List[List[Tuple[int, int, int], ...], ...], bytes], int) -> int
+        """
+        Schedule an instruction to set the color of all LEDs individually
+
+        :param layout: Layout as accepted by :func:`set_all_led_color`
+        :param duration: Time in microseconds before the next
+            instruction is executed
+        :type duration: int
+        :return: Instruction ID or result code
+        :rtype: int
+        :raises: ``ValueError``, ``TypeError`` as
+            :func:`set_all_led_color`
+        """
+        return self._c.set_all_led_color(layout, duration)
+
+    def set_ind_led_color(self, row, col, r, g, b, duration=0):
+        # type: (int, int, int, int, int, int) -> int
+        """
+        Schedule an instruction to set the color of a single LED
+
+        :return: Instruction ID or result code
+        :rtype: int
+        """
+        return self._c.set_ind_led_color(row, col, r, g, b, duration)
+
+    def flash(self, r, g, b, delay, n):
+        # type: (int, int, int, int, int) -> int
+        """
+        Schedule instructions to flash the keyboard in a color
+
+        :param delay: Duration of each step in microseconds
+        :type delay: int
+        :param n: Number of steps
+        :type n: int
+        :return: ID of the first instruction or result code
+        :rtype: int
+        """
+        return self._c.flash(r, g, b, delay, n)
+
+    def generate(self, type, foreground, background, period, duration,
+                 frames=0, size=8, row=0, column=0):
+        # type: (int, Tuple[int, int, int], Tuple[int, int, int], int, int, int, int, int, int) -> int
+        """
+        Schedule an animation that is rendered frame by frame
+
+        The frames are rendered by the controller when they are shown,
+        so an animation of any length takes a constant amount of
+        memory. An animation without a limit on the number of frames
+        is shown until another instruction is scheduled.
+
+        :param type: Animation to render (:class:`.Generator`)
+        :type type: int
+        :param period: Number of frames in a cycle of the animation
+        :type period: int
+        :param duration: Time between the frames in microseconds
+        :type duration: int
+        :param frames: Number of frames to show, zero for no limit
+        :type frames: int
+        :param size: Keys in a cycle of a gradient or wave, or the width
+            of the rings of a ripple
+        :type size: int
+        :param row: Row of the key the rings of a ripple expand from
+        :type row: int
+        :param column: Column of the key the rings of a ripple expand
+            from
+        :type column: int
+        :return: ID of the instruction or result code
+        :rtype: int
+        """
+        return self._c.generate(
+            type, foreground, background, period, duration, frames, size,
+            row, column)
+
+    def transition(self, layout, duration, easing=Easing.LINEAR, interval=0):
+        # type: (Union[List[List[Tuple[int, int, int], ...], ...], bytes], int, int, int) -> int
+        """
+        Schedule a transition of all LEDs from their current colors
+
+        The frames are rendered by the controller until the colors of
+        the layout are reached, after which no more frames are sent.
+
+        :param layout: Layout as accepted by :func:`set_all_led_color`
+        :param duration: Duration of the transition in microseconds
+        :type duration: int
+        :param easing: Progression of the colors over time
+            (:class:`.Easing`)
+        :type easing: int
+        :param interval: Time between the frames in microseconds, zero
+            for the default of 10 milliseconds
+        :type interval: int
+        :return: ID of the instruction or result code
+        :rtype: int
+        :raises: ``ValueError``, ``TypeError`` as
+            :func:`set_all_led_color`
+        """
+        return self._c.transition(layout, duration, easing, interval)
+
+    def cancel(self, id):
+        # type: (int) -> int
+        """
+        Cancel a scheduled instruction by its ID
+
+        :return: Result code (:class:`.ResultCode`)
+        :rtype: int
+        """
+        return self._c.cancel(id)
+
+    def set_overflow_policy(self, policy):
+        # type: (int) -> None
+        """Set the behaviour upon a full queue (:class:`.OverflowPolicy`)"""
+        self._c.set_overflow_policy(policy)
+
+    def set_coalesce(self, coalesce):
+        # type: (bool) -> None
+        """Enable or disable the merging of pending instructions"""
+        self._c.set_coalesce(coalesce)
+
+    def set_late_policy(self, policy, tolerance=0):
+        # type: (int, int) -> None
+        """
+        Set the behaviour for late instructions
+
+        :param policy: Behaviour for late instructions
+            (:class:`.LatePolicy`)
+        :type policy: int
+        :param tolerance: Lateness in microseconds before an
+            instruction is considered late
+        :type tolerance: int
+        """
+        self._c.set_late_policy(policy, tolerance)
+
+    def set_write_ahead(self, window):
+        # type: (int) -> int
+        """
+        Send the LED packets without waiting for their responses
+
+        Must be called before the controller is started. See
+        :func:`set_write_ahead`.
+
+        :param window: Number of packets sent ahead of their responses
+        :type window: int
+        :return: Result code (:class:`.ResultCode`)
+        :rtype: int
+        """
+        return self._c.set_write_ahead(window)
+
+    def get_timing_stats(self, reset=False):
+        # type: (bool) -> Dict[str, int]
+        """
+        Return the timing statistics of the controller
+
+        :param reset: Whether to reset the statistics afterwards
+        :type reset: bool
+        :return: Dictionary with the keys executed, skipped,
+            jitter_last, jitter_max and jitter_mean (microseconds)
+        :rtype: Dict[str, int]
+        """
+        return self._c.get_timing_stats(reset)
+
+    def get_stats(self, reset=False):
+        # type: (bool) -> Dict[str, Union[int, Tuple[int, ...]]]
+        """
+        Return the transfer counters of the keyboard of the controller
+
+        :param reset: Whether to reset the counters afterwards
+        :type reset: bool
+        :return: Dictionary as returned by :func:`get_stats`
+        :rtype: Dict[str, Union[int, Tuple[int, ...]]]
+        """
+        return self._c.get_stats(reset)
+
+
+def get_pollfds():
+    # type: () -> List[Tuple[int, int]]
+    """
+    Return the file descriptors to poll for libusb events
+
+    Used by :class:`masterkeys.aio.AsyncKeyboard` to integrate the
+    asynchronous transfers into an event loop.
+
+    :return: List of (fd, events) tuples, events as for ``select.poll``
+    :rtype: List[Tuple[int, int]]
+    """
+    return _mk.get_pollfds()
+
+
+def handle_events(timeout=0):
+    # type: (int) -> int
+    """
+    Handle pending libusb events, completing asynchronous transfers
+
+    :param timeout: Maximum time to block in milliseconds
+    :type timeout: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.handle_events(timeout)
@@ -0,0 +1,131 @@
+"""
+Author: RedFantom
+License: GNU GPLv3
+Copyright (c) 2018-2019 RedFantom
+
+Awaitable keyboard updates for programs built around asyncio
+
+The frames are transferred with the asynchronous transfers of libmk,
+and the libusb events are handled when its file descriptors become
+ready in the event loop, so no threads are required.
+"""
+import asyncio
+import select
+from . import masterkeys as _mk
+from . import ResultCode, MAX_ROWS, MAX_COLS
+
+
+class AsyncKeyboard(object):
+    """
+    Update the LEDs of the device set with :func:`set_device` from an
+    asyncio event loop
+
+    Control of the device must be enabled with :func:`enable_control`
+    before the keyboard is created, and may only be disabled after it
+    has been closed. Updates are executed one at a time in the order in
+    which they are awaited. Only the packets that differ from the
+    previous update are transferred.
+
+    :param loop: Event loop to handle the libusb events in. Defaults to
+        the event loop of the current thread.
+    :raises: ``RuntimeError`` if no device is set
+    """
+
+    def __init__(self, loop=None):
+        self._loop = loop if loop is not None else asyncio.get_event_loop()
+        self._frame = _mk.Frame()
+        self._lock = asyncio.Lock()
+        self._future = None
+        self._readers = set()
+        self._writers = set()
+        self._timer = None
+        self._watch()
+
+    async def set_all_led_color(self, layout):
+        # type: (Union[List[List[Tuple[int, int, int], ...], ...], bytes]) -> int
+        """
+        Set the color of all LEDs on the keyboard individually
+
+        :param layout: Layout as accepted by :func:`set_all_led_color`
+        :return: Result code (:class:`.ResultCode`)
+        :rtype: int
+        :raises: ``ValueError``, ``TypeError`` as
+            :func:`set_all_led_color`
+        """
+        async with self._lock:
+            r = self._frame.submit(layout)
+            if r != ResultCode.SUCCESS:
+                return r
+            if not self._frame.done():
+                self._future = self._loop.create_future()
+                # Opening a device may have changed the file descriptors
+                self._watch()
+                try:
+                    await self._future
+                finally:
+                    self._future = None
+            return self._frame.result()
+
+    async def set_full_led_color(self, r, g, b):
+        # type: (int, int, int) -> int
+        """
+        Set the color of all LEDs on the keyboard to a single color
+
+        :return: Result code (:class:`.ResultCode`)
+        :rtype: int
+        """
+        color = bytes(bytearray((r, g, b)))
+        return await self.set_all_led_color(color * (MAX_ROWS * MAX_COLS))
+
+    def close(self):
+        # type: () -> None
+        """Stop handling libusb events in the event loop"""
+        for fd in self._readers:
+            self._loop.remove_reader(fd)
+        for fd in self._writers:
+            self._loop.remove_writer(fd)
+        self._readers, self._writers = set(), set()
+        if self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+
+    def _watch(self):
+        """Register the current libusb file descriptors with the loop"""
+        fds = _mk.get_pollfds()
+        if isinstance(fds, int):
+            raise RuntimeError("Failed to get poll fds: {}".format(fds))
+        readers = {fd for fd, events in fds if events & select.POLLIN}
+        writers = {fd for fd, events in fds if events & select.POLLOUT}
+        for fd in self._readers - readers:
+            self._loop.remove_reader(fd)
+        for fd in readers - self._readers:
+            self._loop.add_reader(fd, self._handle_events)
+        for fd in self._writers - writers:
+            self._loop.remove_writer(fd)
+        for fd in writers - self._writers:
+            self._loop.add_writer(fd, self._handle_events)
+        self._readers, self._writers = readers, writers
+        self._schedule_timeout()
+
+    def _schedule_timeout(self):
+        """Handle the events after the next libusb timeout expires"""
+        if self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+        timeout = _mk.get_next_timeout()
+        if timeout >= 0:
+            self._timer = self._loop.call_later(
+                timeout / 1000.0, self._handle_events)
+
+    def _handle_events(self):
+        """Handle ready libusb events and complete the awaited update"""
+        self._timer = None
+        r = _mk.handle_events(0)
+        future = self._future
+        if future is not None and not future.done():
+            if r != ResultCode.SUCCESS:
+                future.set_exception(
+                    RuntimeError("Failed to handle events: {}".format(r)))
+            elif self._frame.done():
+                future.set_result(None)
+        self._schedule_timeout()
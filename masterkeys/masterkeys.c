@@ -9,9 +9,13 @@
  * to control MasterKeys RGB keyboards. For python interface
  * documentation, please check __init__.py.
 */
+// Python.h must be included before any system headers
+#include <Python.h>
 #include "../libmk/libmk.h"
+#include "../libmk/libmkc.h"
+#include "../libmk/libmks.h"
+#include <pthread.h>
 #include <stdlib.h>
-#include <Python.h>
 
 
 #if PY_MAJOR_VERSION >= 3
@@ -21,6 +25,28 @@
 #endif
 
 
+/** Serializes the use of the global device handle of libmk
+ *
+ * Python threads may call the functions of the module concurrently
+ * once the GIL is released, but the global device handle is not
+ * thread-safe.
+ */
+static pthread_mutex_t DeviceLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Perform a blocking libmk call with the GIL released
+ *
+ * The GIL is released before DeviceLock is acquired, so a thread that
+ * waits for another thread performing a USB transfer does not block the
+ * interpreter.
+ */
+#define MASTERKEYS_CALL(call) \
+    Py_BEGIN_ALLOW_THREADS \
+    pthread_mutex_lock(&DeviceLock); \
+    call; \
+    pthread_mutex_unlock(&DeviceLock); \
+    Py_END_ALLOW_THREADS
+
+
 static PyObject* masterkeys_init(PyObject* self, PyObject* args) {
     /** Initialize the library upon import and register libmk_exit
      *
@@ -47,9 +73,10 @@ static PyObject* masterkeys_detect_devices(PyObject* self, PyObject* args) {
      * root privileges are required.
     */
     LibMK_Model* models;
-    int r = libmk_detect_devices(&models);
+    int r;
+    MASTERKEYS_CALL(r = libmk_detect_devices(&models));
     if (r < 0)
-        return Py_None;
+        Py_RETURN_NONE;
     PyObject * tuple = PyTuple_New(r);
     PyObject * elem;
     for (short i=0; i < r; i++) {
@@ -75,21 +102,104 @@ static PyObject* masterkeys_set_device(PyObject* self, PyObject* args) {
     LibMK_Model model;
     if (!PyArg_ParseTuple(args, "i", &model))
         return NULL;
-    int r = libmk_set_device(model, NULL);
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_device(model, NULL));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_set_mock_device(PyObject* self, PyObject* args) {
+    /** Set the device to control to an emulated keyboard */
+    LibMK_Model model;
+    LibMK_Layout layout = LIBMK_LAYOUT_ANSI;
+    if (!PyArg_ParseTuple(args, "i|i", &model, &layout))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_create_mock_handle(NULL, model, layout));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_set_transport(PyObject* self, PyObject* args) {
+    /** Select the backend transferring the packets of the device */
+    LibMK_Transport_Type type;
+    if (!PyArg_ParseTuple(args, "i", &type))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_transport(NULL, type));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_get_mock_packets(PyObject* self, PyObject* args) {
+    /** Return the number of packets written to the emulated keyboard */
+    LibMK_Mock* mock;
+    long n = -1;
+    MASTERKEYS_CALL(
+        mock = libmk_get_mock(NULL);
+        if (mock != NULL)
+            n = (long) mock->n);
+    return PyInt_FromLong(n);
+}
+
+
+static PyObject* masterkeys_set_write_ahead(PyObject* self, PyObject* args) {
+    /** Set the number of LED packets sent ahead of their responses */
+    unsigned int window;
+    if (!PyArg_ParseTuple(args, "I", &window))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_write_ahead(NULL, window));
     return PyInt_FromLong(r);
 }
 
 
+static PyObject* masterkeys_build_stats(LibMK_Stats* stats) {
+    /** Build a dict of transfer counters, the histogram as a tuple */
+    PyObject* latency = PyTuple_New(LIBMK_STATS_BUCKETS);
+    if (latency == NULL)
+        return NULL;
+    for (int k = 0; k < LIBMK_STATS_BUCKETS; k++)
+        PyTuple_SET_ITEM(
+            latency, k, PyLong_FromUnsignedLongLong(stats->latency[k]));
+    return Py_BuildValue(
+        "{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N}",
+        "packets", stats->packets, "responses", stats->responses,
+        "bytes", stats->bytes, "errors", stats->errors,
+        "timeouts", stats->timeouts,
+        "protocol_errors", stats->protocol_errors,
+        "latency_sum", stats->latency_sum, "latency_max", stats->latency_max,
+        "latency", latency);
+}
+
+
+static PyObject* masterkeys_get_stats(PyObject* self, PyObject* args) {
+    /** Return the transfer counters of the device as a dict */
+    PyObject* reset = Py_False;
+    if (!PyArg_ParseTuple(args, "|O", &reset))
+        return NULL;
+    bool clear = PyObject_IsTrue(reset) == 1;
+    LibMK_Stats stats;
+    int r;
+    MASTERKEYS_CALL(r = libmk_get_stats(NULL, &stats, clear));
+    if (r != LIBMK_SUCCESS)
+        return PyInt_FromLong(r);
+    return masterkeys_build_stats(&stats);
+}
+
+
 static PyObject* masterkeys_enable_control(PyObject* self, PyObject* args) {
     /** Enable control of the set control device */
-    int r = libmk_enable_control(NULL);  // NULL -> global DeviceHandle
+    int r;  // NULL -> global DeviceHandle
+    MASTERKEYS_CALL(r = libmk_enable_control(NULL));
     return PyInt_FromLong(r);
 }
 
 
 static PyObject* masterkeys_disable_control(PyObject* self, PyObject* args) {
     /** Disable control of the set control device */
-    int r = libmk_disable_control(NULL);  // NULL -> global DeviceHandle
+    int r;  // NULL -> global DeviceHandle
+    MASTERKEYS_CALL(r = libmk_disable_control(NULL));
     return PyInt_FromLong(r);
 }
 
@@ -99,7 +209,8 @@ static PyObject* masterkeys_set_effect(PyObject* self, PyObject* args) {
     LibMK_Effect effect;
     if (!PyArg_ParseTuple(args, "i", &effect))
         return NULL;
-    int r = libmk_set_effect(NULL, effect);
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_effect(NULL, effect));
     return PyInt_FromLong(r);
 }
 
@@ -112,44 +223,37 @@ static PyObject* masterkeys_set_full_color(PyObject* self, PyObject* args) {
     int r, g, b;
     if (!PyArg_ParseTuple(args, "iii", &r, &g, &b))
         return NULL;
-    int result = libmk_set_full_color(NULL, r, g, b);
+    int result;
+    MASTERKEYS_CALL(result = libmk_set_full_color(NULL, r, g, b));
     return PyInt_FromLong(result);
 }
 
 
-static PyObject* masterkeys_set_all_led_color(PyObject* self, PyObject* args) {
-    /** Set the color of all the LEDs on the keyboard individually
-     *
-     * Allocates a layout matrix of color values to set the color of all
-     * the LEDs on the control device. LEDs not supported on a specific
-     * keyboard are ignored. The argument should be given as a list of
-     * lists of tuples [row][column][index].
-    */
-    PyObject* list, *sub, *tuple, *item;
+static bool masterkeys_parse_layout_list(
+        PyObject* list,
+        unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    /** Copy a list of lists of tuples [row][column][index] into layout */
+    PyObject* sub, *tuple, *item;
     unsigned char value;
-    // Parse the list of lists of tuples
-    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list))
-        return NULL;
     // Check the size of the list (it must be a full list)
     if (PyList_Size(list) != LIBMK_MAX_ROWS) {
         // raise ValueError("Invalid number of list elements")
         PyErr_SetString(PyExc_ValueError, "Invalid number of list elements");
-        return NULL;
+        return false;
     }
     // Populate layout color buffer
-    unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
     for (unsigned char r=0; r < LIBMK_MAX_ROWS; r++) {
         // Assert that the item in the list is also a list
         sub = PyList_GetItem(list, r);
         if (!PyList_Check(sub)) {
             // raise TypeError("Invalid sub-type in list")
             PyErr_SetString(PyExc_TypeError, "Invalid sub-type in list");
-            return NULL;
+            return false;
         } else if (PyList_Size(sub) != LIBMK_MAX_COLS) {
             // raise ValueError("Invalid number of sub-list elements")
             PyErr_SetString(
                 PyExc_ValueError, "Invalid number of sub-list elements");
-            return NULL;
+            return false;
         }
         for (unsigned char c=0; c < LIBMK_MAX_COLS; c++) {
             // Get sub-list item and assert that it is a tuple,3
@@ -158,12 +262,12 @@ static PyObject* masterkeys_set_all_led_color(PyObject* self, PyObject* args) {
                 // raise TypeError("Invalid type of sub-list element")
                 PyErr_SetString(
                     PyExc_TypeError, "Invalid type of sub-list element");
-                return NULL;
+                return false;
             } else if (PyTuple_Size(tuple) != 3) {
                 // raise ValueError("Invalid number of tuple elements")
                 PyErr_SetString(
                     PyExc_ValueError, "Invalid number of tuple elements");
-                return NULL;
+                return false;
             }
             for (unsigned char i=0; i < 3; i++) {
                 // Read a value from the sub-list tuple-element
@@ -172,7 +276,7 @@ static PyObject* masterkeys_set_all_led_color(PyObject* self, PyObject* args) {
                     // raise TypeError("Invalid tuple element type")
                     PyErr_SetString(
                         PyExc_TypeError, "Invalid tuple element type");
-                    return NULL;
+                    return false;
                 }
                 // Update buffer with specified value
                 value = (unsigned char) PyInt_AsLong(item);
@@ -180,8 +284,72 @@ static PyObject* masterkeys_set_all_led_color(PyObject* self, PyObject* args) {
             }
         }
     }
-    // Perform the keyboard LED update
-    int code = libmk_set_all_led_color(NULL, (unsigned char*) layout);
+    return true;
+}
+
+
+static bool masterkeys_parse_layout_buffer(
+        PyObject* object,
+        unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    /** Copy an object supporting the buffer protocol into layout
+     *
+     * The buffer must consist of LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3
+     * bytes, such as a bytes object or a numpy array of uint8 with
+     * shape (LIBMK_MAX_ROWS, LIBMK_MAX_COLS, 3). Non-contiguous buffers,
+     * such as slices of arrays, are supported.
+     */
+    Py_buffer view;
+    if (PyObject_GetBuffer(object, &view, PyBUF_FULL_RO) != 0)
+        return false;
+    if (view.itemsize != 1 ||
+            view.len != LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3) {
+        PyBuffer_Release(&view);
+        // raise ValueError("Invalid size of buffer")
+        PyErr_SetString(PyExc_ValueError, "Invalid size of buffer");
+        return false;
+    }
+    int r = PyBuffer_ToContiguous((void*) layout, &view, view.len, 'C');
+    PyBuffer_Release(&view);
+    return r == 0;
+}
+
+
+static bool masterkeys_parse_layout(
+        PyObject* object,
+        unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
+    /** Copy a list of lists of tuples or a buffer into layout */
+    if (PyList_Check(object))
+        return masterkeys_parse_layout_list(object, layout);
+    else if (PyObject_CheckBuffer(object))
+        return masterkeys_parse_layout_buffer(object, layout);
+    // raise TypeError("Invalid layout type")
+    PyErr_SetString(
+        PyExc_TypeError, "Layout must be a list or support the buffer "
+                         "protocol");
+    return false;
+}
+
+
+static PyObject* masterkeys_set_all_led_color(PyObject* self, PyObject* args) {
+    /** Set the color of all the LEDs on the keyboard individually
+     *
+     * Allocates a layout matrix of color values to set the color of all
+     * the LEDs on the control device. LEDs not supported on a specific
+     * keyboard are ignored. The argument should be given as a list of
+     * lists of tuples [row][column][index], or as an object supporting
+     * the buffer protocol with the same layout of bytes. Buffers are
+     * copied directly, without conversion of individual elements.
+    */
+    PyObject* object;
+    if (!PyArg_ParseTuple(args, "O", &object))
+        return NULL;
+    unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    if (!masterkeys_parse_layout(object, layout))
+        return NULL;
+    // Perform the keyboard LED update without holding the GIL
+    int code;
+    MASTERKEYS_CALL(
+        code = libmk_set_all_led_color(NULL, (unsigned char*) layout));
     return PyInt_FromLong(code);
 }
 
@@ -191,53 +359,113 @@ static PyObject* masterkeys_set_ind_led_color(PyObject* self, PyObject* args) {
     int row, col, r, g, b;
     if (!PyArg_ParseTuple(args, "iiiii", &row, &col, &r, &g, &b))
         return NULL;
-    int result = libmk_set_single_led(NULL, row, col, r, g, b);
+    int result;
+    MASTERKEYS_CALL(result = libmk_set_single_led(NULL, row, col, r, g, b));
     return PyInt_FromLong(result);
 }
 
 
-static PyObject* masterkeys_set_effect_details(PyObject* self, PyObject* args) {
-    /** Set the an effect with additional arguments */
-    unsigned char effect, direction, speed, amount;
+static PyObject* masterkeys_set_ind_led_colors(PyObject* self, PyObject* args) {
+    /** Set the color of a number of LEDs on the keyboard
+     *
+     * Accepts a list of (row, column, (r, g, b)) tuples. libmk chooses
+     * between single key packets and full LED packets, whichever
+     * requires fewer transfers.
+     */
+    PyObject* list;
+    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &list))
+        return NULL;
+    Py_ssize_t n = PyList_Size(list);
+    LibMK_Key_Color* keys = (LibMK_Key_Color*) malloc(
+        sizeof(LibMK_Key_Color) * (n > 0 ? n : 1));
+    if (keys == NULL)
+        return PyErr_NoMemory();
+    int row, col, r, g, b;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (!PyArg_ParseTuple(PyList_GetItem(list, i), "ii(iii)",
+                              &row, &col, &r, &g, &b)) {
+            free(keys);
+            return NULL;
+        }
+        keys[i].row = (unsigned char) row;
+        keys[i].col = (unsigned char) col;
+        keys[i].color[0] = (unsigned char) r;
+        keys[i].color[1] = (unsigned char) g;
+        keys[i].color[2] = (unsigned char) b;
+    }
+    int result;
+    MASTERKEYS_CALL(
+        result = libmk_set_led_colors(NULL, keys, (unsigned int) n));
+    free(keys);
+    return PyInt_FromLong(result);
+}
+
+
+static int masterkeys_parse_effect(
+        PyObject* args, LibMK_Effect_Details* effect_struct) {
+    /** Parse the arguments of an effect into a LibMK_Effect_Details */
+    int effect, direction, speed, amount;
     PyObject* foreground;
     PyObject* background;
     int r = PyArg_ParseTuple(
         args, "iiiiO!O!",
         &effect, &direction, &speed, &amount,
         &PyTuple_Type, &foreground, &PyTuple_Type, &background);
-    if (!r) return NULL;
-    LibMK_Effect_Details* effect_struct =
-        (LibMK_Effect_Details*) malloc(sizeof(LibMK_Effect_Details));
+    if (!r) return 0;
     effect_struct->effect = (LibMK_Effect) effect;
-    effect_struct->direction = direction;
-    effect_struct->speed = speed;
-    effect_struct->amount = amount;
+    effect_struct->direction = (unsigned char) direction;
+    effect_struct->speed = (unsigned char) speed;
+    effect_struct->amount = (unsigned char) amount;
     PyObject* iterim;
     for (unsigned char i=0; i < 3; i++) {
         iterim = PyTuple_GetItem(foreground, i);
         if (iterim == NULL)
-            return NULL;
+            return 0;
         effect_struct->foreground[i] = (unsigned char) PyLong_AsLong(iterim);
         iterim = PyTuple_GetItem(background, i);
         if (iterim == NULL)
-            return NULL;
+            return 0;
         effect_struct->background[i] = (unsigned char) PyLong_AsLong(iterim);
     }
-    r = libmk_set_effect_details(NULL, effect_struct);
+    return 1;
+}
+
+
+static PyObject* masterkeys_set_effect_details(PyObject* self, PyObject* args) {
+    /** Set the an effect with additional arguments */
+    LibMK_Effect_Details effect_struct;
+    if (!masterkeys_parse_effect(args, &effect_struct))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_effect_details(NULL, &effect_struct));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_update_effect(PyObject* self, PyObject* args) {
+    /** Set an effect, sending only the parameters that changed */
+    LibMK_Effect_Details effect_struct;
+    if (!masterkeys_parse_effect(args, &effect_struct))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_update_effect(NULL, &effect_struct));
     return PyInt_FromLong(r);
 }
 
 
 static PyObject* masterkeys_get_device_ident(PyObject* self, PyObject* args) {
     /** Return the bDevice value for the controlled keyboard */
-    return PyInt_FromLong(libmk_get_device_ident(NULL));
+    int r;
+    MASTERKEYS_CALL(r = libmk_get_device_ident(NULL));
+    return PyInt_FromLong(r);
 }
 
 
 static PyObject* masterkeys_get_active_profile(PyObject* self, PyObject* args) {
     /** Return the active profile on the keyboard */
     char profile;
-    int r = libmk_get_active_profile(NULL, &profile);
+    int r;
+    MASTERKEYS_CALL(r = libmk_get_active_profile(NULL, &profile));
     if (r != LIBMK_SUCCESS)
         return NULL;
     return PyInt_FromLong(profile);
@@ -249,14 +477,16 @@ static PyObject* masterkeys_set_active_profile(PyObject* self, PyObject* args) {
     long profile;
     if (!PyArg_ParseTuple(args, "i", &profile))
         return NULL;
-    int r = libmk_set_active_profile(NULL, profile);
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_active_profile(NULL, profile));
     return PyInt_FromLong(r);
 }
 
 
 static PyObject* masterkeys_save_profile(PyObject* self, PyObject* args) {
     /** Save changes made to the active profile */
-    int r = libmk_save_profile(NULL);
+    int r;
+    MASTERKEYS_CALL(r = libmk_save_profile(NULL));
     return PyInt_FromLong(r);
 }
 
@@ -266,7 +496,701 @@ static PyObject* masterkeys_set_control_mode(PyObject* self, PyObject* args) {
     LibMK_ControlMode mode;
     if (!PyArg_ParseTuple(args, "i", &mode))
         return NULL;
-    return PyInt_FromLong(libmk_set_control_mode(NULL, mode));
+    int r;
+    MASTERKEYS_CALL(r = libmk_set_control_mode(NULL, mode));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_calculate_zone_colors(
+        PyObject* self, PyObject* args) {
+    /** Return a layout list of the average colors of the key zones
+     *
+     * Takes the RGB24 pixel data of an image, such as returned by
+     * PIL.Image.tobytes for an image in RGB mode, and calculates the
+     * average color of every key zone with libmk_get_zone_colors.
+     */
+    Py_buffer buffer;
+    unsigned int width, height, step = 1;
+    if (!PyArg_ParseTuple(args, "s*II|I", &buffer, &width, &height, &step))
+        return NULL;
+    if ((size_t) buffer.len < (size_t) width * height * 3) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(PyExc_ValueError, "Not enough pixel data for size");
+        return NULL;
+    }
+    LibMK_Image image = {
+        buffer.buf, width, height, width * 3, LIBMK_PIXEL_RGB24};
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    Py_BEGIN_ALLOW_THREADS
+    libmk_get_zone_colors(&image, 0, 0, width, height, step, NULL, colors);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&buffer);
+
+    PyObject* layout = PyList_New(LIBMK_MAX_ROWS);
+    if (layout == NULL)
+        return NULL;
+    for (short r=0; r < LIBMK_MAX_ROWS; r++) {
+        PyObject* row = PyList_New(LIBMK_MAX_COLS);
+        if (row == NULL) {
+            Py_DECREF(layout);
+            return NULL;
+        }
+        for (short c=0; c < LIBMK_MAX_COLS; c++)
+            PyList_SET_ITEM(row, c, Py_BuildValue(
+                "(iii)", colors[r][c][0], colors[r][c][1], colors[r][c][2]));
+        PyList_SET_ITEM(layout, r, row);
+    }
+    return layout;
+}
+
+
+/** Python object owning a LibMK_Controller
+ *
+ * Instructions are executed by the native thread of the controller, so
+ * frames scheduled from Python are sent to the keyboard entirely outside
+ * of the interpreter.
+ */
+typedef struct masterkeys_Controller {
+    PyObject_HEAD
+    LibMK_Controller* controller;
+} masterkeys_Controller;
+
+
+static int masterkeys_controller_init(
+        masterkeys_Controller* self, PyObject* args, PyObject* kwargs) {
+    /** Open a device with its own handle and create a controller for it */
+    LibMK_Model model;
+    if (!PyArg_ParseTuple(args, "i", &model))
+        return -1;
+    if (self->controller != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Controller already initialized");
+        return -1;
+    }
+    LibMK_Handle* handle;
+    int r;
+    // The device cache of libmk is shared with the global device handle
+    MASTERKEYS_CALL(r = libmk_set_device(model, &handle));
+    if (r != LIBMK_SUCCESS) {
+        PyErr_Format(PyExc_RuntimeError, "Failed to open device: %d", r);
+        return -1;
+    }
+    self->controller = libmk_create_controller(handle);
+    if (self->controller == NULL) {
+        libmk_close_handle(handle);
+        libmk_free_handle(handle);
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+
+static void masterkeys_controller_dealloc(masterkeys_Controller* self) {
+    /** Stop the controller if it is still running and free it */
+    LibMK_Controller* c = self->controller;
+    if (c != NULL) {
+        LibMK_Controller_State state;
+        Py_BEGIN_ALLOW_THREADS
+        libmk_stop_controller(c);
+        state = libmk_get_controller_state(c);
+        while (state == LIBMK_STATE_ACTIVE)
+            state = libmk_join_controller(c, 1.0);
+        Py_END_ALLOW_THREADS
+        // The handle is still open if the controller was never started
+        libmk_close_handle(c->handle);
+        libmk_free_controller(c);
+    }
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+static LibMK_Controller* masterkeys_get_controller(
+        masterkeys_Controller* self) {
+    if (self->controller == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "Controller not initialized");
+    return self->controller;
+}
+
+
+static PyObject* masterkeys_controller_schedule(
+        LibMK_Controller* c, LibMK_Instruction* i, unsigned int duration) {
+    /** Add a list of instructions to the queue and return the first ID
+     *
+     * What happens when the queue of the controller is full depends on
+     * its overflow policy. With LIBMK_OVERFLOW_BLOCK scheduling waits
+     * until the controller has made room, so the GIL is released.
+     */
+    if (i == NULL)
+        return PyErr_NoMemory();
+    if (duration != 0)
+        for (LibMK_Instruction* k = i; k != NULL; k = k->next)
+            k->duration = duration;
+    int r;
+    Py_BEGIN_ALLOW_THREADS
+    r = libmk_sched_instruction(c, i);
+    Py_END_ALLOW_THREADS
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_controller_start(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Enable control of the keyboard and start the controller thread */
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    LibMK_Result r;
+    Py_BEGIN_ALLOW_THREADS
+    r = libmk_start_controller(c);
+    Py_END_ALLOW_THREADS
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_controller_stop(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Request the controller to exit without executing its queue */
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    libmk_stop_controller(c);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* masterkeys_controller_wait(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Request the controller to exit once its queue is empty */
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    libmk_wait_controller(c);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* masterkeys_controller_join(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Wait for the controller to exit and return its state */
+    double timeout = 1.0;
+    if (!PyArg_ParseTuple(args, "|d", &timeout))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    LibMK_Controller_State state;
+    Py_BEGIN_ALLOW_THREADS
+    state = libmk_join_controller(c, timeout);
+    Py_END_ALLOW_THREADS
+    return PyInt_FromLong(state);
+}
+
+
+static PyObject* masterkeys_controller_get_state(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Return the state of the controller */
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    return PyInt_FromLong(libmk_get_controller_state(c));
+}
+
+
+static PyObject* masterkeys_controller_get_error(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Return the error that stopped the controller */
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    return PyInt_FromLong(libmk_get_controller_error(c));
+}
+
+
+static PyObject* masterkeys_controller_set_full_led_color(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule an instruction to set the color of all LEDs */
+    int r, g, b;
+    unsigned int duration = 0;
+    if (!PyArg_ParseTuple(args, "iii|I", &r, &g, &b, &duration))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char color[3] = {r, g, b};
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_full(color), duration);
+}
+
+
+static PyObject* masterkeys_controller_set_all_led_color(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule an instruction to set the color of all LEDs individually
+     *
+     * Accepts the same layouts as masterkeys_set_all_led_color.
+     */
+    PyObject* object;
+    unsigned int duration = 0;
+    if (!PyArg_ParseTuple(args, "O|I", &object, &duration))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    if (!masterkeys_parse_layout(object, layout))
+        return NULL;
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_all(layout), duration);
+}
+
+
+static PyObject* masterkeys_controller_set_ind_led_color(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule an instruction to set the color of a single LED */
+    int row, col, r, g, b;
+    unsigned int duration = 0;
+    if (!PyArg_ParseTuple(
+            args, "iiiii|I", &row, &col, &r, &g, &b, &duration))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char color[3] = {r, g, b};
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_single(row, col, color), duration);
+}
+
+
+static PyObject* masterkeys_controller_flash(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule instructions to flash the keyboard in a color */
+    int r, g, b;
+    unsigned int delay;
+    unsigned char n;
+    if (!PyArg_ParseTuple(args, "iiiIb", &r, &g, &b, &delay, &n))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char color[3] = {r, g, b};
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_flash(color, delay, n), 0);
+}
+
+
+static PyObject* masterkeys_controller_generate(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule an instruction rendering the frames of an animation */
+    int type;
+    int fg[3], bg[3];
+    unsigned int period, duration, frames = 0, size = 8;
+    unsigned char row = 0, column = 0;
+    if (!PyArg_ParseTuple(
+            args, "i(iii)(iii)II|IIbb", &type, &fg[0], &fg[1], &fg[2],
+            &bg[0], &bg[1], &bg[2], &period, &duration, &frames, &size,
+            &row, &column))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char foreground[3] = {fg[0], fg[1], fg[2]};
+    unsigned char background[3] = {bg[0], bg[1], bg[2]};
+    LibMK_Generator g;
+    libmk_init_generator(
+        &g, (LibMK_Generator_Type) type, foreground, background);
+    g.period = period;
+    g.frames = frames;
+    g.size = size;
+    g.row = row;
+    g.column = column;
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_generator(&g), duration);
+}
+
+
+static PyObject* masterkeys_controller_transition(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Schedule a transition of all LEDs to a layout
+     *
+     * Accepts the same layouts as masterkeys_set_all_led_color. The
+     * interval is the time between the frames, zero for the default.
+     */
+    PyObject* object;
+    unsigned int duration, interval = 0;
+    int easing = LIBMK_EASE_LINEAR;
+    if (!PyArg_ParseTuple(args, "OI|iI", &object, &duration, &easing, &interval))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    if (!masterkeys_parse_layout(object, layout))
+        return NULL;
+    return masterkeys_controller_schedule(
+        c, libmk_create_instruction_transition(
+            layout, duration, (LibMK_Easing) easing), interval);
+}
+
+
+static PyObject* masterkeys_controller_cancel(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Cancel a scheduled instruction by its ID */
+    unsigned int id;
+    if (!PyArg_ParseTuple(args, "I", &id))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    return PyInt_FromLong(libmk_cancel_instruction(c, id));
+}
+
+
+static PyObject* masterkeys_controller_set_overflow_policy(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Set the behaviour of the controller upon a full queue */
+    int policy;
+    if (!PyArg_ParseTuple(args, "i", &policy))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    libmk_set_overflow_policy(c, (LibMK_Overflow_Policy) policy);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* masterkeys_controller_set_coalesce(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Enable or disable the merging of pending instructions */
+    PyObject* coalesce;
+    if (!PyArg_ParseTuple(args, "O", &coalesce))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    libmk_set_controller_coalesce(c, PyObject_IsTrue(coalesce) == 1);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* masterkeys_controller_set_late_policy(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Set the behaviour of the controller for late instructions */
+    int policy;
+    unsigned int tolerance = 0;
+    if (!PyArg_ParseTuple(args, "i|I", &policy, &tolerance))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    libmk_set_late_policy(c, (LibMK_Late_Policy) policy, tolerance);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject* masterkeys_controller_set_write_ahead(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Set the number of LED packets sent ahead, before starting */
+    unsigned int window;
+    if (!PyArg_ParseTuple(args, "I", &window))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    // The handle is used by the thread of the controller once started
+    if (libmk_get_controller_state(c) != LIBMK_STATE_PRESTART)
+        return PyInt_FromLong(LIBMK_ERR_STILL_ACTIVE);
+    return PyInt_FromLong(libmk_set_write_ahead(c->handle, window));
+}
+
+
+static PyObject* masterkeys_controller_get_timing_stats(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Return the timing statistics of the controller as a dict */
+    PyObject* reset = Py_False;
+    if (!PyArg_ParseTuple(args, "|O", &reset))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    LibMK_Timing_Stats stats;
+    libmk_get_timing_stats(c, &stats, PyObject_IsTrue(reset) == 1);
+    return Py_BuildValue(
+        "{s:k,s:k,s:l,s:l,s:l}",
+        "executed", stats.executed, "skipped", stats.skipped,
+        "jitter_last", stats.jitter_last, "jitter_max", stats.jitter_max,
+        "jitter_mean", stats.jitter_mean);
+}
+
+
+static PyObject* masterkeys_controller_get_stats(
+        masterkeys_Controller* self, PyObject* args) {
+    /** Return the transfer counters of the keyboard as a dict */
+    PyObject* reset = Py_False;
+    if (!PyArg_ParseTuple(args, "|O", &reset))
+        return NULL;
+    LibMK_Controller* c = masterkeys_get_controller(self);
+    if (c == NULL)
+        return NULL;
+    LibMK_Stats stats;
+    libmk_get_stats(c->handle, &stats, PyObject_IsTrue(reset) == 1);
+    return masterkeys_build_stats(&stats);
+}
+
+
+static struct PyMethodDef masterkeys_controller_funcs[] = {
+    {
+        "start",
+        (PyCFunction) masterkeys_controller_start,
+        METH_NOARGS,
+        "Enable control of the keyboard and start the controller thread"
+    }, {
+        "stop",
+        (PyCFunction) masterkeys_controller_stop,
+        METH_NOARGS,
+        "Request the controller to exit without executing its queue"
+    }, {
+        "wait",
+        (PyCFunction) masterkeys_controller_wait,
+        METH_NOARGS,
+        "Request the controller to exit once its queue is empty"
+    }, {
+        "join",
+        (PyCFunction) masterkeys_controller_join,
+        METH_VARARGS,
+        "Wait for the controller to exit and return its state"
+    }, {
+        "get_state",
+        (PyCFunction) masterkeys_controller_get_state,
+        METH_NOARGS,
+        "Return the state of the controller"
+    }, {
+        "get_error",
+        (PyCFunction) masterkeys_controller_get_error,
+        METH_NOARGS,
+        "Return the error that stopped the controller"
+    }, {
+        "set_full_led_color",
+        (PyCFunction) masterkeys_controller_set_full_led_color,
+        METH_VARARGS,
+        "Schedule an instruction to set the color of all LEDs"
+    }, {
+        "set_all_led_color",
+        (PyCFunction) masterkeys_controller_set_all_led_color,
+        METH_VARARGS,
+        "Schedule an instruction to set the color of all LEDs "
+            "individually"
+    }, {
+        "set_ind_led_color",
+        (PyCFunction) masterkeys_controller_set_ind_led_color,
+        METH_VARARGS,
+        "Schedule an instruction to set the color of a single LED"
+    }, {
+        "flash",
+        (PyCFunction) masterkeys_controller_flash,
+        METH_VARARGS,
+        "Schedule instructions to flash the keyboard in a color"
+    }, {
+        "generate",
+        (PyCFunction) masterkeys_controller_generate,
+        METH_VARARGS,
+        "Schedule an instruction rendering the frames of an animation"
+    }, {
+        "transition",
+        (PyCFunction) masterkeys_controller_transition,
+        METH_VARARGS,
+        "Schedule a transition of all LEDs to a layout"
+    }, {
+        "cancel",
+        (PyCFunction) masterkeys_controller_cancel,
+        METH_VARARGS,
+        "Cancel a scheduled instruction by its ID"
+    }, {
+        "set_overflow_policy",
+        (PyCFunction) masterkeys_controller_set_overflow_policy,
+        METH_VARARGS,
+        "Set the behaviour of the controller upon a full queue"
+    }, {
+        "set_coalesce",
+        (PyCFunction) masterkeys_controller_set_coalesce,
+        METH_VARARGS,
+        "Enable or disable the merging of pending instructions"
+    }, {
+        "set_late_policy",
+        (PyCFunction) masterkeys_controller_set_late_policy,
+        METH_VARARGS,
+        "Set the behaviour of the controller for late instructions"
+    }, {
+        "get_timing_stats",
+        (PyCFunction) masterkeys_controller_get_timing_stats,
+        METH_VARARGS,
+        "Return the timing statistics of the controller"
+    }, {
+        "set_write_ahead",
+        (PyCFunction) masterkeys_controller_set_write_ahead,
+        METH_VARARGS,
+        "Set the number of LED packets sent ahead of their responses"
+    }, {
+        "get_stats",
+        (PyCFunction) masterkeys_controller_get_stats,
+        METH_VARARGS,
+        "Return the transfer counters of the keyboard of the controller"
+    }, {NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject masterkeys_ControllerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "masterkeys.Controller",                    // tp_name
+    sizeof(masterkeys_Controller),              // tp_basicsize
+    0,                                          // tp_itemsize
+    (destructor) masterkeys_controller_dealloc, // tp_dealloc
+};
+
+
+/** Python object owning a LibMK_Frame of the global device handle
+ *
+ * Frames are transferred asynchronously while libusb events are handled
+ * with masterkeys_handle_events, which allows the integration of LED
+ * updates into an event loop polling the file descriptors returned by
+ * masterkeys_get_pollfds.
+ */
+typedef struct masterkeys_Frame {
+    PyObject_HEAD
+    LibMK_Frame* frame;
+} masterkeys_Frame;
+
+
+static int masterkeys_frame_init(
+        masterkeys_Frame* self, PyObject* args, PyObject* kwargs) {
+    /** Allocate a frame for the device set with set_device */
+    if (self->frame != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Frame already initialized");
+        return -1;
+    }
+    LibMK_Frame* frame;
+    MASTERKEYS_CALL(frame = libmk_create_frame(NULL));
+    if (frame == NULL) {
+        PyErr_SetString(
+            PyExc_RuntimeError, "Failed to create frame, is a device set?");
+        return -1;
+    }
+    self->frame = frame;
+    return 0;
+}
+
+
+static void masterkeys_frame_dealloc(masterkeys_Frame* self) {
+    /** Complete the frame if it is still in flight and free it */
+    if (self->frame != NULL) {
+        MASTERKEYS_CALL(
+            libmk_wait_frame(self->frame);
+            libmk_free_frame(self->frame));
+    }
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+static PyObject* masterkeys_frame_submit(
+        masterkeys_Frame* self, PyObject* args) {
+    /** Submit the packets of a layout that differ from the keyboard */
+    PyObject* object;
+    if (!PyArg_ParseTuple(args, "O", &object))
+        return NULL;
+    if (self->frame == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Frame not initialized");
+        return NULL;
+    }
+    unsigned char layout[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    if (!masterkeys_parse_layout(object, layout))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_submit_all_led_color(
+        self->frame, (unsigned char*) layout, NULL, NULL));
+    return PyInt_FromLong(r);
+}
+
+
+static PyObject* masterkeys_frame_done(
+        masterkeys_Frame* self, PyObject* args) {
+    /** Return whether the frame is no longer in flight */
+    if (self->frame == NULL)
+        Py_RETURN_TRUE;
+    return PyBool_FromLong(libmk_frame_done(self->frame));
+}
+
+
+static PyObject* masterkeys_frame_result(
+        masterkeys_Frame* self, PyObject* args) {
+    /** Return the result code of the last completed submission */
+    if (self->frame == NULL)
+        return PyInt_FromLong(LIBMK_ERR_DEV_NOT_SET);
+    return PyInt_FromLong(self->frame->result);
+}
+
+
+static struct PyMethodDef masterkeys_frame_funcs[] = {
+    {
+        "submit",
+        (PyCFunction) masterkeys_frame_submit,
+        METH_VARARGS,
+        "Submit the packets of a layout that differ from the keyboard"
+    }, {
+        "done",
+        (PyCFunction) masterkeys_frame_done,
+        METH_NOARGS,
+        "Return whether the frame is no longer in flight"
+    }, {
+        "result",
+        (PyCFunction) masterkeys_frame_result,
+        METH_NOARGS,
+        "Return the result code of the last completed submission"
+    }, {NULL, NULL, 0, NULL}
+};
+
+
+static PyTypeObject masterkeys_FrameType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "masterkeys.Frame",                         // tp_name
+    sizeof(masterkeys_Frame),                   // tp_basicsize
+    0,                                          // tp_itemsize
+    (destructor) masterkeys_frame_dealloc,      // tp_dealloc
+};
+
+
+static PyObject* masterkeys_get_pollfds(PyObject* self, PyObject* args) {
+    /** Return a list of (fd, events) tuples to poll for libusb events */
+    LibMK_Pollfd* fds;
+    int n = libmk_get_pollfds(&fds);
+    if (n < 0)
+        return PyInt_FromLong(n);
+    PyObject* list = PyList_New(n);
+    if (list == NULL) {
+        free(fds);
+        return NULL;
+    }
+    for (int k = 0; k < n; k++)
+        PyList_SET_ITEM(
+            list, k, Py_BuildValue("(ii)", fds[k].fd, fds[k].events));
+    free(fds);
+    return list;
+}
+
+
+static PyObject* masterkeys_get_next_timeout(PyObject* self, PyObject* args) {
+    /** Return the milliseconds until events must be handled, or -1 */
+    return PyInt_FromLong(libmk_get_next_timeout());
+}
+
+
+static PyObject* masterkeys_handle_events(PyObject* self, PyObject* args) {
+    /** Handle pending libusb events, completing submitted frames */
+    int timeout = 0;
+    if (!PyArg_ParseTuple(args, "|i", &timeout))
+        return NULL;
+    int r;
+    MASTERKEYS_CALL(r = libmk_handle_events(timeout));
+    return PyInt_FromLong(r);
 }
 
 
@@ -281,6 +1205,31 @@ static struct PyMethodDef masterkeys_funcs[] = {
         masterkeys_set_device,
         METH_VARARGS,
         "Set the device to control with the library"
+    }, {
+        "set_mock_device",
+        masterkeys_set_mock_device,
+        METH_VARARGS,
+        "Set the device to control to an emulated keyboard"
+    }, {
+        "set_transport",
+        masterkeys_set_transport,
+        METH_VARARGS,
+        "Select the backend transferring the packets of the device"
+    }, {
+        "get_mock_packets",
+        masterkeys_get_mock_packets,
+        METH_NOARGS,
+        "Return the number of packets written to the emulated keyboard"
+    }, {
+        "set_write_ahead",
+        masterkeys_set_write_ahead,
+        METH_VARARGS,
+        "Set the number of LED packets sent ahead of their responses"
+    }, {
+        "get_stats",
+        masterkeys_get_stats,
+        METH_VARARGS,
+        "Return the transfer counters of the device"
     }, {
         "enable_control",
         masterkeys_enable_control,
@@ -313,11 +1262,22 @@ static struct PyMethodDef masterkeys_funcs[] = {
        masterkeys_set_ind_led_color,
        METH_VARARGS,
        "Set the color of a single LED on the controlled device"
+    }, {
+        "set_ind_led_colors",
+        masterkeys_set_ind_led_colors,
+        METH_VARARGS,
+        "Set the color of a number of LEDs on the controlled device"
     }, {
         "set_effect_details",
         masterkeys_set_effect_details,
         METH_VARARGS,
         "Set the effect on the keyboard with specific arguments"
+    }, {
+        "update_effect",
+        masterkeys_update_effect,
+        METH_VARARGS,
+        "Set the effect on the keyboard with specific arguments, "
+            "sending only the arguments that changed"
     }, {
         "get_device_ident",
         masterkeys_get_device_ident,
@@ -343,14 +1303,67 @@ static struct PyMethodDef masterkeys_funcs[] = {
         masterkeys_set_control_mode,
         METH_VARARGS,
         "Set the control mode of the keyboard"
+    }, {
+        "calculate_zone_colors",
+        masterkeys_calculate_zone_colors,
+        METH_VARARGS,
+        "Calculate a layout list of the colors of the key zones of an image"
+    }, {
+        "get_pollfds",
+        masterkeys_get_pollfds,
+        METH_NOARGS,
+        "Return a list of (fd, events) tuples to poll for libusb events"
+    }, {
+        "get_next_timeout",
+        masterkeys_get_next_timeout,
+        METH_NOARGS,
+        "Return the milliseconds until events must be handled, or -1"
+    }, {
+        "handle_events",
+        masterkeys_handle_events,
+        METH_VARARGS,
+        "Handle pending libusb events, completing submitted frames"
     }, {NULL, NULL, 0, NULL}
 };
 
 
+static bool masterkeys_init_types(void) {
+    /** Fill in the Controller type, portably across Python versions */
+    masterkeys_ControllerType.tp_flags = Py_TPFLAGS_DEFAULT;
+    masterkeys_ControllerType.tp_doc =
+        "Controller executing instructions on a keyboard in a native thread";
+    masterkeys_ControllerType.tp_methods = masterkeys_controller_funcs;
+    masterkeys_ControllerType.tp_init = (initproc) masterkeys_controller_init;
+    masterkeys_ControllerType.tp_new = PyType_GenericNew;
+    masterkeys_FrameType.tp_flags = Py_TPFLAGS_DEFAULT;
+    masterkeys_FrameType.tp_doc =
+        "Asynchronous LED update of the device set with set_device";
+    masterkeys_FrameType.tp_methods = masterkeys_frame_funcs;
+    masterkeys_FrameType.tp_init = (initproc) masterkeys_frame_init;
+    masterkeys_FrameType.tp_new = PyType_GenericNew;
+    return PyType_Ready(&masterkeys_ControllerType) == 0 &&
+        PyType_Ready(&masterkeys_FrameType) == 0;
+}
+
+
+static void masterkeys_add_types(PyObject* module) {
+    Py_INCREF(&masterkeys_ControllerType);
+    PyModule_AddObject(
+        module, "Controller", (PyObject*) &masterkeys_ControllerType);
+    Py_INCREF(&masterkeys_FrameType);
+    PyModule_AddObject(module, "Frame", (PyObject*) &masterkeys_FrameType);
+}
+
+
 #if PY_MAJOR_VERSION < 3
 PyMODINIT_FUNC initmasterkeys(void) {
     masterkeys_init(NULL, NULL);
-    (void) Py_InitModule("masterkeys", masterkeys_funcs);
+    if (!masterkeys_init_types())
+        return;
+    PyObject* module = Py_InitModule("masterkeys", masterkeys_funcs);
+    if (module == NULL)
+        return;
+    masterkeys_add_types(module);
 }
 #else  // PY_MAJOR_VERSION >= 3
 static struct PyModuleDef masterkeys_module_def = {
@@ -362,6 +1375,12 @@ static struct PyModuleDef masterkeys_module_def = {
 };
 PyMODINIT_FUNC PyInit_masterkeys(void) {
     masterkeys_init(NULL, NULL);
-    return PyModule_Create(&masterkeys_module_def);
+    if (!masterkeys_init_types())
+        return NULL;
+    PyObject* module = PyModule_Create(&masterkeys_module_def);
+    if (module == NULL)
+        return NULL;
+    masterkeys_add_types(module);
+    return module;
 }
 #endif
@@ -0,0 +1,326 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "../libmk/libmk.h"
+#include "../libmk/libmkc.h"
+#include "../libmk/libmks.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define IMAGE_WIDTH 1920
+#define IMAGE_HEIGHT 1080
+
+
+double now_us(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+
+int compare_double(const void* a, const void* b) {
+    double d = *(const double*) a - *(const double*) b;
+    return (d > 0) - (d < 0);
+}
+
+
+void report(const char* name, double* samples, int n, double total) {
+    /** Print the percentiles of the durations of a benchmark in us
+     *
+     * The rate is calculated from the total duration, so that it
+     * includes the time spent between the samples.
+     */
+    if (n == 0) {
+        printf("%-28s no samples\n", name);
+        return;
+    }
+    qsort(samples, n, sizeof(double), compare_double);
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    printf("%-28s %8.1f/s  mean %8.1f  p50 %8.1f  p90 %8.1f  "
+           "p99 %8.1f  max %8.1f us\n",
+           name, n / total * 1e6, sum / n, samples[n / 2],
+           samples[n * 90 / 100], samples[n * 99 / 100], samples[n - 1]);
+}
+
+
+void fill_colors(unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3],
+                 int seed) {
+    /** Fill a color matrix so that every key differs between seeds */
+    for (int r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (int c = 0; c < LIBMK_MAX_COLS; c++)
+            for (int k = 0; k < 3; k++)
+                colors[r][c][k] = (unsigned char) (seed * 67 + r * 31 + c * 7 + k);
+}
+
+
+void bench_packets(int n, double* samples) {
+    /** Build the full LED packets for a handle that is not opened */
+    LibMK_Handle handle;
+    memset(&handle, 0x00, sizeof(LibMK_Handle));
+    handle.layout = LIBMK_LAYOUT_ANSI;
+    handle.size = LIBMK_L;
+    handle.keys = -1;
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    unsigned char packets[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+    fill_colors(colors, 0);
+    double start = now_us(), t;
+    for (int i = 0; i < n; i++) {
+        t = now_us();
+        libmk_build_all_led_packets(
+            &handle, (unsigned char*) colors, packets);
+        samples[i] = now_us() - t;
+    }
+    report("build_all_led_packets", samples, n, now_us() - start);
+}
+
+
+void bench_capture(int n, double* samples) {
+    /** Run the color calculations of libmks on a generated image */
+    LibMK_Image image;
+    image.width = IMAGE_WIDTH;
+    image.height = IMAGE_HEIGHT;
+    image.stride = IMAGE_WIDTH * 4;
+    image.format = LIBMK_PIXEL_BGRX32;
+    image.data = (unsigned char*) malloc(image.stride * image.height);
+    if (image.data == NULL)
+        return;
+    for (unsigned int i = 0; i < image.stride * image.height; i++)
+        image.data[i] = (unsigned char) (i * 2654435761u >> 24);
+    LibMK_Color_Filter filter;
+    libmk_init_color_filter(&filter);
+    LibMK_Color_Sum sum;
+    LibMK_Color_Sum sums[LIBMK_MAX_ROWS][LIBMK_MAX_COLS];
+    printf("Instruction set: %d\n", libmk_get_simd());
+
+    double start = now_us(), t;
+    for (int i = 0; i < n; i++) {
+        t = now_us();
+        libmk_sum_image(&image, 0, 0, image.width, image.height, &filter, &sum);
+        samples[i] = now_us() - t;
+    }
+    report("sum_image 1080p", samples, n, now_us() - start);
+
+    start = now_us();
+    for (int i = 0; i < n; i++) {
+        t = now_us();
+        libmk_sum_zones(
+            &image, 0, 0, image.width, image.height, 1, &filter, sums);
+        samples[i] = now_us() - t;
+    }
+    report("sum_zones 1080p", samples, n, now_us() - start);
+
+    LibMK_Workers* workers = libmk_create_workers(0);
+    if (workers != NULL) {
+        start = now_us();
+        for (int i = 0; i < n; i++) {
+            t = now_us();
+            libmk_sum_zones_parallel(
+                workers, &image, 0, 0, image.width, image.height, 1,
+                &filter, sums);
+            samples[i] = now_us() - t;
+        }
+        report("sum_zones_parallel 1080p", samples, n, now_us() - start);
+        libmk_free_workers(workers);
+    }
+    free(image.data);
+}
+
+
+void bench_device(LibMK_Handle* handle, int n, double* samples) {
+    /** Measure the packet and LED update performance of a device */
+    double start = now_us(), t;
+    int r, k;
+    for (k = 0; k < n; k++) {
+        t = now_us();
+        r = libmk_send_recv_packet(handle, libmk_build_packet(2, 0x01, 0x02), true);
+        if (r != LIBMK_SUCCESS)
+            break;
+        samples[k] = now_us() - t;
+    }
+    report("send_recv_packet", samples, k, now_us() - start);
+
+    unsigned char colors[2][LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    fill_colors(colors[0], 0);
+    fill_colors(colors[1], 1);
+    start = now_us();
+    for (k = 0; k < n; k++) {
+        t = now_us();
+        // Alternate between frames so that all packets are sent
+        r = libmk_set_all_led_color(handle, (unsigned char*) colors[k % 2]);
+        if (r != LIBMK_SUCCESS)
+            break;
+        samples[k] = now_us() - t;
+    }
+    report("set_all_led_color", samples, k, now_us() - start);
+
+    start = now_us();
+    for (k = 0; k < n; k++) {
+        t = now_us();
+        r = libmk_set_single_led(
+            handle, (k / LIBMK_MAX_COLS) % 6, k % LIBMK_MAX_COLS,
+            (k * 16) & 0xFF, 0x00, 0xFF);
+        if (r != LIBMK_SUCCESS)
+            break;
+        samples[k] = now_us() - t;
+    }
+    report("set_single_led", samples, k, now_us() - start);
+
+    // Batches of keys of a typing effect, in the full LED state
+    LibMK_Key_Color keys[8];
+    libmk_set_all_led_color(handle, (unsigned char*) colors[0]);
+    start = now_us();
+    for (k = 0; k < n; k++) {
+        for (int i = 0; i < 8; i++) {
+            keys[i].row = (k + i) % 6;
+            keys[i].col = (k * 3 + i * 5) % LIBMK_MAX_COLS;
+            keys[i].color[0] = (k * 16) & 0xFF;
+            keys[i].color[1] = (unsigned char) i;
+            keys[i].color[2] = 0xFF;
+        }
+        t = now_us();
+        r = libmk_set_led_colors(handle, keys, 8);
+        if (r != LIBMK_SUCCESS)
+            break;
+        samples[k] = now_us() - t;
+    }
+    report("set_led_colors x8", samples, k, now_us() - start);
+}
+
+
+void bench_controller(LibMK_Handle* handle, int n, double* samples) {
+    /** Measure the time from scheduling until the USB transfers are done
+     *
+     * Instructions are scheduled one at a time on an idle controller,
+     * and the execution is detected from the timing statistics. The
+     * controller takes ownership of the handle.
+     */
+    LibMK_Controller* c = libmk_create_controller(handle);
+    if (c == NULL) {
+        libmk_close_handle(handle);
+        libmk_free_handle(handle);
+        return;
+    }
+    if (libmk_start_controller(c) != LIBMK_SUCCESS) {
+        printf("Failed to start controller.\n");
+        libmk_close_handle(handle);
+        libmk_free_controller(c);
+        return;
+    }
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    LibMK_Timing_Stats stats;
+    libmk_get_timing_stats(c, &stats, true);
+    double start = now_us(), t;
+    int k;
+    for (k = 0; k < n; k++) {
+        fill_colors(colors, k);
+        t = now_us();
+        if (libmk_sched_instruction(c, libmk_create_instruction_all(colors)) < 0)
+            break;
+        do {
+            sched_yield();
+            libmk_get_timing_stats(c, &stats, false);
+        } while (stats.executed + stats.skipped < (unsigned long) k + 1 &&
+                 libmk_get_controller_state(c) == LIBMK_STATE_ACTIVE);
+        if (libmk_get_controller_state(c) != LIBMK_STATE_ACTIVE)
+            break;
+        samples[k] = now_us() - t;
+    }
+    report("controller schedule->done", samples, k, now_us() - start);
+    libmk_stop_controller(c);
+    libmk_join_controller(c, 1.0);
+    LibMK_Result r = libmk_get_controller_error(c);
+    if (r != LIBMK_SUCCESS)
+        printf("Controller error: %d\n", r);
+    libmk_close_handle(handle);
+    libmk_free_controller(c);
+}
+
+
+int main(int argc, char** argv) {
+    /** Benchmark the throughput and latency of libmk
+     *
+     * Usage: bench [-n samples] [-m] [-w window]
+     *
+     * With -m, the device benchmarks are run on an emulated keyboard,
+     * so that the overhead of libmk and libmkc can be measured on
+     * machines without a device. Otherwise, the benchmarks are run for
+     * every connected device. With -w, the LED packets are sent ahead
+     * of their responses. Changes the LEDs of the devices, but not
+     * their profiles.
+     */
+    int n = 1000, opt;
+    unsigned int window = 0;
+    bool mock = false;
+    while ((opt = getopt(argc, argv, "n:mw:")) != -1) {
+        if (opt == 'n')
+            n = atoi(optarg);
+        else if (opt == 'm')
+            mock = true;
+        else if (opt == 'w')
+            window = (unsigned int) atoi(optarg);
+        else {
+            printf("Usage: %s [-n samples] [-m] [-w window]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (n <= 0)
+        n = 1;
+    double* samples = (double*) malloc(sizeof(double) * n);
+    if (samples == NULL)
+        return -1;
+
+    bench_packets(n, samples);
+    bench_capture(n < 100 ? n : 100, samples);
+    if (!libmk_init()) {
+        printf("Failed to initialize LibMK Library.\n");
+        free(samples);
+        return -1;
+    }
+    LibMK_Handle** handles = NULL;
+    int devices;
+    if (mock) {
+        handles = (LibMK_Handle**) malloc(sizeof(LibMK_Handle*));
+        devices = handles == NULL ? LIBMK_ERR_DEV_OPEN_FAILED :
+            libmk_create_mock_handle(handles, DEV_RGB_L, LIBMK_LAYOUT_ANSI);
+        if (devices == LIBMK_SUCCESS)
+            devices = 1;
+    } else
+        devices = libmk_open_all_devices(&handles);
+    if (devices < 0)
+        printf("Failed to open devices: %d\n", devices);
+    else if (devices == 0)
+        printf("No devices detected.\n");
+    for (int i = 0; i < devices; i++) {
+        printf("\nDevice %d: %s\n", i, LIBMK_MODEL_STRINGS[handles[i]->model]);
+        int r = libmk_set_write_ahead(handles[i], window);
+        if (r == LIBMK_SUCCESS)
+            r = libmk_enable_control(handles[i]);
+        if (r != LIBMK_SUCCESS) {
+            printf("Failed to enable control: %d\n", r);
+            libmk_close_handle(handles[i]);
+            libmk_free_handle(handles[i]);
+            continue;
+        }
+        bench_device(handles[i], n, samples);
+        if (mock)
+            printf("%-28s %lu\n", "packets emulated",
+                   libmk_get_mock(handles[i])->n);
+        // Disabling control would close the device, the controller
+        // enables control again and disables it when it stops
+        bench_controller(handles[i], n, samples);
+    }
+    free(handles);
+    free(samples);
+    libmk_exit();
+    return 0;
+}
@@ -72,81 +72,78 @@ RgbColor* HsvToRgb(HsvColor* hsv) {
 
 int main(void) {
     libmk_init();
-    printf("Detecting devices...\n");
-    LibMK_Model* models = NULL;
-    int n = libmk_detect_devices(&models);
-    printf("%d devices detected.\n", n);
-    for (int i=0; i < n; i++) {
-        printf("  Detected: %d\n", models[i]);
-        LibMK_Handle* handle;
-        int r = libmk_set_device(models[i], &handle);
-        if (r != LIBMK_SUCCESS) {
-            printf("  Could not open this device.\n");
-            continue;
-        }
-    
-        LibMK_Controller* ctrl = libmk_create_controller(handle);
-        if (ctrl == NULL) {
-            printf("  Could not create controller for this device.\n");
-            continue;
-        }
-        
-        fprintf(stdout, "  Starting controlller... ");
-        libmk_start_controller(ctrl);
-        printf("Done.\n");
-        
-        fprintf(stdout, "  Scheduling instructions... ");
-        
-        unsigned char red[3] = {255, 0, 0};
-        LibMK_Instruction* full = libmk_create_instruction_flash(red, 10000, 255);
-        unsigned int n = libmk_sched_instruction(ctrl, full);
-        
-        unsigned char yellow[3] = {255, 255, 0};
-        full = libmk_create_instruction_full(yellow);
-        full->duration = 1000000;
-        libmk_sched_instruction(ctrl, full);
-        
-        unsigned char blank[3] = {0};
-        LibMK_Instruction* wave = libmk_create_instruction_full(blank);
-        LibMK_Instruction* a, * b;
-        a = wave;
-        HsvColor color;
-        color.s = 255;
-        color.v = 255;
-        
-        unsigned char map[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
-        for (int i=0; i<1000; i++) {
-            for (int r=0; r<LIBMK_MAX_ROWS; r++) {
-                for (int c=0; c<LIBMK_MAX_COLS; c++) {
-                    color.h = (i+c) * (255 / (LIBMK_MAX_COLS+40));
-                    RgbColor* rgb = HsvToRgb(&color);
-                    map[r][c][0] = rgb->r;
-                    map[r][c][1] = rgb->g;
-                    map[r][c][2] = rgb->b;
-                    free(rgb);
-                }
+    printf("Opening devices...\n");
+    LibMK_Pool* pool = libmk_create_pool();
+    if (pool == NULL) {
+        printf("Could not open the devices.\n");
+        return 1;
+    }
+    printf("%d devices opened.\n", pool->n);
+
+    fprintf(stdout, "  Starting controllers... ");
+    if (libmk_start_pool(pool) != LIBMK_SUCCESS) {
+        printf("Failed.\n");
+        libmk_free_pool(pool);
+        return 1;
+    }
+    printf("Done.\n");
+
+    fprintf(stdout, "  Scheduling instructions... ");
+
+    unsigned char red[3] = {255, 0, 0};
+    LibMK_Instruction* full = libmk_create_instruction_flash(red, 10000, 255);
+    libmk_broadcast_instruction(pool, full);
+
+    unsigned char yellow[3] = {255, 255, 0};
+    full = libmk_create_instruction_full(yellow);
+    full->duration = 1000000;
+    libmk_broadcast_instruction(pool, full);
+
+    unsigned char blank[3] = {0};
+    LibMK_Instruction* wave = libmk_create_instruction_full(blank);
+    LibMK_Instruction* a, * b;
+    a = wave;
+    HsvColor color;
+    color.s = 255;
+    color.v = 255;
+
+    unsigned char map[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    for (int i=0; i<1000; i++) {
+        for (int r=0; r<LIBMK_MAX_ROWS; r++) {
+            for (int c=0; c<LIBMK_MAX_COLS; c++) {
+                color.h = (i+c) * (255 / (LIBMK_MAX_COLS+40));
+                RgbColor* rgb = HsvToRgb(&color);
+                map[r][c][0] = rgb->r;
+                map[r][c][1] = rgb->g;
+                map[r][c][2] = rgb->b;
+                free(rgb);
             }
-            b = libmk_create_instruction_all(map);
-            b->duration = 10000;
-            a->next = b;
-            a = b;
         }
-        libmk_sched_instruction(ctrl, wave);
-        
-        
-        printf("Done: %d.\n", full->id);
-        
-        fprintf(stdout, "  Awaiting controller... ");
-        libmk_wait_controller(ctrl);
-        printf("Done.\n");
-        
-        printf("\n  Now the controller will automatically exit after all instructions are done.\n");
-        printf("  You can let your program do other stuff while the instructions execute.\n\n");
-        
-        LibMK_Controller_State s = libmk_join_controller(ctrl, 40);
-        if (s != LIBMK_STATE_STOPPED)
-            printf("  Could not stop the Controller: %d\n", s);
-        libmk_free_handle(handle);
-        printf("  Controller test ended.\n");
+        b = libmk_create_instruction_all(map);
+        b->duration = 10000;
+        a->next = b;
+        a = b;
+    }
+    int n = libmk_broadcast_instruction(pool, wave);
+    printf("Done: %d devices.\n", n);
+
+    fprintf(stdout, "  Awaiting controllers... ");
+    libmk_wait_pool(pool);
+    printf("Done.\n");
+
+    printf("\n  Now the controllers will automatically exit after all instructions are done.\n");
+    printf("  All keyboards execute their instructions in parallel.\n\n");
+
+    LibMK_Controller_State s = libmk_join_pool(pool, 40);
+    if (s != LIBMK_STATE_STOPPED)
+        printf("  Could not stop the Controllers: %d\n", s);
+    for (unsigned int k=0; k < pool->n; k++) {
+        LibMK_Result e;
+        unsigned long errors = libmk_get_pool_errors(pool, k, &e);
+        if (errors != 0 || e != LIBMK_SUCCESS)
+            printf("  Device %u: %lu failed broadcasts, error %d\n", k, errors, e);
     }
-}
\ No newline at end of file
+    libmk_free_pool(pool);
+    printf("  Controller test ended.\n");
+    return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#include "../libmk/libmk.h"
+#include <stdio.h>
+
+
+const char* LAYOUT_NAMES[] = {"ANSI", "ISO"};
+const char* SIZE_NAMES[] = {"L", "M", "S"};
+
+
+int write_table(unsigned char layout, unsigned char size) {
+    /** Write the packed table of the known keys of a layout matrix
+     *
+     * Keys are listed in the order of the matrix, so that the colors are
+     * read from the color matrix sequentially. Returns the number of
+     * keys written.
+     */
+    int n = 0;
+    unsigned char offset;
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            offset = LIBMK_LAYOUT[layout][size][r][c];
+            if (offset >= LIBMK_MAX_OFFSETS)  // 0xFF for unknown keys
+                continue;
+            if (n == 0)
+                printf("static const LibMK_Key LIBMK_KEYS_%s_%s[] = {\n   ",
+                       LAYOUT_NAMES[layout], SIZE_NAMES[size]);
+            else if (n % 6 == 0)
+                printf("\n   ");
+            printf(" {%d, %d},", (r * LIBMK_MAX_COLS + c) * 3,
+                   (offset / LIBMK_ALL_LED_PER_PCK) * LIBMK_PACKET_SIZE +
+                   4 + (offset % LIBMK_ALL_LED_PER_PCK) * 3);
+            n++;
+        }
+    if (n != 0)
+        printf("\n};\n\n");
+    return n;
+}
+
+
+int main(void) {
+    /** Generate libmk_keys.h from the layout matrices of libmk
+     *
+     * The scatter tables list only the known keys of each layout, so
+     * that libmk does not have to skip the unknown keys of the matrices
+     * for every frame. Run after changing a matrix in libmk.c:
+     * `./keys > ../libmk/libmk_keys.h`
+     */
+    int counts[2][3];
+    printf("/**\n"
+           " * Author: RedFantom\n"
+           " * License: GNU GPLv3\n"
+           " * Copyright (c) 2018-2019 RedFantom\n"
+           " *\n"
+           " * @file libmk_keys.h\n"
+           " * @brief Scatter tables of the layouts of libmk\n"
+           " *\n"
+           " * Generated from LIBMK_LAYOUT by utils/keys.c, do not edit.\n"
+           "*/\n"
+           "#ifndef LIBMK_KEYS_H\n"
+           "#define LIBMK_KEYS_H\n"
+           "#include \"libmk.h\"\n\n");
+    for (unsigned char l = 0; l < 2; l++)
+        for (unsigned char s = 0; s < 3; s++)
+            counts[l][s] = write_table(l, s);
+
+    printf("/// Scatter tables by layout and size, NULL if no keys are known\n");
+    printf("static const LibMK_Key* const LIBMK_KEYS[2][3] = {\n");
+    for (unsigned char l = 0; l < 2; l++) {
+        printf("    {");
+        for (unsigned char s = 0; s < 3; s++) {
+            if (counts[l][s] == 0)
+                printf("NULL");
+            else
+                printf("LIBMK_KEYS_%s_%s", LAYOUT_NAMES[l], SIZE_NAMES[s]);
+            printf(s != 2 ? ", " : "},\n");
+        }
+    }
+    printf("};\n\n");
+    printf("/// Number of keys in the scatter tables by layout and size\n");
+    printf("static const short LIBMK_KEY_COUNTS[2][3] = {\n");
+    for (unsigned char l = 0; l < 2; l++)
+        printf("    {%d, %d, %d},\n", counts[l][0], counts[l][1], counts[l][2]);
+    printf("};\n\n#endif\n");
+    return 0;
+}
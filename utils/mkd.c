@@ -0,0 +1,334 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "../libmk/libmk.h"
+#include "../libmk/libmkc.h"
+#include "../libmk/libmkd.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+#define MAX_CLIENTS 16
+
+
+typedef struct Client {
+    int sock;
+    int event;
+    unsigned int layer;  // Layer of the client in the compositor
+    unsigned long order;  // Number of the client for the log
+    LibMK_Layer_Ring* ring;
+} Client;
+
+
+static volatile sig_atomic_t ExitFlag = 0;
+static Client* Clients[MAX_CLIENTS];
+static LibMK_Compositor* Compositor;
+static unsigned int NumClients = 0;
+static unsigned long NextOrder = 0;
+
+
+void handle_signal(int sig) {
+    ExitFlag = 1;
+}
+
+
+int create_socket(const char* path) {
+    /** Bind the listening socket, replacing a stale socket file
+     *
+     * The socket is accessible to all users, so that clients do
+     * not require the privileges the daemon needs for the device.
+     */
+    struct sockaddr_un addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+            chmod(path, 0666) != 0 || listen(sock, MAX_CLIENTS) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+int create_ring(LibMK_Layer_Ring** ring) {
+    /** Create the sealed shared memory of a layer */
+    int fd = memfd_create("mkd-layer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(LibMK_Layer_Ring)) != 0 ||
+            fcntl(fd, F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, sizeof(LibMK_Layer_Ring), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    *ring = (LibMK_Layer_Ring*) map;
+    memset(*ring, 0x00, sizeof(LibMK_Layer_Ring));
+    (*ring)->version = LIBMK_DAEMON_VERSION;
+    return fd;
+}
+
+
+void send_welcome(int sock, LibMK_Daemon_Welcome* welcome, int memfd, int event) {
+    /** Respond to a client, passing the fds of its layer on success */
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {welcome, sizeof(LibMK_Daemon_Welcome)};
+    struct msghdr msg;
+    memset(&msg, 0x00, sizeof(msg));
+    memset(control, 0x00, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (welcome->result == LIBMK_SUCCESS) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+        int fds[2] = {memfd, event};
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+
+void free_client(Client* client) {
+    libmk_remove_layer(Compositor, client->layer);
+    munmap(client->ring, sizeof(LibMK_Layer_Ring));
+    close(client->event);
+    close(client->sock);
+    free(client);
+}
+
+
+void accept_client(int listener, LibMK_Handle* handle) {
+    /** Accept a connection and create the layer of the client */
+    int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+        return;
+    LibMK_Daemon_Hello hello;
+    LibMK_Daemon_Welcome welcome = {LIBMK_SUCCESS, handle->model, handle->layout};
+    // The hello is sent right after connecting
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) != 1 ||
+            recv(sock, &hello, sizeof(hello), MSG_DONTWAIT) != sizeof(hello) ||
+            hello.version != LIBMK_DAEMON_VERSION) {
+        welcome.result = LIBMK_ERR_DAEMON;
+        send_welcome(sock, &welcome, -1, -1);
+        close(sock);
+        return;
+    }
+    Client* client = NULL;
+    int memfd = -1, layer = -1;
+    if (NumClients < MAX_CLIENTS)
+        client = (Client*) malloc(sizeof(Client));
+    if (client != NULL) {
+        client->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        memfd = client->event < 0 ? -1 : create_ring(&client->ring);
+    }
+    if (memfd >= 0)
+        layer = libmk_add_layer(Compositor, hello.priority, 0);
+    if (client == NULL || layer < 0) {
+        if (memfd >= 0) {
+            munmap(client->ring, sizeof(LibMK_Layer_Ring));
+            close(memfd);
+        }
+        if (client != NULL && client->event >= 0)
+            close(client->event);
+        free(client);
+        welcome.result = NumClients < MAX_CLIENTS ?
+            LIBMK_ERR_DAEMON : LIBMK_ERR_STILL_ACTIVE;
+        send_welcome(sock, &welcome, -1, -1);
+        close(sock);
+        return;
+    }
+    client->sock = sock;
+    client->layer = (unsigned int) layer;
+    client->order = NextOrder++;
+    send_welcome(sock, &welcome, memfd, client->event);
+    close(memfd);  // The mapping of the daemon remains
+    Clients[NumClients++] = client;
+    printf("Client %lu connected with priority %d.\n",
+           client->order, hello.priority);
+}
+
+
+void remove_client(unsigned int k) {
+    printf("Client %lu disconnected.\n", Clients[k]->order);
+    free_client(Clients[k]);
+    for (; k + 1 < NumClients; k++)
+        Clients[k] = Clients[k + 1];
+    NumClients--;
+}
+
+
+int serve(int listener, LibMK_Handle* handle, LibMK_Controller* controller) {
+    /** Handle clients and send composited frames until signalled
+     *
+     * Every client is polled on its socket, to detect disconnects, and
+     * on its eventfd, signalled for every frame submitted. The frames
+     * of the clients are layers of a compositor, and the composited
+     * frames are scheduled on a coalescing controller, so a client
+     * submitting frames faster than the keyboard can display them only
+     * determines the next frame.
+     */
+    struct pollfd fds[1 + MAX_CLIENTS * 2];
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][4];
+    while (!ExitFlag) {
+        // Only the keys of which the color changed are sent
+        if (libmk_sched_composite(controller, Compositor) < 0)
+            return LIBMK_ERR_DAEMON;
+        if (libmk_get_controller_state(controller) != LIBMK_STATE_ACTIVE)
+            return libmk_get_controller_error(controller);
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (unsigned int k = 0; k < NumClients; k++) {
+            fds[1 + k * 2].fd = Clients[k]->sock;
+            fds[1 + k * 2].events = POLLIN;
+            fds[2 + k * 2].fd = Clients[k]->event;
+            fds[2 + k * 2].events = POLLIN;
+        }
+        // Wake up regularly to notice a controller that failed
+        int n = poll(fds, 1 + NumClients * 2, 1000);
+        if (n < 0 && errno != EINTR)
+            return LIBMK_ERR_DAEMON;
+        if (n <= 0)
+            continue;
+
+        // Iterate backwards, so removals do not shift unhandled clients
+        for (unsigned int k = NumClients; k > 0; k--) {
+            Client* client = Clients[k - 1];
+            uint64_t count;
+            if (fds[k * 2].revents & POLLIN &&
+                    read(client->event, &count, sizeof(count)) > 0 &&
+                    libmk_read_layer(client->ring, colors))
+                libmk_set_layer(Compositor, client->layer, colors);
+            // Clients do not send anything after the hello
+            if (fds[k * 2 - 1].revents != 0)
+                remove_client(k - 1);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_client(listener, handle);
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int main(int argc, char** argv) {
+    /** Daemon owning a keyboard on behalf of multiple client processes
+     *
+     * Usage: mkd [-s socket] [-m]
+     *
+     * Control of the first supported keyboard is enabled once when the
+     * daemon starts, so clients do not claim the interface or reset
+     * the device. Clients connect with libmk_connect_daemon of libmkd
+     * and draw into a layer in shared memory. With -m an emulated
+     * keyboard is used, for testing clients without a device.
+     */
+    const char* path = libmk_get_daemon_socket();
+    bool mock = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m")) != -1) {
+        if (opt == 's')
+            path = optarg;
+        else if (opt == 'm')
+            mock = true;
+        else {
+            printf("Usage: %s [-s socket] [-m]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    Compositor = libmk_create_compositor();
+    if (Compositor == NULL)
+        return -1;
+    if (!libmk_init()) {
+        printf("Failed to initialize LibMK Library.\n");
+        libmk_free_compositor(Compositor);
+        return -1;
+    }
+    LibMK_Handle* handle;
+    int r = mock ?
+        libmk_create_mock_handle(&handle, DEV_RGB_L, LIBMK_LAYOUT_ANSI) :
+        libmk_set_device(DEV_ANY, &handle);
+    if (r != LIBMK_SUCCESS) {
+        printf("Failed to open device: %d\n", r);
+        libmk_free_compositor(Compositor);
+        libmk_exit();
+        return -1;
+    }
+    LibMK_Controller* controller = libmk_create_controller(handle);
+    if (controller == NULL) {
+        libmk_close_handle(handle);
+        libmk_free_handle(handle);
+        libmk_free_compositor(Compositor);
+        libmk_exit();
+        return -1;
+    }
+    libmk_set_controller_coalesce(controller, true);
+    libmk_set_overflow_policy(controller, LIBMK_OVERFLOW_COALESCE);
+    r = libmk_start_controller(controller);
+    int listener = r == LIBMK_SUCCESS ? create_socket(path) : -1;
+    if (r != LIBMK_SUCCESS)
+        printf("Failed to start controller: %d\n", r);
+    else if (listener < 0)
+        printf("Failed to listen on %s: %s\n", path, strerror(errno));
+    else {
+        printf("Listening on %s.\n", path);
+        // The layout is only known once control has been enabled
+        while (handle->layout == LIBMK_LAYOUT_UNKNOWN &&
+               libmk_get_controller_state(controller) == LIBMK_STATE_ACTIVE)
+            usleep(1000);
+        r = serve(listener, handle, controller);
+        if (r != LIBMK_SUCCESS)
+            printf("Daemon error: %d\n", r);
+    }
+
+    while (NumClients > 0)
+        remove_client(NumClients - 1);
+    if (listener >= 0) {
+        close(listener);
+        unlink(path);
+    }
+    libmk_stop_controller(controller);
+    libmk_join_controller(controller, 1.0);
+    libmk_close_handle(handle);
+    libmk_free_controller(controller);
+    libmk_free_compositor(Compositor);
+    libmk_exit();
+    return r == LIBMK_SUCCESS ? 0 : -1;
+}
@@ -0,0 +1,119 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "../libmk/libmk.h"
+#include "../libmk/libmkc.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static volatile sig_atomic_t ExitFlag = 0;
+
+
+void handle_signal(int sig) {
+    ExitFlag = 1;
+}
+
+
+int main(int argc, char** argv) {
+    /** Play an animation file on the first supported keyboard
+     *
+     * Usage: play [-l] [-m] [-s ms] file
+     *
+     * Animation files are created from images or GIFs with
+     * examples/photoviewer/convert.py. With -l the animation loops
+     * until interrupted, with -s playback starts at the given time in
+     * milliseconds and with -m an emulated keyboard is used.
+     */
+    bool loop = false, mock = false;
+    unsigned int seek = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "lms:")) != -1) {
+        if (opt == 'l')
+            loop = true;
+        else if (opt == 'm')
+            mock = true;
+        else if (opt == 's')
+            seek = (unsigned int) atoi(optarg) * 1000;
+        else
+            break;
+    }
+    if (opt != -1 || optind != argc - 1) {
+        printf("Usage: %s [-l] [-m] [-s ms] file\n", argv[0]);
+        return -1;
+    }
+
+    LibMK_Animation* animation;
+    int r = libmk_open_animation(&animation, argv[optind]);
+    if (r != LIBMK_SUCCESS) {
+        printf("Failed to open animation: %d\n", r);
+        return -1;
+    }
+    LibMK_Player player;
+    libmk_init_player(&player, animation, loop);
+    if (seek != 0)
+        libmk_seek_player(&player, seek);
+    printf("%u frames, %.2f seconds.\n", animation->header->frames,
+           animation->header->duration / 1e6);
+
+    struct sigaction action;
+    memset(&action, 0x00, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (!libmk_init()) {
+        printf("Failed to initialize LibMK Library.\n");
+        libmk_close_animation(animation);
+        return -1;
+    }
+    LibMK_Handle* handle;
+    r = mock ?
+        libmk_create_mock_handle(&handle, DEV_RGB_L, LIBMK_LAYOUT_ANSI) :
+        libmk_set_device(DEV_ANY, &handle);
+    if (r != LIBMK_SUCCESS) {
+        printf("Failed to open device: %d\n", r);
+        libmk_close_animation(animation);
+        libmk_exit();
+        return -1;
+    }
+    LibMK_Controller* controller = libmk_create_controller(handle);
+    if (controller == NULL) {
+        libmk_close_handle(handle);
+        libmk_free_handle(handle);
+        libmk_close_animation(animation);
+        libmk_exit();
+        return -1;
+    }
+    r = libmk_start_controller(controller);
+    if (r == LIBMK_SUCCESS)
+        r = libmk_sched_instruction(
+            controller, libmk_create_instruction_animation(&player));
+    if (r < 0)
+        printf("Failed to start playback: %d\n", r);
+    else {
+        // A looping animation is only stopped by a signal
+        if (!loop)
+            libmk_wait_controller(controller);
+        while (!ExitFlag &&
+               libmk_get_controller_state(controller) == LIBMK_STATE_ACTIVE)
+            usleep(10000);
+    }
+
+    libmk_stop_controller(controller);
+    libmk_join_controller(controller, 1.0);
+    LibMK_Result e = libmk_get_controller_error(controller);
+    if (e != LIBMK_SUCCESS)
+        printf("Controller error: %d\n", e);
+    libmk_close_handle(handle);
+    libmk_free_controller(controller);
+    libmk_close_animation(animation);
+    libmk_exit();
+    return r >= 0 && e == LIBMK_SUCCESS ? 0 : -1;
+}
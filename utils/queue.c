@@ -0,0 +1,76 @@
+/**
+ * Author: RedFantom
+ * License: GNU GPLv3
+ * Copyright (c) 2018-2019 RedFantom
+*/
+#define _GNU_SOURCE
+#include "../libmk/libmk.h"
+#include "../libmk/libmkc.h"
+#include <stdio.h>
+#include <unistd.h>
+
+
+#define INSTRUCTIONS (LIBMK_QUEUE_SIZE * 2)
+
+
+int main(void) {
+    /** Schedule more instructions than fit in the queue of a controller
+     *
+     * Runs on an emulated keyboard with LIBMK_OVERFLOW_BLOCK, so that
+     * scheduling waits for the controller to make room while it takes
+     * the instructions. Fails if the controller does not execute all
+     * instructions, and is killed by the alarm if either side hangs.
+     */
+    alarm(30);
+    if (!libmk_init()) {
+        printf("Failed to initialize LibMK Library.\n");
+        return 1;
+    }
+    LibMK_Handle* handle;
+    int r = libmk_create_mock_handle(&handle, DEV_RGB_L, LIBMK_LAYOUT_ANSI);
+    if (r != LIBMK_SUCCESS) {
+        printf("Failed to create mock device: %d\n", r);
+        libmk_exit();
+        return 1;
+    }
+    LibMK_Controller* c = libmk_create_controller(handle);
+    if (c == NULL || libmk_start_controller(c) != LIBMK_SUCCESS) {
+        printf("Failed to start controller.\n");
+        libmk_close_handle(handle);
+        if (c != NULL)
+            libmk_free_controller(c);
+        else
+            libmk_free_handle(handle);
+        libmk_exit();
+        return 1;
+    }
+    libmk_set_overflow_policy(c, LIBMK_OVERFLOW_BLOCK);
+
+    // Let the controller fall asleep on the empty queue first
+    usleep(10000);
+    unsigned char color[3] = {255, 0, 0};
+    LibMK_Instruction* first = libmk_create_instruction_full(color);
+    LibMK_Instruction* last = first;
+    for (int k = 1; k < INSTRUCTIONS; k++) {
+        color[1] = (unsigned char) k;
+        last->next = libmk_create_instruction_full(color);
+        last = last->next;
+    }
+    r = libmk_sched_instruction(c, first);
+    libmk_wait_controller(c);
+    LibMK_Controller_State s = libmk_join_controller(c, 20.0);
+    LibMK_Timing_Stats stats;
+    libmk_get_timing_stats(c, &stats, false);
+    libmk_close_handle(handle);
+    libmk_free_controller(c);
+    libmk_exit();
+
+    if (r < 0 || s != LIBMK_STATE_STOPPED ||
+            stats.executed + stats.skipped != INSTRUCTIONS) {
+        printf("Failed: scheduled %d, state %d, executed %lu of %d\n",
+               r, s, stats.executed + stats.skipped, INSTRUCTIONS);
+        return 1;
+    }
+    printf("Executed %d instructions.\n", INSTRUCTIONS);
+    return 0;
+}